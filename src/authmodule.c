@@ -8,6 +8,7 @@
  */
 
 #include "dbmail.h"
+#include "dm_authcache.h"
 #define THIS_MODULE "auth"
 
 static auth_func_t *auth = NULL;
@@ -135,9 +136,33 @@ int auth_disconnect(void)
 }
 
 int auth_user_exists(const char *username, uint64_t * user_idnr)
-	{ return auth->user_exists(username, user_idnr); }
+{
+	uint64_t generation;
+	int result;
+
+	if (AuthCache_getUser(username, user_idnr))
+		return TRUE;
+
+	generation = AuthCache_generation();
+	if ((result = auth->user_exists(username, user_idnr)) == TRUE)
+		AuthCache_setUser(username, *user_idnr, generation);
+
+	return result;
+}
 char *auth_get_userid(uint64_t user_idnr)
-	{ return auth->get_userid(user_idnr); }
+{
+	uint64_t generation;
+	char *username;
+
+	if ((username = AuthCache_getUserid(user_idnr)))
+		return username;
+
+	generation = AuthCache_generation();
+	if ((username = auth->get_userid(user_idnr)))
+		AuthCache_setUserid(user_idnr, username, generation);
+
+	return username;
+}
 int auth_check_userid(uint64_t user_idnr)
 	{ return auth->check_userid(user_idnr); }
 GList * auth_get_known_users(void)
@@ -154,21 +179,53 @@ int auth_check_user_ext(const char *username, GList **userids, GList **fwds, int
 	{ return auth->check_user_ext(username, userids, fwds, checks); }
 int auth_adduser(const char *username, const char *password, const char *enctype,
 		uint64_t clientid, uint64_t maxmail, uint64_t * user_idnr)
-	{ return auth->adduser(username, password, enctype,
-			clientid, maxmail, user_idnr); }
+{
+	int result = auth->adduser(username, password, enctype,
+			clientid, maxmail, user_idnr);
+	AuthCache_flush();
+	return result;
+}
 int auth_delete_user(const char *username)
-	{ return auth->delete_user(username); }
+{
+	int result = auth->delete_user(username);
+	AuthCache_flush();
+	return result;
+}
 int auth_change_username(uint64_t user_idnr, const char *new_name)
-	{ return auth->change_username(user_idnr, new_name); }
+{
+	int result = auth->change_username(user_idnr, new_name);
+	AuthCache_flush();
+	return result;
+}
 int auth_change_password(uint64_t user_idnr,
 		const char *new_pass, const char *enctype)
-	{ return auth->change_password(user_idnr, new_pass, enctype); }
+{
+	int result = auth->change_password(user_idnr, new_pass, enctype);
+	AuthCache_flush();
+	return result;
+}
 int auth_change_clientid(uint64_t user_idnr, uint64_t new_cid)
 	{ return auth->change_clientid(user_idnr, new_cid); }
 int auth_change_mailboxsize(uint64_t user_idnr, uint64_t new_size)
 	{ return auth->change_mailboxsize(user_idnr, new_size); }
 int auth_validate(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr)
-	{ return auth->validate(ci, username, password, user_idnr); }
+{
+	uint64_t generation;
+	int result;
+
+	/* CRAM-MD5 uses a new challenge for every login */
+	if (ci && ci->auth)
+		return auth->validate(ci, username, password, user_idnr);
+
+	if (AuthCache_getValid(username, password, user_idnr))
+		return TRUE;
+
+	generation = AuthCache_generation();
+	if ((result = auth->validate(ci, username, password, user_idnr)) == TRUE)
+		AuthCache_setValid(username, password, *user_idnr, generation);
+
+	return result;
+}
 uint64_t auth_md5_validate(ClientBase_T *ci, char *username,
 		unsigned char *md5_apop_he, char *apop_stamp)
 	{ return auth->md5_validate(ci, username,
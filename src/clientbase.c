@@ -34,6 +34,8 @@ extern DBParam_T db_params;
 extern ServerConfig_T *server_conf;
 extern SSL_CTX *tls_context;
 
+static volatile gint client_count = 0;
+
 static void dm_tls_error(void)
 {
 	unsigned long e;
@@ -191,6 +193,10 @@ ClientBase_T * client_init(client_sock *c)
 	client->rev = NULL;
 	client->wev = NULL;
 
+	g_atomic_int_inc(&client_count);
+
+	client->reactor = dm_reactor_attach(client);
+
 	return client;
 }
 
@@ -552,6 +558,9 @@ void ci_close(ClientBase_T *client)
 	TRACE(TRACE_DEBUG, "closing clientbase [%p] [%d] [%d]", client,
 			client->tx, client->rx);
 
+	dm_reactor_detach(client->reactor, client);
+	client->reactor = NULL;
+
 	ci_cork(client);
 
 	if (client->rev) {
@@ -590,6 +599,8 @@ void ci_close(ClientBase_T *client)
 
 	pthread_mutex_destroy(&client->lock);
 
+	g_atomic_int_add(&client_count, -1);
+
 	Mempool_T pool = client->pool;
 	mempool_push(pool, client->timeout, sizeof(struct timeval));
 	client->timeout = NULL;
@@ -607,4 +618,7 @@ void ci_close(ClientBase_T *client)
 	client = NULL;
 }
 
-
+int ci_count(void)
+{
+	return g_atomic_int_get(&client_count);
+}
@@ -43,4 +43,7 @@ size_t ci_wbuf_len(ClientBase_T *);
 
 void   ci_close(ClientBase_T *);
 
+/* number of open client connections in this process */
+int    ci_count(void);
+
 #endif
@@ -27,7 +27,6 @@
 #define THIS_MODULE "clientsession"
 
 extern ServerConfig_T *server_conf;
-extern struct event_base *evbase;
 
 ClientSession_T * client_session_new(client_sock *c)
 {
@@ -45,6 +44,7 @@ ClientSession_T * client_session_new(client_sock *c)
 	session->args = p_list_new(pool);
 	session->from = p_list_new(pool);
 	session->rbuff = p_string_new(pool, "");
+	session->wbuff = p_string_new(pool, "");
 	session->messagelst = p_list_new(pool);
 
 	gethostname(session->hostname, sizeof(session->hostname));
@@ -53,9 +53,8 @@ ClientSession_T * client_session_new(client_sock *c)
 	create_unique_id(unique_id, 0);
 	session->apop_stamp = g_strdup_printf("<%s@%s>", unique_id, session->hostname);
 
-	assert(evbase);
-        ci->rev = event_new(evbase, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
-        ci->wev = event_new(evbase, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+        ci->rev = event_new(dm_reactor_base(), ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
+        ci->wev = event_new(dm_reactor_base(), ci->tx, EV_WRITE, socket_write_cb, (void *)session);
 	ci_cork(ci);
 
 	session->ci = ci;
@@ -152,6 +151,7 @@ void client_session_bailout(ClientSession_T **session)
 	ci_close(c->ci);
 
 	p_string_free(c->rbuff, TRUE);
+	p_string_free(c->wbuff, TRUE);
 
 	if (c->from) {
 		from = p_list_first(c->from);
@@ -241,6 +241,30 @@ void client_session_read(void *arg)
 		session->handle_input(session);
 }
 
+/*
+ * worker threads can not write to the client directly. Replies
+ * are collected here and written by client_session_flush once
+ * the job is back in the main thread.
+ */
+void client_session_printf(ClientSession_T *session, const char *message, ...)
+{
+	va_list ap, cp;
+
+	va_start(ap, message);
+	va_copy(cp, ap);
+	p_string_append_vprintf(session->wbuff, message, cp);
+	va_end(cp);
+	va_end(ap);
+}
+
+void client_session_flush(ClientSession_T *session)
+{
+	if (! p_string_len(session->wbuff))
+		return;
+	ci_write(session->ci, "%s", p_string_str(session->wbuff));
+	p_string_truncate(session->wbuff, 0);
+}
+
 void client_session_set_timeout(ClientSession_T *session, int timeout)
 {
 	int current = session->ci->timeout->tv_sec;
@@ -31,6 +31,9 @@ void client_session_reset_parser(ClientSession_T *session);
 void client_session_bailout(ClientSession_T **session);
 void client_session_set_timeout(ClientSession_T *session, int timeout);
 
+void client_session_printf(ClientSession_T *session, const char *message, ...) PRINTF_ARGS(2, 3);
+void client_session_flush(ClientSession_T *session);
+
 void socket_read_cb(int fd, short what, void *arg);
 void socket_write_cb(int fd, short what, void *arg);
  
@@ -118,6 +118,7 @@ typedef struct {
 	unsigned int query_time_notice;
 	unsigned int query_time_warning;
 	unsigned int query_timeout;
+	gboolean stmt_stats;	/**< count and time prepared statements */
 } DBParam_T;
 
 enum DBMAIL_MESSAGE_CLASS {
@@ -153,7 +154,6 @@ typedef struct {
 	String_T crlf; 
 
 	// Mappings
-	GHashTable *header_dict;
 	GTree *header_name;
 	GTree *header_value;
 	
@@ -161,6 +161,10 @@ typedef struct {
 	int part_key;
 	int part_depth;
 	int part_order;
+	GList *mimeparts;		/* mimeparts queued for a batched store */
+
+	// delivery
+	GList *targets;			/* DeliveryTarget_T queued for delivery */
 
 } DbmailMessage;
 
@@ -337,6 +341,8 @@ typedef struct {
 	uint64_t write_buffer_offset;	/* output buffer offset */
 
 	uint64_t len;			/* crlf decoded octets read by last ci_read(ln) call */
+
+	void *reactor;			/* reactor owning this connection */
 } ClientBase_T;
 
 struct http_sock {
@@ -360,6 +366,7 @@ typedef struct {
 	List_T args;			/* command args (allocated char *) */
 
 	String_T rbuff;			/* input buffer */
+	String_T wbuff;			/* output buffer for worker threads */
 
 	char *username;
 	char *password;
@@ -395,6 +402,8 @@ typedef struct {
 	gboolean authlog;
 	gboolean ssl;
 	int backlog;
+	int reactors;			// event loop threads
+	int processes;			// prefork worker processes
 	int resolveIP;
 	struct evhttp *evh;		// http server
 	Field_T service_name;
@@ -468,6 +477,23 @@ typedef enum {
 	SEARCH_THREAD_REFERENCES
 } search_order;
 
+typedef enum {
+	SORT_ARRIVAL = 0,
+	SORT_CC,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SIZE,
+	SORT_SUBJECT,
+	SORT_TO
+} sort_field;
+
+#define MAX_SORT_KEYS 8
+
+typedef struct {
+	sort_field field;
+	gboolean reverse;
+} sort_key;
+
 typedef struct {
 	int type;
 	uint64_t size;
@@ -477,6 +503,11 @@ typedef struct {
 	char op[MAX_SEARCH_LEN];
 	char search[MAX_SEARCH_LEN];
 	char hdrfld[MIME_FIELD_MAX];
+	sort_key sort[MAX_SORT_KEYS];
+	int nsort;		// may exceed MAX_SORT_KEYS
+	int flag[2];		// IST_FLAG: IMAP_FLAG_* to match
+	int flag_set[2];	// IST_FLAG: wanted value of each flag
+	int nflags;
 //	int match;
 	GTree *found;
 	gboolean reverse;
@@ -539,17 +570,30 @@ typedef struct {
  */
 #define IMAP_NFLAGS 6
 typedef struct { // map dbmail_messages
-	uint64_t mailbox_id;
 	uint64_t msn;
 	uint64_t uid;
 	uint64_t rfcsize;
 	uint64_t seq;
 	char internaldate[IMAP_INTERNALDATE_LEN];
-	int flags[IMAP_NFLAGS];
+	unsigned char flags[IMAP_NFLAGS];
 	// reference dbmail_keywords
 	GList *keywords;
 } MessageInfo;
 
+/*
+ * a messages row to create for a stored physmessage
+ */
+typedef struct {
+	uint64_t user_idnr;
+	uint64_t mailbox_idnr;
+	int flags[IMAP_NFLAGS];
+	GList *keywords;
+	int status;		/* message status of the new row */
+	// result
+	uint64_t message_idnr;
+	int result;		/* DM_SUCCESS, -2 over quotum, DM_EQUERY */
+} DeliveryTarget_T;
+
 
 /*************************************************************************
 *                                 SIEVE
@@ -652,6 +696,7 @@ typedef enum {
 	SQL_RETURNING,
 	SQL_TABLE_EXISTS,
 	SQL_ESCAPE_COLUMN,
-	SQL_COMPARE_BLOB
+	SQL_COMPARE_BLOB,
+	SQL_CONCAT
 } sql_fragment;
 #endif
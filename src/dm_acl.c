@@ -42,6 +42,11 @@ static const char *acl_right_strings[] = {
 static const char acl_right_chars[] = "lrswipkxteacd";
 //{'l','r','s','w','i','p','k','x','t','e','a','c','d'};
 
+/* bumped on every change, so rights cached by MailboxState are reloaded.
+ * Other processes notice the change through the mailbox seq. */
+static pthread_mutex_t acl_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t acl_version = 1;
+
 /* local functions */
 static ACLRight acl_get_right_from_char(char right_char);
 static int acl_change_rights(uint64_t userid, uint64_t mboxid,
@@ -56,10 +61,27 @@ static int acl_get_rightsstring(uint64_t userid, uint64_t mboxid,
 				/*@out@*/ char *rightsstring);
 
 
+static void acl_changed(void)
+{
+	PLOCK(acl_lock);
+	acl_version++;
+	PUNLOCK(acl_lock);
+}
+
+uint64_t acl_get_version(void)
+{
+	uint64_t version;
+
+	PLOCK(acl_lock);
+	version = acl_version;
+	PUNLOCK(acl_lock);
+
+	return version;
+}
+
 int acl_has_right(MailboxState_T S, uint64_t userid, ACLRight right)
 {
-	uint64_t anyone_userid;
-	int test;
+	unsigned rights;
 	
 	switch(right) {
 		case ACL_RIGHT_SEEN:
@@ -84,27 +106,29 @@ int acl_has_right(MailboxState_T S, uint64_t userid, ACLRight right)
 		break;
 	}
 
-	const char *right_flag = acl_right_strings[right];
+	/* The rights of the user and the 'anyone' user combined;
+	 * the mailbox owner has all rights unless restricted. */
+	if (MailboxState_getRights(S, userid, &rights) != DM_SUCCESS)
+		return DM_EQUERY;
 
-	/* Check if the user has the right; this will also
-	 * return true if the user is the mailbox owner. */
-	if ((test = MailboxState_hasPermission(S, userid, right_flag)))
-		return TRUE;
-
-	/* else check the 'anyone' user */
-	if (auth_user_exists(DBMAIL_ACL_ANYONE_USER, &anyone_userid))
-		return MailboxState_hasPermission(S, anyone_userid, right_flag);
-	
-	return FALSE;
+	return (rights & (1 << right)) ? TRUE : FALSE;
 }
 
 int acl_set_rights(uint64_t userid, uint64_t mboxid, const char *rightsstring)
 {
+	int result;
+
 	if (rightsstring[0] == '-')
-		return acl_change_rights(userid, mboxid, rightsstring, 0);
-	if (rightsstring[0] == '+')
-		return acl_change_rights(userid, mboxid, rightsstring, 1);
-	return acl_replace_rights(userid, mboxid, rightsstring);
+		result = acl_change_rights(userid, mboxid, rightsstring, 0);
+	else if (rightsstring[0] == '+')
+		result = acl_change_rights(userid, mboxid, rightsstring, 1);
+	else
+		result = acl_replace_rights(userid, mboxid, rightsstring);
+
+	acl_changed();
+	db_mailbox_seq_update(mboxid, 0);
+
+	return result;
 }
 
 ACLRight acl_get_right_from_char(char right_char)
@@ -206,12 +230,13 @@ acl_set_one_right(uint64_t userid, uint64_t mboxid, ACLRight right, int set)
 }
 
 
-/*
 int acl_delete_acl(uint64_t userid, uint64_t mboxid)
 {
-	return db_acl_delete_acl(userid, mboxid);
+	int result = db_acl_delete_acl(userid, mboxid);
+	acl_changed();
+	db_mailbox_seq_update(mboxid, 0);
+	return result;
 }
-*/
 
 char *acl_get_acl(uint64_t mboxid)
 {
@@ -56,8 +56,14 @@ int acl_set_rights(uint64_t userid, uint64_t mboxid, const char *rightsstring);
  *      -  0 if nothing removed (i.e. no acl was found)
  *      -  1 if acl removed
  */
-//int acl_delete_acl(uint64_t userid, uint64_t mboxid);
-#define acl_delete_acl(a,b) db_acl_delete_acl((a),(b))
+int acl_delete_acl(uint64_t userid, uint64_t mboxid);
+
+/**
+ * \brief version of the ACLs, bumped by acl_set_rights() and
+ * acl_delete_acl() to invalidate cached rights. Both also bump the
+ * mailbox seq, which invalidates them in other processes.
+ */
+uint64_t acl_get_version(void);
 
 /**
  * \brief checks if a user has a certain right to a mailbox 
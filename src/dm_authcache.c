@@ -0,0 +1,364 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#include "dbmail.h"
+#include "dm_authcache.h"
+#include "dm_digest.h"
+
+#define THIS_MODULE "AuthCache"
+
+#define AUTH_CACHE_SIZE 10000 // entries per map
+#define AUTH_CACHE_TTL 0      // seconds, disabled by default
+#define AUTH_CACHE_STATS 1000
+
+typedef struct {
+	char *key;
+	uint64_t id;
+	char *name;
+	time_t expires;
+	GList *link;
+} Entry_T;
+
+typedef struct {
+	const char *label;
+	GHashTable *map;  // key -> Entry_T
+	GQueue *lru;      // most recently used first
+} Map_T;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Map_T credentials = { "credentials", NULL, NULL };
+static Map_T users = { "users", NULL, NULL };
+static Map_T userids = { "userids", NULL, NULL };
+static int cache_limit = -1;
+static int cache_ttl = AUTH_CACHE_TTL;
+static int cache_usermap = -1;
+static char cache_salt[33];
+static uint64_t cache_generation = 0;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+
+static void entry_free(Entry_T *E)
+{
+	g_free(E->key);
+	g_free(E->name);
+	g_free(E);
+}
+
+static void map_init(Map_T *M)
+{
+	M->map = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)entry_free);
+	M->lru = g_queue_new();
+}
+
+static void map_free(Map_T *M)
+{
+	if (! M->map)
+		return;
+	g_queue_free(M->lru);
+	g_hash_table_destroy(M->map);
+	M->lru = NULL;
+	M->map = NULL;
+}
+
+static void map_clear(Map_T *M)
+{
+	if (! M->map)
+		return;
+	g_queue_clear(M->lru);
+	g_hash_table_remove_all(M->map);
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void map_evict(Map_T *M, Entry_T *E)
+{
+	g_queue_delete_link(M->lru, E->link);
+	g_hash_table_remove(M->map, E->key);
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static Entry_T * map_get(Map_T *M, const char *key)
+{
+	Entry_T *E;
+
+	if ((! M->map) || (! (E = g_hash_table_lookup(M->map, key))))
+		return NULL;
+
+	if (E->expires <= time(NULL)) {
+		map_evict(M, E);
+		return NULL;
+	}
+
+	g_queue_unlink(M->lru, E->link);
+	g_queue_push_head_link(M->lru, E->link);
+
+	return E;
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void map_set(Map_T *M, const char *key, uint64_t id, const char *name)
+{
+	Entry_T *E;
+
+	if (! M->map) // disabled by a flush since
+		return;
+
+	if ((E = g_hash_table_lookup(M->map, key)))
+		map_evict(M, E);
+
+	while (g_hash_table_size(M->map) >= (guint)cache_limit) {
+		Entry_T *last = g_queue_peek_tail(M->lru);
+		if (! last) break;
+		map_evict(M, last);
+	}
+
+	E = g_new0(Entry_T, 1);
+	E->key = g_strdup(key);
+	E->id = id;
+	E->name = g_strdup(name);
+	E->expires = time(NULL) + cache_ttl;
+	g_queue_push_head(M->lru, E);
+	E->link = g_queue_peek_head_link(M->lru);
+	g_hash_table_insert(M->map, E->key, E);
+}
+
+static void config_int(const char *name, int *value)
+{
+	Field_T val;
+
+	config_get_value(name, "DBMAIL", val);
+	if (strlen(val))
+		*value = atoi(val);
+	if (*value < 0)
+		*value = 0;
+}
+
+static gboolean cache_init(void)
+{
+	gboolean enabled;
+
+	PLOCK(cache_lock);
+	if (cache_limit < 0) {
+		cache_limit = AUTH_CACHE_SIZE;
+		cache_ttl = AUTH_CACHE_TTL;
+		config_int("auth_cache_size", &cache_limit);
+		config_int("auth_cache_ttl", &cache_ttl);
+		if (! (cache_limit > 0 && cache_ttl > 0)) {
+			map_free(&credentials);
+			map_free(&users);
+			map_free(&userids);
+		} else if (! credentials.map) {
+			map_init(&credentials);
+			map_init(&users);
+			map_init(&userids);
+			g_snprintf(cache_salt, sizeof(cache_salt), "%08x%08x%08x%08x",
+					g_random_int(), g_random_int(), g_random_int(), g_random_int());
+		}
+		TRACE(TRACE_DEBUG, "auth cache size [%d] ttl [%d]", cache_limit, cache_ttl);
+	}
+	enabled = (credentials.map != NULL);
+	PUNLOCK(cache_lock);
+
+	return enabled;
+}
+
+static void cache_count(gboolean hit)
+{
+	uint64_t lookups;
+
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+
+	lookups = cache_hits + cache_misses;
+	if (credentials.map && (lookups % AUTH_CACHE_STATS == 0))
+		TRACE(TRACE_INFO, "hits [%" PRIu64 "] misses [%" PRIu64 "] credentials [%u] users [%u] userids [%u]",
+				cache_hits, cache_misses,
+				g_hash_table_size(credentials.map),
+				g_hash_table_size(users.map),
+				g_hash_table_size(userids.map));
+}
+
+/*
+ * the usermap rewrites login names depending on the client
+ * address, so credential checks cannot be shared between clients.
+ */
+static gboolean credentials_cacheable(void)
+{
+	if (! cache_init())
+		return FALSE;
+
+	if (cache_usermap < 0) {
+		cache_usermap = db_use_usermap() ? 1 : 0;
+		if (cache_usermap)
+			TRACE(TRACE_INFO, "usermap in use, not caching credentials");
+	}
+
+	return cache_usermap == 0;
+}
+
+/*
+ * the plain text credentials are never stored: the key is a hash
+ * over them and a random salt that only lives in this process.
+ */
+static void credentials_key(const char *username, const char *password, char *key)
+{
+	char *s = g_strdup_printf("%s%zu:%s%s", cache_salt, strlen(username), username, password);
+	dm_sha256(s, key);
+	memset(s, 0, strlen(s));
+	g_free(s);
+}
+
+uint64_t AuthCache_generation(void)
+{
+	uint64_t generation;
+
+	PLOCK(cache_lock);
+	generation = cache_generation;
+	PUNLOCK(cache_lock);
+
+	return generation;
+}
+
+gboolean AuthCache_getValid(const char *username, const char *password, uint64_t *user_idnr)
+{
+	char key[FIELDSIZE];
+	Entry_T *E;
+
+	if ((! username) || (! password) || (! credentials_cacheable()))
+		return FALSE;
+
+	credentials_key(username, password, key);
+
+	PLOCK(cache_lock);
+	if ((E = map_get(&credentials, key)))
+		*user_idnr = E->id;
+	cache_count(E != NULL);
+	PUNLOCK(cache_lock);
+
+	TRACE(TRACE_DEBUG, "[%s] %s", username, E ? "hit" : "miss");
+
+	return E != NULL;
+}
+
+void AuthCache_setValid(const char *username, const char *password,
+		uint64_t user_idnr, uint64_t generation)
+{
+	char key[FIELDSIZE];
+
+	if ((! username) || (! password) || (! user_idnr) || (! credentials_cacheable()))
+		return;
+
+	credentials_key(username, password, key);
+
+	PLOCK(cache_lock);
+	if (generation == cache_generation)
+		map_set(&credentials, key, user_idnr, NULL);
+	PUNLOCK(cache_lock);
+}
+
+gboolean AuthCache_getUser(const char *username, uint64_t *user_idnr)
+{
+	Entry_T *E;
+
+	if ((! username) || (! cache_init()))
+		return FALSE;
+
+	PLOCK(cache_lock);
+	if ((E = map_get(&users, username)))
+		*user_idnr = E->id;
+	cache_count(E != NULL);
+	PUNLOCK(cache_lock);
+
+	return E != NULL;
+}
+
+void AuthCache_setUser(const char *username, uint64_t user_idnr, uint64_t generation)
+{
+	if ((! username) || (! user_idnr) || (! cache_init()))
+		return;
+
+	PLOCK(cache_lock);
+	if (generation == cache_generation)
+		map_set(&users, username, user_idnr, NULL);
+	PUNLOCK(cache_lock);
+}
+
+char * AuthCache_getUserid(uint64_t user_idnr)
+{
+	char key[32];
+	char *username = NULL;
+	Entry_T *E;
+
+	if (! cache_init())
+		return NULL;
+
+	g_snprintf(key, sizeof(key), "%" PRIu64, user_idnr);
+
+	PLOCK(cache_lock);
+	if ((E = map_get(&userids, key)))
+		username = g_strdup(E->name);
+	cache_count(E != NULL);
+	PUNLOCK(cache_lock);
+
+	return username;
+}
+
+void AuthCache_setUserid(uint64_t user_idnr, const char *username, uint64_t generation)
+{
+	char key[32];
+
+	if ((! username) || (! user_idnr) || (! cache_init()))
+		return;
+
+	g_snprintf(key, sizeof(key), "%" PRIu64, user_idnr);
+
+	PLOCK(cache_lock);
+	if (generation == cache_generation)
+		map_set(&userids, key, user_idnr, username);
+	PUNLOCK(cache_lock);
+}
+
+void AuthCache_flush(void)
+{
+	PLOCK(cache_lock);
+	cache_generation++;
+	cache_limit = -1; // re-read the config on next use
+	map_clear(&credentials);
+	map_clear(&users);
+	map_clear(&userids);
+	PUNLOCK(cache_lock);
+	TRACE(TRACE_DEBUG, "flushed");
+}
+
+void AuthCache_stats(uint64_t *hits, uint64_t *misses)
+{
+	PLOCK(cache_lock);
+	if (hits) *hits = cache_hits;
+	if (misses) *misses = cache_misses;
+	PUNLOCK(cache_lock);
+}
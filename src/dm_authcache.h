@@ -0,0 +1,78 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * process-wide cache of authentication results
+ *
+ * Keeps successful credential checks, keyed by a salted hash of the
+ * username and password, and the username <-> user_idnr lookups of
+ * the auth backend for a short, configurable time. Failed logins are
+ * never cached. Every change to a user made through the auth layer
+ * flushes the cache.
+ */
+
+#ifndef DM_AUTHCACHE_H
+#define DM_AUTHCACHE_H
+
+#include "dbmail.h"
+
+/*
+ * \brief current generation of the cache
+ *
+ * take this before asking the backend and pass it to the setters:
+ * results obtained before a flush are not stored.
+ */
+extern uint64_t AuthCache_generation(void);
+
+/*
+ * \brief look up a successful credential check
+ * \return TRUE on a hit, with user_idnr set
+ */
+extern gboolean AuthCache_getValid(const char *username, const char *password, uint64_t *user_idnr);
+extern void     AuthCache_setValid(const char *username, const char *password,
+		uint64_t user_idnr, uint64_t generation);
+
+/*
+ * \brief look up the user_idnr of an existing user
+ * \return TRUE on a hit
+ */
+extern gboolean AuthCache_getUser(const char *username, uint64_t *user_idnr);
+extern void     AuthCache_setUser(const char *username, uint64_t user_idnr, uint64_t generation);
+
+/*
+ * \brief look up the username for a user_idnr
+ * \return newly allocated username on a hit, NULL otherwise
+ */
+extern char *   AuthCache_getUserid(uint64_t user_idnr);
+extern void     AuthCache_setUserid(uint64_t user_idnr, const char *username, uint64_t generation);
+
+/*
+ * \brief drop all entries and re-read auth_cache_size and
+ * auth_cache_ttl on next use
+ */
+extern void     AuthCache_flush(void);
+
+/*
+ * \brief cache statistics
+ */
+extern void     AuthCache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -199,6 +199,15 @@ config_get_value_done:
 	return 0;
 }
 
+void config_set_value(const Field_T field_name, const char * const service_name,
+		const char *value)
+{
+	assert(service_name);
+	assert(config_dict);
+
+	g_key_file_set_value(config_dict, service_name, field_name, value);
+}
+
 void SetTraceLevel(const char *service_name)
 {
 	Trace_T trace_stderr_int, trace_syslog_int;
@@ -294,7 +303,7 @@ void SetTraceLevel(const char *service_name)
 void GetDBParams(void)
 {
 	Field_T port_string, sock_string, serverid_string, query_time;
-	Field_T max_db_connections;
+	Field_T max_db_connections, stmt_stats;
 
 	if (config_get_value("dburi", "DBMAIL", db_params.dburi) < 0) {
 		TRACE(TRACE_WARNING, "deprecation warning! [dburi] missing");
@@ -401,6 +410,10 @@ void GetDBParams(void)
 	else
 		db_params.query_timeout = 300000;
 
+	if (config_get_value("statement_stats", "DBMAIL", stmt_stats) < 0)
+		TRACE(TRACE_DEBUG, "error getting config! [statement_stats]");
+	db_params.stmt_stats = SMATCH(stmt_stats, "yes");
+
 
 	if (strcmp(db_params.pfx, "\"\"") == 0) {
 		/* FIXME: It appears that when the empty string is quoted
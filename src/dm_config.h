@@ -53,6 +53,15 @@ void config_free(void);
 int config_get_value(const Field_T name, const char *service_name,
                      /*@out@*/ Field_T value);
 
+/**
+ * \brief override a configuration value until the next config_read
+ * \param name name of configuration item
+ * \param service_name name of service
+ * \param value new value of configuration item name
+ */
+void config_set_value(const Field_T name, const char *service_name,
+		const char *value);
+
 /* some common used functions reading config options */
 /**
  \brief get parameters for database connection
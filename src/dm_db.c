@@ -26,6 +26,10 @@
 
 #include "dbmail.h"
 #include "dm_mailboxstate.h"
+#include "dm_mailboxwatch.h"
+#include "dm_headercache.h"
+#include "dm_mailboxlist.h"
+#include "dm_authcache.h"
 
 #define THIS_MODULE "db"
 
@@ -157,11 +161,15 @@ void mailbox_match_free(struct mailbox_match *m)
 
 
 /** list of tables used in dbmail */
-#define DB_NTABLES 20
+#define DB_NTABLES 23
 const char *DB_TABLENAMES[DB_NTABLES] = {
 	"acl",
 	"aliases",
+	"bodystructure",
 	"envelope",
+	"fts_parts",
+	"fts_postings",
+	"fts_terms",
 	"header",
 	"headername",
 	"headervalue",
@@ -284,10 +292,178 @@ int db_connect(void)
 	return db_check_version();
 }
 
+/*
+ * prepared statement statistics
+ *
+ * libzdb frees the prepared statements of a connection when the
+ * connection is cleared or returned to the pool, and the connections
+ * are handed out by its pool, so a statement can not be kept on a
+ * connection for the next checkout. A cache per (connection, sql) is
+ * not possible without replacing the statement handling of libzdb.
+ *
+ * With statement_stats enabled the prepares, executions and execution
+ * times are counted per sql template, the format string passed to
+ * db_stmt_prepare, so statements with inlined ids or prefixes share
+ * one entry. Statements prepared from a fully formatted string ("%s")
+ * are counted by their text, up to STMT_STATS_MAX distinct entries.
+ * The statements of a connection are tracked until db_con_clear or
+ * db_con_close, to map them back to their entry.
+ */
+#define STMT_STATS_LOG 1000
+#define STMT_STATS_MAX 1000
+
+typedef struct {
+	char *sql;
+	uint64_t prepared;
+	uint64_t executed;
+	double elapsed;
+} StmtStat_T;
+
+typedef struct {
+	StmtStat_T *stat;
+	char *query;		// as prepared
+} StmtRef_T;
+
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *stmt_stats = NULL;	// sql template -> StmtStat_T
+static GHashTable *stmt_conns = NULL;	// Connection_T -> GList of PreparedStatement_T
+static GHashTable *stmt_owner = NULL;	// PreparedStatement_T -> StmtRef_T
+static uint64_t stmt_prepared = 0;
+static uint64_t stmt_untracked = 0;
+
+static void stmt_stat_free(StmtStat_T *S)
+{
+	g_free(S->sql);
+	g_free(S);
+}
+
+static void stmt_ref_free(StmtRef_T *R)
+{
+	g_free(R->query);
+	g_free(R);
+}
+
+static void stmt_stats_init(void)
+{
+	if (stmt_stats)
+		return;
+	stmt_stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)stmt_stat_free);
+	stmt_conns = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_list_free);
+	stmt_owner = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)stmt_ref_free);
+}
+
+static void stmt_stats_prepared(Connection_T c, const char *template, const char *query, PreparedStatement_T s)
+{
+	const char *key = MATCH(template, "%s") ? query : template;
+	StmtStat_T *S;
+	StmtRef_T *R;
+	GList *stmts;
+
+	PLOCK(stmt_lock);
+	stmt_stats_init();
+	if (++stmt_prepared % STMT_STATS_LOG == 0)
+		TRACE(TRACE_INFO, "prepared statements [%" PRIu64 "] distinct [%u] untracked [%" PRIu64 "]",
+				stmt_prepared, g_hash_table_size(stmt_stats), stmt_untracked);
+
+	if (! (S = g_hash_table_lookup(stmt_stats, key))) {
+		if (g_hash_table_size(stmt_stats) >= STMT_STATS_MAX) {
+			stmt_untracked++;
+			PUNLOCK(stmt_lock);
+			return;
+		}
+		S = g_new0(StmtStat_T, 1);
+		S->sql = g_strdup(key);
+		g_hash_table_insert(stmt_stats, S->sql, S);
+	}
+	S->prepared++;
+
+	R = g_new0(StmtRef_T, 1);
+	R->stat = S;
+	R->query = g_strdup(query);
+	g_hash_table_insert(stmt_owner, s, R);
+
+	stmts = g_hash_table_lookup(stmt_conns, c);
+	g_hash_table_steal(stmt_conns, c);
+	g_hash_table_insert(stmt_conns, c, g_list_prepend(stmts, s));
+	PUNLOCK(stmt_lock);
+}
+
+/*
+ * forget the statements of a connection. libzdb frees them.
+ */
+static void stmt_stats_drop(Connection_T c)
+{
+	GList *stmts;
+
+	if (! db_params.stmt_stats)
+		return;
+
+	PLOCK(stmt_lock);
+	if (stmt_conns && (stmts = g_hash_table_lookup(stmt_conns, c))) {
+		while (stmts) {
+			g_hash_table_remove(stmt_owner, stmts->data);
+			if (! g_list_next(stmts)) break;
+			stmts = g_list_next(stmts);
+		}
+		g_hash_table_remove(stmt_conns, c);
+	}
+	PUNLOCK(stmt_lock);
+}
+
+static void stmt_stats_clear(void)
+{
+	PLOCK(stmt_lock);
+	if (stmt_conns) {
+		g_hash_table_remove_all(stmt_conns);
+		g_hash_table_remove_all(stmt_owner);
+	}
+	PUNLOCK(stmt_lock);
+}
+
+/*
+ * count an execution of a tracked statement. Returns the sql as
+ * prepared, to be freed by the caller, and a copy of its entry.
+ */
+static char * stmt_stat_update(PreparedStatement_T s, double elapsed, StmtStat_T *copy)
+{
+	StmtRef_T *R = NULL;
+	char *query = NULL;
+
+	if (! db_params.stmt_stats)
+		return NULL;
+
+	PLOCK(stmt_lock);
+	if (stmt_owner && (R = g_hash_table_lookup(stmt_owner, s))) {
+		R->stat->executed++;
+		R->stat->elapsed += elapsed;
+		*copy = *R->stat;
+		query = g_strdup(R->query);
+	}
+	PUNLOCK(stmt_lock);
+
+	return query;
+}
+
+gboolean db_stmt_stats(const char *sql, uint64_t *prepared, uint64_t *executed, double *elapsed)
+{
+	StmtStat_T *S = NULL;
+
+	PLOCK(stmt_lock);
+	if (stmt_stats && (S = g_hash_table_lookup(stmt_stats, sql))) {
+		if (prepared) *prepared = S->prepared;
+		if (executed) *executed = S->executed;
+		if (elapsed) *elapsed = S->elapsed;
+	}
+	PUNLOCK(stmt_lock);
+
+	return S ? TRUE : FALSE;
+}
+
 /* But sometimes this gets called after help text or an
  * error but without a matching db_connect before it. */
 int db_disconnect(void)
 {
+	stmt_stats_clear();
 	if(db_connected >= 3) ConnectionPool_stop(pool);
 	if(db_connected >= 2) ConnectionPool_free(&pool);
 	if(db_connected >= 1) URL_free(&dburi);
@@ -340,6 +516,7 @@ gboolean dm_db_ping(void)
 void db_con_close(Connection_T c)
 {
 	TRACE(TRACE_DATABASE,"[%p] connection to pool", c);
+	stmt_stats_drop(c);
 	Connection_close(c);
 	return;
 }
@@ -347,24 +524,51 @@ void db_con_close(Connection_T c)
 void db_con_clear(Connection_T c)
 {
 	TRACE(TRACE_DATABASE,"[%p] connection cleared", c);
+	stmt_stats_drop(c);
 	Connection_clear(c);
 	Connection_setQueryTimeout(c, (int)db_params.query_timeout);
 	return;
 }
 
-void log_query_time(char *query, struct timeval before, struct timeval after)
+static double query_elapsed(struct timeval before, struct timeval after)
+{
+	return ((double)after.tv_sec + ((double)after.tv_usec / 1000000)) - ((double)before.tv_sec + ((double)before.tv_usec / 1000000));
+}
+
+static void query_time_log(const char *query, double elapsed, const char *stats)
 {
-	double elapsed = ((double)after.tv_sec + ((double)after.tv_usec / 1000000)) - ((double)before.tv_sec + ((double)before.tv_usec / 1000000));
-	TRACE(TRACE_DATABASE, "last query took [%.3f] seconds", elapsed);
+	TRACE(TRACE_DATABASE, "last query took [%.3f] seconds%s", elapsed, stats);
 	if (elapsed > (double)db_params.query_time_warning)
-		TRACE(TRACE_WARNING, "slow query [%s] took [%.3f] seconds", query, elapsed);
+		TRACE(TRACE_WARNING, "slow query [%s] took [%.3f] seconds%s", query, elapsed, stats);
 	else if (elapsed > (double)db_params.query_time_notice)
-		TRACE(TRACE_NOTICE, "slow query [%s] took [%.3f] seconds", query, elapsed);
+		TRACE(TRACE_NOTICE, "slow query [%s] took [%.3f] seconds%s", query, elapsed, stats);
 	else if (elapsed > (double)db_params.query_time_info)
-		TRACE(TRACE_INFO, "slow query [%s] took [%.3f] seconds", query, elapsed);
+		TRACE(TRACE_INFO, "slow query [%s] took [%.3f] seconds%s", query, elapsed, stats);
 	return;
 }
 
+void log_query_time(char *query, struct timeval before, struct timeval after)
+{
+	query_time_log(query, query_elapsed(before, after), "");
+}
+
+static void stmt_log_time(PreparedStatement_T s, struct timeval before, struct timeval after)
+{
+	double elapsed = query_elapsed(before, after);
+	StmtStat_T S;
+	char stats[128];
+	char *query;
+
+	if (! (query = stmt_stat_update(s, elapsed, &S)))
+		return;
+
+	memset(stats, 0, sizeof(stats));
+	snprintf(stats, sizeof(stats), ", prepared [%" PRIu64 "] executed [%" PRIu64 "] in [%.3f] seconds",
+			S.prepared, S.executed, S.elapsed);
+	query_time_log(query, elapsed, stats);
+	g_free(query);
+}
+
 gboolean db_exec(Connection_T c, const char *q, ...)
 {
 	struct timeval before, after;
@@ -476,6 +680,8 @@ PreparedStatement_T db_stmt_prepare(Connection_T c, const char *q, ...)
 
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
 	s = Connection_prepareStatement(c, "%s", (const char *)query);
+	if (db_params.stmt_stats && s)
+		stmt_stats_prepared(c, q, query, s);
 	g_free(query);
 	return s;
 }
@@ -508,15 +714,29 @@ int db_stmt_set_blob(PreparedStatement_T s, int index, const void *x, int size)
 	return TRUE;
 }
 
-inline gboolean db_stmt_exec(PreparedStatement_T s)
+gboolean db_stmt_exec(PreparedStatement_T s)
 {
+	struct timeval before, after;
+
+	gettimeofday(&before, NULL);
 	PreparedStatement_execute(s);
+	gettimeofday(&after, NULL);
+
+	stmt_log_time(s, before, after);
 	return TRUE;
 }
 
-inline ResultSet_T db_stmt_query(PreparedStatement_T s)
+ResultSet_T db_stmt_query(PreparedStatement_T s)
 {
-	return PreparedStatement_executeQuery(s);
+	struct timeval before, after;
+	ResultSet_T r;
+
+	gettimeofday(&before, NULL);
+	r = PreparedStatement_executeQuery(s);
+	gettimeofday(&after, NULL);
+
+	stmt_log_time(s, before, after);
+	return r;
 }
 
 int db_result_next(ResultSet_T r)
@@ -681,6 +901,9 @@ static const char * db_get_sqlite_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -737,6 +960,9 @@ static const char * db_get_mysql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "CONCAT(%s,%s)";
+		break;
 	}
 	return NULL;
 }
@@ -796,6 +1022,9 @@ static const char * db_get_pgsql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -852,6 +1081,9 @@ static const char * db_get_oracle_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "DBMS_LOB.COMPARE(%s,?) = 0";
 		break;
+		case SQL_CONCAT:
+			return "%s||%s";
+		break;
 	}
 	return NULL;
 }
@@ -930,18 +1162,24 @@ static int check_upgrade_step(Connection_T c, int from_version, int to_version)
 			if (to_version == 32002) query = DM_SQLITE_32002;
 			if (to_version == 32003) query = DM_SQLITE_32003;
 			if (to_version == 32004) query = DM_SQLITE_32004;
+			if (to_version == 32005) query = DM_SQLITE_32005;
+			if (to_version == 32006) query = DM_SQLITE_32006;
 		break;
 		case DM_DRIVER_MYSQL:
 			if (to_version == 32001) query = DM_MYSQL_32001;
 			if (to_version == 32002) query = DM_MYSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_MYSQL_32005;
+			if (to_version == 32006) query = DM_MYSQL_32006;
 		break;
 		case DM_DRIVER_POSTGRESQL:
 			if (to_version == 32001) query = DM_PGSQL_32001;
 			if (to_version == 32002) query = DM_PGSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_PGSQL_32005;
+			if (to_version == 32006) query = DM_PGSQL_32006;
 		break;
 		default:
 			TRACE(TRACE_WARNING, "Migrations not supported for database driver");
@@ -1021,12 +1259,16 @@ int db_check_version(void)
 			break;
 		if ((ok = check_upgrade_step(c, 32001, 32004)) == DM_EQUERY)
 			break;
+		if ((ok = check_upgrade_step(c, 32001, 32005)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(c, 32001, 32006)) == DM_EQUERY)
+			break;
 		break;
 	} while (true);
 
 	db_con_close(c);
 
-	if (ok == 32004) {
+	if (ok == 32006) {
 		TRACE(TRACE_DEBUG, "Schema check successful");
 	} else {
 		TRACE(TRACE_WARNING,"Schema version incompatible [%d]. Bailing out",
@@ -1485,11 +1727,18 @@ int db_icheck_physmessages(gboolean cleanup)
 {
 	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
 	GList *ids = NULL;
+	char expire[DEF_FRAGSIZE];
 
 	c = db_con_get();
 	TRY
+		/* A physmessage is pending until it is delivered: its
+		 * messagesize is still 0 and its internal_date is the time it
+		 * was created. Pending ones are left alone for a day, they may
+		 * still be on their way to their mailboxes. */
+		snprintf(expire, DEF_FRAGSIZE-1, db_get_sql(SQL_EXPIRE), 1);
 		r = db_query(c, "SELECT p.id FROM %sphysmessage p LEFT JOIN %smessages m ON p.id = m.physmessage_id "
-				"WHERE m.physmessage_id IS NULL", DBPFX, DBPFX);
+				"WHERE m.physmessage_id IS NULL "
+				"AND (p.messagesize > 0 OR p.internal_date < %s)", DBPFX, DBPFX, expire);
 		while(db_result_next(r)) {
 			uint64_t *id = g_new0(uint64_t, 1);
 			*id = db_result_get_u64(r, 0);
@@ -1613,6 +1862,7 @@ int db_icheck_headernames(gboolean cleanup)
 				if (! g_list_next(ids)) break;
 				ids = g_list_next(ids);
 			}
+			HeaderCache_flush();
 		}
 		g_list_destroy(ids);
 	CATCH(SQLException)
@@ -1649,6 +1899,7 @@ int db_icheck_headervalues(gboolean cleanup)
 				if (! g_list_next(ids)) break;
 				ids = g_list_next(ids);
 			}
+			HeaderCache_flush();
 		}
 		g_list_destroy(ids);
 	CATCH(SQLException)
@@ -1861,6 +2112,67 @@ int db_icheck_envelope(GList **lost)
 }
 
 
+int db_set_bodystructure(GList *lost)
+{
+	uint64_t pmsgid;
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
+
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+		pmsgid = *id;
+		
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
+
+		if (! (msg = dbmail_message_retrieve(msg, pmsgid))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", pmsgid);
+			fprintf(stderr,"E");
+		} else {
+			dbmail_message_cache_bodystructure(msg);
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	mempool_close(&pool);
+	return DM_SUCCESS;
+}
+
+int db_icheck_bodystructure(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p LEFT JOIN %sbodystructure b "
+			"ON p.id = b.physmessage_id WHERE b.physmessage_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
 int db_set_message_status(uint64_t message_idnr, MessageStatus_T status)
 {
 	return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
@@ -1873,6 +2185,13 @@ int db_delete_message(uint64_t message_idnr)
 			DBPFX, message_idnr);
 }
 
+int db_delete_physmessage(uint64_t physmessage_id)
+{
+	return db_update("DELETE FROM %sphysmessage WHERE id = %" PRIu64 " "
+			"AND NOT EXISTS (SELECT 1 FROM %smessages WHERE physmessage_id = %" PRIu64 ")", 
+			DBPFX, physmessage_id, DBPFX, physmessage_id);
+}
+
 static int mailbox_delete(uint64_t mailbox_idnr)
 {
 	return db_update("DELETE FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 "", 
@@ -1948,6 +2267,7 @@ int db_delete_mailbox(uint64_t mailbox_idnr, int only_empty, int update_curmail_
 	} else {
 		if (! mailbox_delete(mailbox_idnr))
 			return DM_EGENERAL;
+		MailboxList_changed();
 	}
 
 	/* calculate the new quotum */
@@ -2637,6 +2957,7 @@ int db_createmailbox(const char * name, uint64_t owner_idnr, uint64_t * mailbox_
 			*mailbox_idnr = db_insert_result(c, r);
 		}
 		db_commit_transaction(c);
+		MailboxList_changed();
 		TRACE(TRACE_DEBUG, "created mailbox with idnr [%" PRIu64 "] for user [%" PRIu64 "]",
 				*mailbox_idnr, owner_idnr);
 	CATCH(SQLException)
@@ -2659,7 +2980,6 @@ int db_mailbox_set_permission(uint64_t mailbox_id, int permission)
 
 
 /* Called from:
- * dm_message.c (dbmail_message_store -> _message_insert) (always INBOX)
  * modules/authldap.c (creates shadow INBOX) (always INBOX)
  * sort.c (delivers to a mailbox) (performs own ACL checking)
  *
@@ -2898,6 +3218,46 @@ int db_mailbox_has_message_id(uint64_t mailbox_idnr, const char *messageid)
 	return rows;
 }
 
+/*
+ * render a list of message_idnr ranges as sql conditions
+ * on message_idnr, at most DB_RANGES_SLICE ranges each.
+ */
+#define DB_RANGES_SLICE 100
+
+static GList * db_ranges_slices(GList *ranges)
+{
+	GList *slices = NULL;
+	GString *slice = NULL;
+	unsigned i = 0;
+
+	ranges = g_list_first(ranges);
+	while (ranges) {
+		uint64_t *range = (uint64_t *)ranges->data;
+		if (! slice)
+			slice = g_string_new("(");
+		else
+			g_string_append(slice, " OR ");
+
+		if (range[0] == range[1])
+			g_string_append_printf(slice, "message_idnr = %" PRIu64 "", range[0]);
+		else
+			g_string_append_printf(slice, "message_idnr BETWEEN %" PRIu64 " AND %" PRIu64 "",
+					range[0], range[1]);
+
+		if (++i == DB_RANGES_SLICE || (! g_list_next(ranges))) {
+			g_string_append(slice, ")");
+			slices = g_list_append(slices, g_string_free(slice, FALSE));
+			slice = NULL;
+			i = 0;
+		}
+
+		if (! g_list_next(ranges)) break;
+		ranges = g_list_next(ranges);
+	}
+
+	return slices;
+}
+
 static uint64_t message_get_size(uint64_t message_idnr)
 {
 	Connection_T c; ResultSet_T r;
@@ -2998,6 +3358,419 @@ int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
 	return DM_EGENERAL;
 }
 
+int db_copymsg_set(uint64_t mailbox_from, GList *ranges, uint64_t mailbox_to,
+		uint64_t user_idnr, gboolean recent, GList **old_ids, GList **new_ids)
+{
+	Connection_T c; ResultSet_T r;
+	GList *slices, *l;
+	GList * volatile from = NULL;
+	GList * volatile to = NULL;
+	volatile uint64_t msgsize = 0, seq = 0;
+	volatile int t = DM_SUCCESS;
+	volatile unsigned expected = 0, copied = 0;
+	int valid;
+	char token[UID_SIZE], prefix[UID_SIZE];
+	char unique_id[DEF_FRAGSIZE], copy_of[DEF_FRAGSIZE];
+
+	slices = db_ranges_slices(ranges);
+
+	/* Every copy gets the unique_id <token>:<message_idnr of the
+	 * original>. The token is shared by the whole set, so the copies
+	 * are matched up with their originals in SQL. */
+	memset(token, 0, sizeof(token));
+	create_unique_id(token, 0);
+	memset(prefix, 0, sizeof(prefix));
+	snprintf(prefix, UID_SIZE-1, "'%s:'", token);
+
+	memset(unique_id, 0, sizeof(unique_id));
+	snprintf(unique_id, DEF_FRAGSIZE-1, db_get_sql(SQL_CONCAT), prefix, "message_idnr");
+	memset(copy_of, 0, sizeof(copy_of));
+	snprintf(copy_of, DEF_FRAGSIZE-1, db_get_sql(SQL_CONCAT), prefix, "o.message_idnr");
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		/* Get the number and the total size of the messages to be
+		 * copied. They are read within the transaction so the set
+		 * can not change between the quotum check and the copy. */
+		l = g_list_first(slices);
+		while (l) {
+			r = db_query(c, "SELECT COUNT(*), SUM(pm.messagesize) FROM %smessages "
+					"JOIN %sphysmessage pm ON pm.id = physmessage_id "
+					"WHERE mailbox_idnr = %" PRIu64 " AND status < %d AND %s",
+					DBPFX, DBPFX, mailbox_from, MESSAGE_STATUS_DELETE, (char *)l->data);
+			if (db_result_next(r)) {
+				expected += db_result_get_int(r, 0);
+				msgsize += db_result_get_u64(r, 1);
+			}
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		if (! expected) {
+			TRACE(TRACE_INFO, "mailbox [%" PRIu64 "] messages expunged before copy",
+					mailbox_from);
+			t = DM_EGENERAL;
+		}
+
+		/* Check to see if the user has room for the messages. */
+		if (t == DM_SUCCESS && (valid = dm_quota_user_validate(user_idnr, msgsize)) != TRUE) {
+			if (valid == DM_EQUERY) {
+				t = DM_EQUERY;
+			} else {
+				TRACE(TRACE_INFO, "user [%" PRIu64 "] would exceed quotum", user_idnr);
+				t = -2;
+			}
+		}
+
+		if (t == DM_SUCCESS) {
+			db_exec(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = %" PRIu64 "",
+					db_get_sql(SQL_IGNORE), DBPFX, mailbox_to);
+			r = db_query(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 "",
+					DBPFX, mailbox_to);
+			if (db_result_next(r))
+				seq = db_result_get_u64(r, 0);
+
+			/* Copy the message table entries. */
+			l = g_list_first(slices);
+			while (l) {
+				if (! db_exec(c, "INSERT INTO %smessages ("
+						"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,"
+						"flagged_flag,recent_flag,draft_flag,unique_id,status,seq)"
+						" SELECT %" PRIu64 ",physmessage_id,seen_flag,answered_flag,deleted_flag,"
+						"flagged_flag,%d,draft_flag,%s,status,%" PRIu64 ""
+						" FROM %smessages WHERE mailbox_idnr = %" PRIu64 " AND status < %d AND %s",
+						DBPFX, mailbox_to, recent, unique_id, seq,
+						DBPFX, mailbox_from, MESSAGE_STATUS_DELETE, (char *)l->data))
+					t = DM_EQUERY;
+				if (! g_list_next(l)) break;
+				l = g_list_next(l);
+			}
+
+			/* Pair the copies with their originals. */
+			r = db_query(c, "SELECT o.message_idnr, m.message_idnr FROM %smessages m "
+					"JOIN %smessages o ON m.unique_id = %s "
+					"WHERE m.mailbox_idnr = %" PRIu64 " AND m.unique_id LIKE '%s:%%' "
+					"AND o.mailbox_idnr = %" PRIu64 " "
+					"ORDER BY o.message_idnr",
+					DBPFX, DBPFX, copy_of, mailbox_to, token, mailbox_from);
+			while (db_result_next(r)) {
+				uint64_t *id = g_new0(uint64_t, 1);
+				*id = db_result_get_u64(r, 0);
+				from = g_list_prepend(from, id);
+				id = g_new0(uint64_t, 1);
+				*id = db_result_get_u64(r, 1);
+				to = g_list_prepend(to, id);
+				copied++;
+			}
+			from = g_list_reverse(from);
+			to = g_list_reverse(to);
+
+			if (t == DM_SUCCESS && copied != expected) {
+				TRACE(TRACE_INFO, "mailbox [%" PRIu64 "] changed while copying [%u/%u] messages",
+						mailbox_from, copied, expected);
+				t = DM_EGENERAL;
+			}
+		}
+
+		/* Copy the message keywords */
+		if (t == DM_SUCCESS) {
+			db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+					"SELECT m.message_idnr, k.keyword FROM %smessages m "
+					"JOIN %smessages o ON m.unique_id = %s "
+					"JOIN %skeywords k ON k.message_idnr = o.message_idnr "
+					"WHERE m.mailbox_idnr = %" PRIu64 " AND m.unique_id LIKE '%s:%%' "
+					"AND o.mailbox_idnr = %" PRIu64 "",
+					DBPFX, DBPFX, DBPFX, copy_of, DBPFX,
+					mailbox_to, token, mailbox_from);
+		}
+
+		if (t == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(slices);
+
+	if (t != DM_SUCCESS) {
+		g_list_destroy(from);
+		g_list_destroy(to);
+		return t;
+	}
+
+	TRACE(TRACE_DEBUG, "copied [%u] messages from [%" PRIu64 "] to [%" PRIu64 "] seq [%" PRIu64 "]",
+			copied, mailbox_from, mailbox_to, seq);
+
+	if (seq)
+		MailboxWatch_publish(mailbox_to, seq);
+
+	/* update quotum */
+	if (! dm_quota_user_inc(user_idnr, msgsize))
+		t = DM_EQUERY;
+
+	if (old_ids)
+		*old_ids = from;
+	else
+		g_list_destroy(from);
+	if (new_ids)
+		*new_ids = to;
+	else
+		g_list_destroy(to);
+
+	return t;
+}
+
+typedef struct {
+	uint64_t id;
+	uint64_t maxmail;
+	uint64_t curmail;
+	uint64_t added;
+	uint64_t seq;
+	gboolean error;
+	gboolean uncounted;	/* the delivery user has no quotum */
+} DeliveryAccount_T;
+
+static DeliveryAccount_T * delivery_account(GTree *tree, GList **list, uint64_t id)
+{
+	DeliveryAccount_T *A;
+	if ((A = g_tree_lookup(tree, &id)))
+		return A;
+	A = g_new0(DeliveryAccount_T, 1);
+	A->id = id;
+	g_tree_insert(tree, &A->id, A);
+	*list = g_list_append(*list, A);
+	return A;
+}
+
+static char * delivery_account_ids(GList *list)
+{
+	GString *ids = g_string_new("");
+	list = g_list_first(list);
+	while (list) {
+		DeliveryAccount_T *A = (DeliveryAccount_T *)list->data;
+		g_string_append_printf(ids, "%s%" PRIu64 "", ids->len?",":"", A->id);
+		if (! g_list_next(list)) break;
+		list = g_list_next(list);
+	}
+	return g_string_free(ids, FALSE);
+}
+
+int db_deliver_targets(uint64_t physmessage_id, uint64_t msgsize, uint64_t rfcsize,
+		const char *internal_date, GList *targets)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	GTree *users, *boxes;
+	GList *userlist = NULL, *boxlist = NULL, *l;
+	volatile int t = DM_SUCCESS;
+	volatile unsigned delivered = 0;
+	char unique_id[UID_SIZE], *frag;
+	char * volatile uids = NULL;
+	char * volatile bids = NULL;
+
+	if (! targets)
+		return DM_SUCCESS;
+
+	users = g_tree_new((GCompareFunc)ucmp);
+	boxes = g_tree_new((GCompareFunc)ucmp);
+
+	/* quota limits come from the authentication backend */
+	l = g_list_first(targets);
+	while (l) {
+		DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+		DeliveryAccount_T *A;
+		T->result = DM_EQUERY;
+		T->message_idnr = 0;
+		if (! g_tree_lookup(users, &T->user_idnr)) {
+			A = delivery_account(users, &userlist, T->user_idnr);
+			if (auth_getmaxmailsize(A->id, &A->maxmail) == -1) {
+				TRACE(TRACE_ERR, "auth_getmaxmailsize() failed for [%" PRIu64 "]", A->id);
+				A->error = TRUE;
+			}
+			A->uncounted = (user_idnr_is_delivery_user_idnr(A->id) != DM_SUCCESS);
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	frag = db_returning("message_idnr");
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		/* current usage of all recipients */
+		uids = delivery_account_ids(userlist);
+		r = db_query(c, "SELECT user_idnr, curmail_size FROM %susers WHERE user_idnr IN (%s)",
+				DBPFX, uids);
+		while (db_result_next(r)) {
+			uint64_t id = db_result_get_u64(r, 0);
+			DeliveryAccount_T *A = g_tree_lookup(users, &id);
+			if (A) A->curmail = db_result_get_u64(r, 1);
+		}
+
+		/* check the quota of every target in order */
+		l = g_list_first(targets);
+		while (l) {
+			DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+			DeliveryAccount_T *A = g_tree_lookup(users, &T->user_idnr);
+			if (A->error) {
+				T->result = DM_EQUERY;
+			} else if (A->maxmail && (A->curmail + A->added + msgsize > A->maxmail)) {
+				TRACE(TRACE_INFO, "user [%" PRIu64 "] would exceed quotum", A->id);
+				T->result = -2;
+			} else {
+				A->added += msgsize;
+				T->result = DM_SUCCESS;
+				delivery_account(boxes, &boxlist, T->mailbox_idnr);
+			}
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* one seq update per mailbox */
+		if (boxlist) {
+			bids = delivery_account_ids(boxlist);
+			db_exec(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr IN (%s)",
+					db_get_sql(SQL_IGNORE), DBPFX, bids);
+			r = db_query(c, "SELECT mailbox_idnr, seq FROM %smailboxes WHERE mailbox_idnr IN (%s)",
+					DBPFX, bids);
+			while (db_result_next(r)) {
+				uint64_t id = db_result_get_u64(r, 0);
+				DeliveryAccount_T *B = g_tree_lookup(boxes, &id);
+				if (B) B->seq = db_result_get_u64(r, 1);
+			}
+		}
+
+		/* the messages rows */
+		s = db_stmt_prepare(c, "INSERT INTO %skeywords (message_idnr, keyword) VALUES (?, ?)", DBPFX);
+		l = g_list_first(targets);
+		while (l) {
+			DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+			DeliveryAccount_T *B;
+			GList *k;
+
+			if (T->result != DM_SUCCESS) {
+				if (! g_list_next(l)) break;
+				l = g_list_next(l);
+				continue;
+			}
+
+			B = g_tree_lookup(boxes, &T->mailbox_idnr);
+			memset(unique_id, 0, sizeof(unique_id));
+			create_unique_id(unique_id, physmessage_id);
+
+			if (db_params.db_driver == DM_DRIVER_ORACLE) {
+				db_exec(c, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, "
+						"seen_flag, answered_flag, deleted_flag, flagged_flag, draft_flag, recent_flag, "
+						"unique_id, status, seq) VALUES "
+						"(%" PRIu64 ", %" PRIu64 ", %d, %d, %d, %d, %d, %d, '%s', %d, %" PRIu64 ")",
+						DBPFX, T->mailbox_idnr, physmessage_id,
+						T->flags[IMAP_FLAG_SEEN], T->flags[IMAP_FLAG_ANSWERED],
+						T->flags[IMAP_FLAG_DELETED], T->flags[IMAP_FLAG_FLAGGED],
+						T->flags[IMAP_FLAG_DRAFT], T->flags[IMAP_FLAG_RECENT],
+						unique_id, T->status, B->seq);
+				T->message_idnr = db_get_pk(c, "messages");
+			} else {
+				r = db_query(c, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, "
+						"seen_flag, answered_flag, deleted_flag, flagged_flag, draft_flag, recent_flag, "
+						"unique_id, status, seq) VALUES "
+						"(%" PRIu64 ", %" PRIu64 ", %d, %d, %d, %d, %d, %d, '%s', %d, %" PRIu64 ") %s",
+						DBPFX, T->mailbox_idnr, physmessage_id,
+						T->flags[IMAP_FLAG_SEEN], T->flags[IMAP_FLAG_ANSWERED],
+						T->flags[IMAP_FLAG_DELETED], T->flags[IMAP_FLAG_FLAGGED],
+						T->flags[IMAP_FLAG_DRAFT], T->flags[IMAP_FLAG_RECENT],
+						unique_id, T->status, B->seq, frag);
+				T->message_idnr = db_insert_result(c, r);
+			}
+
+			k = g_list_first(T->keywords);
+			while (k) {
+				db_stmt_set_u64(s, 1, T->message_idnr);
+				db_stmt_set_str(s, 2, (char *)k->data);
+				db_stmt_exec(s);
+				if (! g_list_next(k)) break;
+				k = g_list_next(k);
+			}
+
+			delivered++;
+
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* one quota update per user */
+		l = g_list_first(userlist);
+		while (l) {
+			DeliveryAccount_T *A = (DeliveryAccount_T *)l->data;
+			if (A->added && (! A->uncounted))
+				db_exec(c, "UPDATE %susers SET curmail_size = curmail_size + %" PRIu64 " "
+						"WHERE user_idnr = %" PRIu64 "", DBPFX, A->added, A->id);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* the physmessage is no longer pending */
+		if (delivered) {
+			Field_T to_date_str;
+			char2date_str(internal_date, &to_date_str);
+			db_exec(c, "UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 ", "
+					"internal_date = %s WHERE id = %" PRIu64 "",
+					DBPFX, msgsize, rfcsize, &to_date_str, physmessage_id);
+		}
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(frag);
+	g_free(uids);
+	g_free(bids);
+
+	if (t == DM_EQUERY) {
+		l = g_list_first(targets);
+		while (l) {
+			DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+			if (T->result == DM_SUCCESS) {
+				T->result = DM_EQUERY;
+				T->message_idnr = 0;
+			}
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+	} else {
+		TRACE(TRACE_DEBUG, "physmessage [%" PRIu64 "] delivered [%u/%u]",
+				physmessage_id, delivered, g_list_length(targets));
+		l = g_list_first(boxlist);
+		while (l) {
+			DeliveryAccount_T *B = (DeliveryAccount_T *)l->data;
+			if (B->seq)
+				MailboxWatch_publish(B->id, B->seq);
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+	}
+
+	g_tree_destroy(users);
+	g_tree_destroy(boxes);
+	g_list_destroy(userlist);
+	g_list_destroy(boxlist);
+
+	return t;
+}
+
 int db_getmailboxname(uint64_t mailbox_idnr, uint64_t user_idnr, char *name)
 {
 	Connection_T c; ResultSet_T r;
@@ -3051,6 +3824,7 @@ int db_setmailboxname(uint64_t mailbox_idnr, const char *name)
 		db_stmt_set_str(s,1,name);
 		db_stmt_set_u64(s,2,mailbox_idnr);
 		db_stmt_exec(s);
+		MailboxList_changed();
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		t = DM_EQUERY;
@@ -3058,6 +3832,10 @@ int db_setmailboxname(uint64_t mailbox_idnr, const char *name)
 		db_con_close(c);
 	END_TRY;
 
+	/* other processes notice the new name through the mailbox seq */
+	if (t == DM_SUCCESS)
+		db_mailbox_seq_update(mailbox_idnr, 0);
+
 	return t;
 }
 
@@ -3080,6 +3858,7 @@ int db_subscribe(uint64_t mailbox_idnr, uint64_t user_idnr)
 			t = TRUE;
 		}
 		db_commit_transaction(c);
+		MailboxList_changed();
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		db_rollback_transaction(c);
@@ -3088,12 +3867,18 @@ int db_subscribe(uint64_t mailbox_idnr, uint64_t user_idnr)
 		db_con_close(c);
 	END_TRY;
 
+	if (t == TRUE)
+		db_mailbox_seq_update(mailbox_idnr, 0);
+
 	return t;
 }
 
 int db_unsubscribe(uint64_t mailbox_idnr, uint64_t user_idnr)
 {
-	return db_update("DELETE FROM %ssubscription WHERE user_id=%" PRIu64 " AND mailbox_id=%" PRIu64 "", DBPFX, user_idnr, mailbox_idnr);
+	int result = db_update("DELETE FROM %ssubscription WHERE user_id=%" PRIu64 " AND mailbox_id=%" PRIu64 "", DBPFX, user_idnr, mailbox_idnr);
+	MailboxList_changed();
+	db_mailbox_seq_update(mailbox_idnr, 0);
+	return result;
 }
 
 int db_get_msgflag(const char *flag_name, uint64_t msg_idnr)
@@ -3277,6 +4062,179 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 	return count;
 }
 
+/*
+ * change the keywords for the messages matching cond
+ *
+ * Messages that are going to change are stamped with seq first, the
+ * keywords are then changed for the stamped messages only.
+ */
+static void db_set_msgkeywords_set(Connection_T c, const char *cond, const char *guard,
+		GList *keywords, int action_type, uint64_t seq)
+{
+	PreparedStatement_T s;
+	GString *in;
+	GList *k;
+	int i, n;
+
+	keywords = g_list_first(keywords);
+	n = g_list_length(keywords);
+
+	if (action_type == IMAPFA_REMOVE || action_type == IMAPFA_REPLACE) {
+		in = g_string_new("");
+		for (i = 0; i < n; i++)
+			g_string_append_printf(in, "%sLOWER(?)", i?",":"");
+
+		s = db_stmt_prepare(c, "UPDATE %smessages SET seq = %" PRIu64 " WHERE %s%s "
+				"AND EXISTS (SELECT 1 FROM %skeywords k WHERE k.message_idnr = %smessages.message_idnr "
+				"AND LOWER(k.keyword) %s IN (%s))",
+				DBPFX, seq, cond, guard, DBPFX, DBPFX,
+				action_type == IMAPFA_REPLACE ? "NOT" : "", in->str);
+		for (i = 1, k = keywords; k; k = g_list_next(k), i++)
+			db_stmt_set_str(s, i, (char *)k->data);
+		db_stmt_exec(s);
+
+		s = db_stmt_prepare(c, "DELETE FROM %skeywords WHERE LOWER(keyword) %s IN (%s) AND message_idnr IN "
+				"(SELECT message_idnr FROM %smessages WHERE %s AND seq = %" PRIu64 ")",
+				DBPFX, action_type == IMAPFA_REPLACE ? "NOT" : "", in->str,
+				DBPFX, cond, seq);
+		for (i = 1, k = keywords; k; k = g_list_next(k), i++)
+			db_stmt_set_str(s, i, (char *)k->data);
+		db_stmt_exec(s);
+
+		g_string_free(in, TRUE);
+	}
+
+	if (action_type == IMAPFA_ADD || action_type == IMAPFA_REPLACE) {
+		for (k = keywords; k; k = g_list_next(k)) {
+			s = db_stmt_prepare(c, "UPDATE %smessages SET seq = %" PRIu64 " WHERE %s%s "
+					"AND NOT EXISTS (SELECT 1 FROM %skeywords k WHERE k.message_idnr = %smessages.message_idnr "
+					"AND LOWER(k.keyword) = LOWER(?))",
+					DBPFX, seq, cond, guard, DBPFX, DBPFX);
+			db_stmt_set_str(s, 1, (char *)k->data);
+			db_stmt_exec(s);
+
+			s = db_stmt_prepare(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+					"SELECT message_idnr, ? FROM %smessages m WHERE %s AND seq = %" PRIu64 " "
+					"AND NOT EXISTS (SELECT 1 FROM %skeywords k WHERE k.message_idnr = m.message_idnr "
+					"AND LOWER(k.keyword) = LOWER(?))",
+					DBPFX, DBPFX, cond, seq, DBPFX);
+			db_stmt_set_str(s, 1, (char *)k->data);
+			db_stmt_set_str(s, 2, (char *)k->data);
+			db_stmt_exec(s);
+		}
+	}
+}
+
+int db_set_msgflag_set(uint64_t mailbox_id, GList *ranges, int *flags, GList *keywords,
+		int action_type, uint64_t unchangedsince, uint64_t seq, GTree *changed, GList **failed)
+{
+	Connection_T c; ResultSet_T r;
+	GList *slices, *l;
+	GString *set, *differ;
+	char guard[DEF_FRAGSIZE];
+	char * volatile cond = NULL;
+	volatile int count = 0;
+	int i, nflags = 0;
+
+	assert(seq);
+
+	/* the flag columns to set, and the test for messages
+	 * on which at least one of them would change */
+	set = g_string_new("");
+	differ = g_string_new("");
+	for (i = 0; flags && i < IMAP_NFLAGS; i++) {
+		int value;
+		if (i == IMAP_FLAG_RECENT)
+			continue;
+		switch (action_type) {
+			case IMAPFA_ADD:
+				if (! flags[i]) continue;
+				value = 1;
+				break;
+			case IMAPFA_REMOVE:
+				if (! flags[i]) continue;
+				value = 0;
+				break;
+			case IMAPFA_REPLACE:
+				value = flags[i] ? 1 : 0;
+				break;
+			default:
+				continue;
+		}
+		TRACE(TRACE_DEBUG,"set %s=%d", db_flag_desc[i], value);
+		g_string_append_printf(set, "%s=%d, ", db_flag_desc[i], value);
+		g_string_append_printf(differ, "%s%s<>%d", nflags?" OR ":"", db_flag_desc[i], value);
+		nflags++;
+	}
+
+	memset(guard, 0, sizeof(guard));
+	if (unchangedsince)
+		snprintf(guard, DEF_FRAGSIZE-1, " AND seq <= %" PRIu64 "", unchangedsince);
+
+	slices = db_ranges_slices(ranges);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		l = g_list_first(slices);
+		while (l) {
+			cond = g_strdup_printf("mailbox_idnr = %" PRIu64 " AND status < %d AND %s",
+					mailbox_id, MESSAGE_STATUS_DELETE, (char *)l->data);
+
+			if (unchangedsince && failed) {
+				r = db_query(c, "SELECT message_idnr FROM %smessages WHERE %s AND seq > %" PRIu64 "",
+						DBPFX, cond, unchangedsince);
+				while (db_result_next(r)) {
+					uint64_t *id = g_new0(uint64_t, 1);
+					*id = db_result_get_u64(r, 0);
+					*failed = g_list_prepend(*failed, id);
+				}
+			}
+
+			if (nflags)
+				db_exec(c, "UPDATE %smessages SET %sseq = %" PRIu64 " WHERE %s%s AND (%s)",
+						DBPFX, set->str, seq, cond, guard, differ->str);
+
+			if (keywords)
+				db_set_msgkeywords_set(c, cond, guard, keywords, action_type, seq);
+
+			r = db_query(c, "SELECT message_idnr FROM %smessages WHERE %s AND seq = %" PRIu64 "",
+					DBPFX, cond, seq);
+			while (db_result_next(r)) {
+				uint64_t *id;
+				count++;
+				if (! changed)
+					continue;
+				id = g_new0(uint64_t, 1);
+				*id = db_result_get_u64(r, 0);
+				g_tree_insert(changed, id, id);
+			}
+			g_free(cond);
+			cond = NULL;
+
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		count = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+		g_free(cond);
+	END_TRY;
+
+	g_list_destroy(slices);
+	g_string_free(set, TRUE);
+	g_string_free(differ, TRUE);
+
+	if (failed)
+		*failed = g_list_reverse(*failed);
+
+	return count;
+}
+
 static int db_acl_has_acl(uint64_t userid, uint64_t mboxid)
 {
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
@@ -3337,12 +4295,16 @@ int db_acl_set_right(uint64_t userid, uint64_t mboxid, const char *right_flag,
 		}
 	}
 
-	return db_update("UPDATE %sacl SET %s = %i WHERE user_id = %" PRIu64 " AND mailbox_id = %" PRIu64 "",DBPFX, right_flag, set, userid, mboxid);
+	result = db_update("UPDATE %sacl SET %s = %i WHERE user_id = %" PRIu64 " AND mailbox_id = %" PRIu64 "",DBPFX, right_flag, set, userid, mboxid);
+	MailboxList_changed();
+	return result;
 }
 
 int db_acl_delete_acl(uint64_t userid, uint64_t mboxid)
 {
-	return db_update("DELETE FROM %sacl WHERE user_id = %" PRIu64 " AND mailbox_id = %" PRIu64 "",DBPFX, userid, mboxid);
+	int result = db_update("DELETE FROM %sacl WHERE user_id = %" PRIu64 " AND mailbox_id = %" PRIu64 "",DBPFX, userid, mboxid);
+	MailboxList_changed();
+	return result;
 }
 
 int db_acl_get_identifier(uint64_t mboxid, GList **identifier_list)
@@ -3842,6 +4804,11 @@ int db_user_security_trigger(uint64_t user_idnr)
 	config_get_security_actions(server_conf);
 
 	assert(user_idnr);
+
+	/* a login with the security password must run the trigger
+	 * every time, so it must not be served from the auth cache */
+	AuthCache_flush();
+
 	c = db_con_get();
 	TRY
 		s = db_stmt_prepare(c, "SELECT saction FROM %susers WHERE user_idnr = ?", DBPFX);
@@ -4262,6 +5229,8 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 	END_TRY;
 	TRACE(TRACE_DEBUG, "mailbox_id [%" PRIu64 "] message_id [%" PRIu64 "] -> [%" PRIu64 "]",
 			mailbox_id, message_id, seq);
+	if (seq)
+		MailboxWatch_publish(mailbox_id, seq);
 	return seq;
 }
 
@@ -4353,6 +5322,8 @@ int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr
 		char* internal_date, uint64_t * msg_idnr, gboolean recent)
 {
         DbmailMessage *message;
+	DeliveryTarget_T target;
+	GList *targets = NULL;
 	int result;
 
 	if (! mailbox_is_writable(mailbox_idnr)) return DM_EQUERY;
@@ -4366,9 +5337,22 @@ int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr
 		return DM_EQUERY;
 	}
 
-	result = db_copymsg(message->msg_idnr, mailbox_idnr, user_idnr, msg_idnr, recent);
-	db_delete_message(message->msg_idnr);
+	memset(&target, 0, sizeof(target));
+	target.user_idnr = user_idnr;
+	target.mailbox_idnr = mailbox_idnr;
+	target.flags[IMAP_FLAG_RECENT] = recent ? 1 : 0;
+	target.status = MESSAGE_STATUS_SEEN;
+	targets = g_list_append(targets, &target);
+
+	if ((result = dbmail_message_deliver_targets(message, targets)) == DM_SUCCESS)
+		result = target.result;
+	g_list_free(targets);
+
+	if (result != DM_SUCCESS)
+		db_delete_physmessage(message->id);
         dbmail_message_free(message);
+
+	*msg_idnr = target.message_idnr;
 	
         switch (result) {
             case -2:
@@ -4383,6 +5367,6 @@ int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr
                 
         TRACE(TRACE_NOTICE, "message id=%" PRIu64 " is inserted", *msg_idnr);
         
-        return (db_set_message_status(*msg_idnr, MESSAGE_STATUS_SEEN)?FALSE:TRUE);
+        return DM_SUCCESS;
 }
 
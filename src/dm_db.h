@@ -76,6 +76,13 @@ int db_disconnect(void);
 
 void log_query_time(char *query, struct timeval before, struct timeval after);
 
+/**
+ * \brief prepared statement statistics, with statement_stats enabled
+ * \param sql the template passed to db_stmt_prepare
+ * \return FALSE if the statement was never prepared
+ */
+gboolean db_stmt_stats(const char *sql, uint64_t *prepared, uint64_t *executed, double *elapsed);
+
 PreparedStatement_T db_stmt_prepare(Connection_T, const char *, ...);
 int db_stmt_set_str(S stmt, int index, const char *x);
 int db_stmt_set_int(S stmt, int index, int x);
@@ -390,6 +397,14 @@ int db_update_rfcsize(GList *lost);
 int db_icheck_envelope(GList **lost);
 int db_set_envelope(GList *lost);
 
+/**
+ * \brief check for cached bodystructures
+ *
+ */
+
+int db_icheck_bodystructure(GList **lost);
+int db_set_bodystructure(GList *lost);
+
 /**
  * \brief set status of a message
  * \param message_idnr
@@ -407,6 +422,17 @@ int db_set_message_status(uint64_t message_idnr, MessageStatus_T status);
  */
 int db_delete_message(uint64_t message_idnr);
 
+/**
+ * \brief delete a stored message that was not delivered
+ * \param physmessage_id
+ * \return 
+ *     - -1 on error
+ *     -  1 on success
+ *
+ * does nothing if a message still refers to the physmessage
+ */
+int db_delete_physmessage(uint64_t physmessage_id);
+
 /**
  * \brief delete a mailbox. 
  * \param mailbox_idnr
@@ -612,6 +638,49 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from);
 int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to,
 	       uint64_t user_idnr, uint64_t * newmsg_idnr, gboolean recent);
 
+/**
+ * \brief copy a set of messages to a mailbox
+ * \param mailbox_from mailbox holding the messages
+ * \param ranges list of uint64_t[2] message_idnr ranges {first, last}.
+ *        every message in mailbox_from within a range is copied.
+ * \param mailbox_to mailbox to copy to
+ * \param user_idnr user to copy the messages for.
+ * \param recent set the recent flag on the copies
+ * \param old_ids will hold the message_idnrs of the copied messages
+ * \param new_ids will hold the message_idnrs of the copies, in the
+ *        same order as old_ids
+ * \return 
+ * 		- -2 if the quotum is exceeded
+ * 		- -1 on failure
+ * 		- 0 on success
+ * 		- 1 if messages were expunged while copying; nothing is copied
+ *
+ * The whole set is copied in a single transaction, with a single
+ * quotum check and a single update of the mailbox seq.
+ */
+int db_copymsg_set(uint64_t mailbox_from, GList *ranges, uint64_t mailbox_to,
+		uint64_t user_idnr, gboolean recent, GList **old_ids, GList **new_ids);
+
+/**
+ * \brief create the messages rows for a stored physmessage
+ * \param physmessage_id the stored message
+ * \param msgsize size of the message for quotum accounting
+ * \param rfcsize size of the message with CRLF line endings
+ * \param internal_date internal date of the message
+ * \param targets list of DeliveryTarget_T. The result and
+ *        message_idnr of each target are filled in.
+ * \return 
+ * 		- -1 on failure
+ * 		- 0 on success, though single targets may be over quotum
+ *
+ * All targets are delivered in a single transaction, with one
+ * quotum update per user and one seq update per mailbox. The sizes
+ * and internal date are stored with the first delivery, until then
+ * the physmessage is pending.
+ */
+int db_deliver_targets(uint64_t physmessage_id, uint64_t msgsize, uint64_t rfcsize,
+		const char *internal_date, GList *targets);
+
 /**
  * \brief check if mailbox already holds message with message-id
  * \param mailbox_idnr
@@ -695,6 +764,28 @@ int db_get_msgflag(const char *flag_name, uint64_t msg_idnr);
  */
 int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo);
 
+/**
+ * \brief set flags and keywords for a set of messages
+ * \param mailbox_id mailbox holding the messages
+ * \param ranges list of uint64_t[2] message_idnr ranges {first, last}
+ * \param flags, keywords, action_type as for db_set_msgflag()
+ * \param unchangedsince only modify messages with modsequence <= 
+ *        unchangedsince, 0 to modify all messages
+ * \param seq modsequence to set on the messages that changed
+ * \param changed if not NULL, the message_idnrs (uint64_t *) of the
+ *        messages that changed are added as keys
+ * \param failed if not NULL, will hold the message_idnrs that were
+ *        not modified because of unchangedsince
+ * \return 
+ * 		- -1 on failure
+ * 		- number of messages changed
+ *
+ * Every flag change is done in a single statement per slice of
+ * ranges.
+ */
+int db_set_msgflag_set(uint64_t mailbox_id, GList *ranges, int *flags, GList *keywords,
+		int action_type, uint64_t unchangedsince, uint64_t seq, GTree *changed, GList **failed);
+
 /**
  * \brief set one right in an acl for a user
  * \param userid id of user
@@ -22,6 +22,7 @@
 */
 
 #include "dbmail.h"
+#include "dm_recipientcache.h"
 #define THIS_MODULE "dsn"
 
 /* Enhanced Status Codes from RFC 1893
@@ -542,6 +543,11 @@ int dsnuser_resolve(Delivery_T *delivery)
 	/* Ok, we don't have a useridnr, maybe we have an address? */
 	} else if (strlen(delivery->address) > 0) {
 
+		if (RecipientCache_get(delivery)) {
+			TRACE(TRACE_INFO, "[%s] resolved from cache", delivery->address);
+			return 0;
+		}
+
 		TRACE(TRACE_INFO, "checking if [%s] is a valid username, alias, or catchall.", delivery->address);
 
 		if (address_has_alias(delivery))  {
@@ -582,6 +588,8 @@ int dsnuser_resolve(Delivery_T *delivery)
 			TRACE(TRACE_INFO, "could not find [%s] at all.", delivery->address);
 		}
 
+		RecipientCache_set(delivery);
+
 	/* Neither useridnr nor address.
 	 * Something is wrong upstream. */
 	} else {
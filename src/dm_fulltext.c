@@ -0,0 +1,617 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include "dm_fulltext.h"
+
+#define THIS_MODULE "FullText"
+
+#define FULLTEXT_TERM_MIN 2       // characters
+#define FULLTEXT_TERM_MAX 64      // bytes, the width of fts_terms.term
+#define FULLTEXT_TERMS_MAX 10000  // distinct terms per part
+#define FULLTEXT_BATCH 64
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+static int fulltext_enabled = -1;
+
+gboolean FullText_enabled(void)
+{
+	Field_T val;
+
+	if (fulltext_enabled < 0) {
+		config_get_value("fulltext_index", "DBMAIL", val);
+		fulltext_enabled = MATCH(val, "yes") ? 1 : 0;
+		// needs multi-row inserts
+		if (db_params.db_driver == DM_DRIVER_ORACLE)
+			fulltext_enabled = 0;
+	}
+	return fulltext_enabled ? TRUE : FALSE;
+}
+
+void FullText_reset(void)
+{
+	fulltext_enabled = -1;
+}
+
+/*
+ * tokenizer
+ */
+
+struct terms {
+	GHashTable *seen;
+	GList *list;
+	int count;
+};
+
+static void terms_add(struct terms *T, GString *word)
+{
+	gchar *term;
+
+	if (g_utf8_strlen(word->str, -1) < FULLTEXT_TERM_MIN || T->count >= FULLTEXT_TERMS_MAX) {
+		g_string_truncate(word, 0);
+		return;
+	}
+
+	term = g_utf8_casefold(word->str, -1);
+	g_string_truncate(word, 0);
+
+	// long words are kept by their prefix
+	while (strlen(term) >= FULLTEXT_TERM_MAX)
+		*(g_utf8_find_prev_char(term, term + strlen(term))) = '\0';
+
+	if (g_hash_table_lookup(T->seen, term)) {
+		g_free(term);
+		return;
+	}
+
+	g_hash_table_insert(T->seen, term, term);
+	T->list = g_list_prepend(T->list, term);
+	T->count++;
+}
+
+GList * FullText_terms(const char *text)
+{
+	struct terms T;
+	GString *word;
+	const char *p = text;
+
+	if (! text)
+		return NULL;
+
+	T.seen = g_hash_table_new(g_str_hash, g_str_equal);
+	T.list = NULL;
+	T.count = 0;
+	word = g_string_new("");
+
+	while (*p) {
+		gunichar c = g_utf8_get_char_validated(p, -1);
+
+		// invalid bytes end a word
+		if (c == (gunichar)-1 || c == (gunichar)-2) {
+			terms_add(&T, word);
+			p++;
+			continue;
+		}
+
+		// utf8 columns in mysql only hold the basic plane
+		if (c <= 0xFFFF && g_unichar_isalnum(c))
+			g_string_append_unichar(word, c);
+		else
+			terms_add(&T, word);
+
+		p = g_utf8_next_char(p);
+	}
+	terms_add(&T, word);
+
+	g_string_free(word, TRUE);
+	g_hash_table_destroy(T.seen);
+
+	return g_list_reverse(T.list);
+}
+
+/*
+ * decoding
+ */
+
+/* the unfolded fields of a raw header block */
+static gchar ** head_fields(const char *head)
+{
+	GString *s = g_string_new("");
+	gchar **fields;
+	const char *p;
+
+	for (p = head; *p; p++) {
+		if (*p == '\r')
+			continue;
+		if (*p == '\n' && (*(p+1) == ' ' || *(p+1) == '\t')) {
+			g_string_append_c(s, ' ');
+			p++;
+			continue;
+		}
+		g_string_append_c(s, *p);
+	}
+
+	fields = g_strsplit(s->str, "\n", 0);
+	g_string_free(s, TRUE);
+
+	return fields;
+}
+
+static gchar * head_get(gchar **fields, const char *name)
+{
+	size_t l = strlen(name);
+	int i;
+
+	for (i = 0; fields[i]; i++) {
+		if (g_ascii_strncasecmp(fields[i], name, l) == 0 && fields[i][l] == ':')
+			return g_strstrip(g_strdup(fields[i] + l + 1));
+	}
+
+	return NULL;
+}
+
+static gchar * head_decode(const char *head)
+{
+	gchar **fields = head_fields(head);
+	GString *text = g_string_new("");
+	int i;
+
+	for (i = 0; fields[i]; i++) {
+		char *value, *decoded;
+		if (! (value = strchr(fields[i], ':')))
+			continue;
+		if ((decoded = dbmail_iconv_decode_text(value + 1))) {
+			g_string_append(text, decoded);
+			g_string_append_c(text, '\n');
+			g_free(decoded);
+		}
+	}
+
+	g_strfreev(fields);
+
+	return g_string_free(text, FALSE);
+}
+
+static void html_strip(gchar *text)
+{
+	gboolean tag = FALSE;
+	gchar *p;
+
+	for (p = text; *p; p++) {
+		if (*p == '<')
+			tag = TRUE;
+		if (tag) {
+			if (*p == '>')
+				tag = FALSE;
+			*p = ' ';
+		}
+	}
+}
+
+/*
+ * decode the body of a text part, given the header of the part.
+ * Returns NULL for non-text parts.
+ */
+static gchar * body_decode(const char *head, const char *body)
+{
+	GMimeContentType *type = NULL;
+	GMimeContentEncoding encoding = GMIME_CONTENT_ENCODING_DEFAULT;
+	GMimeStream *stream, *fstream;
+	GMimeFilter *filter;
+	GByteArray *bytes;
+	const char *charset = NULL;
+	gboolean html = FALSE;
+	gchar **fields = NULL, *value, *text;
+
+	if (head) {
+		fields = head_fields(head);
+		if ((value = head_get(fields, "content-type"))) {
+			type = g_mime_content_type_new_from_string(value);
+			g_free(value);
+		}
+		if ((value = head_get(fields, "content-transfer-encoding"))) {
+			encoding = g_mime_content_encoding_from_string(value);
+			g_free(value);
+		}
+		g_strfreev(fields);
+	}
+
+	if (type) {
+		if (! g_mime_content_type_is_type(type, "text", "*")) {
+			g_object_unref(type);
+			return NULL;
+		}
+		html = g_mime_content_type_is_type(type, "text", "html");
+		charset = g_mime_content_type_get_parameter(type, "charset");
+	}
+
+	stream = g_mime_stream_mem_new();
+	fstream = g_mime_stream_filter_new(stream);
+
+	switch (encoding) {
+		case GMIME_CONTENT_ENCODING_BASE64:
+		case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+		case GMIME_CONTENT_ENCODING_UUENCODE:
+			filter = g_mime_filter_basic_new(encoding, FALSE);
+			g_mime_stream_filter_add((GMimeStreamFilter *)fstream, filter);
+			g_object_unref(filter);
+			break;
+		default:
+			break;
+	}
+
+	if (charset && g_ascii_strcasecmp(charset, "utf-8") != 0
+			&& (filter = g_mime_filter_charset_new(charset, "utf-8"))) {
+		g_mime_stream_filter_add((GMimeStreamFilter *)fstream, filter);
+		g_object_unref(filter);
+	}
+
+	g_mime_stream_write_string(fstream, body);
+	g_mime_stream_flush(fstream);
+	g_object_unref(fstream);
+
+	bytes = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)stream);
+	text = g_strndup((const char *)bytes->data, bytes->len);
+	g_object_unref(stream);
+
+	if (type)
+		g_object_unref(type);
+
+	if (html)
+		html_strip(text);
+
+	return text;
+}
+
+/*
+ * storage
+ */
+
+static void terms_lookup(Connection_T c, GHashTable *ids, GList *batch)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	GString *q = g_string_new("");
+	int i, count = g_list_length(batch);
+
+	g_string_printf(q, "SELECT id, term FROM %sfts_terms WHERE term IN (", DBPFX);
+	for (i = 0; i < count; i++)
+		g_string_append_printf(q, "%s?", i ? "," : "");
+	g_string_append(q, ")");
+
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "%s", q->str);
+	i = 1;
+	batch = g_list_first(batch);
+	while (batch) {
+		db_stmt_set_str(s, i++, (const char *)batch->data);
+		if (! g_list_next(batch)) break;
+		batch = g_list_next(batch);
+	}
+
+	r = db_stmt_query(s);
+	while (db_result_next(r)) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = db_result_get_u64(r, 0);
+		g_hash_table_insert(ids, g_strdup(db_result_get(r, 1)), id);
+	}
+
+	g_string_free(q, TRUE);
+}
+
+static uint64_t term_insert(Connection_T c, const char *term)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	char *frag;
+
+	db_con_clear(c);
+	frag = db_returning("id");
+	s = db_stmt_prepare(c, "INSERT %s INTO %sfts_terms (term) VALUES (?) %s",
+			db_get_sql(SQL_IGNORE), DBPFX, frag);
+	g_free(frag);
+
+	db_stmt_set_str(s, 1, term);
+	r = db_stmt_query(s);
+
+	return db_insert_result(c, r);
+}
+
+/*
+ * resolve the ids of all terms in one query per FULLTEXT_BATCH terms,
+ * inserting the terms never seen before.
+ */
+static GHashTable * terms_resolve(Connection_T c, GList *terms)
+{
+	GHashTable *ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	GList *l, *batch = NULL;
+	int n = 0;
+
+	l = g_list_first(terms);
+	while (l) {
+		batch = g_list_append(batch, l->data);
+		if ((++n == FULLTEXT_BATCH) || (! g_list_next(l))) {
+			terms_lookup(c, ids, batch);
+			g_list_free(batch);
+			batch = NULL;
+			n = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	l = g_list_first(terms);
+	while (l) {
+		const char *term = (const char *)l->data;
+		if (! g_hash_table_lookup(ids, term)) {
+			uint64_t id;
+			if ((id = term_insert(c, term))) {
+				uint64_t *v = g_new0(uint64_t, 1);
+				*v = id;
+				g_hash_table_insert(ids, g_strdup(term), v);
+			} else {
+				/* inserted concurrently and ignored */
+				GList *one = g_list_append(NULL, (gpointer)term);
+				terms_lookup(c, ids, one);
+				g_list_free(one);
+			}
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	return ids;
+}
+
+static void part_store(Connection_T c, uint64_t part_id, GList *terms)
+{
+	GHashTable *ids;
+	GString *q;
+	GList *l;
+	int rows = 0;
+
+	db_con_clear(c);
+	db_exec(c, "INSERT INTO %sfts_parts (part_id) VALUES (%" PRIu64 ")", DBPFX, part_id);
+
+	if (! terms)
+		return;
+
+	ids = terms_resolve(c, terms);
+	q = g_string_new("");
+
+	l = g_list_first(terms);
+	while (l) {
+		uint64_t *id = g_hash_table_lookup(ids, (const char *)l->data);
+		if (id) {
+			if (rows == 0)
+				g_string_printf(q, "INSERT INTO %sfts_postings (term_id, part_id) VALUES ", DBPFX);
+			g_string_append_printf(q, "%s(%" PRIu64 ",%" PRIu64 ")",
+					rows ? "," : "", *id, part_id);
+			rows++;
+		}
+		if (rows && ((rows == FULLTEXT_BATCH) || (! g_list_next(l)))) {
+			db_con_clear(c);
+			db_exec(c, "%s", q->str);
+			rows = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_string_free(q, TRUE);
+	g_hash_table_destroy(ids);
+}
+
+/* which of the parts are indexed already */
+static GTree * parts_indexed(Connection_T c, GList *parts)
+{
+	GTree *indexed = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+	GString *q = g_string_new("");
+	ResultSet_T r;
+	GList *l;
+	int n = 0;
+
+	g_string_printf(q, "SELECT part_id FROM %sfts_parts WHERE part_id IN (", DBPFX);
+	l = g_list_first(parts);
+	while (l) {
+		FullTextPart_T *part = (FullTextPart_T *)l->data;
+		g_string_append_printf(q, "%s%" PRIu64, n++ ? "," : "", part->id);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_string_append(q, ")");
+
+	db_con_clear(c);
+	r = db_query(c, "%s", q->str);
+	while (db_result_next(r)) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = db_result_get_u64(r, 0);
+		g_tree_insert(indexed, id, id);
+	}
+
+	g_string_free(q, TRUE);
+
+	return indexed;
+}
+
+int FullText_store(GList *parts)
+{
+	Connection_T c;
+	GTree * volatile indexed = NULL;
+	volatile int t = DM_SUCCESS;
+	volatile int count = 0;
+
+	if (! parts)
+		return DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		GList *l;
+		const char *head = NULL;
+
+		db_begin_transaction(c);
+		indexed = parts_indexed(c, parts);
+
+		l = g_list_first(parts);
+		while (l) {
+			FullTextPart_T *part = (FullTextPart_T *)l->data;
+			if (! g_tree_lookup(indexed, &part->id)) {
+				uint64_t *id = g_new0(uint64_t, 1);
+				gchar *text;
+				GList *terms;
+
+				if (part->is_header)
+					text = head_decode(part->data);
+				else
+					text = body_decode(head, part->data);
+
+				terms = FullText_terms(text);
+				part_store(c, part->id, terms);
+				g_list_destroy(terms);
+				g_free(text);
+
+				// parts shared within the message are indexed once
+				*id = part->id;
+				g_tree_insert(indexed, id, id);
+				count++;
+			}
+			if (part->is_header)
+				head = part->data;
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (indexed)
+		g_tree_destroy(indexed);
+
+	TRACE(TRACE_DEBUG, "indexed [%d] parts", count);
+
+	return t;
+}
+
+/*
+ * maintenance
+ */
+
+int FullText_icheck(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT DISTINCT l.physmessage_id "
+			"FROM %spartlists l "
+			"LEFT JOIN %sfts_parts f ON l.part_id = f.part_id "
+			"WHERE f.part_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static int physmessage_index(uint64_t physid)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	GList * volatile parts = NULL;
+	volatile int t = DM_SUCCESS;
+	char data[DEF_FRAGSIZE];
+
+	memset(data, 0, sizeof(data));
+	snprintf(data, DEF_FRAGSIZE-1, db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT l.part_id, l.is_header, %s "
+				"FROM %spartlists l "
+				"JOIN %smimeparts p ON p.id = l.part_id "
+				"WHERE l.physmessage_id = ? ORDER BY l.part_key, l.part_order ASC",
+				data, DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, physid);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			int l;
+			const void *blob;
+			FullTextPart_T *part = g_new0(FullTextPart_T, 1);
+			part->id = db_result_get_u64(r, 0);
+			part->is_header = db_result_get_bool(r, 1);
+			blob = db_result_get_blob(r, 2, &l);
+			part->data = g_strndup((const char *)blob, l);
+			parts = g_list_prepend(parts, part);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	parts = g_list_reverse(parts);
+	if (t == DM_SUCCESS)
+		t = FullText_store(parts);
+
+	while (parts) {
+		FullTextPart_T *part = (FullTextPart_T *)parts->data;
+		g_free((gchar *)part->data);
+		g_free(part);
+		parts = g_list_delete_link(parts, parts);
+	}
+
+	return t;
+}
+
+int FullText_rebuild(GList *lost)
+{
+	int t = DM_SUCCESS;
+
+	lost = g_list_first(lost);
+	while (lost) {
+		uint64_t physid = *(uint64_t *)lost->data;
+		if (physmessage_index(physid) == DM_EQUERY) {
+			TRACE(TRACE_WARNING, "error indexing physmessage: [%" PRIu64 "]", physid);
+			fprintf(stderr, "E");
+			t = DM_EQUERY;
+		} else {
+			fprintf(stderr, ".");
+		}
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	return t;
+}
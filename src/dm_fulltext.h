@@ -0,0 +1,78 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * full-text index of mimeparts
+ *
+ * Text parts are decoded (base64, quoted-printable, charset) and split
+ * into case-folded words, which are stored per mimepart in the
+ * dbmail_fts_terms and dbmail_fts_postings tables. Since mimeparts are
+ * shared between messages, each distinct part is indexed once. Parts
+ * that have been indexed are listed in dbmail_fts_parts, so SEARCH can
+ * still scan the parts that are not.
+ */
+
+#ifndef DM_FULLTEXT_H
+#define DM_FULLTEXT_H
+
+#include "dbmail.h"
+
+typedef struct {
+	uint64_t id;           // mimeparts.id
+	gboolean is_header;
+	const char *data;
+} FullTextPart_T;
+
+/*
+ * \brief is the full-text index maintained and used
+ */
+extern gboolean FullText_enabled(void);
+
+/*
+ * \brief read the fulltext_index setting again
+ */
+extern void     FullText_reset(void);
+
+/*
+ * \brief split text into unique case-folded words
+ * \return list of newly allocated strings, or NULL
+ */
+extern GList *  FullText_terms(const char *text);
+
+/*
+ * \brief index the parts of a message that are not indexed yet
+ * \param parts list of FullTextPart_T in message order, so the body
+ *        of a part follows its header
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+extern int      FullText_store(GList *parts);
+
+/*
+ * \brief find physmessages with parts that are not indexed
+ */
+extern int      FullText_icheck(GList **lost);
+
+/*
+ * \brief index the parts of the physmessages in lost
+ */
+extern int      FullText_rebuild(GList *lost);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include "dm_headercache.h"
+
+#define THIS_MODULE "HeaderCache"
+
+#define HEADER_CACHE_SIZE 10000   // entries per map
+#define HEADER_CACHE_VALUE_MAX 255 // longest value kept
+#define HEADER_CACHE_WARMUP 100    // messages scanned on first use
+#define HEADER_CACHE_STATS 10000
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+typedef struct {
+	char *key;
+	uint64_t id;
+	GList *link;
+} Entry_T;
+
+typedef struct {
+	GHashTable *map;  // key -> Entry_T
+	GQueue *lru;      // most recently used first
+} Map_T;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Map_T names = { NULL, NULL };
+static Map_T values = { NULL, NULL };
+static int cache_limit = -1;
+static gboolean cache_warm = FALSE;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+
+static void entry_free(Entry_T *E)
+{
+	g_free(E->key);
+	g_free(E);
+}
+
+static void map_init(Map_T *M)
+{
+	M->map = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)entry_free);
+	M->lru = g_queue_new();
+}
+
+static void map_clear(Map_T *M)
+{
+	if (! M->map)
+		return;
+	g_queue_clear(M->lru);
+	g_hash_table_remove_all(M->map);
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static gboolean map_get(Map_T *M, const char *key, uint64_t *id)
+{
+	Entry_T *E;
+
+	if (! (E = g_hash_table_lookup(M->map, key)))
+		return FALSE;
+
+	g_queue_unlink(M->lru, E->link);
+	g_queue_push_head_link(M->lru, E->link);
+	*id = E->id;
+
+	return TRUE;
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void map_set(Map_T *M, const char *key, uint64_t id)
+{
+	Entry_T *E;
+
+	if ((E = g_hash_table_lookup(M->map, key))) {
+		E->id = id;
+		return;
+	}
+
+	while (g_hash_table_size(M->map) >= (guint)cache_limit) {
+		Entry_T *last = g_queue_pop_tail(M->lru);
+		if (! last) break;
+		g_hash_table_remove(M->map, last->key);
+	}
+
+	E = g_new0(Entry_T, 1);
+	E->key = g_strdup(key);
+	E->id = id;
+	g_queue_push_head(M->lru, E);
+	E->link = g_queue_peek_head_link(M->lru);
+	g_hash_table_insert(M->map, E->key, E);
+}
+
+/*
+ * fill the cache with the headers of the most recently stored
+ * messages, which hold the commonly used names and values.
+ */
+static void cache_warmup(void)
+{
+	Connection_T c; ResultSet_T r;
+	volatile uint64_t last = 0;
+	volatile int count = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT MAX(physmessage_id) FROM %sheader", DBPFX);
+		if (db_result_next(r))
+			last = db_result_get_u64(r, 0);
+
+		if (last) {
+			db_con_clear(c);
+			r = db_query(c, "SELECT n.id, n.headername, v.id, v.headervalue FROM %sheader h "
+					"JOIN %sheadername n ON h.headername_id = n.id "
+					"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+					"WHERE h.physmessage_id > %" PRIu64 "",
+					DBPFX, DBPFX, DBPFX,
+					last > HEADER_CACHE_WARMUP ? last - HEADER_CACHE_WARMUP : 0);
+			while (db_result_next(r)) {
+				uint64_t nid = db_result_get_u64(r, 0);
+				uint64_t vid = db_result_get_u64(r, 2);
+				HeaderCache_setName(db_result_get(r, 1), nid);
+				HeaderCache_setValue(db_result_get(r, 3), vid);
+				count++;
+			}
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "warmed up with [%d] headers", count);
+}
+
+static gboolean cache_init(void)
+{
+	Field_T val;
+	gboolean warmup = FALSE;
+
+	PLOCK(cache_lock);
+	if (cache_limit < 0) {
+		cache_limit = HEADER_CACHE_SIZE;
+		config_get_value("header_cache_size", "DBMAIL", val);
+		if (strlen(val))
+			cache_limit = atoi(val);
+		if (cache_limit < 0)
+			cache_limit = 0;
+		if (cache_limit > 0) {
+			map_init(&names);
+			map_init(&values);
+		}
+		TRACE(TRACE_DEBUG, "header cache size [%d] entries", cache_limit);
+	}
+	if (cache_limit > 0 && (! cache_warm)) {
+		cache_warm = TRUE;
+		warmup = TRUE;
+	}
+	PUNLOCK(cache_lock);
+
+	if (warmup)
+		cache_warmup();
+
+	return cache_limit > 0;
+}
+
+static void cache_count(gboolean hit)
+{
+	uint64_t lookups;
+
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+
+	lookups = cache_hits + cache_misses;
+	if (lookups % HEADER_CACHE_STATS == 0)
+		TRACE(TRACE_INFO, "hits [%" PRIu64 "] misses [%" PRIu64 "] names [%u] values [%u]",
+				cache_hits, cache_misses,
+				g_hash_table_size(names.map), g_hash_table_size(values.map));
+}
+
+static gboolean cache_get(Map_T *M, const char *key, uint64_t *id)
+{
+	gboolean hit;
+
+	if (! cache_init())
+		return FALSE;
+
+	PLOCK(cache_lock);
+	hit = map_get(M, key, id);
+	cache_count(hit);
+	PUNLOCK(cache_lock);
+
+	return hit;
+}
+
+static void cache_set(Map_T *M, const char *key, uint64_t id)
+{
+	if (cache_limit <= 0 || (! id))
+		return;
+
+	PLOCK(cache_lock);
+	map_set(M, key, id);
+	PUNLOCK(cache_lock);
+}
+
+gboolean HeaderCache_getName(const char *name, uint64_t *id)
+{
+	return cache_get(&names, name, id);
+}
+
+void HeaderCache_setName(const char *name, uint64_t id)
+{
+	cache_set(&names, name, id);
+}
+
+gboolean HeaderCache_getValue(const char *value, uint64_t *id)
+{
+	if (strlen(value) > HEADER_CACHE_VALUE_MAX)
+		return FALSE;
+	return cache_get(&values, value, id);
+}
+
+void HeaderCache_setValue(const char *value, uint64_t id)
+{
+	if (strlen(value) > HEADER_CACHE_VALUE_MAX)
+		return;
+	cache_set(&values, value, id);
+}
+
+void HeaderCache_flush(void)
+{
+	PLOCK(cache_lock);
+	map_clear(&names);
+	map_clear(&values);
+	PUNLOCK(cache_lock);
+	TRACE(TRACE_DEBUG, "flushed");
+}
+
+void HeaderCache_stats(uint64_t *hits, uint64_t *misses)
+{
+	PLOCK(cache_lock);
+	if (hits) *hits = cache_hits;
+	if (misses) *misses = cache_misses;
+	PUNLOCK(cache_lock);
+}
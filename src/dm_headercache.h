@@ -0,0 +1,61 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * process-wide cache of headername and headervalue ids
+ *
+ * Maps lower-cased header names and short header values to the ids
+ * of their rows in dbmail_headername and dbmail_headervalue, so the
+ * header cache of a new message does not have to look up values
+ * like "1.0" or "7bit" again for every delivery. Both maps are
+ * bounded and evict the least recently used entries. The cache is
+ * filled from the most recently stored messages on first use.
+ */
+
+#ifndef DM_HEADERCACHE_H
+#define DM_HEADERCACHE_H
+
+#include "dbmail.h"
+
+/*
+ * \brief look up the id of a lower-cased header name
+ * \return TRUE on a hit
+ */
+extern gboolean HeaderCache_getName(const char *name, uint64_t *id);
+extern void     HeaderCache_setName(const char *name, uint64_t id);
+
+/*
+ * \brief look up the id of a header value
+ * \return TRUE on a hit. Long values are never cached.
+ */
+extern gboolean HeaderCache_getValue(const char *value, uint64_t *id);
+extern void     HeaderCache_setValue(const char *value, uint64_t id);
+
+/*
+ * \brief drop all entries, e.g. when a cached id turned out to be stale
+ */
+extern void     HeaderCache_flush(void);
+
+/*
+ * \brief cache statistics
+ */
+extern void     HeaderCache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#include "dbmail.h"
+#include "dm_headerqueue.h"
+
+#define THIS_MODULE "HeaderQueue"
+
+#define HEADER_QUEUE_BATCH 100
+#define HEADER_QUEUE_SWEEP 10000 // recent physmessages checked on startup
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t queue_thread;
+
+static gboolean queue_started = FALSE;
+static gboolean queue_threaded = FALSE;
+static volatile gboolean queue_running = FALSE;
+static int queue_deferred = -1;
+static GQueue *queue = NULL; // physmessage ids waiting
+
+gboolean HeaderQueue_deferred(void)
+{
+	Field_T val;
+
+	if (queue_deferred < 0) {
+		config_get_value("header_cache_deferred", "DBMAIL", val);
+		queue_deferred = MATCH(val, "yes") ? 1 : 0;
+	}
+	return queue_deferred ? TRUE : FALSE;
+}
+
+/*
+ * queue the recently delivered messages that have no header cache,
+ * left over by a previous run. Older ones are handled by dbmail-util.
+ */
+static void queue_sweep(void)
+{
+	Connection_T c; ResultSet_T r;
+	GList *ids = NULL;
+	volatile uint64_t last = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT MAX(id) FROM %sphysmessage", DBPFX);
+		if (db_result_next(r))
+			last = db_result_get_u64(r, 0);
+		db_con_clear(c);
+		r = db_query(c, "SELECT DISTINCT m.physmessage_id FROM %smessages m "
+				"LEFT JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+				"WHERE m.physmessage_id > %" PRIu64 " AND h.physmessage_id IS NULL "
+				"ORDER BY m.physmessage_id",
+				DBPFX, DBPFX,
+				last > HEADER_QUEUE_SWEEP ? last - HEADER_QUEUE_SWEEP : 0);
+		while (db_result_next(r)) {
+			uint64_t *id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			ids = g_list_prepend(ids, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (! ids)
+		return;
+
+	TRACE(TRACE_INFO, "[%u] messages pending from a previous run", g_list_length(ids));
+
+	ids = g_list_reverse(ids);
+	PLOCK(queue_lock);
+	ids = g_list_first(ids);
+	while (ids) {
+		g_queue_push_tail(queue, ids->data);
+		if (! g_list_next(ids)) break;
+		ids = g_list_next(ids);
+	}
+	PUNLOCK(queue_lock);
+
+	g_list_free(g_list_first(ids));
+}
+
+/*
+ * drop the ids that already have a header cache, e.g. when dbmail-util
+ * got to them first.
+ */
+static GList * queue_filter(GList *batch)
+{
+	Connection_T c; ResultSet_T r;
+	GString *q = g_string_new("");
+	GTree *done = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+	GList *l, *todo = NULL;
+	int i = 0;
+
+	g_string_printf(q, "SELECT DISTINCT physmessage_id FROM %sheader WHERE physmessage_id IN (", DBPFX);
+	l = g_list_first(batch);
+	while (l) {
+		g_string_append_printf(q, "%s%" PRIu64 "", i++ ? "," : "", *(uint64_t *)l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_string_append(q, ")");
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "%s", q->str);
+		while (db_result_next(r)) {
+			uint64_t *id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			g_tree_insert(done, id, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	l = g_list_first(batch);
+	while (l) {
+		if (g_tree_lookup(done, l->data))
+			g_free(l->data);
+		else
+			todo = g_list_append(todo, l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_list_free(g_list_first(batch));
+	g_tree_destroy(done);
+	g_string_free(q, TRUE);
+
+	return todo;
+}
+
+static void queue_process(GList *batch)
+{
+	GList *l;
+	int done = 0;
+
+	if (! (batch = queue_filter(batch)))
+		return;
+
+	l = g_list_first(batch);
+	while (l) {
+		uint64_t id = *(uint64_t *)l->data;
+		DbmailMessage *m = dbmail_message_new(NULL);
+
+		if (! (m = dbmail_message_retrieve(m, id))) {
+			TRACE(TRACE_WARNING, "[%" PRIu64 "] unable to retrieve message", id);
+		} else {
+			if (dbmail_message_cache_headers(m) == DM_SUCCESS) {
+				dbmail_message_cache_envelope(m);
+				dbmail_message_cache_bodystructure(m);
+				done++;
+			} else {
+				TRACE(TRACE_ERR, "[%" PRIu64 "] error caching headers", id);
+			}
+			dbmail_message_free(m);
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	TRACE(TRACE_DEBUG, "cached [%d/%u] messages", done, g_list_length(batch));
+
+	g_list_destroy(batch);
+}
+
+static void * queue_loop(void UNUSED *arg)
+{
+	GList *batch;
+	int n;
+
+	TRACE(TRACE_INFO, "deferred header caching started");
+
+	queue_sweep();
+
+	PLOCK(queue_lock);
+	while (queue_running) {
+		if (g_queue_is_empty(queue))
+			pthread_cond_wait(&queue_cond, &queue_lock);
+
+		if (! queue_running)
+			break;
+
+		batch = NULL;
+		n = 0;
+		while ((n++ < HEADER_QUEUE_BATCH) && (! g_queue_is_empty(queue)))
+			batch = g_list_append(batch, g_queue_pop_head(queue));
+		PUNLOCK(queue_lock);
+
+		if (batch)
+			queue_process(batch);
+
+		PLOCK(queue_lock);
+	}
+	PUNLOCK(queue_lock);
+
+	return NULL;
+}
+
+static void queue_open(gboolean threaded)
+{
+	PLOCK(queue_lock);
+	if (queue_started) {
+		PUNLOCK(queue_lock);
+		return;
+	}
+	queue_started = TRUE;
+
+	// the configuration is read again on every start
+	queue_deferred = -1;
+	if (! HeaderQueue_deferred()) {
+		PUNLOCK(queue_lock);
+		return;
+	}
+
+	queue = g_queue_new();
+
+	queue_running = TRUE;
+	queue_threaded = threaded;
+	if (threaded && pthread_create(&queue_thread, NULL, queue_loop, NULL)) {
+		TRACE(TRACE_ERR, "unable to start header queue: %s", strerror(errno));
+		queue_running = FALSE;
+		queue_threaded = FALSE;
+		g_queue_free(queue);
+		queue = NULL;
+	}
+	PUNLOCK(queue_lock);
+}
+
+void HeaderQueue_start(void)
+{
+	// called for every new connection, from any reactor
+	queue_open(TRUE);
+}
+
+void HeaderQueue_open(void)
+{
+	queue_open(FALSE);
+}
+
+void HeaderQueue_run(void)
+{
+	GList *batch;
+	int n;
+
+	if (! queue_running)
+		return;
+
+	while (TRUE) {
+		batch = NULL;
+		n = 0;
+		PLOCK(queue_lock);
+		while ((n++ < HEADER_QUEUE_BATCH) && (! g_queue_is_empty(queue)))
+			batch = g_list_append(batch, g_queue_pop_head(queue));
+		PUNLOCK(queue_lock);
+
+		if (! batch)
+			break;
+
+		queue_process(batch);
+	}
+}
+
+/*
+ * ids still queued are picked up again by the next run
+ */
+void HeaderQueue_stop(void)
+{
+	if (! queue_running)
+		return;
+
+	PLOCK(queue_lock);
+	queue_running = FALSE;
+	pthread_cond_signal(&queue_cond);
+	PUNLOCK(queue_lock);
+
+	if (queue_threaded)
+		pthread_join(queue_thread, NULL);
+
+	PLOCK(queue_lock);
+	queue_started = FALSE;
+	queue_threaded = FALSE;
+	if (g_queue_get_length(queue))
+		TRACE(TRACE_INFO, "[%u] messages left pending", g_queue_get_length(queue));
+	while (! g_queue_is_empty(queue))
+		g_free(g_queue_pop_head(queue));
+	g_queue_free(queue);
+	queue = NULL;
+	PUNLOCK(queue_lock);
+}
+
+gboolean HeaderQueue_running(void)
+{
+	return queue_running;
+}
+
+void HeaderQueue_push(uint64_t physmessage_id)
+{
+	uint64_t *id;
+
+	if (! queue_running)
+		return;
+
+	id = g_new0(uint64_t, 1);
+	*id = physmessage_id;
+
+	PLOCK(queue_lock);
+	g_queue_push_tail(queue, id);
+	pthread_cond_signal(&queue_cond);
+	PUNLOCK(queue_lock);
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] queued", physmessage_id);
+}
@@ -0,0 +1,72 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * deferred header caching
+ *
+ * With header_cache_deferred enabled, dbmail-lmtpd stores and delivers
+ * a message without its header, envelope and bodystructure caches, and
+ * queues the physmessage instead. A worker thread fills the caches
+ * after the MTA has its reply. Messages left pending by a previous run
+ * are queued again when the worker starts.
+ */
+
+#ifndef DM_HEADERQUEUE_H
+#define DM_HEADERQUEUE_H
+
+#include "dbmail.h"
+
+/*
+ * \brief start the worker thread if deferred header caching is enabled
+ *
+ * safe to call more than once; only the first call has effect.
+ */
+extern void     HeaderQueue_start(void);
+extern void     HeaderQueue_stop(void);
+extern gboolean HeaderQueue_running(void);
+
+/*
+ * \brief queue like HeaderQueue_start, but without a worker thread
+ *
+ * the caller fills the caches of the queued messages itself with
+ * HeaderQueue_run.
+ */
+extern void     HeaderQueue_open(void);
+
+/*
+ * \brief cache the queued messages in the calling thread
+ */
+extern void     HeaderQueue_run(void);
+
+/*
+ * \brief queue a delivered physmessage for header caching
+ */
+extern void     HeaderQueue_push(uint64_t physmessage_id);
+
+/*
+ * \brief is deferred header caching configured
+ *
+ * readers that depend on the header cache must then be prepared for
+ * recent messages that do not have one yet.
+ */
+extern gboolean HeaderQueue_deferred(void);
+
+#endif
@@ -25,10 +25,13 @@
 
 #include "dbmail.h"
 #include "dm_mempool.h"
+#include "dm_mailboxwatch.h"
+#include "dm_headerqueue.h"
 
 #define THIS_MODULE "imap"
 #define BUFLEN 2048
 #define SEND_BUF_SIZE 8192
+#define IMAP_BUF_SIZE 4096
 #define MAX_ARGS 512
 #define IDLE_TIMEOUT 30
 
@@ -48,7 +51,6 @@ extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern volatile sig_atomic_t alarm_occured;
 
-extern GAsyncQueue *queue;
 extern ServerConfig_T *server_conf;
 
 /*
@@ -57,21 +59,20 @@ extern ServerConfig_T *server_conf;
  */
 static void send_data(ImapSession *self, const String_T stream, size_t offset, size_t len)
 {
-	char buf[SEND_BUF_SIZE];
 	size_t l = 0;
-	char *head;
+	const char *head;
 
 	assert(stream);
 	assert(p_string_len(stream) >= (offset+len));
 
-	head = (char *)p_string_str(stream)+offset;
+	head = p_string_str(stream)+offset;
 
 	TRACE(TRACE_DEBUG,"[%p] stream [%p] offset [%ld] len [%ld]", self, stream, offset, len);
 	while (len > 0) {
-		l = min(len, sizeof(buf)-1);
-		memset(buf,0,sizeof(buf));
-		strncpy(buf, head, l);
-		dbmail_imap_session_buff_printf(self, "%s", buf);
+		l = min(len, SEND_BUF_SIZE);
+		p_string_append_len(self->buff, head, l);
+		if (p_string_len(self->buff) >= IMAP_BUF_SIZE)
+			dbmail_imap_session_buff_flush(self);
 		head += l;
 		len -= l;
 	}
@@ -156,7 +157,7 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	return self;
 }
 
-static uint64_t dbmail_imap_session_message_load(ImapSession *self)
+static uint64_t * dbmail_imap_session_physid(ImapSession *self)
 {
 	uint64_t *id = NULL;
 
@@ -166,13 +167,28 @@ static uint64_t dbmail_imap_session_message_load(ImapSession *self)
 			
 		if ((db_get_physmessage_id(self->msg_idnr, id)) != DM_SUCCESS) {
 			TRACE(TRACE_ERR,"can't find physmessage_id for message_idnr [%" PRIu64 "]", self->msg_idnr);
-			g_free(id);
-			return 0;
+			mempool_push(self->pool, id, sizeof(uint64_t));
+			return NULL;
 		}
 		uid = mempool_pop(self->pool, sizeof(uint64_t));
 		*uid = self->msg_idnr;
 		g_tree_insert(self->physids, uid, id);
 	}
+
+	return id;
+}
+
+/*
+ * load the current message. The shared message cache provides the
+ * CRLF stream and the structure strings; the parsed message is only
+ * retrieved when the fetch needs to walk the mime parts.
+ */
+static uint64_t dbmail_imap_session_message_load(ImapSession *self, gboolean parse)
+{
+	uint64_t *id = NULL;
+
+	if (! (id = dbmail_imap_session_physid(self)))
+		return 0;
 		
 	if (self->message) {
 		if (*id != self->message->id) {
@@ -181,23 +197,71 @@ static uint64_t dbmail_imap_session_message_load(ImapSession *self)
 		}
 	}
 
+	if (self->cached) {
+		if (*id != MessageCache_getId(self->cached))
+			MessageCache_release(&self->cached);
+	}
+
 	assert(id);
 
-	if (! self->message) {
+	if (! self->cached)
+		self->cached = MessageCache_lookup(*id);
+
+	if ((parse || ! self->cached) && (! self->message)) {
 		DbmailMessage *msg = dbmail_message_new(self->pool);
 		if ((msg = dbmail_message_retrieve(msg, *id)) != NULL)
 			self->message = msg;
+
+		if (! self->message) {
+			TRACE(TRACE_ERR,"message retrieval failed");
+			return 0;
+		}
 	}
 
-	if (! self->message) {
-		TRACE(TRACE_ERR,"message retrieval failed");
-		return 0;
+	if (! self->cached) {
+		if (! (self->cached = MessageCache_store(self->message)))
+			return 0;
 	}
 
-	assert(*id == self->message->id);
+	assert(*id == MessageCache_getId(self->cached));
 	return 1;
 }
 
+/*
+ * load the current message as a plain CRLF stream. Used for whole
+ * message fetches of messages too large for the message cache, so
+ * they are reassembled once and never parsed.
+ */
+static String_T dbmail_imap_session_message_stream(ImapSession *self)
+{
+	uint64_t *id = NULL;
+
+	if (! (id = dbmail_imap_session_physid(self)))
+		return NULL;
+
+	if (self->cached && (*id == MessageCache_getId(self->cached)))
+		return MessageCache_getCRLF(self->cached);
+
+	MessageCache_release(&self->cached);
+	if (self->message) {
+		dbmail_message_free(self->message);
+		self->message = NULL;
+	}
+	if (self->stream) {
+		p_string_free(self->stream, TRUE);
+		self->stream = NULL;
+	}
+
+	if ((self->stream = dbmail_message_retrieve_crlf(self->pool, *id)))
+		return self->stream;
+
+	// legacy messageblks storage
+	if (! (dbmail_imap_session_message_load(self, FALSE)))
+		return NULL;
+
+	return MessageCache_getCRLF(self->cached);
+}
+
 ImapSession * dbmail_imap_session_set_command(ImapSession * self, const char * command)
 {
 	g_strlcpy(self->command, command, sizeof(self->command));
@@ -225,6 +289,7 @@ void dbmail_imap_session_delete(ImapSession ** s)
 	dbmail_imap_session_fetch_free(self, TRUE);
 
 	if (self->mailbox) {
+		MailboxWatch_remove(self->mailbox->id, self);
 		dbmail_mailbox_free(self->mailbox);
 		self->mailbox = NULL;
 	}
@@ -236,6 +301,7 @@ void dbmail_imap_session_delete(ImapSession ** s)
 		dbmail_message_free(self->message);
 		self->message = NULL;
 	}
+	MessageCache_release(&self->cached);
 	if (self->physids) {
 		g_tree_foreach(self->physids, (GTraverseFunc)_physids_free, (gpointer)self);
 		g_tree_destroy(self->physids);
@@ -259,6 +325,14 @@ void dbmail_imap_session_fetch_free(ImapSession *self, gboolean all)
 		g_tree_destroy(self->envelopes);
 		self->envelopes = NULL;
 	}
+	if (self->structures) {
+		g_tree_destroy(self->structures);
+		self->structures = NULL;
+	}
+	if (self->stream) {
+		p_string_free(self->stream, TRUE);
+		self->stream = NULL;
+	}
 	if (self->ids) {
 		g_tree_destroy(self->ids);
 		self->ids = NULL;
@@ -560,7 +634,6 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 		
 		if (! nexttoken || ! MATCH(nexttoken,"[")) {
 			if (ispeek) return -2;	/* error DONE */
-			self->fi->msgparse_needed = 1;
 			self->fi->getMIME_IMB_noextension = 1;	/* just BODY specified */
 		} else {
 			int res = 0;
@@ -604,20 +677,17 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 			return res;
 		}
 	} else if (MATCH(token,"all")) {		
-		self->fi->msgparse_needed=1; // because of getEnvelope
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"full")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getMIME_IMB_noextension = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"bodystructure")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getMIME_IMB = 1;
 	} else if (MATCH(token,"envelope")) {
 		self->fi->getEnvelope = 1;
@@ -644,18 +714,74 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 
 #define QUERY_BATCHSIZE 2000
 
+struct header_fields {
+	const body_fetch *bodyfetch;
+	gboolean not;
+	GString *fields;
+};
+
+static void _collect_header_field(const char *name, const char *value, gpointer data)
+{
+	struct header_fields *f = (struct header_fields *)data;
+	gboolean listed = FALSE;
+	GList *n = g_list_first(f->bodyfetch->names);
+
+	while (n) {
+		if (MATCH((const char *)n->data, name)) {
+			listed = TRUE;
+			break;
+		}
+		if (! g_list_next(n)) break;
+		n = g_list_next(n);
+	}
+
+	if (listed != f->not)
+		g_string_append_printf(f->fields, "%s: %s\n", name, value);
+}
+
+/*
+ * header fields of a recent message whose header cache may still be
+ * pending, taken from the message itself
+ */
+static gchar * _fetch_headers_parsed(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
+{
+	struct header_fields f;
+	GMimeHeaderList *headers;
+
+	if (! dbmail_imap_session_message_load(self, TRUE))
+		return NULL;
+
+	f.bodyfetch = bodyfetch;
+	f.not = not;
+	f.fields = g_string_new("");
+
+	headers = g_mime_object_get_header_list(GMIME_OBJECT(self->message->content));
+	g_mime_header_list_foreach(headers, _collect_header_field, &f);
+
+	if (! f.fields->len) {
+		g_string_free(f.fields, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(f.fields, FALSE);
+}
+
 void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
 {
 	long long cnt = 0;
 	gchar *tmp;
 	gchar *s;
+	gchar *parsed = NULL;
 	String_T ts;
 
 	dbmail_imap_session_buff_printf(self,"HEADER.FIELDS%s %s] ", not ? ".NOT" : "", bodyfetch->hdrplist);
 
 	if (! (s = g_tree_lookup(bodyfetch->headers, &(self->msg_idnr)))) {
-		dbmail_imap_session_buff_printf(self, "{2}\r\n\r\n");
-		return;
+		if (! (HeaderQueue_deferred() && (parsed = _fetch_headers_parsed(self, bodyfetch, not)))) {
+			dbmail_imap_session_buff_printf(self, "{2}\r\n\r\n");
+			return;
+		}
+		s = parsed;
 	}
 
 	TRACE(TRACE_DEBUG,"[%p] [%s] [%s]", self, bodyfetch->hdrplist, s);
@@ -686,6 +812,7 @@ void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
 	ts = NULL;
 	g_free(tmp);
 	tmp = NULL;
+	g_free(parsed);
 }
 
 
@@ -890,7 +1017,7 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 	
 	TRACE(TRACE_DEBUG,"[%p] itemtype [%d] partspec [%s]", self, bodyfetch->itemtype, bodyfetch->partspec);
 	
-	if (self->fi->msgparse_needed) {
+	if (self->fi->msgparse_needed && self->message) {
 		if (bodyfetch->partspec[0]) {
 			if (bodyfetch->partspec[0] == '0') {
 				dbmail_imap_session_buff_printf(self, "\r\n%s BAD protocol error\r\n", self->tag);
@@ -940,27 +1067,29 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 	return 0;
 }
 
-/* get envelopes */
-static void _fetch_envelopes(ImapSession *self)
+/* 
+ * prefetch the cached envelopes and bodystructures for a batch
+ * of messages starting at the current message
+ */
+static int _fetch_prefetch(ImapSession *self)
 {
-	Connection_T c; ResultSet_T r; volatile int t = FALSE;
-	INIT_QUERY;
-	gchar *s;
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	gboolean envelope = self->fi->getEnvelope;
+	gboolean structure = (self->fi->getMIME_IMB || self->fi->getMIME_IMB_noextension);
+	const char *val;
 	uint64_t *mid;
 	uint64_t id;
-	char range[DEF_FRAGSIZE];
 	GList *last;
-	memset(range,0,sizeof(range));
+	String_T query;
+	String_T range;
 
 	if (! self->envelopes) {
 		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
 		self->lo = 0;
 		self->hi = 0;
 	}
-
-	if ((s = g_tree_lookup(self->envelopes, &(self->msg_idnr))) != NULL) {
-		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s);
-		return;
+	if (! self->structures) {
+		self->structures = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_strfreev);
 	}
 
 	TRACE(TRACE_DEBUG,"[%p] lo: %" PRIu64 "", self, self->lo);
@@ -969,31 +1098,50 @@ static void _fetch_envelopes(ImapSession *self)
 		last = g_list_last(self->ids_list);
 	self->hi = *(uint64_t *)last->data;
 
+	range = p_string_new(self->pool, "");
+	query = p_string_new(self->pool, "");
+
 	if (self->msg_idnr == self->hi)
-		snprintf(range,DEF_FRAGSIZE-1,"= %" PRIu64 "", self->msg_idnr);
+		p_string_printf(range, "= %" PRIu64 "", self->msg_idnr);
 	else
-		snprintf(range,DEF_FRAGSIZE-1,"BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, self->hi);
+		p_string_printf(range, "BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, self->hi);
+
+	p_string_printf(query, "SELECT m.message_idnr, %s, %s FROM %smessages m ",
+			envelope?"e.envelope":"NULL",
+			structure?"b.bodystructure, b.body":"NULL, NULL",
+			DBPFX);
+	if (envelope)
+		p_string_append_printf(query, "LEFT JOIN %senvelope e ON e.physmessage_id = m.physmessage_id ", DBPFX);
+	if (structure)
+		p_string_append_printf(query, "LEFT JOIN %sbodystructure b ON b.physmessage_id = m.physmessage_id ", DBPFX);
+	p_string_append_printf(query, "WHERE m.mailbox_idnr = %" PRIu64 " AND m.message_idnr %s",
+			self->mailbox->id, p_string_str(range));
 
-	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,envelope "
-			"FROM %senvelope e "
-			"LEFT JOIN %smessages m USING (physmessage_id) "
-			"WHERE m.mailbox_idnr = %" PRIu64 " "
-			"AND message_idnr %s",
-			DBPFX, DBPFX,  
-			self->mailbox->id, range);
 	c = db_con_get();
 	TRY
-		r = db_query(c, query);
+		r = db_query(c, p_string_str(query));
 		while (db_result_next(r)) {
 			id = db_result_get_u64(r, 0);
 			
 			if (! g_tree_lookup(self->ids,&id))
 				continue;
 			
-			mid = mempool_pop(small_pool, sizeof(uint64_t));
-			*mid = id;
-			
-			g_tree_insert(self->envelopes,mid,g_strdup(ResultSet_getString(r, 2)));
+			if (envelope && (val = db_result_get(r, 1))) {
+				mid = mempool_pop(small_pool, sizeof(uint64_t));
+				*mid = id;
+				g_tree_insert(self->envelopes,mid,g_strdup(val));
+			}
+			if (structure) {
+				// an empty entry marks a message without a cached structure
+				gchar **strings = g_new0(gchar *, 3);
+				if ((val = db_result_get(r, 2))) {
+					strings[0] = g_strdup(val);
+					strings[1] = g_strdup(db_result_get(r, 3));
+				}
+				mid = mempool_pop(small_pool, sizeof(uint64_t));
+				*mid = id;
+				g_tree_insert(self->structures,mid,strings);
+			}
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1002,14 +1150,70 @@ static void _fetch_envelopes(ImapSession *self)
 		db_con_close(c);
 	END_TRY;
 
-	if (t == DM_EQUERY) return;
+	p_string_free(range, TRUE);
+	p_string_free(query, TRUE);
+
+	if (t == DM_EQUERY) return t;
 
 	self->lo += QUERY_BATCHSIZE;
 
+	return t;
+}
+
+/* get envelopes */
+static void _fetch_envelopes(ImapSession *self)
+{
+	gchar *s;
+
+	if (self->envelopes && (s = g_tree_lookup(self->envelopes, &(self->msg_idnr))) != NULL) {
+		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s);
+		return;
+	}
+
+	if (self->fi->msgparse_needed && self->cached && MessageCache_getEnvelope(self->cached)) {
+		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", MessageCache_getEnvelope(self->cached));
+		return;
+	}
+
+	if (_fetch_prefetch(self) == DM_EQUERY) return;
+
 	s = g_tree_lookup(self->envelopes, &(self->msg_idnr));
+
+	// the envelope cache of a recent message may still be pending
+	if ((! s) && HeaderQueue_deferred() && dbmail_imap_session_message_load(self, FALSE))
+		s = (gchar *)MessageCache_getEnvelope(self->cached);
+
 	dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s?s:"");
 }
 
+/* 
+ * get bodystructures. Messages that were stored before the
+ * bodystructure cache existed fall back to the parsed message.
+ */
+static int _fetch_bodystructure(ImapSession *self, gboolean extension)
+{
+	gchar **s = NULL;
+	const char *structure;
+
+	if (self->structures)
+		s = g_tree_lookup(self->structures, &(self->msg_idnr));
+
+	if ((! s) && (_fetch_prefetch(self) == DM_SUCCESS))
+		s = g_tree_lookup(self->structures, &(self->msg_idnr));
+
+	if (s && s[0]) {
+		structure = extension ? s[0] : s[1];
+	} else {
+		if (! (dbmail_imap_session_message_load(self, FALSE)))
+			return -1;
+		structure = MessageCache_getStructure(self->cached, extension);
+	}
+
+	dbmail_imap_session_buff_printf(self, "%s %s", extension?"BODYSTRUCTURE":"BODY", structure);
+
+	return 0;
+}
+
 static void _imap_show_body_sections(ImapSession *self) 
 {
 	List_T head;
@@ -1025,6 +1229,33 @@ static void _imap_show_body_sections(ImapSession *self)
 	}
 }
 
+/*
+ * do any of the requested items need the parsed mime structure
+ * rather than the cached message stream
+ */
+static gboolean _fetch_parse_needed(ImapSession *self)
+{
+	List_T head;
+
+	if (self->fi->getRFC822Header || self->fi->getRFC822Text)
+		return TRUE;
+	if (! self->fi->bodyfetch)
+		return FALSE;
+
+	head = p_list_first(self->fi->bodyfetch);
+	while (head) {
+		body_fetch *bodyfetch = (body_fetch *)p_list_data(head);
+		if (bodyfetch && bodyfetch->itemtype >= BFIT_TEXT) {
+			if (bodyfetch->partspec[0])
+				return TRUE;
+			if (bodyfetch->itemtype != BFIT_HEADER_FIELDS && bodyfetch->itemtype != BFIT_HEADER_FIELDS_NOT)
+				return TRUE;
+		}
+		head = p_list_next(head);
+	}
+	return FALSE;
+}
+
 static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 {
 	int result;
@@ -1052,10 +1283,15 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	self->fi->isfirstfetchout = 1;
 
 	if (self->fi->msgparse_needed) {
-		if (! (dbmail_imap_session_message_load(self)))
-			return 0;
+		if ((! _fetch_parse_needed(self)) && (! MessageCache_accepts(msginfo->rfcsize))) {
+			if (! (stream = dbmail_imap_session_message_stream(self)))
+				return 0;
+		} else {
+			if (! (dbmail_imap_session_message_load(self, _fetch_parse_needed(self))))
+				return 0;
 
-		stream = self->message->crlf;
+			stream = MessageCache_getCRLF(self->cached);
+		}
 		size = p_string_len(stream);
 	}
 
@@ -1092,24 +1328,20 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	}
 	if (self->fi->getMIME_IMB) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 1))==NULL) {
+		if (_fetch_bodystructure(self, TRUE) < 0) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body structure\r\n");
 			return -1;
 		}
-		dbmail_imap_session_buff_printf(self, "BODYSTRUCTURE %s", s);
-		g_free(s);
 	}
 
 	if (self->fi->getMIME_IMB_noextension) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 0))==NULL) {
+		if (_fetch_bodystructure(self, FALSE) < 0) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body\r\n");
 			return -1;
 		}
-		dbmail_imap_session_buff_printf(self, "BODY %s",s);
-		g_free(s);
 	}
 
 	if (self->fi->getEnvelope) {
@@ -1194,6 +1426,11 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 
 	dbmail_imap_session_buff_printf(self, ")\r\n");
 
+	if (self->stream) {
+		p_string_free(self->stream, TRUE);
+		self->stream = NULL;
+	}
+
 	if (reportflags) {
 		char *t = NULL;
 		GList *sublist = NULL;
@@ -1269,8 +1506,6 @@ void dbmail_imap_session_buff_flush(ImapSession *self)
 	dm_queue_push(dm_thread_data_sendmessage, session, data);
 }
 
-#define IMAP_BUF_SIZE 4096
-
 int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...)
 {
         va_list ap, cp;
@@ -1556,8 +1791,8 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 
 		TRACE(TRACE_DEBUG, "seq: [%u] -> [%u]", oldseq, newseq);
 		if (oldseq != newseq) {
-			// do a full reload: re-read flags and counters
-			N = MailboxState_new(self->pool, self->mailbox->id);
+			// reload: re-read counters and the changed messages
+			N = MailboxState_update(self->pool, M);
 			unsigned newexists = MailboxState_getExists(N);
 			MailboxState_setExists(N, max(oldexists, newexists));
 
@@ -1630,7 +1865,7 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 		if (! M) {
 			id = mempool_pop(small_pool, sizeof(uint64_t));
 			*id = mailbox_id;
-			M = MailboxState_new(self->pool, mailbox_id);
+			M = MailboxState_lookup(self->pool, mailbox_id);
 			g_tree_replace(self->mbxinfo, id, M);
 		} else {
 			unsigned newseq = 0, oldseq = 0;
@@ -1645,7 +1880,7 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 			if (oldseq < newseq) {
 				id = mempool_pop(small_pool, sizeof(uint64_t));
 				*id = mailbox_id;
-				M = MailboxState_new(self->pool, mailbox_id);
+				M = MailboxState_lookup(self->pool, mailbox_id);
 				newexists = MailboxState_getExists(M);
 				MailboxState_setExists(M, max(oldexists, newexists));
 				g_tree_replace(self->mbxinfo, id, M);
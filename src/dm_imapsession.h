@@ -8,6 +8,7 @@
 #define DM_COMMANDCHANNEL_H
 
 #include "dbmail.h"
+#include "dm_messagecache.h"
 
 // command state during idle command
 #define IDLE -1 
@@ -44,6 +45,8 @@ typedef struct {
 	uint64_t ceiling;       // upper boundary during prefetching
 
 	DbmailMessage *message;
+	MessageCache_T cached;  // shared copy of the current message
+	String_T stream;        // current message when too large to cache
 
 	uint64_t userid;		/* userID of client in dbase */
 
@@ -51,6 +54,7 @@ typedef struct {
 	GList *new_ids; // store new uids after a COPY command
 	GTree *physids;		// cache physmessage_ids for uids 
 	GTree *envelopes;
+	GTree *structures;      // cached BODYSTRUCTURE and BODY per uid
 	GTree *mbxinfo; 	// cache MailboxState_T 
 	GList *ids_list;
 
@@ -72,6 +76,7 @@ typedef struct {
 	void (* cb_enter)(gpointer);	/* callback on thread entry		*/
 	void (* cb_leave)(gpointer);	/* callback on thread exit		*/
 	ImapSession *session;
+	ClientSession_T *client;        /* set instead of session for pop3/lmtp */
 	gpointer data;                  /* payload */
 	volatile int status;		/* command result 			*/
 } dm_thread_data;
@@ -23,10 +23,14 @@
  */
 
 #include "dbmail.h"
+#include "dm_headerqueue.h"
+#include "dm_searchindex.h"
+#include "dm_fulltext.h"
 #define THIS_MODULE "mailbox"
 
 extern DBParam_T db_params;
 extern Mempool_T small_pool;
+extern const char *imap_flag_desc[];
 
 #define DBPFX db_params.pfx
 
@@ -539,6 +543,15 @@ static void _append_sort(char *order, char *field, gboolean reverse)
 	g_strlcat(order, tmp, MAX_SEARCH_LEN);
 }
 
+static void _append_sort_key(search_key *value, sort_field field, gboolean reverse)
+{
+	if (value->nsort < MAX_SORT_KEYS) {
+		value->sort[value->nsort].field = field;
+		value->sort[value->nsort].reverse = reverse;
+	}
+	value->nsort++;
+}
+
 static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_key *value, uint64_t *idx)
 {
 	value->type = IST_SORT;
@@ -558,41 +571,48 @@ static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_
 	
 	if ( MATCH(key, "arrival") ) {
 		_append_sort(value->order, "internal_date", reverse);
+		_append_sort_key(value, SORT_ARRIVAL, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "size") ) {
 		_append_sort(value->order, "messagesize", reverse);
+		_append_sort_key(value, SORT_SIZE, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "from") ) {
 		_append_join(value->table, "fromfield");
 		_append_sort(value->order, "fromfield", reverse);
+		_append_sort_key(value, SORT_FROM, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "subject") ) {
 		_append_join(value->table, "subjectfield");
 		_append_sort(value->order, "sortfield", reverse);
+		_append_sort_key(value, SORT_SUBJECT, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "cc") ) {
 		_append_join(value->table, "ccfield");
 		_append_sort(value->order, "ccfield", reverse);
+		_append_sort_key(value, SORT_CC, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "to") ) {
 		_append_join(value->table, "tofield");
 		_append_sort(value->order, "tofield", reverse);
+		_append_sort_key(value, SORT_TO, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "date") ) {
 		_append_join(value->table, "datefield");
 		_append_sort(value->order, "sortfield", reverse);
+		_append_sort_key(value, SORT_DATE, reverse);
 		(*idx)++;
 	}	
 
@@ -633,6 +653,20 @@ static void pop_search(DbmailMailbox *self)
 		self->search = self->search->parent;
 }
 
+/*
+ * a flag search key: the sql clause goes in value->search, the flags
+ * are kept for matching in memory
+ */
+static void _search_flag(search_key *value, int flag, int set)
+{
+	value->type = IST_FLAG;
+	if (value->nflags < 2) {
+		value->flag[value->nflags] = flag;
+		value->flag_set[value->nflags] = set;
+		value->nflags++;
+	}
+}
+
 static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint64_t *idx)
 {
 	int result = 0;
@@ -676,67 +710,68 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 	 */
 
 	else if ( MATCH(key, "answered") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_ANSWERED, 1);
 		strncpy(value->search, "answered_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "deleted") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_DELETED, 1);
 		strncpy(value->search, "deleted_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "flagged") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_FLAGGED, 1);
 		strncpy(value->search, "flagged_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "recent") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_RECENT, 1);
 		strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "seen") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_SEEN, 1);
 		strncpy(value->search, "seen_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "draft") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_DRAFT, 1);
 		strncpy(value->search, "draft_flag=1", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "new") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_SEEN, 0);
+		_search_flag(value, IMAP_FLAG_RECENT, 1);
 		strncpy(value->search, "(seen_flag=0 AND recent_flag=1)", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "old") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_RECENT, 0);
 		strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "unanswered") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_ANSWERED, 0);
 		strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 
 	} else if ( MATCH(key, "undeleted") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_DELETED, 0);
 		strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 	
 	} else if ( MATCH(key, "unflagged") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_FLAGGED, 0);
 		strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 	
 	} else if ( MATCH(key, "unseen") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_SEEN, 0);
 		strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 	
 	} else if ( MATCH(key, "undraft") ) {
-		value->type = IST_FLAG;
+		_search_flag(value, IMAP_FLAG_DRAFT, 0);
 		strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN-1);
 		(*idx)++;
 	
@@ -846,6 +881,8 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		(*idx)++;
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
 		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date < '%s'", s);
+		strncpy(value->op, "<", MAX_SEARCH_LEN-1);
+		strncpy(value->field, s, MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "on") ) {
@@ -859,6 +896,8 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
 		g_snprintf(d, MIME_FIELD_MAX-1, db_get_sql(SQL_TO_DATE), "p.internal_date");
 		g_snprintf(value->search, MAX_SEARCH_LEN-1, "%s = '%s'", d, s);
+		strncpy(value->op, "=", MAX_SEARCH_LEN-1);
+		strncpy(value->field, s, MAX_SEARCH_LEN-1);
 		(*idx)++;
 		
 	} else if ( MATCH(key, "since") ) {
@@ -870,6 +909,8 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		(*idx)++;
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
 		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date > '%s'", s);
+		strncpy(value->op, ">", MAX_SEARCH_LEN-1);
+		strncpy(value->field, s, MAX_SEARCH_LEN-1);
 		(*idx)++;
 
 	} else if (MATCH(key, "older") ) {
@@ -984,42 +1025,43 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		nextkey = p_string_str(search_keys[*idx+1]);
 
 		if ( MATCH(nextkey, "answered") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_ANSWERED, 0);
 			strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "deleted") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_DELETED, 0);
 			strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "flagged") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_FLAGGED, 0);
 			strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "recent") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_RECENT, 0);
 			strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "seen") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_SEEN, 0);
 			strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "draft") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_DRAFT, 0);
 			strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "new") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_SEEN, 1);
+			_search_flag(value, IMAP_FLAG_RECENT, 0);
 			strncpy(value->search, "(seen_flag=1 AND recent_flag=0)", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
 		} else if ( MATCH(nextkey, "old") ) {
-			value->type = IST_FLAG;
+			_search_flag(value, IMAP_FLAG_RECENT, 1);
 			strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN-1);
 			(*idx)+=2;
 			
@@ -1158,8 +1200,31 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 }
 
 
-static gboolean _do_sort(GNode *node, DbmailMailbox *self)
+struct sort_request {
+	DbmailMailbox *self;
+	uint64_t limit;
+};
+
+static gboolean mailbox_sort_memory(DbmailMailbox *self, search_key *s, uint64_t limit);
+
+/*
+ * keep only the first limit entries of the sorted list
+ */
+static void _sort_truncate(DbmailMailbox *self, uint64_t limit)
 {
+	GList *tail;
+
+	if ((! limit) || (! (tail = g_list_nth(self->sorted, limit))))
+		return;
+
+	tail->prev->next = NULL;
+	tail->prev = NULL;
+	g_list_destroy(tail);
+}
+
+static gboolean _do_sort(GNode *node, struct sort_request *req)
+{
+	DbmailMailbox *self = req->self;
 	GString *q;
 	uint64_t tid, *id;
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
@@ -1172,6 +1237,16 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 	
 	if (s->searched) return FALSE;
 
+        if (self->sorted) {
+                g_list_destroy(self->sorted);
+                self->sorted = NULL;
+        }
+
+	if ((! self->dbsearch) && mailbox_sort_memory(self, s, req->limit)) {
+		s->searched = TRUE;
+		return FALSE;
+	}
+
 	q = g_string_new("");
 	g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
 			"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
@@ -1180,11 +1255,6 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 			"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
 			dbmail_mailbox_get_id(self), MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, s->order);
 
-        if (self->sorted) {
-                g_list_destroy(self->sorted);
-                self->sorted = NULL;
-        }
-
 	z = g_tree_new((GCompareFunc)ucmp);
 	c = db_con_get();
 	TRY
@@ -1209,6 +1279,7 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 	if (t == DM_EQUERY) return TRUE;
 
         self->sorted = g_list_reverse(self->sorted);
+	_sort_truncate(self, req->limit);
 
 	g_string_free(q,TRUE);
 
@@ -1216,6 +1287,386 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 	
 	return FALSE;
 }
+static gchar * _search_fold(const char *s)
+{
+	if (g_utf8_validate(s, -1, NULL))
+		return g_utf8_casefold(s, -1);
+	return g_ascii_strdown(s, -1);
+}
+
+/* case-insensitive substring match, like ILIKE '%needle%' */
+static gboolean _search_contains(const char *haystack, const char *needle)
+{
+	gchar *h, *n;
+	gboolean found;
+
+	if (! (haystack && needle))
+		return FALSE;
+
+	h = _search_fold(haystack);
+	n = _search_fold(needle);
+	found = (strstr(h, n) != NULL);
+	g_free(h);
+	g_free(n);
+
+	return found;
+}
+
+/*
+ * match a search key that depends on the header cache against
+ * the message itself
+ */
+static gboolean _search_message(DbmailMessage *message, search_key *s)
+{
+	gboolean found = FALSE;
+
+	switch (s->type) {
+		case IST_HDR:
+		{
+			const char *charset = dbmail_message_get_charset(message);
+			gboolean isaddr = (MATCH(s->hdrfld, "from") || MATCH(s->hdrfld, "to")
+					|| MATCH(s->hdrfld, "cc") || MATCH(s->hdrfld, "bcc")
+					|| MATCH(s->hdrfld, "reply-to") || MATCH(s->hdrfld, "return-path"));
+			GList *values = g_list_first(dbmail_message_get_header_repeated(message, s->hdrfld));
+			GList *l = values;
+			while (l) {
+				char *value = dbmail_iconv_decode_field((const char *)l->data, charset, isaddr);
+				found = _search_contains(value, s->search);
+				g_free(value);
+				if (found || (! g_list_next(l))) break;
+				l = g_list_next(l);
+			}
+			g_list_free(values);
+		}
+		break;
+
+		case IST_HDRDATE_ON:
+		case IST_HDRDATE_SINCE:
+		case IST_HDRDATE_BEFORE:
+		{
+			char d[SQL_INTERNALDATE_LEN];
+			char datefield[SQL_INTERNALDATE_LEN];
+			const char *value;
+			time_t date;
+			int offset, cmp;
+
+			if ((value = dbmail_message_get_header(message, "Date"))) {
+				date = g_mime_utils_header_decode_date(value, &offset);
+			} else {
+				date = message->internal_date;
+				offset = message->internal_date_gmtoff;
+			}
+			date += (offset * 36); // +0200 -> offset 200
+
+			memset(d, 0, sizeof(d));
+			memset(datefield, 0, sizeof(datefield));
+			strftime(datefield, sizeof(datefield)-1, "%Y-%m-%d", gmtime(&date));
+			date_imap2sql(s->search, d);
+
+			cmp = strncmp(datefield, d, 10);
+			if (s->type == IST_HDRDATE_SINCE)
+				found = (cmp >= 0);
+			else if (s->type == IST_HDRDATE_BEFORE)
+				found = (cmp < 0);
+			else
+				found = (cmp == 0);
+		}
+		break;
+
+		case IST_DATA_TEXT:
+		{
+			gchar *headers = dbmail_message_hdrs_to_string(message);
+			found = _search_contains(headers, s->search);
+			g_free(headers);
+		}
+		break;
+
+		default:
+		break;
+	}
+
+	return found;
+}
+
+/*
+ * With deferred header caching, recently delivered messages may not
+ * have a header cache yet. Search keys that use the cache are matched
+ * against the stored messages instead.
+ */
+static void mailbox_search_pending(DbmailMailbox *self, search_key *s, const char *inset)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	GTree *ids;
+	GList *pending = NULL, *l;
+	uint64_t *k, *v, *w;
+
+	c = db_con_get();
+	TRY
+		st = db_stmt_prepare(c, "SELECT m.message_idnr, m.physmessage_id FROM %smessages m "
+				"LEFT JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+				"%s "
+				"AND h.physmessage_id IS NULL",
+				DBPFX, DBPFX, inset?inset:"");
+		db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+		db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+		r = db_stmt_query(st);
+		while (db_result_next(r)) {
+			uint64_t *row = g_new0(uint64_t, 2);
+			row[0] = db_result_get_u64(r, 0);
+			row[1] = db_result_get_u64(r, 1);
+			pending = g_list_append(pending, row);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (! pending)
+		return;
+
+	TRACE(TRACE_DEBUG, "[%u] messages without header cache", g_list_length(pending));
+
+	ids = MailboxState_getIds(self->mbstate);
+	l = g_list_first(pending);
+	while (l) {
+		uint64_t *row = (uint64_t *)l->data;
+		DbmailMessage *message;
+
+		if ((w = g_tree_lookup(ids, &row[0])) && (! g_tree_lookup(s->found, &row[0]))) {
+			message = dbmail_message_new(self->pool);
+			if ((message = dbmail_message_retrieve(message, row[1]))) {
+				if (_search_message(message, s)) {
+					k = mempool_pop(small_pool, sizeof(uint64_t));
+					v = mempool_pop(small_pool, sizeof(uint64_t));
+					*k = row[0];
+					*v = *w;
+					g_tree_insert(s->found, k, v);
+				}
+				dbmail_message_free(message);
+			}
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_list_destroy(pending);
+}
+
+static void _search_fulltext_ids(ResultSet_T r, GTree *ids, GTree *found)
+{
+	uint64_t *k, *v, *w;
+	uint64_t id;
+
+	while (db_result_next(r)) {
+		id = db_result_get_u64(r,0);
+		if (! (w = g_tree_lookup(ids, &id)))
+			continue;
+
+		k = mempool_pop(small_pool, sizeof(uint64_t));
+		v = mempool_pop(small_pool, sizeof(uint64_t));
+		*k = id;
+		*v = *w;
+
+		g_tree_insert(found, k, v);
+	}
+}
+
+/*
+ * the substring match of BODY and TEXT against the stored message.
+ * partial must outlive the statement.
+ */
+static PreparedStatement_T _search_data_stmt(DbmailMailbox *self, Connection_T c,
+		search_key *s, const char *inset, char *partial)
+{
+	PreparedStatement_T st;
+	char data[DEF_FRAGSIZE];
+
+	memset(partial,0,DEF_FRAGSIZE);
+	snprintf(partial, DEF_FRAGSIZE-1, "%%%s%%", s->search);
+
+	if (s->type == IST_DATA_TEXT) {
+		st = db_stmt_prepare(c, "SELECT DISTINCT m.message_idnr "
+				"FROM %smimeparts k "
+				"LEFT JOIN %spartlists l ON k.id=l.part_id "
+				"LEFT JOIN %sphysmessage p ON l.physmessage_id=p.id "
+				"LEFT JOIN %sheader h ON h.physmessage_id=p.id "
+				"LEFT JOIN %sheadervalue v ON h.headervalue_id=v.id "
+				"LEFT JOIN %smessages m ON m.physmessage_id=p.id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+				"%s "
+				"AND (v.headervalue %s ? OR k.data %s ?) "
+				"ORDER BY m.message_idnr",
+				DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
+				inset?inset:"",
+				db_get_sql(SQL_INSENSITIVE_LIKE), 
+				db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
+		db_stmt_set_str(st, 5, partial);
+	} else {
+		memset(data, 0, sizeof(data));
+		snprintf(data, DEF_FRAGSIZE-1, db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
+		st = db_stmt_prepare(c, "SELECT DISTINCT m.message_idnr FROM %smimeparts p "
+				"LEFT JOIN %spartlists l ON p.id=l.part_id "
+				"LEFT JOIN %sphysmessage s ON l.physmessage_id=s.id "
+				"LEFT JOIN %smessages m ON m.physmessage_id=s.id "
+				"LEFT JOIN %smailboxes b ON m.mailbox_idnr = b.mailbox_idnr "
+				"WHERE b.mailbox_idnr=? AND m.status IN (?,?) "
+				"%s "
+				"AND (l.part_key > 1 OR l.is_header=0) "
+				"AND %s %s ? "
+				"ORDER BY m.message_idnr",
+				DBPFX,DBPFX,DBPFX,DBPFX,DBPFX,
+				inset?inset:"",
+				data, db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
+	}
+
+	db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+	db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+	db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+	db_stmt_set_str(st, 4, partial);
+
+	return st;
+}
+
+/*
+ * BODY and TEXT search narrowed by the full-text index. Candidates are
+ * the messages where every word but the first of the search string
+ * occurs at the start of a word in an indexed part. The first word may
+ * end any word, and a LIKE on '%word%' can not use the index on
+ * fts_terms, so it is only used when it is the sole word of the search
+ * string and left to the substring match otherwise. Messages with parts
+ * that are not indexed yet are
+ * candidates as well. The candidates are then matched with the same
+ * substring search as without the index, so the result only differs
+ * where the index does not hold the text searched for: inside HTML
+ * tags, in the raw transfer-encoding of a part, or in parts with more
+ * distinct words than the index keeps.
+ */
+#define FULLTEXT_CONFIRM_BATCH 200
+
+static gboolean mailbox_search_fulltext(DbmailMailbox *self, search_key *s, const char *inset)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	GTree * volatile found = NULL;
+	GTree * volatile candidates = NULL;
+	GTree *ids, *step;
+	GList *terms, *l;
+	GList * volatile keys = NULL;
+	volatile gboolean done = TRUE;
+	const char *body = (s->type == IST_DATA_BODY) ? "AND (l.part_key > 1 OR l.is_header=0) " : "";
+	char partial[DEF_FRAGSIZE];
+
+	if (! FullText_enabled())
+		return FALSE;
+	if (! (terms = FullText_terms(s->search)))
+		return FALSE;
+
+	ids = MailboxState_getIds(self->mbstate);
+
+	c = db_con_get();
+	TRY
+		l = g_list_first(terms);
+		if (g_list_next(l))
+			l = g_list_next(l);
+		while (l) {
+			db_con_clear(c);
+			st = db_stmt_prepare(c, "SELECT DISTINCT m.message_idnr FROM %smessages m "
+					"JOIN %spartlists l ON l.physmessage_id = m.physmessage_id "
+					"JOIN %sfts_postings p ON p.part_id = l.part_id "
+					"JOIN %sfts_terms t ON t.id = p.term_id "
+					"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+					"%s %s"
+					"AND t.term LIKE ?",
+					DBPFX, DBPFX, DBPFX, DBPFX,
+					inset?inset:"", body);
+			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+			memset(partial,0,sizeof(partial));
+			snprintf(partial, DEF_FRAGSIZE-1, "%s%s%%",
+					l == g_list_first(terms) ? "%" : "", (char *)l->data);
+			db_stmt_set_str(st, 4, partial);
+			r = db_stmt_query(st);
+
+			step = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+			_search_fulltext_ids(r, ids, step);
+			if (candidates) {
+				g_tree_merge(candidates, step, IST_SUBSEARCH_AND);
+				g_tree_destroy(step);
+			} else {
+				candidates = step;
+			}
+
+			if (! g_tree_nnodes(candidates)) break;
+			if (! g_list_next(l)) break;
+			l = g_list_next(l);
+		}
+
+		/* messages with parts that are not indexed yet */
+		db_con_clear(c);
+		st = db_stmt_prepare(c, "SELECT DISTINCT m.message_idnr FROM %smessages m "
+				"JOIN %spartlists l ON l.physmessage_id = m.physmessage_id "
+				"LEFT JOIN %sfts_parts f ON f.part_id = l.part_id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
+				"%s %s"
+				"AND f.part_id IS NULL",
+				DBPFX, DBPFX, DBPFX,
+				inset?inset:"", body);
+		db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+		db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+		r = db_stmt_query(st);
+
+		step = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+		_search_fulltext_ids(r, ids, step);
+		g_tree_merge(candidates, step, IST_SUBSEARCH_OR);
+		g_tree_destroy(step);
+
+		/* match the candidates as without the index */
+		found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+		keys = g_tree_keys(candidates);
+		l = g_list_first(keys);
+		while (l) {
+			GString *batch = g_string_new("AND m.message_idnr IN (");
+			int n = 0;
+			while (l && n < FULLTEXT_CONFIRM_BATCH) {
+				g_string_append_printf(batch, "%s%" PRIu64 "", n++ ? "," : "", *(uint64_t *)l->data);
+				l = g_list_next(l);
+			}
+			g_string_append(batch, ")");
+
+			db_con_clear(c);
+			st = _search_data_stmt(self, c, s, batch->str, partial);
+			r = db_stmt_query(st);
+			_search_fulltext_ids(r, ids, found);
+			g_string_free(batch, TRUE);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		done = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(terms);
+	g_list_free(keys);
+	if (candidates)
+		g_tree_destroy(candidates);
+
+	if (! done) {
+		if (found)
+			g_tree_destroy(found);
+		return FALSE;
+	}
+
+	TRACE(TRACE_DEBUG, "found [%d] ids using the full-text index", g_tree_nnodes(found));
+	s->found = found;
+
+	return TRUE;
+}
+
 static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 {
 	uint64_t *k, *v, *w;
@@ -1227,7 +1678,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 	GTree *ids;
 	char *inset = NULL;
 	
-	GString *t;
 	String_T q;
 
 	if (self->found && g_tree_nnodes(self->found) <= 200) {
@@ -1238,8 +1688,15 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 		}
 	}
 
+	if ((s->type == IST_DATA_BODY || s->type == IST_DATA_TEXT)
+			&& mailbox_search_fulltext(self, s, inset)) {
+		if (s->type == IST_DATA_TEXT && HeaderQueue_deferred())
+			mailbox_search_pending(self, s, inset);
+		g_free(inset);
+		return s->found;
+	}
+
 	c = db_con_get();
-	t = g_string_new("");
 	q = p_string_new(self->pool, "");
 	TRY
 		switch (s->type) {
@@ -1313,32 +1770,7 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 			break;
 
 			case IST_DATA_TEXT:
-
-			p_string_printf(q,"SELECT DISTINCT m.message_idnr "
-					"FROM %smimeparts k "
-					"LEFT JOIN %spartlists l ON k.id=l.part_id "
-					"LEFT JOIN %sphysmessage p ON l.physmessage_id=p.id "
-					"LEFT JOIN %sheader h ON h.physmessage_id=p.id "
-					"LEFT JOIN %sheadervalue v ON h.headervalue_id=v.id "
-					"LEFT JOIN %smessages m ON m.physmessage_id=p.id "
-					"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
-					"%s "
-					"AND (v.headervalue %s ? OR k.data %s ?) "
-					"ORDER BY m.message_idnr",
-					DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
-					inset?inset:"",
-					db_get_sql(SQL_INSENSITIVE_LIKE), 
-					db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			memset(partial,0,sizeof(partial));
-			snprintf(partial, DEF_FRAGSIZE-1, "%%%s%%", s->search);
-			db_stmt_set_str(st, 4, partial);
-			db_stmt_set_str(st, 5, partial);
-
+			st = _search_data_stmt(self, c, s, inset, partial);
 			break;
 				
 			case IST_IDATE:
@@ -1359,29 +1791,7 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 			break;
 			
 			case IST_DATA_BODY:
-			g_string_printf(t,db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
-			p_string_printf(q,"SELECT DISTINCT m.message_idnr FROM %smimeparts p "
-					"LEFT JOIN %spartlists l ON p.id=l.part_id "
-					"LEFT JOIN %sphysmessage s ON l.physmessage_id=s.id "
-					"LEFT JOIN %smessages m ON m.physmessage_id=s.id "
-					"LEFT JOIN %smailboxes b ON m.mailbox_idnr = b.mailbox_idnr "
-					"WHERE b.mailbox_idnr=? AND m.status IN (?,?) "
-					"%s "
-					"AND (l.part_key > 1 OR l.is_header=0) "
-					"AND %s %s ? "
-					"ORDER BY m.message_idnr",
-					DBPFX,DBPFX,DBPFX,DBPFX,DBPFX,
-					inset?inset:"",
-					t->str, db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			memset(partial,0,sizeof(partial));
-			snprintf(partial, DEF_FRAGSIZE-1, "%%%s%%", s->search);
-			db_stmt_set_str(st, 4, partial);
-
+			st = _search_data_stmt(self, c, s, inset, partial);
 			break;
 
 			case IST_SIZE_LARGER:
@@ -1512,11 +1922,24 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 		db_con_close(c);
 	END_TRY;
 
+	if (s->found && HeaderQueue_deferred()) {
+		switch (s->type) {
+			case IST_HDR:
+			case IST_HDRDATE_ON:
+			case IST_HDRDATE_SINCE:
+			case IST_HDRDATE_BEFORE:
+			case IST_DATA_TEXT:
+				mailbox_search_pending(self, s, inset);
+			break;
+			default:
+			break;
+		}
+	}
+
 	if (inset)
 		g_free(inset);
 
 	p_string_free(q,TRUE);
-	g_string_free(t,TRUE);
 
 	return s->found;
 }
@@ -1950,12 +2373,543 @@ static gboolean _merge_search(GNode *node, GTree *found)
 	return FALSE;
 }
 	
+/*
+ * in-memory search
+ *
+ * Flags, keywords, sizes and internal dates are known from the
+ * MailboxState, and the common header fields are kept in the search
+ * index. When all keys of a search can be answered from those, the
+ * search tree is evaluated per message without querying the database.
+ */
+struct search_context {
+	DbmailMailbox *self;
+	GTree *msginfo;
+	GTree *found;
+	GHashTable *needles;    // search_key -> case-folded search string
+	SearchIndex_T index;
+	gboolean headers;
+	gboolean supported;
+};
+
+static gboolean _search_supported(GNode *node, struct search_context *ctx)
+{
+	search_key *s = (search_key *)node->data;
+
+	switch (s->type) {
+		case IST_SET:
+		case IST_UIDSET:
+		case IST_SORT:
+		case IST_FLAG:
+		case IST_KEYWORD:
+		case IST_UNKEYWORD:
+		case IST_SIZE_LARGER:
+		case IST_SIZE_SMALLER:
+		case IST_SUBSEARCH_AND:
+		case IST_SUBSEARCH_NOT:
+			break;
+		case IST_SUBSEARCH_OR:
+			if (g_node_n_children(node) != 2)
+				ctx->supported = FALSE;
+			break;
+		case IST_IDATE:
+			// OLDER and YOUNGER are relative to the database clock
+			if (! strlen(s->op))
+				ctx->supported = FALSE;
+			break;
+		case IST_HDRDATE_BEFORE:
+		case IST_HDRDATE_ON:
+		case IST_HDRDATE_SINCE:
+			ctx->headers = TRUE;
+			break;
+		case IST_HDR:
+			if (SearchIndex_field(s->hdrfld) < 0)
+				ctx->supported = FALSE;
+			else
+				ctx->headers = TRUE;
+			break;
+		default:
+			ctx->supported = FALSE;
+			break;
+	}
+
+	return (! ctx->supported);
+}
+
+static gboolean _search_prepare(GNode *node, struct search_context *ctx)
+{
+	search_key *s = (search_key *)node->data;
+
+	switch (s->type) {
+		case IST_SET:
+		case IST_UIDSET:
+			if (! (s->found = dbmail_mailbox_get_set(ctx->self, (const char *)s->search, s->type == IST_UIDSET)))
+				ctx->supported = FALSE;
+			break;
+		case IST_HDR:
+			g_hash_table_insert(ctx->needles, s, _search_fold(s->search));
+			break;
+		default:
+			break;
+	}
+
+	return (! ctx->supported);
+}
+
+static gboolean _search_cleanup(GNode *node, gpointer UNUSED data)
+{
+	search_key *s = (search_key *)node->data;
+
+	if ((s->type == IST_SET || s->type == IST_UIDSET) && s->found) {
+		g_tree_destroy(s->found);
+		s->found = NULL;
+	}
+
+	return FALSE;
+}
+
+/*
+ * match the flags of a flag search key, all must match
+ */
+static int _search_flags(search_key *s, MessageInfo *info)
+{
+	int i;
+
+	if (! s->nflags)
+		return -1;
+
+	for (i = 0; i < s->nflags; i++) {
+		if ((info->flags[s->flag[i]] ? 1 : 0) != s->flag_set[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static gboolean _search_keyword(MessageInfo *info, const char *keyword)
+{
+	GList *l = g_list_first(info->keywords);
+
+	while (l) {
+		if (MATCH((const char *)l->data, keyword))
+			return TRUE;
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	return FALSE;
+}
+
+static int _search_match(GNode *, struct search_context *, uint64_t, MessageInfo *);
+
+static int _search_children(GNode *node, struct search_context *ctx, uint64_t uid, MessageInfo *info)
+{
+	GNode *child;
+	int match;
+
+	for (child = g_node_first_child(node); child; child = g_node_next_sibling(child)) {
+		if ((match = _search_match(child, ctx, uid, info)) != 1)
+			return match;
+	}
+
+	return 1;
+}
+
+/*
+ * \return 1 on a match, 0 if not, -1 if the key cannot be evaluated
+ * for this message
+ */
+static int _search_match(GNode *node, struct search_context *ctx, uint64_t uid, MessageInfo *info)
+{
+	search_key *s = (search_key *)node->data;
+	int match = 1, a, b;
+
+	switch (s->type) {
+		case IST_SET:
+		case IST_UIDSET:
+			match = g_tree_lookup(s->found, &uid) ? 1 : 0;
+			break;
+
+		case IST_FLAG:
+			match = _search_flags(s, info);
+			break;
+
+		case IST_KEYWORD:
+			match = _search_keyword(info, s->search);
+			break;
+
+		case IST_UNKEYWORD:
+			match = (! _search_keyword(info, s->search));
+			break;
+
+		case IST_SIZE_LARGER:
+			match = (info->rfcsize > s->size);
+			break;
+
+		case IST_SIZE_SMALLER:
+			match = (info->rfcsize < s->size);
+			break;
+
+		case IST_IDATE:
+			// internaldate is in sql format, unless it was missing
+			if (info->internaldate[4] != '-')
+				return -1;
+			if (s->op[0] == '<')
+				match = (strcmp(info->internaldate, s->field) < 0);
+			else if (s->op[0] == '>')
+				match = (strcmp(info->internaldate, s->field) > 0);
+			else
+				match = (strncmp(info->internaldate, s->field, 10) == 0);
+			break;
+
+		case IST_HDRDATE_BEFORE:
+		case IST_HDRDATE_ON:
+		case IST_HDRDATE_SINCE:
+		{
+			char d[SQL_INTERNALDATE_LEN];
+			const char *date;
+			int cmp;
+
+			if (! SearchIndex_has(ctx->index, uid))
+				return -1;
+			if (! (date = SearchIndex_getDate(ctx->index, uid))) {
+				match = 0;
+				break;
+			}
+
+			memset(d, 0, sizeof(d));
+			date_imap2sql(s->search, d);
+			cmp = strncmp(date, d, 10);
+			if (s->type == IST_HDRDATE_SINCE)
+				match = (cmp >= 0);
+			else if (s->type == IST_HDRDATE_BEFORE)
+				match = (cmp < 0);
+			else
+				match = (cmp == 0);
+		}
+		break;
+
+		case IST_HDR:
+		{
+			const char *value;
+
+			if (! SearchIndex_has(ctx->index, uid))
+				return -1;
+			value = SearchIndex_getField(ctx->index, uid, SearchIndex_field(s->hdrfld));
+			match = (value && strstr(value, g_hash_table_lookup(ctx->needles, s)));
+		}
+		break;
+
+		case IST_SUBSEARCH_OR:
+			if ((a = _search_match(g_node_nth_child(node, 0), ctx, uid, info)) < 0)
+				return a;
+			if (a == 1)
+				return 1;
+			return _search_match(g_node_nth_child(node, 1), ctx, uid, info);
+
+		case IST_SUBSEARCH_NOT:
+			if ((b = _search_children(node, ctx, uid, info)) < 0)
+				return b;
+			return (! b);
+
+		default:
+			break;
+	}
+
+	if (match != 1)
+		return match;
+
+	return _search_children(node, ctx, uid, info);
+}
+
+static gboolean _search_message_info(uint64_t *uid, uint64_t *msn, struct search_context *ctx)
+{
+	MessageInfo *info;
+	int match;
+
+	if (! (info = g_tree_lookup(ctx->msginfo, uid)))
+		return FALSE;
+
+	match = _search_match(g_node_get_root(ctx->self->search), ctx, *uid, info);
+	if (match < 0) {
+		ctx->supported = FALSE;
+		return TRUE;
+	}
+
+	if (match)
+		g_tree_insert(ctx->found, uid, msn);
+
+	return FALSE;
+}
+
+/*
+ * \return TRUE if the search was done in memory, FALSE if it has to
+ * be done by the database
+ */
+static gboolean mailbox_search_memory(DbmailMailbox *self)
+{
+	struct search_context ctx;
+	GNode *root = g_node_get_root(self->search);
+	GTree *ids;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.self = self;
+	ctx.supported = TRUE;
+
+	g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			(GNodeTraverseFunc)_search_supported, (gpointer)&ctx);
+	if (! ctx.supported)
+		return FALSE;
+
+	ids = MailboxState_getIds(self->mbstate);
+	if (ctx.headers && (! (ctx.index = SearchIndex_get(dbmail_mailbox_get_id(self), ids))))
+		return FALSE;
+
+	ctx.msginfo = MailboxState_getMsginfo(self->mbstate);
+	ctx.needles = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	ctx.found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+
+	g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			(GNodeTraverseFunc)_search_prepare, (gpointer)&ctx);
+
+	if (ctx.supported)
+		g_tree_foreach(ids, (GTraverseFunc)_search_message_info, &ctx);
+
+	g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			(GNodeTraverseFunc)_search_cleanup, NULL);
+	g_hash_table_destroy(ctx.needles);
+	SearchIndex_release(&ctx.index);
+
+	if (! ctx.supported) {
+		TRACE(TRACE_DEBUG, "search not supported in memory");
+		g_tree_destroy(ctx.found);
+		return FALSE;
+	}
+
+	if (self->found) g_tree_destroy(self->found);
+	self->found = ctx.found;
+
+	return TRUE;
+}
+
+/*
+ * SORT in memory
+ *
+ * Sizes and arrival dates come from the MailboxState, the sort keys
+ * of the header fields from the search index. Messages are compared
+ * on each sort criterion in turn and ties are broken by uid. When
+ * only the first messages are wanted, only those are put in order.
+ */
+typedef struct {
+	uint64_t uid;
+	MessageInfo *info;
+} sort_item;
+
+struct sort_state {
+	search_key *key;
+	GTree *msginfo;
+	GArray *items;          // sort_item
+	SearchIndex_T index;
+	gboolean supported;
+};
+
+static const char * _sort_string(struct sort_state *st, const sort_item *item, sort_field field)
+{
+	const char *value = NULL;
+
+	switch (field) {
+		case SORT_FROM:
+			value = SearchIndex_getSortKey(st->index, item->uid, SEARCH_FIELD_FROM);
+			break;
+		case SORT_TO:
+			value = SearchIndex_getSortKey(st->index, item->uid, SEARCH_FIELD_TO);
+			break;
+		case SORT_CC:
+			value = SearchIndex_getSortKey(st->index, item->uid, SEARCH_FIELD_CC);
+			break;
+		case SORT_SUBJECT:
+			value = SearchIndex_getSortKey(st->index, item->uid, SEARCH_FIELD_SUBJECT);
+			break;
+		case SORT_DATE:
+			// without a Date header the arrival date is used
+			if ((value = SearchIndex_getSortDate(st->index, item->uid)))
+				break;
+			/* fall through */
+		case SORT_ARRIVAL:
+			value = item->info->internaldate;
+			break;
+		default:
+			break;
+	}
+
+	return value ? value : "";
+}
+
+static gint _sort_compare(const sort_item *a, const sort_item *b, struct sort_state *st)
+{
+	int i, cmp;
+
+	for (i = 0; i < st->key->nsort; i++) {
+		sort_key *k = &st->key->sort[i];
+
+		switch (k->field) {
+			case SORT_SIZE:
+				cmp = (a->info->rfcsize > b->info->rfcsize) - (a->info->rfcsize < b->info->rfcsize);
+				break;
+			case SORT_ARRIVAL:
+			case SORT_DATE:
+				cmp = strcmp(_sort_string(st, a, k->field), _sort_string(st, b, k->field));
+				break;
+			default:
+				cmp = g_ascii_strcasecmp(_sort_string(st, a, k->field), _sort_string(st, b, k->field));
+				break;
+		}
+
+		if (cmp)
+			return k->reverse ? -cmp : cmp;
+	}
+
+	return ucmp(&a->uid, &b->uid);
+}
+
+static gboolean _sort_collect(uint64_t *uid, gpointer UNUSED msn, struct sort_state *st)
+{
+	sort_item item;
+
+	if ((! (item.info = g_tree_lookup(st->msginfo, uid)))
+			|| (st->index && (! SearchIndex_has(st->index, *uid)))) {
+		st->supported = FALSE;
+		return TRUE;
+	}
+
+	item.uid = *uid;
+	g_array_append_val(st->items, item);
+
+	return FALSE;
+}
+
+/*
+ * move an item down the heap until no child sorts after it
+ */
+static void _sort_sift(sort_item *heap, guint n, guint i, struct sort_state *st)
+{
+	while (TRUE) {
+		guint left = 2 * i + 1, right = left + 1, top = i;
+		sort_item t;
+
+		if (left < n && _sort_compare(&heap[left], &heap[top], st) > 0)
+			top = left;
+		if (right < n && _sort_compare(&heap[right], &heap[top], st) > 0)
+			top = right;
+		if (top == i)
+			break;
+
+		t = heap[i];
+		heap[i] = heap[top];
+		heap[top] = t;
+		i = top;
+	}
+}
+
+/*
+ * put only the first limit items in order. The heap holds the items
+ * that sort first so far, with the last of them on top.
+ */
+static void _sort_partial(GArray *items, guint limit, struct sort_state *st)
+{
+	sort_item *v = (sort_item *)items->data;
+	guint i;
+
+	for (i = limit / 2; i-- > 0; )
+		_sort_sift(v, limit, i, st);
+
+	for (i = limit; i < items->len; i++) {
+		if (_sort_compare(&v[i], &v[0], st) < 0) {
+			v[0] = v[i];
+			_sort_sift(v, limit, 0, st);
+		}
+	}
+
+	g_array_set_size(items, limit);
+	g_qsort_with_data(items->data, limit, sizeof(sort_item), (GCompareDataFunc)_sort_compare, st);
+}
+
+/*
+ * \return TRUE if the sort was done in memory, FALSE if it has to
+ * be done by the database
+ */
+static gboolean mailbox_sort_memory(DbmailMailbox *self, search_key *s, uint64_t limit)
+{
+	struct sort_state st;
+	gboolean headers = FALSE;
+	GList *sorted = NULL;
+	guint i;
+
+	if ((! self->found) || (! self->mbstate))
+		return FALSE;
+	if (s->nsort < 1 || s->nsort > MAX_SORT_KEYS)
+		return FALSE;
+
+	for (i = 0; i < (guint)s->nsort; i++) {
+		if (s->sort[i].field != SORT_ARRIVAL && s->sort[i].field != SORT_SIZE)
+			headers = TRUE;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.key = s;
+	st.supported = TRUE;
+
+	if (headers && (! (st.index = SearchIndex_get(dbmail_mailbox_get_id(self),
+						MailboxState_getIds(self->mbstate)))))
+		return FALSE;
+
+	st.msginfo = MailboxState_getMsginfo(self->mbstate);
+	st.items = g_array_sized_new(FALSE, FALSE, sizeof(sort_item), g_tree_nnodes(self->found));
+
+	g_tree_foreach(self->found, (GTraverseFunc)_sort_collect, &st);
+
+	if (st.supported) {
+		if (limit && limit < st.items->len)
+			_sort_partial(st.items, (guint)limit, &st);
+		else
+			g_array_sort_with_data(st.items, (GCompareDataFunc)_sort_compare, &st);
+
+		for (i = st.items->len; i-- > 0; ) {
+			uint64_t *id = g_new0(uint64_t, 1);
+			*id = g_array_index(st.items, sort_item, i).uid;
+			sorted = g_list_prepend(sorted, id);
+		}
+		self->sorted = sorted;
+	}
+
+	SearchIndex_release(&st.index);
+	g_array_free(st.items, TRUE);
+
+	if (! st.supported) {
+		TRACE(TRACE_DEBUG, "sort not supported in memory");
+		return FALSE;
+	}
+
+	TRACE(TRACE_DEBUG, "sorted [%u] ids in memory", g_list_length(self->sorted));
+
+	return TRUE;
+}
+
 int dbmail_mailbox_sort(DbmailMailbox *self) 
 {
+	return dbmail_mailbox_sort_limit(self, 0);
+}
+
+int dbmail_mailbox_sort_limit(DbmailMailbox *self, uint64_t limit)
+{
+	struct sort_request req;
+
 	if (! self->search) return 0;
+
+	req.self = self;
+	req.limit = limit;
 	
 	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
-			(GNodeTraverseFunc)_do_sort, (gpointer)self);
+			(GNodeTraverseFunc)_do_sort, (gpointer)&req);
 	
 	return 0;
 }
@@ -1969,6 +2923,11 @@ int dbmail_mailbox_search(DbmailMailbox *self)
 	if (! self->mbstate)
 		dbmail_mailbox_open(self);
 
+	if ((! self->dbsearch) && mailbox_search_memory(self)) {
+		TRACE(TRACE_DEBUG,"found [%d] ids in memory", g_tree_nnodes(self->found));
+		return 0;
+	}
+
 	if (self->found) g_tree_destroy(self->found);
 	self->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
 
@@ -51,6 +51,7 @@ typedef struct {
 	GTree *found;		// search result (key: uid, value: msn)
 	GNode *search;
 	const char *charset;		// charset used during search/sort
+	gboolean dbsearch;		// never search or sort in memory
 
 } DbmailMailbox;
 
@@ -58,6 +59,8 @@ typedef struct {
 DbmailMailbox * dbmail_mailbox_new(Mempool_T, uint64_t);
 int dbmail_mailbox_open(DbmailMailbox *self);
 int dbmail_mailbox_sort(DbmailMailbox *self);
+/* sort, keeping only the first limit messages. 0 keeps all */
+int dbmail_mailbox_sort_limit(DbmailMailbox *self, uint64_t limit);
 int dbmail_mailbox_search(DbmailMailbox *self);
 
 GTree * dbmail_mailbox_get_msginfo(DbmailMailbox *self);
@@ -0,0 +1,441 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#include "dbmail.h"
+#include "dm_mailboxlist.h"
+
+#define THIS_MODULE "MailboxList"
+
+#define T MailboxTree_T
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+/*
+ * the mailboxes a user can see, summed up. Mailbox ids only grow, and
+ * so does the seq of a mailbox, which is bumped on a rename, a change
+ * of subscription or ACL, so any change made by any process changes
+ * the signature.
+ */
+struct signature {
+	uint64_t count;
+	uint64_t max_id;
+	uint64_t sum_seq;
+};
+
+#define LIST_VISIBLE "WHERE mbx.owner_idnr = ? " \
+	"OR mbx.mailbox_idnr IN (SELECT acl.mailbox_id FROM %sacl acl " \
+	"JOIN %susers usr ON acl.user_id = usr.user_idnr " \
+	"WHERE acl.lookup_flag = 1 AND (acl.user_id = ? OR usr.userid = ?))"
+
+struct T {
+	uint64_t user_id;
+	uint64_t version;     // list_version when loaded
+	struct signature sig; // of the mailboxes when loaded
+	time_t loaded;
+	GPtrArray *items;     // MailboxListItem_T
+	GStringChunk *names;
+	int refs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GTree *cache = NULL;   // user_id -> T
+static int cache_ttl = -1;
+static uint64_t list_version = 1;
+
+static void tree_free(T t)
+{
+	g_ptr_array_foreach(t->items, (GFunc)g_free, NULL);
+	g_ptr_array_free(t->items, TRUE);
+	g_string_chunk_free(t->names);
+	g_free(t);
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void tree_unref(T t)
+{
+	if (--t->refs > 0)
+		return;
+	tree_free(t);
+}
+
+/*
+ * a mailbox has children when any of the mailboxes in the tree
+ * lives below it.
+ */
+static void tree_children(T t)
+{
+	GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+	guint i;
+
+	for (i = 0; i < t->items->len; i++) {
+		MailboxListItem_T *I = g_ptr_array_index(t->items, i);
+		g_hash_table_insert(names, I->name, I);
+	}
+
+	for (i = 0; i < t->items->len; i++) {
+		MailboxListItem_T *I = g_ptr_array_index(t->items, i), *P;
+		char *name = g_strdup(I->name), *sep;
+
+		while ((sep = g_strrstr(name, MAILBOX_SEPARATOR))) {
+			*sep = '\0';
+			if ((P = g_hash_table_lookup(names, name)))
+				P->no_children = FALSE;
+		}
+		g_free(name);
+	}
+
+	g_hash_table_destroy(names);
+}
+
+static T tree_load(uint64_t user_idnr, uint64_t version)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile gboolean failed = FALSE;
+	GString *name = g_string_new("");
+	T t;
+
+	t = g_new0(struct T, 1);
+	t->user_id = user_idnr;
+	t->version = version;
+	t->loaded = time(NULL);
+	t->items = g_ptr_array_new();
+	t->names = g_string_chunk_new(4096);
+	t->refs = 1;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c,
+				"SELECT mbx.mailbox_idnr, mbx.owner_idnr, own.userid, mbx.name, "
+				"mbx.no_select, mbx.no_inferiors, "
+				"CASE WHEN sub.user_id IS NULL THEN 0 ELSE 1 END, mbx.seq "
+				"FROM %smailboxes mbx "
+				"JOIN %susers own ON mbx.owner_idnr = own.user_idnr "
+				"LEFT JOIN %ssubscription sub ON sub.mailbox_id = mbx.mailbox_idnr "
+				"AND sub.user_id = ? "
+				LIST_VISIBLE,
+				DBPFX, DBPFX, DBPFX, DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, user_idnr);
+		db_stmt_set_u64(s, 2, user_idnr);
+		db_stmt_set_u64(s, 3, user_idnr);
+		db_stmt_set_str(s, 4, DBMAIL_ACL_ANYONE_USER);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			MailboxListItem_T *I = g_new0(MailboxListItem_T, 1);
+			uint64_t owner_idnr = db_result_get_u64(r, 1);
+			const char *owner = db_result_get(r, 2);
+
+			/* add the namespace prefix */
+			if (owner_idnr == user_idnr)
+				g_string_assign(name, "");
+			else if (MATCH(owner, PUBLIC_FOLDER_USER))
+				g_string_printf(name, "%s%s", NAMESPACE_PUBLIC, MAILBOX_SEPARATOR);
+			else
+				g_string_printf(name, "%s%s%s%s", NAMESPACE_USER, MAILBOX_SEPARATOR,
+						owner, MAILBOX_SEPARATOR);
+			g_string_append(name, db_result_get(r, 3));
+
+			I->id = db_result_get_u64(r, 0);
+			I->name = g_string_chunk_insert(t->names, name->str);
+			I->no_select = db_result_get_bool(r, 4);
+			I->no_inferiors = db_result_get_bool(r, 5);
+			I->no_children = TRUE;
+			I->subscribed = db_result_get_bool(r, 6);
+			g_ptr_array_add(t->items, I);
+
+			t->sig.count++;
+			t->sig.max_id = max(t->sig.max_id, I->id);
+			t->sig.sum_seq += db_result_get_u64(r, 7);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		failed = TRUE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_string_free(name, TRUE);
+
+	if (failed) {
+		tree_free(t);
+		return NULL;
+	}
+
+	tree_children(t);
+
+	TRACE(TRACE_DEBUG, "user [%" PRIu64 "] mailboxes [%u]", user_idnr, t->items->len);
+
+	return t;
+}
+
+static gboolean tree_signature(uint64_t user_idnr, struct signature *sig)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile gboolean done = TRUE;
+
+	memset(sig, 0, sizeof(struct signature));
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT COUNT(*), MAX(mbx.mailbox_idnr), SUM(mbx.seq) "
+				"FROM %smailboxes mbx " LIST_VISIBLE,
+				DBPFX, DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, user_idnr);
+		db_stmt_set_u64(s, 2, user_idnr);
+		db_stmt_set_str(s, 3, DBMAIL_ACL_ANYONE_USER);
+		r = db_stmt_query(s);
+		if (db_result_next(r)) {
+			sig->count = db_result_get_u64(r, 0);
+			sig->max_id = db_result_get_u64(r, 1);
+			sig->sum_seq = db_result_get_u64(r, 2);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		done = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return done;
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void cache_init(void)
+{
+	Field_T val;
+
+	if (cache_ttl >= 0)
+		return;
+
+	cache_ttl = 0;
+	config_get_value("list_cache_ttl", "IMAP", val);
+	if (strlen(val))
+		cache_ttl = atoi(val);
+	if (cache_ttl < 0)
+		cache_ttl = 0;
+
+	if (cache_ttl > 0)
+		cache = g_tree_new((GCompareFunc)ucmp);
+	TRACE(TRACE_DEBUG, "mailbox list cache ttl [%d] seconds", cache_ttl);
+}
+
+static gboolean cache_expired(gpointer UNUSED key, T t, GList **expired)
+{
+	if ((t->version != list_version) || (time(NULL) - t->loaded >= cache_ttl))
+		*expired = g_list_prepend(*expired, t);
+	return FALSE;
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void cache_purge(void)
+{
+	GList *expired = NULL, *l;
+
+	g_tree_foreach(cache, (GTraverseFunc)cache_expired, &expired);
+
+	l = g_list_first(expired);
+	while (l) {
+		T t = l->data;
+		g_tree_remove(cache, &t->user_id);
+		tree_unref(t);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_list_free(expired);
+}
+
+static void tree_release(T t)
+{
+	PLOCK(cache_lock);
+	tree_unref(t);
+	PUNLOCK(cache_lock);
+}
+
+static T tree_get(uint64_t user_idnr)
+{
+	struct signature sig;
+	uint64_t version;
+	T t = NULL, old;
+
+	PLOCK(cache_lock);
+	cache_init();
+	version = list_version;
+	if (cache && (t = g_tree_lookup(cache, &user_idnr))) {
+		if ((t->version == version) && (time(NULL) - t->loaded < cache_ttl))
+			t->refs++;
+		else
+			t = NULL;
+	}
+	PUNLOCK(cache_lock);
+
+	/* changes made by other processes */
+	if (t) {
+		if (tree_signature(user_idnr, &sig) && (memcmp(&sig, &t->sig, sizeof(sig)) == 0)) {
+			TRACE(TRACE_DEBUG, "user [%" PRIu64 "] hit", user_idnr);
+			return t;
+		}
+		TRACE(TRACE_DEBUG, "user [%" PRIu64 "] changed", user_idnr);
+		tree_release(t);
+	}
+
+	if (! (t = tree_load(user_idnr, version)))
+		return NULL;
+
+	PLOCK(cache_lock);
+	if (cache) {
+		cache_purge();
+		if (version == list_version) {
+			if ((old = g_tree_lookup(cache, &user_idnr))) {
+				g_tree_remove(cache, &old->user_id);
+				tree_unref(old);
+			}
+			t->refs++; // the cache and the caller
+			g_tree_insert(cache, &t->user_id, t);
+		}
+	}
+	PUNLOCK(cache_lock);
+
+	return t;
+}
+
+static MailboxListItem_T * item_copy(MailboxListItem_T *I)
+{
+	MailboxListItem_T *C = g_new0(MailboxListItem_T, 1);
+	*C = *I;
+	C->name = g_strdup(I->name);
+	return C;
+}
+
+static void item_free(MailboxListItem_T *I)
+{
+	g_free(I->name);
+	g_free(I);
+}
+
+static gboolean found_collect(gpointer UNUSED key, MailboxListItem_T *I, GList **result)
+{
+	*result = g_list_prepend(*result, I);
+	return FALSE;
+}
+
+int MailboxList_find(uint64_t user_idnr, const char *pattern,
+		gboolean only_subscribed, GList **result)
+{
+	// levels of hierarchy are kept apart, so they never mask
+	// a real mailbox of the same name
+	GTree *found, *hierarchy;
+	gboolean levels = g_str_has_suffix(pattern, "%");
+	guint i;
+	T t;
+
+	*result = NULL;
+
+	if (! (t = tree_get(user_idnr)))
+		return DM_EQUERY;
+
+	found = g_tree_new((GCompareFunc)strcmp);
+	hierarchy = g_tree_new((GCompareFunc)strcmp);
+
+	for (i = 0; i < t->items->len; i++) {
+		MailboxListItem_T *I = g_ptr_array_index(t->items, i), *H;
+		char *name, *sep;
+
+		if (only_subscribed && (! I->subscribed))
+			continue;
+
+		if (listex_match(pattern, I->name, MAILBOX_SEPARATOR, 0)) {
+			H = item_copy(I);
+			g_tree_insert(found, H->name, H);
+			continue;
+		}
+
+		if (! levels)
+			continue;
+
+		/* If the "%" wildcard is the last character of a mailbox name
+		 * argument, matching levels of hierarchy are also returned,
+		 * with the \Noselect attribute. */
+		name = g_strdup(I->name);
+		while ((sep = g_strrstr(name, MAILBOX_SEPARATOR))) {
+			*sep = '\0';
+			if (! listex_match(pattern, name, MAILBOX_SEPARATOR, 0))
+				continue;
+			if (! g_tree_lookup(hierarchy, name)) {
+				H = g_new0(MailboxListItem_T, 1);
+				H->name = g_strdup(name);
+				H->no_select = TRUE;
+				g_tree_insert(hierarchy, H->name, H);
+			}
+			break;
+		}
+		g_free(name);
+	}
+
+	tree_release(t);
+
+	g_tree_foreach(hierarchy, (GTraverseFunc)found_collect, result);
+	while (*result) {
+		MailboxListItem_T *H = (*result)->data;
+		if (g_tree_lookup(found, H->name))
+			item_free(H);
+		else
+			g_tree_insert(found, H->name, H);
+		*result = g_list_delete_link(*result, *result);
+	}
+	g_tree_destroy(hierarchy);
+
+	g_tree_foreach(found, (GTraverseFunc)found_collect, result);
+	g_tree_destroy(found);
+
+	*result = g_list_reverse(*result);
+
+	TRACE(TRACE_DEBUG, "[%s] matches [%u] mailboxes", pattern, g_list_length(*result));
+
+	return DM_SUCCESS;
+}
+
+void MailboxList_free(GList **result)
+{
+	GList *l = g_list_first(*result);
+
+	while (l) {
+		item_free(l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_list_free(*result);
+	*result = NULL;
+}
+
+void MailboxList_changed(void)
+{
+	PLOCK(cache_lock);
+	list_version++;
+	PUNLOCK(cache_lock);
+}
+
+#undef T
@@ -0,0 +1,71 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * mailbox listing for LIST and LSUB
+ *
+ * All mailboxes a user can see - the ones owned by the user and those
+ * shared with the user or with anyone with the lookup right - are
+ * read with their owner, flags and subscription in a single query.
+ * Children and the \Noselect levels of hierarchy are derived in
+ * memory from that tree, and the pattern is matched against it.
+ *
+ * The tree of a user can optionally be kept for a few seconds. Any
+ * change to the mailboxes, subscriptions or ACLs made by this process
+ * bumps a version and invalidates all cached trees at once. Changes
+ * made by other processes are noticed by reading the count, the
+ * highest id and the sum of the seqs of the mailboxes the user can
+ * see, before a cached tree is used.
+ */
+
+#ifndef DM_MAILBOXLIST_H
+#define DM_MAILBOXLIST_H
+
+#include "dbmail.h"
+
+typedef struct {
+	uint64_t id;        // 0 for levels of hierarchy
+	char *name;         // fully qualified, including the namespace
+	gboolean no_select;
+	gboolean no_inferiors;
+	gboolean no_children;
+	gboolean subscribed;
+} MailboxListItem_T;
+
+/*
+ * \brief find the mailboxes matching a LIST pattern
+ * \param user_idnr the user listing
+ * \param pattern reference name and mailbox name joined
+ * \param only_subscribed LSUB
+ * \param result list of MailboxListItem_T, sorted by name
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+extern int      MailboxList_find(uint64_t user_idnr, const char *pattern,
+		gboolean only_subscribed, GList **result);
+extern void     MailboxList_free(GList **result);
+
+/*
+ * \brief invalidate all cached trees after a mailbox was created,
+ * renamed or deleted, or a subscription or ACL changed
+ */
+extern void     MailboxList_changed(void);
+
+#endif
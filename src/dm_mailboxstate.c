@@ -58,8 +58,31 @@ struct T {
 	GTree *ids;
 	GTree *msn;
 	GTree *recent_queue;
+	// ACL rights of acl_user, valid while acl_version and acl_seq are current
+	uint64_t acl_user;
+	uint64_t acl_version;
+	uint64_t acl_seq;
+	unsigned acl_rights;
 };
    
+/*
+ * process-wide cache of mailbox snapshots shared by all
+ * sessions. Snapshots are never handed out directly; sessions
+ * get a private clone so they can keep updating flags and
+ * expunges in place.
+ */
+#define STATE_CACHE_SIZE 100
+
+typedef struct {
+	T state;
+	time_t atime;
+	int refs;
+} StateSnapshot;
+
+static pthread_mutex_t state_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GTree *state_cache = NULL;
+static int state_cache_size = -1;
+
 static void db_getmailbox_seq(T M, Connection_T c);
 static void db_getmailbox_permission(T M, Connection_T c);
 static void state_load_metadata(T M, Connection_T c);
@@ -72,7 +95,7 @@ static void MailboxState_uid_msn_new(T M)
 	M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
 
 	if (M->ids) g_tree_destroy(M->ids);
-	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
 }
 
 static void MessageInfo_free(MessageInfo *m)
@@ -81,13 +104,59 @@ static void MessageInfo_free(MessageInfo *m)
 	g_free(m);
 }
 
+/*
+ * the msginfo tree is keyed on the uid field of its values,
+ * so there is no separate allocation for the keys
+ */
+static GTree * state_msginfo_new(void)
+{
+	return g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)MessageInfo_free);
+}
+
+/* 
+ * build a MessageInfo from a row selected with the
+ * STATE_MESSAGE_COLUMNS
+ */
+#define STATE_MESSAGE_COLUMNS "seen_flag, answered_flag, deleted_flag, flagged_flag, " \
+	"draft_flag, recent_flag, %s, rfcsize, seq, message_idnr"
+
+static MessageInfo * state_message_row(ResultSet_T r)
+{
+	unsigned j;
+	const char *query_result;
+	MessageInfo *result;
+
+	result = g_new0(MessageInfo,1);
+
+	/* id */
+	result->uid = db_result_get_u64(r,IMAP_NFLAGS + 3);
+
+	/* flags */
+	for (j = 0; j < IMAP_NFLAGS; j++)
+		result->flags[j] = db_result_get_bool(r,j);
+
+	/* internal date */
+	query_result = db_result_get(r,IMAP_NFLAGS);
+	strncpy(result->internaldate,
+			(query_result) ? query_result :
+			"01-Jan-1970 00:00:01 +0100",
+			IMAP_INTERNALDATE_LEN-1);
+
+	/* rfcsize */
+	result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
+
+	result->seq = db_result_get_u64(r,IMAP_NFLAGS + 2);
+
+	return result;
+}
+
 static T state_load_messages(T M, Connection_T c)
 {
-	unsigned nrows = 0, i = 0, j;
-	const char *query_result, *keyword;
+	unsigned nrows = 0, i = 0;
+	const char *keyword;
 	MessageInfo *result;
 	GTree *msginfo;
-	uint64_t *uid, id = 0;
+	uint64_t id = 0;
 	ResultSet_T r;
 	PreparedStatement_T stmt;
 	Field_T frag;
@@ -95,13 +164,12 @@ static T state_load_messages(T M, Connection_T c)
 
 	date2char_str("internal_date", &frag);
 	snprintf(query, DEF_QUERYSIZE-1,
-			"SELECT seen_flag, answered_flag, deleted_flag, flagged_flag, "
-			"draft_flag, recent_flag, %s, rfcsize, seq, message_idnr FROM %smessages m "
+			"SELECT " STATE_MESSAGE_COLUMNS " FROM %smessages m "
 			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
 			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) ORDER BY message_idnr ASC",
 			frag, DBPFX, DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
 
-	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	msginfo = state_msginfo_new();
 
 	stmt = db_stmt_prepare(c, query);
 	db_stmt_set_u64(stmt, 1, M->id);
@@ -111,35 +179,9 @@ static T state_load_messages(T M, Connection_T c)
 	while (db_result_next(r)) {
 		i++;
 
-		id = db_result_get_u64(r,IMAP_NFLAGS + 3);
-
-		uid = g_new0(uint64_t,1); *uid = id;
-
-		result = g_new0(MessageInfo,1);
-
-		/* id */
-		result->uid = id;
-
-		/* mailbox_id */
-		result->mailbox_id = M->id;
-
-		/* flags */
-		for (j = 0; j < IMAP_NFLAGS; j++)
-			result->flags[j] = db_result_get_bool(r,j);
-
-		/* internal date */
-		query_result = db_result_get(r,IMAP_NFLAGS);
-		strncpy(result->internaldate,
-				(query_result) ? query_result :
-				"01-Jan-1970 00:00:01 +0100",
-				IMAP_INTERNALDATE_LEN-1);
+		result = state_message_row(r);
 
-		/* rfcsize */
-		result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
-
-		result->seq = db_result_get_u64(r,IMAP_NFLAGS + 2);
-
-		g_tree_insert(msginfo, uid, result); 
+		g_tree_insert(msginfo, &result->uid, result); 
 
 	}
 
@@ -179,15 +221,171 @@ static T state_load_messages(T M, Connection_T c)
 	return M;
 }
 
+static gboolean _copy_msginfo(uint64_t UNUSED *uid, MessageInfo *info, GTree *msginfo)
+{
+	GList *k;
+	MessageInfo *copy = g_new0(MessageInfo,1);
+
+	*copy = *info;
+	copy->keywords = NULL;
+
+	k = g_list_first(info->keywords);
+	while (k) {
+		copy->keywords = g_list_append(copy->keywords, g_strdup((char *)k->data));
+		if (! g_list_next(k)) break;
+		k = g_list_next(k);
+	}
+
+	g_tree_insert(msginfo, &copy->uid, copy);
+	return FALSE;
+}
+
+static gboolean _count_unseen(gpointer UNUSED uid, MessageInfo *info, unsigned *unseen)
+{
+	if (! info->flags[IMAP_FLAG_SEEN])
+		(*unseen)++;
+	return FALSE;
+}
+
+/*
+ * refresh the message list of M starting from the one in OldM
+ *
+ * only messages changed since OldM was loaded (seq) and new
+ * messages (uid) are read. Expunged messages are removed either
+ * through their status or, if the message count doesn't add up,
+ * by checking the list of live uids. 
+ *
+ * returns FALSE if the merged result doesn't match the counters
+ * in M; in that case the caller must do a full load.
+ */
+static gboolean state_load_changes(T M, T OldM, Connection_T c)
+{
+	unsigned changed = 0, unseen = 0;
+	int status;
+	const char *keyword;
+	MessageInfo *result;
+	GTree *msginfo;
+	uint64_t *uid, id = 0;
+	ResultSet_T r;
+	PreparedStatement_T stmt;
+	Field_T frag;
+	INIT_QUERY;
+
+	msginfo = state_msginfo_new();
+	g_tree_foreach(OldM->msginfo, (GTraverseFunc)_copy_msginfo, msginfo);
+
+	date2char_str("internal_date", &frag);
+	snprintf(query, DEF_QUERYSIZE-1,
+			"SELECT " STATE_MESSAGE_COLUMNS ", status FROM %smessages m "
+			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
+			"WHERE m.mailbox_idnr = ? AND (m.seq > ? OR m.message_idnr >= ?) "
+			"ORDER BY message_idnr ASC",
+			frag, DBPFX, DBPFX);
+
+	stmt = db_stmt_prepare(c, query);
+	db_stmt_set_u64(stmt, 1, M->id);
+	db_stmt_set_u64(stmt, 2, OldM->seq);
+	db_stmt_set_u64(stmt, 3, OldM->uidnext);
+	r = db_stmt_query(stmt);
+
+	while (db_result_next(r)) {
+		status = db_result_get_int(r, IMAP_NFLAGS + 4);
+		id = db_result_get_u64(r, IMAP_NFLAGS + 3);
+
+		if (status != MESSAGE_STATUS_NEW && status != MESSAGE_STATUS_SEEN) {
+			// tombstone
+			g_tree_remove(msginfo, &id);
+			continue;
+		}
+
+		changed++;
+		result = state_message_row(r);
+		g_tree_replace(msginfo, &result->uid, result);
+	}
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] seq [%" PRIu64 "] -> [%" PRIu64 "] changed [%u]",
+			M->id, OldM->seq, M->seq, changed);
+
+	if (changed) {
+		db_con_clear(c);
+
+		memset(query,0,sizeof(query));
+		snprintf(query, DEF_QUERYSIZE-1,
+			"SELECT k.message_idnr, keyword FROM %skeywords k "
+			"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
+			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) "
+			"AND (m.seq > ? OR m.message_idnr >= ?)",
+			DBPFX, DBPFX,
+			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+
+		stmt = db_stmt_prepare(c, query);
+		db_stmt_set_u64(stmt, 1, M->id);
+		db_stmt_set_u64(stmt, 2, OldM->seq);
+		db_stmt_set_u64(stmt, 3, OldM->uidnext);
+		r = db_stmt_query(stmt);
+
+		while (db_result_next(r)) {
+			id = db_result_get_u64(r,0);
+			keyword = db_result_get(r,1);
+			if ((result = g_tree_lookup(msginfo, &id)) != NULL)
+				result->keywords = g_list_append(result->keywords, g_strdup(keyword));
+		}
+	}
+
+	if ((unsigned)g_tree_nnodes(msginfo) != M->exists) {
+		// expunged messages don't get a new seq: drop every
+		// uid that is no longer live in the database
+		GTree *live = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, (GDestroyNotify)g_free, NULL);
+		GList *ids;
+
+		db_con_clear(c);
+		stmt = db_stmt_prepare(c,
+				"SELECT message_idnr FROM %smessages "
+				"WHERE mailbox_idnr = ? AND status IN (%d,%d)",
+				DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+		db_stmt_set_u64(stmt, 1, M->id);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = g_new0(uint64_t,1);
+			*uid = db_result_get_u64(r, 0);
+			g_tree_insert(live, uid, uid);
+		}
+
+		ids = g_tree_keys(msginfo);
+		ids = g_list_first(ids);
+		while (ids) {
+			id = *(uint64_t *)ids->data;
+			if (! g_tree_lookup(live, &id))
+				g_tree_remove(msginfo, &id);
+			if (! g_list_next(ids)) break;
+			ids = g_list_next(ids);
+		}
+		g_list_free(g_list_first(ids));
+		g_tree_destroy(live);
+	}
+
+	g_tree_foreach(msginfo, (GTraverseFunc)_count_unseen, &unseen);
+
+	if (((unsigned)g_tree_nnodes(msginfo) != M->exists) || (unseen != M->unseen)) {
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] exists [%d/%u] unseen [%u/%u] mismatch",
+				M->id, g_tree_nnodes(msginfo), M->exists, unseen, M->unseen);
+		g_tree_destroy(msginfo);
+		return FALSE;
+	}
+
+	MailboxState_setMsginfo(M, msginfo);
+
+	return TRUE;
+}
+
 gboolean _compare_data(gconstpointer a, gconstpointer b, gpointer UNUSED data)
 {
 	return strcmp((const char *)a,(const char *)b);
 }
 
-T MailboxState_new(Mempool_T pool, uint64_t id)
+static T state_new(Mempool_T pool, uint64_t id)
 {
-	T M; Connection_T c;
-	volatile int t = DM_SUCCESS;
+	T M;
 	gboolean freepool = FALSE;
 
 	if (! pool) {
@@ -205,6 +403,18 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
 	M->keywords     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
 
+	return M;
+}
+
+T MailboxState_new(Mempool_T pool, uint64_t id)
+{
+	T M; Connection_T c;
+	volatile int t = DM_SUCCESS;
+
+	M = state_new(pool, id);
+
+	if (! id) return M;
+
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c); // we need read-committed isolation
@@ -226,32 +436,257 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	return M;
 }
 
-void MailboxState_remap(T M)
+static T state_clone(Mempool_T pool, T S)
 {
-	GList *ids = NULL;
-	uint64_t *uid, *msn = NULL, rows = 1;
-	MessageInfo *msginfo;
+	T M = state_new(pool, S->id);
+
+	M->uidnext = S->uidnext;
+	M->owner_id = S->owner_id;
+	M->seq = S->seq;
+	M->no_select = S->no_select;
+	M->no_children = S->no_children;
+	M->no_inferiors = S->no_inferiors;
+	M->recent = S->recent;
+	M->exists = S->exists;
+	M->unseen = S->unseen;
+	M->permission = S->permission;
+	M->is_subscribed = S->is_subscribed;
+	M->is_public = S->is_public;
+	M->is_users = S->is_users;
+	M->is_inbox = S->is_inbox;
+
+	if (S->name)
+		MailboxState_setName(M, p_string_str(S->name));
+
+	if (S->keywords) {
+		GList *k = g_tree_keys(S->keywords);
+		k = g_list_first(k);
+		while (k) {
+			MailboxState_addKeyword(M, (const char *)k->data);
+			if (! g_list_next(k)) break;
+			k = g_list_next(k);
+		}
+		g_list_free(g_list_first(k));
+	}
 
-	MailboxState_uid_msn_new(M);
+	if (S->msginfo) {
+		GTree *msginfo = state_msginfo_new();
+		g_tree_foreach(S->msginfo, (GTraverseFunc)_copy_msginfo, msginfo);
+		MailboxState_setMsginfo(M, msginfo);
+	}
+
+	return M;
+}
+
+static void state_snapshot_release(StateSnapshot *s)
+{
+	if (--s->refs > 0)
+		return;
+	MailboxState_free(&s->state);
+	g_free(s);
+}
+
+static gboolean _oldest_snapshot(uint64_t *id, StateSnapshot *s, uint64_t **oldest)
+{
+	StateSnapshot *o;
+	if (! *oldest) {
+		*oldest = id;
+		return FALSE;
+	}
+	o = g_tree_lookup(state_cache, *oldest);
+	if (s->atime < o->atime)
+		*oldest = id;
+	return FALSE;
+}
+
+/*
+ * add or replace the snapshot for a mailbox. Caller must hold the lock.
+ *
+ * returns the new snapshot with a reference for the caller, or NULL
+ * if the cache already holds a snapshot that is at least as recent
+ */
+static StateSnapshot * state_cache_store(T S)
+{
+	StateSnapshot *s, *old;
+	uint64_t *id;
+
+	if ((old = g_tree_lookup(state_cache, &S->id)) && (old->state->seq >= S->seq))
+		return NULL;
+
+	while (g_tree_nnodes(state_cache) >= state_cache_size) {
+		uint64_t *oldest = NULL;
+		g_tree_foreach(state_cache, (GTraverseFunc)_oldest_snapshot, &oldest);
+		if (! oldest) break;
+		g_tree_remove(state_cache, oldest);
+	}
+
+	s = g_new0(StateSnapshot, 1);
+	s->state = S;
+	s->atime = time(NULL);
+	s->refs = 2; // the cache and the caller
+
+	id = g_new0(uint64_t, 1);
+	*id = S->id;
+	g_tree_replace(state_cache, id, s);
+
+	return s;
+}
+
+static uint64_t state_current_seq(uint64_t id)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T stmt;
+	volatile uint64_t seq = 0;
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
+		db_stmt_set_u64(stmt, 1, id);
+		r = db_stmt_query(stmt);
+		if (db_result_next(r))
+			seq = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return seq;
+}
+
+T MailboxState_lookup(Mempool_T pool, uint64_t id)
+{
+	T M, S = NULL;
+	StateSnapshot *s;
+	uint64_t seq;
+
+	PLOCK(state_cache_lock);
+	if (state_cache_size < 0) {
+		Field_T val;
+		state_cache_size = STATE_CACHE_SIZE;
+		config_get_value("state_cache_size", "IMAP", val);
+		if (strlen(val))
+			state_cache_size = atoi(val);
+		if (state_cache_size > 0)
+			state_cache = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,
+					(GDestroyNotify)g_free, (GDestroyNotify)state_snapshot_release);
+		TRACE(TRACE_DEBUG, "shared mailbox state cache size [%d]", state_cache_size);
+	}
+	PUNLOCK(state_cache_lock);
+
+	if (state_cache_size <= 0)
+		return MailboxState_new(pool, id);
+
+	seq = state_current_seq(id);
+
+	PLOCK(state_cache_lock);
+	if ((s = g_tree_lookup(state_cache, &id))) {
+		s->refs++;
+		s->atime = time(NULL);
+	}
+	PUNLOCK(state_cache_lock);
+
+	if (s && s->state->seq == seq) {
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] shared state hit seq [%" PRIu64 "]", id, seq);
+		M = state_clone(pool, s->state);
+		PLOCK(state_cache_lock);
+		state_snapshot_release(s);
+		PUNLOCK(state_cache_lock);
+		return M;
+	}
 
-	ids = g_tree_keys(M->msginfo);
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = (uint64_t *)ids->data;
+	// missing or stale: load a new snapshot
+	if (s) {
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] shared state stale seq [%" PRIu64 "] -> [%" PRIu64 "]",
+				id, s->state->seq, seq);
+		S = MailboxState_update(NULL, s->state);
+		PLOCK(state_cache_lock);
+		state_snapshot_release(s);
+		PUNLOCK(state_cache_lock);
+	} else {
+		S = MailboxState_new(NULL, id);
+	}
 
-		msginfo = g_tree_lookup(M->msginfo, uid);
+	if (! S)
+		return NULL;
 
-		msn = g_new0(uint64_t,1);
-		*msn = msginfo->msn = rows++;
+	PLOCK(state_cache_lock);
+	s = state_cache_store(S);
+	PUNLOCK(state_cache_lock);
 
-		g_tree_insert(M->ids, uid, msn);
-		g_tree_insert(M->msn, msn, uid);
+	M = state_clone(pool, S);
 
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+	if (s) {
+		PLOCK(state_cache_lock);
+		state_snapshot_release(s);
+		PUNLOCK(state_cache_lock);
+	} else {
+		// another session stored a newer snapshot meanwhile
+		MailboxState_free(&S);
 	}
 
-	g_list_free(g_list_first(ids));
+	return M;
+}
+
+T MailboxState_update(Mempool_T pool, T OldM)
+{
+	T M; Connection_T c;
+	volatile int t = DM_SUCCESS;
+
+	if (! (OldM->msginfo && OldM->seq && OldM->uidnext))
+		return MailboxState_new(pool, OldM->id);
+
+	M = state_new(pool, OldM->id);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c); // we need read-committed isolation
+		state_load_metadata(M, c);
+		if (! state_load_changes(M, OldM, c)) {
+			db_con_clear(c);
+			state_load_messages(M, c);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_commit_transaction(c);
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		TRACE(TRACE_ERR, "Error updating mailbox");
+		MailboxState_free(&M);
+	}
+
+	return M;
+}
+
+struct remap_helper {
+	T M;
+	uint64_t rows;
+};
+
+static gboolean _remap(uint64_t *uid, MessageInfo *msginfo, struct remap_helper *h)
+{
+	msginfo->msn = ++h->rows;
+	g_tree_insert(h->M->ids, uid, &msginfo->msn);
+	g_tree_insert(h->M->msn, &msginfo->msn, uid);
+	return FALSE;
+}
+
+/*
+ * rebuild the uid/msn maps. Both point into the MessageInfo
+ * records, which own the uid and msn values.
+ */
+void MailboxState_remap(T M)
+{
+	struct remap_helper h;
+
+	h.M = M;
+	h.rows = 0;
+
+	MailboxState_uid_msn_new(M);
+	g_tree_foreach(M->msginfo, (GTraverseFunc)_remap, &h);
 }
 	
 GTree * MailboxState_getMsginfo(T M)
@@ -269,9 +704,8 @@ static void MailboxState_setMsginfo(T M, GTree *msginfo)
 
 void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *msginfo)
 {
-	uint64_t *id = g_new0(uint64_t,1);
-	*id = uid;
-	g_tree_insert(M->msginfo, id, msginfo); 
+	msginfo->uid = uid;
+	g_tree_replace(M->msginfo, &msginfo->uid, msginfo); 
 	if (msginfo->flags[IMAP_FLAG_RECENT] == 1) {
 		M->seq--; // force resync
 		M->recent++;
@@ -776,83 +1210,96 @@ char * MailboxState_flags(T M)
 	return g_strchomp(s);
 }
 
-int MailboxState_hasPermission(T M, uint64_t userid, const char *right_flag)
+/*
+ * read the rights of the owner, the user and the 'anyone' user in one
+ * query. The owner has all rights unless an ACL restricts them.
+ */
+static int state_load_rights(T M, uint64_t userid, unsigned *rights)
 {
 	PreparedStatement_T stmt;
 	Connection_T c;
        	ResultSet_T r;
-	volatile int result = FALSE;
-	volatile bool owner_acl = false;
-	uint64_t owner_id, mboxid;
-
-	mboxid = MailboxState_getId(M);
-
-	TRACE(TRACE_DEBUG, "checking ACL [%s] for user [%" PRIu64 "] on mailbox [%" PRIu64 "]",
-			right_flag, userid, mboxid);
-
-	/* If we don't know who owns the mailbox, look it up. */
-	owner_id = MailboxState_getOwner(M);
-	if (! owner_id) {
-		result = db_get_mailbox_owner(mboxid, &owner_id);
-		MailboxState_setOwner(M, owner_id);
-		if (! result > 0)
-			return result;
-	}
-
-	if (owner_id == userid) {
-		c = db_con_get();
-		TRY
-			stmt = db_stmt_prepare(c,
-					"SELECT * FROM %sacl WHERE "
-					"user_id = ? AND mailbox_id = ?", 
-					DBPFX);
-			db_stmt_set_u64(stmt, 1, userid);
-			db_stmt_set_u64(stmt, 2, mboxid);
-			r = db_stmt_query(stmt);
-
-			if (db_result_next(r))
-				owner_acl = true;
-		CATCH(SQLException)
-			LOG_SQLERROR;
-			result = DM_EQUERY;
-		FINALLY	
-			db_con_close(c);
-		END_TRY;
-
-		if (! owner_acl) {
-			TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "]"
-					"and no ACL in place. Giving all rights",
-					mboxid, userid);
-			return 1;
-		} else {
-			TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "]"
-					"but ACL in place. Restricted access for owner.",
-					mboxid, userid);
-		}
-
-	}
+	volatile int t = DM_SUCCESS;
+	volatile gboolean owner_acl = FALSE;
+	volatile uint64_t owner_id = 0;
+	volatile unsigned bits = 0;
 
-	result = FALSE;
 	c = db_con_get();
 	TRY
 		stmt = db_stmt_prepare(c,
-			       	"SELECT * FROM %sacl WHERE "
-				"user_id = ? AND mailbox_id = ? AND %s = 1", 
-				DBPFX, right_flag);
+				"SELECT b.owner_idnr, a.user_id, a.lookup_flag, a.read_flag, a.seen_flag, "
+				"a.write_flag, a.insert_flag, a.post_flag, "
+				"a.create_flag, a.delete_flag, a.deleted_flag, a.expunge_flag, a.administer_flag "
+				"FROM %smailboxes b "
+				"LEFT JOIN %sacl a ON a.mailbox_id = b.mailbox_idnr AND (a.user_id = ? "
+				"OR a.user_id IN (SELECT user_idnr FROM %susers WHERE userid = ?)) "
+				"WHERE b.mailbox_idnr = ?",
+				DBPFX, DBPFX, DBPFX);
 		db_stmt_set_u64(stmt, 1, userid);
-		db_stmt_set_u64(stmt, 2, mboxid);
+		db_stmt_set_str(stmt, 2, DBMAIL_ACL_ANYONE_USER);
+		db_stmt_set_u64(stmt, 3, M->id);
 		r = db_stmt_query(stmt);
 
-		if (db_result_next(r))
-			result = TRUE;
+		while (db_result_next(r)) {
+			uint64_t acl_user;
+			int i;
+			owner_id = db_result_get_u64(r, 0);
+			if (! (acl_user = db_result_get_u64(r, 1)))
+				continue; // no ACL at all
+			if (acl_user == userid)
+				owner_acl = TRUE;
+			for (i = ACL_RIGHT_LOOKUP; i < ACL_RIGHT_NONE; i++) {
+				if (db_result_get_bool(r, i + 2))
+					bits |= (1 << i);
+			}
+		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		result = DM_EQUERY;
+		t = DM_EQUERY;
 	FINALLY	
 		db_con_close(c);
 	END_TRY;
 
-	return result;
+	if (t == DM_EQUERY)
+		return t;
+
+	if (owner_id)
+		M->owner_id = owner_id;
+
+	if ((owner_id == userid) && (! owner_acl)) {
+		TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "] "
+				"and no ACL in place. Giving all rights",
+				M->id, userid);
+		bits = (1 << ACL_RIGHT_NONE) - 1;
+	}
+
+	*rights = bits;
+
+	return DM_SUCCESS;
+}
+
+int MailboxState_getRights(T M, uint64_t userid, unsigned *rights)
+{
+	uint64_t version = acl_get_version();
+	int t;
+
+	if ((M->acl_version == version) && (M->acl_seq == M->seq) && (M->acl_user == userid)) {
+		*rights = M->acl_rights;
+		return DM_SUCCESS;
+	}
+
+	if ((t = state_load_rights(M, userid, rights)) != DM_SUCCESS)
+		return t;
+
+	TRACE(TRACE_DEBUG, "user [%" PRIu64 "] mailbox [%" PRIu64 "] rights [%x]",
+			userid, M->id, *rights);
+
+	M->acl_user = userid;
+	M->acl_version = version;
+	M->acl_seq = M->seq;
+	M->acl_rights = *rights;
+
+	return DM_SUCCESS;
 }
 
 int MailboxState_getAcl(T M, uint64_t userid, struct ACLMap *map)
@@ -28,6 +28,18 @@
 typedef struct T *T;
 
 extern T            MailboxState_new(Mempool_T pool, uint64_t id);
+/*
+ * \brief reload a mailbox incrementally
+ * \param pool memory pool for the new state
+ * \param M state to start from; left untouched
+ * \return new state with all changes since M merged in
+ */
+extern T            MailboxState_update(Mempool_T pool, T M);
+/*
+ * \brief get a private copy of a mailbox from the process-wide
+ * cache of mailbox snapshots, loading it if missing or stale
+ */
+extern T            MailboxState_lookup(Mempool_T pool, uint64_t id);
 
 extern int          MailboxState_info(T);
 extern int          MailboxState_count(T);
@@ -79,9 +91,12 @@ extern GList *      MailboxState_message_flags(T, MessageInfo *);
 extern void         MailboxState_free(T *);
 
 /**
- * \brief check if a user has a certain right to a mailbox
+ * \brief get the rights of a user on a mailbox, including those
+ * granted to anyone, as a bitmask of (1 << ACLRight). The result is
+ * kept until the ACL version changes or another user is checked.
+ * \return DM_SUCCESS or DM_EQUERY
  */
-extern int MailboxState_hasPermission(T, uint64_t user_idnr, const char *right_flag);
+extern int MailboxState_getRights(T, uint64_t user_idnr, unsigned *rights);
 /**
  * \brief get all permissions on a mailbox for a user
  * 
@@ -0,0 +1,432 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include "dm_mailboxwatch.h"
+
+#define THIS_MODULE "MailboxWatch"
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+#define WATCH_INTERVAL 30
+#define WATCH_SLICE 100
+
+typedef struct {
+	gpointer session;
+	gpointer reactor;  // event loop the session is pinned to
+} Watcher_T;
+
+typedef struct {
+	uint64_t id;
+	uint64_t seq;      // last seq seen for this mailbox
+	GList *sessions;   // Watcher_T waiting for changes
+} Watch_T;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t watch_thread;
+
+static gboolean watch_started = FALSE;
+static volatile gboolean watch_running = FALSE;
+static int watch_interval = WATCH_INTERVAL;
+static void (*watch_notify)(gpointer) = NULL;
+
+static GTree *watches = NULL; // mailbox_id -> Watch_T
+static GHashTable *pending = NULL; // reactor -> changed mailbox_ids not yet dispatched
+
+static void watch_free(Watch_T *w)
+{
+	GList *s = g_list_first(w->sessions);
+	while (s) {
+		g_free(s->data);
+		if (! g_list_next(s)) break;
+		s = g_list_next(s);
+	}
+	g_list_free(g_list_first(w->sessions));
+	g_free(w);
+}
+
+static GTree * watch_pending_new(void)
+{
+	return g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+}
+
+/*
+ * mark a mailbox as changed for every reactor that has sessions
+ * watching it. Caller must hold the lock.
+ *
+ * returns the reactors the caller must schedule a drain for
+ */
+static GList * watch_pending_add(Watch_T *w)
+{
+	GList *s, *wake = NULL;
+	uint64_t *id;
+
+	s = g_list_first(w->sessions);
+	while (s) {
+		Watcher_T *W = (Watcher_T *)s->data;
+		GTree *changed = g_hash_table_lookup(pending, W->reactor);
+
+		if (! changed) {
+			changed = watch_pending_new();
+			g_hash_table_insert(pending, W->reactor, changed);
+		}
+		if (! g_tree_lookup(changed, &w->id)) {
+			if (g_tree_nnodes(changed) == 0)
+				wake = g_list_prepend(wake, W->reactor);
+			id = g_new0(uint64_t, 1);
+			*id = w->id;
+			g_tree_insert(changed, id, id);
+		}
+
+		if (! g_list_next(s)) break;
+		s = g_list_next(s);
+	}
+
+	return wake;
+}
+
+typedef struct {
+	gpointer reactor;
+	GList *sessions;
+} Collect_T;
+
+static gboolean _collect_sessions(uint64_t *id, gpointer UNUSED value, Collect_T *C)
+{
+	GList *s;
+	Watch_T *w = g_tree_lookup(watches, id);
+
+	if (! w)
+		return FALSE;
+
+	s = g_list_first(w->sessions);
+	while (s) {
+		Watcher_T *W = (Watcher_T *)s->data;
+		if (W->reactor == C->reactor)
+			C->sessions = g_list_prepend(C->sessions, W->session);
+		if (! g_list_next(s)) break;
+		s = g_list_next(s);
+	}
+	return FALSE;
+}
+
+/*
+ * event loop thread: wake up the sessions of this reactor
+ * watching the changed mailboxes
+ */
+static void watch_drain(gpointer UNUSED data)
+{
+	GTree *changed;
+	GList *sessions;
+	Collect_T C;
+
+	C.reactor = dm_reactor_current();
+	C.sessions = NULL;
+
+	PLOCK(watch_lock);
+	if (! (pending && (changed = g_hash_table_lookup(pending, C.reactor)))) {
+		PUNLOCK(watch_lock);
+		return;
+	}
+	g_hash_table_steal(pending, C.reactor);
+	g_hash_table_insert(pending, C.reactor, watch_pending_new());
+	g_tree_foreach(changed, (GTraverseFunc)_collect_sessions, &C);
+	PUNLOCK(watch_lock);
+
+	sessions = C.sessions;
+
+	TRACE(TRACE_DEBUG, "[%d] mailboxes changed, notify [%u] sessions",
+			g_tree_nnodes(changed), g_list_length(sessions));
+	g_tree_destroy(changed);
+
+	sessions = g_list_first(sessions);
+	while (sessions) {
+		watch_notify(sessions->data);
+		if (! g_list_next(sessions)) break;
+		sessions = g_list_next(sessions);
+	}
+	g_list_free(g_list_first(sessions));
+}
+
+/*
+ * schedule a drain on each reactor in the list and free it
+ */
+static void watch_wake(GList *wake)
+{
+	GList *r = g_list_first(wake);
+	while (r) {
+		dm_queue_push_reactor(r->data, watch_drain, NULL, NULL);
+		if (! g_list_next(r)) break;
+		r = g_list_next(r);
+	}
+	g_list_free(g_list_first(wake));
+}
+
+static gboolean _collect_ids(uint64_t *id, Watch_T UNUSED *w, GList **ids)
+{
+	uint64_t *copy = g_new0(uint64_t, 1);
+	*copy = *id;
+	*ids = g_list_prepend(*ids, copy);
+	return FALSE;
+}
+
+/*
+ * watcher thread: fetch the seq for all watched mailboxes in bulk
+ */
+static void watch_poll(GList *ids)
+{
+	Connection_T c; ResultSet_T r;
+	GList *slices, *s;
+	GList * volatile seen = NULL;
+	GList *wake = NULL;
+
+	slices = g_list_slices_u64(ids, WATCH_SLICE);
+
+	c = db_con_get();
+	TRY
+		s = g_list_first(slices);
+		while (s) {
+			r = db_query(c, "SELECT mailbox_idnr, seq FROM %smailboxes "
+					"WHERE mailbox_idnr IN (%s)",
+					DBPFX, (char *)s->data);
+			while (db_result_next(r)) {
+				uint64_t *row = g_new0(uint64_t, 2);
+				row[0] = db_result_get_u64(r, 0);
+				row[1] = db_result_get_u64(r, 1);
+				seen = g_list_prepend(seen, row);
+			}
+			if (! g_list_next(s)) break;
+			s = g_list_next(s);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+		g_list_destroy(slices);
+	END_TRY;
+
+	if (! seen)
+		return;
+
+	PLOCK(watch_lock);
+	s = g_list_first(seen);
+	while (s) {
+		uint64_t *row = (uint64_t *)s->data;
+		Watch_T *w = g_tree_lookup(watches, &row[0]);
+		if (w && w->seq != row[1]) {
+			TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] seq [%" PRIu64 "] -> [%" PRIu64 "]",
+					w->id, w->seq, row[1]);
+			if (w->seq)
+				wake = g_list_concat(wake, watch_pending_add(w));
+			w->seq = row[1];
+		}
+		if (! g_list_next(s)) break;
+		s = g_list_next(s);
+	}
+	PUNLOCK(watch_lock);
+
+	g_list_destroy(seen);
+
+	watch_wake(wake);
+}
+
+static void * watch_loop(void UNUSED *arg)
+{
+	struct timespec deadline;
+	GList *ids;
+
+	TRACE(TRACE_INFO, "watching mailboxes every [%d] seconds", watch_interval);
+
+	PLOCK(watch_lock);
+	while (watch_running) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += watch_interval;
+		pthread_cond_timedwait(&watch_cond, &watch_lock, &deadline);
+
+		if (! watch_running)
+			break;
+
+		ids = NULL;
+		g_tree_foreach(watches, (GTraverseFunc)_collect_ids, &ids);
+		PUNLOCK(watch_lock);
+
+		if (ids) {
+			watch_poll(ids);
+			g_list_destroy(ids);
+		}
+
+		PLOCK(watch_lock);
+	}
+	PUNLOCK(watch_lock);
+
+	return NULL;
+}
+
+void MailboxWatch_start(void (*notify)(gpointer))
+{
+	Field_T val;
+	int interval;
+
+	// called for every new connection, from any reactor
+	PLOCK(watch_lock);
+	if (watch_started) {
+		PUNLOCK(watch_lock);
+		return;
+	}
+	watch_started = TRUE;
+
+	config_get_value("idle_notify", "IMAP", val);
+	if (MATCH(val, "no")) {
+		PUNLOCK(watch_lock);
+		TRACE(TRACE_INFO, "mailbox change notification disabled");
+		return;
+	}
+
+	config_get_value("idle_timeout", "IMAP", val);
+	if (strlen(val) && (interval = atoi(val)) > 0)
+		watch_interval = interval;
+
+	watch_notify = notify;
+	watches = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)watch_free);
+	pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_tree_destroy);
+
+	watch_running = TRUE;
+	if (pthread_create(&watch_thread, NULL, watch_loop, NULL)) {
+		TRACE(TRACE_ERR, "unable to start mailbox watcher: %s", strerror(errno));
+		watch_running = FALSE;
+		g_tree_destroy(watches);
+		watches = NULL;
+		g_hash_table_destroy(pending);
+		pending = NULL;
+	}
+	PUNLOCK(watch_lock);
+}
+
+void MailboxWatch_stop(void)
+{
+	if (! watch_running)
+		return;
+
+	PLOCK(watch_lock);
+	watch_running = FALSE;
+	pthread_cond_signal(&watch_cond);
+	PUNLOCK(watch_lock);
+
+	pthread_join(watch_thread, NULL);
+
+	PLOCK(watch_lock);
+	g_tree_destroy(watches);
+	watches = NULL;
+	g_hash_table_destroy(pending);
+	pending = NULL;
+	PUNLOCK(watch_lock);
+}
+
+gboolean MailboxWatch_running(void)
+{
+	return watch_running;
+}
+
+static GList * watch_find(Watch_T *w, gpointer session)
+{
+	GList *s = g_list_first(w->sessions);
+	while (s) {
+		if (((Watcher_T *)s->data)->session == session)
+			return s;
+		if (! g_list_next(s)) break;
+		s = g_list_next(s);
+	}
+	return NULL;
+}
+
+void MailboxWatch_add(uint64_t mailbox_id, uint64_t seq, gpointer session)
+{
+	Watch_T *w;
+	GList *wake = NULL;
+	gboolean changed = FALSE;
+
+	if (! watch_running)
+		return;
+
+	PLOCK(watch_lock);
+	if (! (w = g_tree_lookup(watches, &mailbox_id))) {
+		w = g_new0(Watch_T, 1);
+		w->id = mailbox_id;
+		w->seq = seq;
+		g_tree_insert(watches, &w->id, w);
+	} else if (seq && w->seq > seq) {
+		// mailbox changed since the session last looked
+		changed = TRUE;
+	}
+	if (! watch_find(w, session)) {
+		Watcher_T *W = g_new0(Watcher_T, 1);
+		W->session = session;
+		W->reactor = dm_reactor_current();
+		w->sessions = g_list_prepend(w->sessions, W);
+	}
+	if (changed)
+		wake = watch_pending_add(w);
+	PUNLOCK(watch_lock);
+
+	TRACE(TRACE_DEBUG, "[%p] watch mailbox [%" PRIu64 "] seq [%" PRIu64 "]",
+			session, mailbox_id, seq);
+
+	watch_wake(wake);
+}
+
+void MailboxWatch_remove(uint64_t mailbox_id, gpointer session)
+{
+	Watch_T *w;
+	GList *s;
+
+	if (! watch_running)
+		return;
+
+	PLOCK(watch_lock);
+	if ((w = g_tree_lookup(watches, &mailbox_id))) {
+		if ((s = watch_find(w, session))) {
+			g_free(s->data);
+			w->sessions = g_list_delete_link(w->sessions, s);
+		}
+		if (! w->sessions)
+			g_tree_remove(watches, &mailbox_id);
+	}
+	PUNLOCK(watch_lock);
+}
+
+void MailboxWatch_publish(uint64_t mailbox_id, uint64_t seq)
+{
+	Watch_T *w;
+	GList *wake = NULL;
+
+	if (! watch_running)
+		return;
+
+	PLOCK(watch_lock);
+	if ((w = g_tree_lookup(watches, &mailbox_id))) {
+		if (seq > w->seq)
+			w->seq = seq;
+		wake = watch_pending_add(w);
+	}
+	PUNLOCK(watch_lock);
+
+	watch_wake(wake);
+}
@@ -0,0 +1,63 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * mailbox change notification
+ *
+ * A single watcher thread per process polls the seq column of all
+ * mailboxes that have IDLE sessions attached in one bulk query.
+ * Sessions are only woken up when the mailbox they are watching
+ * actually changed.
+ */
+
+#ifndef DM_MAILBOXWATCH_H
+#define DM_MAILBOXWATCH_H
+
+#include "dbmail.h"
+
+/*
+ * \brief start the watcher thread
+ * \param notify callback run in the event loop of the reactor
+ *        that owns the session, for every session watching a
+ *        mailbox that changed
+ *
+ * safe to call more than once; only the first call has effect.
+ */
+extern void     MailboxWatch_start(void (*notify)(gpointer));
+extern void     MailboxWatch_stop(void);
+extern gboolean MailboxWatch_running(void);
+
+/*
+ * \brief attach a session to a mailbox
+ * \param mailbox_id mailbox to watch
+ * \param seq mailbox seq as last seen by the session
+ * \param session opaque pointer passed to the notify callback
+ *
+ * must be called from the session's reactor or one of its workers
+ */
+extern void     MailboxWatch_add(uint64_t mailbox_id, uint64_t seq, gpointer session);
+extern void     MailboxWatch_remove(uint64_t mailbox_id, gpointer session);
+
+/*
+ * \brief signal a change to a mailbox from within this process
+ */
+extern void     MailboxWatch_publish(uint64_t mailbox_id, uint64_t seq);
+
+#endif
@@ -23,6 +23,9 @@
  */
 
 #include "dbmail.h"
+#include "dm_headercache.h"
+#include "dm_headerqueue.h"
+#include "dm_fulltext.h"
 
 extern DBParam_T db_params;
 #define DBPFX db_params.pfx
@@ -46,15 +49,9 @@ extern DBParam_T db_params;
 
 static void _header_cache(const char *, const char *, gpointer);
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id);
-static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id);
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id);
-
 static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template);
-static int _message_insert(DbmailMessage *self, 
-		uint64_t user_idnr, 
-		const char *mailbox, 
-		const char *unique_id); 
+static int _message_insert(DbmailMessage *self);
+static void targets_clear(DbmailMessage *self);
 
 
 /* general mime utils (missing from gmime?) */
@@ -262,6 +259,297 @@ static uint64_t blob_store(const char *buf)
 	return 0;
 }
 
+/*
+ * batched storage of mimeparts
+ *
+ * instead of storing each mimepart as soon as the mime walker
+ * finds it, the parts are queued on the message and written in
+ * a single transaction once the walk is done: one lookup for all
+ * known blobs, inserts for the missing ones and a multi-row insert
+ * into the partlists table.
+ */
+
+#define MIMEPART_BATCH 64
+
+typedef struct {
+	char *data;
+	size_t size;
+	char *hash;
+	uint64_t id;
+	gboolean is_header;
+	int part_key;
+	int part_depth;
+	int part_order;
+} MimePart_T;
+
+static void mimepart_free(MimePart_T *part)
+{
+	g_free(part->data);
+	g_free(part->hash);
+	g_free(part);
+}
+
+static void mimeparts_clear(DbmailMessage *m)
+{
+	GList *l = g_list_first(m->mimeparts);
+	while (l) {
+		mimepart_free((MimePart_T *)l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_list_free(g_list_first(m->mimeparts));
+	m->mimeparts = NULL;
+}
+
+static int mimepart_queue(DbmailMessage *m, const char *buf, gboolean is_header)
+{
+	MimePart_T *part;
+	char hash[FIELDSIZE];
+
+	memset(hash, 0, sizeof(hash));
+	if (dm_get_hash_for_string(buf, hash))
+		return DM_EQUERY;
+
+	if (m->part_depth > MAX_MIME_DEPTH) {
+		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed limit. You should recompile "
+				"with CFLAGS+=-DMAX_MIME_DEPTH=<int> where <int> greater than [%d]",
+				m->part_depth);
+	}
+
+	part = g_new0(MimePart_T, 1);
+	part->data = g_strdup(buf);
+	part->size = strlen(buf);
+	part->hash = g_strdup(hash);
+	part->is_header = is_header;
+	part->part_key = m->part_key;
+	part->part_depth = m->part_depth;
+	part->part_order = m->part_order;
+
+	m->mimeparts = g_list_prepend(m->mimeparts, part);
+
+	return DM_SUCCESS;
+}
+
+/* assign id to all queued parts with the same content */
+static void mimeparts_set_id(GList *parts, const char *data, size_t size, uint64_t id)
+{
+	parts = g_list_first(parts);
+	while (parts) {
+		MimePart_T *part = (MimePart_T *)parts->data;
+		if ((! part->id) && (part->size == size) && (memcmp(part->data, data, size) == 0))
+			part->id = id;
+		if (! g_list_next(parts)) break;
+		parts = g_list_next(parts);
+	}
+}
+
+/*
+ * match the queued parts against the stored blobs. The blobs are
+ * compared by the database, so existing parts are never fetched.
+ */
+static void mimeparts_lookup(Connection_T c, GHashTable *byhash, GList *hashes)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	GString *q = g_string_new("");
+	MimePart_T **match;
+	char blob_cmp[DEF_FRAGSIZE];
+	int i, count = g_list_length(hashes);
+
+	memset(blob_cmp, 0, sizeof(blob_cmp));
+	snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
+
+	for (i = 0; i < count; i++)
+		g_string_append_printf(q, "%sSELECT id, %d FROM %smimeparts "
+				"WHERE hash=? AND %ssize%s=? AND %s",
+				i ? " UNION ALL " : "", i, DBPFX,
+				db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
+				blob_cmp);
+
+	s = db_stmt_prepare(c, "%s", q->str);
+	match = g_new0(MimePart_T *, count);
+	i = 0;
+	hashes = g_list_first(hashes);
+	while (hashes) {
+		GList *parts = g_hash_table_lookup(byhash, (const char *)hashes->data);
+		MimePart_T *part = (MimePart_T *)parts->data;
+		match[i] = part;
+		db_stmt_set_str(s, (i * 3) + 1, part->hash);
+		db_stmt_set_u64(s, (i * 3) + 2, part->size);
+		db_stmt_set_blob(s, (i * 3) + 3, part->data, part->size);
+		i++;
+		if (! g_list_next(hashes)) break;
+		hashes = g_list_next(hashes);
+	}
+
+	r = db_stmt_query(s);
+	while (db_result_next(r)) {
+		uint64_t id = db_result_get_u64(r, 0);
+		MimePart_T *part;
+		i = db_result_get_int(r, 1);
+		if ((i < 0) || (i >= count))
+			continue;
+		part = match[i];
+		mimeparts_set_id(g_hash_table_lookup(byhash, part->hash), part->data, part->size, id);
+	}
+
+	g_free(match);
+	g_string_free(q, TRUE);
+}
+
+static void mimeparts_insert(Connection_T c, GHashTable *byhash, GList *parts)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	char *frag = db_returning("id");
+
+	s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s", 
+			DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
+	g_free(frag);
+
+	parts = g_list_first(parts);
+	while (parts) {
+		MimePart_T *part = (MimePart_T *)parts->data;
+		if (! part->id) {
+			uint64_t id;
+			db_stmt_set_str(s, 1, part->hash);
+			db_stmt_set_blob(s, 2, part->data, part->size);
+			db_stmt_set_int(s, 3, part->size);
+			r = db_stmt_query(s);
+			id = db_insert_result(c, r);
+			TRACE(TRACE_DEBUG,"inserted id [%" PRIu64 "]", id);
+			/* identical parts within this message share the new blob */
+			mimeparts_set_id(g_hash_table_lookup(byhash, part->hash), part->data, part->size, id);
+		}
+		if (! g_list_next(parts)) break;
+		parts = g_list_next(parts);
+	}
+}
+
+static void mimeparts_register(Connection_T c, uint64_t physid, GList *parts)
+{
+	GString *q = g_string_new("");
+	int rows = 0;
+
+	parts = g_list_first(parts);
+	while (parts) {
+		MimePart_T *part = (MimePart_T *)parts->data;
+		if (rows == 0)
+			g_string_printf(q, "INSERT INTO %spartlists "
+					"(physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
+					"VALUES ", DBPFX);
+		g_string_append_printf(q, "%s(%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")",
+				rows ? "," : "", physid, part->is_header, part->part_key,
+				part->part_depth, part->part_order, part->id);
+		rows++;
+
+		if ((rows == MIMEPART_BATCH) || (! g_list_next(parts))) {
+			db_exec(c, "%s", q->str);
+			rows = 0;
+		}
+		if (! g_list_next(parts)) break;
+		parts = g_list_next(parts);
+	}
+
+	g_string_free(q, TRUE);
+}
+
+/*
+ * a failure to index is not fatal: the parts are still found by
+ * SEARCH, and are indexed later by dbmail-util
+ */
+static void mimeparts_index(GList *mimeparts)
+{
+	GList *l, *parts = NULL;
+
+	l = g_list_first(mimeparts);
+	while (l) {
+		MimePart_T *part = (MimePart_T *)l->data;
+		FullTextPart_T *fpart = g_new0(FullTextPart_T, 1);
+		fpart->id = part->id;
+		fpart->is_header = part->is_header;
+		fpart->data = part->data;
+		parts = g_list_prepend(parts, fpart);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	parts = g_list_reverse(parts);
+	if (FullText_store(parts) != DM_SUCCESS)
+		TRACE(TRACE_WARNING, "failed to index mimeparts");
+
+	g_list_destroy(parts);
+}
+
+static int mimeparts_flush(DbmailMessage *m)
+{
+	Connection_T c;
+	GHashTable *byhash;
+	GList *parts, *hashes = NULL;
+	volatile int t = DM_SUCCESS;
+
+	if (! m->mimeparts)
+		return DM_SUCCESS;
+
+	m->mimeparts = g_list_reverse(m->mimeparts);
+
+	/* group the queued parts by hash */
+	byhash = g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, NULL,
+			(GDestroyNotify)g_list_free);
+	parts = g_list_first(m->mimeparts);
+	while (parts) {
+		MimePart_T *part = (MimePart_T *)parts->data;
+		GList *same = g_hash_table_lookup(byhash, part->hash);
+		if (same) {
+			same = g_list_append(same, part);
+		} else {
+			hashes = g_list_append(hashes, part->hash);
+			g_hash_table_insert(byhash, part->hash, g_list_append(NULL, part));
+		}
+		if (! g_list_next(parts)) break;
+		parts = g_list_next(parts);
+	}
+
+	c = db_con_get();
+	TRY
+		GList *h, *batch = NULL;
+		int n = 0;
+
+		db_begin_transaction(c);
+
+		/* one lookup per MIMEPART_BATCH distinct hashes */
+		h = g_list_first(hashes);
+		while (h) {
+			batch = g_list_append(batch, h->data);
+			if ((++n == MIMEPART_BATCH) || (! g_list_next(h))) {
+				mimeparts_lookup(c, byhash, batch);
+				g_list_free(batch);
+				batch = NULL;
+				n = 0;
+			}
+			if (! g_list_next(h)) break;
+			h = g_list_next(h);
+		}
+
+		mimeparts_insert(c, byhash, m->mimeparts);
+		mimeparts_register(c, dbmail_message_get_physid(m), m->mimeparts);
+
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_free(g_list_first(hashes));
+	g_hash_table_destroy(byhash);
+
+	if ((t == DM_SUCCESS) && FullText_enabled())
+		mimeparts_index(m->mimeparts);
+
+	return t;
+}
+
 static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 {
 	uint64_t id;
@@ -276,12 +564,17 @@ static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 	dprint("<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n", 
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
-		return DM_EQUERY;
-
-	// register this message fragment
-	if (! register_blob(m, id, is_header))
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		/* no multi-row inserts and no batched lob compares */
+		if (! (id = blob_store(buf)))
+			return DM_EQUERY;
+
+		// register this message fragment
+		if (! register_blob(m, id, is_header))
+			return DM_EQUERY;
+	} else if (mimepart_queue(m, buf, is_header)) {
 		return DM_EQUERY;
+	}
 
 	m->part_order++;
 
@@ -368,12 +661,45 @@ static bool find_boundary(const char *s, char *boundary)
 	return true;
 }
 
-static DbmailMessage * _mime_retrieve(DbmailMessage *self)
+/*
+ * append a fragment to a reassembled message, optionally
+ * converting bare LF line endings to CRLF on the fly
+ */
+static void _mime_append(String_T m, const char *s, size_t l, gboolean crlf)
+{
+	size_t i, start = 0, len;
+	char prev;
+
+	if (! crlf) {
+		p_string_append_len(m, s, l);
+		return;
+	}
+
+	len = p_string_len(m);
+	prev = len ? p_string_str(m)[len-1] : 0;
+
+	for (i = 0; i < l; i++) {
+		if (s[i] == '\n' && prev != '\r') {
+			p_string_append_len(m, s + start, i - start);
+			p_string_append_len(m, "\r", 1);
+			start = i;
+		}
+		prev = s[i];
+	}
+	p_string_append_len(m, s + start, l - start);
+}
+
+#define MIME_APPEND(m, s) _mime_append((m), (s), strlen(s), crlf)
+
+/*
+ * reassemble a message from its mimeparts, interleaving the
+ * multipart boundaries
+ */
+static String_T _mime_assemble(Mempool_T pool, uint64_t physid, gboolean crlf, char *internal_date)
 {
 	PreparedStatement_T stmt;
 	Connection_T c;
        	ResultSet_T r;
-	char internal_date[SQL_INTERNALDATE_LEN];
 	GMimeContentType *mimetype = NULL;
 	int prevdepth, depth = 0, row = 0;
 	volatile int t = FALSE;
@@ -383,15 +709,16 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 	const void *blob;
 	Field_T frag;
 
-	assert(dbmail_message_get_physid(self));
+	assert(physid);
 	date2char_str("ph.internal_date", &frag);
-	n = p_string_new(self->pool, "");
+	n = p_string_new(pool, "");
 	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
 
 	c = db_con_get();
 	TRY
 		char boundary[MAX_MIME_BLEN];
 		char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+		char fence[MAX_MIME_BLEN+8];
 
 		memset(&boundary, 0, sizeof(boundary));
 		memset(&blist, 0, sizeof(blist));
@@ -403,14 +730,15 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 				"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
 				"WHERE l.physmessage_id = ? ORDER BY l.part_key,l.part_order ASC", 
 				frag, p_string_str(n), DBPFX, DBPFX, DBPFX);
-		db_stmt_set_u64(stmt, 1, self->id);
+		db_stmt_set_u64(stmt, 1, physid);
 		r = db_stmt_query(stmt);
 		
-		m = p_string_new(self->pool, "");
+		m = p_string_new(pool, "");
 
 		row = 0;
 		while (db_result_next(r)) {
 			int l;
+			char *str = NULL;
 #if DPRINT
 			int order;
 			int key;
@@ -432,15 +760,19 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 			order		= db_result_get_int(r,2);
 #endif
 			is_header	= db_result_get_bool(r,3);
-			if (row == 0) {
-				memset(internal_date, 0, sizeof(internal_date));
+			if (row == 0 && internal_date) {
+				memset(internal_date, 0, SQL_INTERNALDATE_LEN);
 				g_strlcpy(internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
 			}
 			blob		= db_result_get_blob(r,5,&l);
-			char *str = g_new0(char, l + 1);
-			str = strncpy(str, blob, l);
+			// blobs are handled as strings
+			l = strnlen(blob, l);
 
 			if (is_header) {
+				// only headers are scanned, so only they need a copy
+				str = g_new0(char, l + 1);
+				str = strncpy(str, blob, l);
+
 				prev_boundary = got_boundary;
 				prev_is_message = is_message;
 				if ((mimetype = find_type(str))) {
@@ -459,7 +791,8 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 
 			while ((prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
 				dprint("\n--%s at %d -> %d--\n", blist[prevdepth-1], prevdepth, prevdepth-1);
-				p_string_append_printf(m, "\n--%s--\n", blist[prevdepth-1]);
+				snprintf(fence, sizeof(fence), "\n--%s--\n", blist[prevdepth-1]);
+				MIME_APPEND(m, fence);
 				memset(blist[prevdepth-1], 0, MAX_MIME_BLEN);
 				prevdepth--;
 				finalized=TRUE;
@@ -470,15 +803,16 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 
 			if (is_header && (!prev_header || prev_boundary || (prev_header && depth>0 && !prev_is_message))) {
 				dprint("\n--%s\n", boundary);
-				p_string_append_printf(m, "\n--%s\n", boundary);
+				snprintf(fence, sizeof(fence), "\n--%s\n", boundary);
+				MIME_APPEND(m, fence);
 			}
 
-			p_string_append_printf(m, "%s", str);
-			dprint("<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%s\n</part>\n", 
-				is_header, depth, key, order, str);
+			_mime_append(m, blob, l, crlf);
+			dprint("<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%.*s\n</part>\n", 
+				is_header, depth, key, order, l, (const char *)blob);
 
 			if (is_header)
-				p_string_append_printf(m,"\n");
+				MIME_APPEND(m, "\n");
 			
 			g_free(str);
 			row++;
@@ -486,7 +820,8 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 
 		if (row > 2 && boundary[0] && !finalized) {
 			dprint("\n--%s-- final\n", boundary);
-			p_string_append_printf(m, "\n--%s--\n", boundary);
+			snprintf(fence, sizeof(fence), "\n--%s--\n", boundary);
+			MIME_APPEND(m, fence);
 			finalized=1;
 		}
 
@@ -498,19 +833,37 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 		db_con_close(c);
 	END_TRY;
 
+	p_string_free(n, TRUE);
+
 	if ((row == 0) || (t == DM_EQUERY)) {
 		if (m) p_string_free(m, TRUE);
-		p_string_free(n, TRUE);
 		return NULL;
 	}
 
+	return m;
+}
+
+static DbmailMessage * _mime_retrieve(DbmailMessage *self)
+{
+	char internal_date[SQL_INTERNALDATE_LEN];
+	String_T m;
+
+	assert(dbmail_message_get_physid(self));
+
+	if (! (m = _mime_assemble(self->pool, self->id, FALSE, internal_date)))
+		return NULL;
+
 	self = dbmail_message_init_with_string(self,p_string_str(m));
 	dbmail_message_set_internal_date(self, internal_date);
 	p_string_free(m,TRUE);
-	p_string_free(n,TRUE);
 	return self;
 }
 
+String_T dbmail_message_retrieve_crlf(Mempool_T pool, uint64_t physid)
+{
+	return _mime_assemble(pool, physid, TRUE, NULL);
+}
+
 static gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessage *m);
 
 static int store_head(GMimeObject *object, DbmailMessage *m)
@@ -654,7 +1007,24 @@ gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessa
 
 gboolean dm_message_store(DbmailMessage *m)
 {
-	return store_mime_object(NULL, (GMimeObject *)m->content, m);
+	gboolean r;
+
+	/* nothing is committed if a batched store fails, so a retry
+	 * must start from scratch */
+	if (db_params.db_driver != DM_DRIVER_ORACLE) {
+		m->part_key = 0;
+		m->part_depth = 0;
+		m->part_order = 0;
+		mimeparts_clear(m);
+	}
+
+	r = store_mime_object(NULL, (GMimeObject *)m->content, m);
+	if ((! r) && (mimeparts_flush(m) != DM_SUCCESS))
+		r = TRUE;
+
+	mimeparts_clear(m);
+
+	return r;
 }
 
 
@@ -702,10 +1072,6 @@ DbmailMessage * dbmail_message_new(Mempool_T pool)
 	/* provide quick case-sensitive header value searches */
 	self->header_value = g_tree_new((GCompareFunc)strcmp);
 	
-	/* internal cache: header_dict[headername.name] = headername.id */
-	self->header_dict = g_hash_table_new_full((GHashFunc)g_str_hash,
-			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
-	
 	dbmail_message_set_class(self, DBMAIL_MESSAGE);
 	
 	return self;
@@ -732,8 +1098,9 @@ void dbmail_message_free(DbmailMessage *self)
 		self->crlf = NULL;
 	}
 
+	mimeparts_clear(self);
+	targets_clear(self);
 	p_string_free(self->envelope_recipient,TRUE);
-	g_hash_table_destroy(self->header_dict);
 	g_tree_destroy(self->header_name);
 	g_tree_destroy(self->header_value);
 	
@@ -1105,67 +1472,40 @@ DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
 }
 
 
-/* \brief store a temporary copy of a message.
- * \param 	filled DbmailMessage
- * \return 
- *     - -1 on error
- *     -  1 on success
- */
-static int _update_message(DbmailMessage *self)
-{
-	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
-	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
-
-	assert(size);
-	assert(rfcsize);
-	if (! db_update("UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
-			DBPFX, size, rfcsize, self->id))
-		return DM_EQUERY;
-
-	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
-		return DM_EQUERY;
-
-	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
-		return DM_EQUERY;
-
-	return DM_SUCCESS;
-}
-
 
+/* \brief store a message once, without delivering it to any mailbox.
+ *
+ * The physmessage, its mime-parts and its header cache are stored;
+ * the messages rows are created by dbmail_message_deliver. With
+ * deferred header caching the caches are left to the HeaderQueue.
+ *
+ * These steps are not part of the transaction of db_deliver_targets.
+ * The Sieve sorting and the auto replies of every recipient run between
+ * store and delivery, and may take long. A transaction held across
+ * them would keep the shared mimeparts, headername and headervalue rows
+ * locked and stall concurrent deliveries of messages with the same
+ * parts or headers. Each step is also retried on its own after a lost
+ * race on those shared rows, and on PostgreSQL a failed statement
+ * aborts the whole transaction it is part of. Instead the physmessage
+ * stays pending until db_deliver_targets commits the messages rows and
+ * its sizes together. An undelivered one is deleted by
+ * dbmail_message_deliver, or later by dbmail-util.
+ */
 int dbmail_message_store(DbmailMessage *self)
 {
-	uint64_t user_idnr;
-	char unique_id[UID_SIZE];
 	int res = 0, i = 1, retry = 10, delay = 200;
 	int step = 0;
 	
-	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
-		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
-		return DM_EQUERY;
-	}
-	
-	create_unique_id(unique_id, user_idnr);
-
 	while (i++ < retry) {
 		if (step == 0) {
-			/* create a message record */
-			if(_message_insert(self, user_idnr, DBMAIL_TEMPMBOX, unique_id) < 0) {
+			/* create a physmessage record */
+			if(_message_insert(self) < 0) {
 				usleep(delay*i);
 				continue;
 			}
 			step++;
 		}
 		if (step == 1) {
-			/* update message meta-data and owner quota */
-			if ((res = _update_message(self) < 0)) {
-				usleep(delay*i);
-				continue;
-			}
-			step++;
-		}
-
-		if (step == 2) {
 			/* store the message mime-parts */
 			if ((res = dm_message_store(self))) {
 				TRACE(TRACE_WARNING,"Failed to store mimeparts");
@@ -1175,7 +1515,10 @@ int dbmail_message_store(DbmailMessage *self)
 			step++;
 		}
 
-		if (step == 3) {
+		if (step == 2) {
+			if (HeaderQueue_running())
+				break;
+
 			/* store message headers */
 			if ((res = dbmail_message_cache_headers(self)) < 0) {
 				usleep(delay*i);
@@ -1183,6 +1526,7 @@ int dbmail_message_store(DbmailMessage *self)
 			}
 
 			dbmail_message_cache_envelope(self);
+			dbmail_message_cache_bodystructure(self);
 
 			step++;
 		}
@@ -1194,42 +1538,133 @@ int dbmail_message_store(DbmailMessage *self)
 	return res;
 }
 
-static void insert_physmessage(DbmailMessage *self, Connection_T c)
+void dbmail_message_add_target(DbmailMessage *self, uint64_t user_idnr,
+		uint64_t mailbox_idnr, int *flags, GList *keywords)
 {
-	ResultSet_T r = NULL;
-	char *internal_date = NULL, *frag;
-	int thisyear;
-	volatile uint64_t id = 0;
+	DeliveryTarget_T *T = g_new0(DeliveryTarget_T, 1);
+	int i;
+
+	T->user_idnr = user_idnr;
+	T->mailbox_idnr = mailbox_idnr;
+	T->status = MESSAGE_STATUS_NEW;
+	if (flags) {
+		for (i = 0; i < IMAP_NFLAGS; i++)
+			T->flags[i] = flags[i] ? 1 : 0;
+	}
+	T->flags[IMAP_FLAG_RECENT] = 1;
+
+	keywords = g_list_first(keywords);
+	while (keywords) {
+		T->keywords = g_list_append(T->keywords, g_strdup((char *)keywords->data));
+		if (! g_list_next(keywords)) break;
+		keywords = g_list_next(keywords);
+	}
+
+	self->targets = g_list_append(self->targets, T);
+}
+
+static void targets_clear(DbmailMessage *self)
+{
+	GList *l = g_list_first(self->targets);
+	while (l) {
+		DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+		g_list_destroy(T->keywords);
+		g_free(T);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_list_free(g_list_first(self->targets));
+	self->targets = NULL;
+}
+
+int dbmail_message_deliver_targets(DbmailMessage *self, GList *targets)
+{
+	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
+	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
+	char *internal_date;
 	struct timeval tv;
 	struct tm gmt;
+	int t;
+
+	assert(size);
+	assert(rfcsize);
 
 	/* get the messages date, but override it if it's from the future */
 	gettimeofday(&tv, NULL);
 	localtime_r(&tv.tv_sec, &gmt);
-	thisyear = gmt.tm_year + 1900;
-	internal_date = dbmail_message_get_internal_date(self, thisyear);
+	internal_date = dbmail_message_get_internal_date(self, gmt.tm_year + 1900);
 
-	frag = db_returning("id");
+	t = db_deliver_targets(self->id, size, rfcsize, internal_date, targets);
 
-	if (internal_date != NULL) {
-		Field_T to_date_str;
-		char2date_str(internal_date, &to_date_str);
-		g_free(internal_date);
-		if (db_params.db_driver == DM_DRIVER_ORACLE) 
-			db_exec(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, &to_date_str, frag);
-		else 
-			r = db_query(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, &to_date_str, frag);
-	} else {
-		if (db_params.db_driver == DM_DRIVER_ORACLE) 
-			db_exec(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
-		else
-			r = db_query(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
+	g_free(internal_date);
+
+	return t;
+}
+
+int dbmail_message_deliver(DbmailMessage *self)
+{
+	int t;
+	uint64_t delivered = 0;
+	GList *l;
+
+	assert(self->id);
+
+	if (! self->targets) {
+		db_delete_physmessage(self->id);
+		return DM_SUCCESS;
+	}
+
+	t = dbmail_message_deliver_targets(self, self->targets);
+
+	l = g_list_first(self->targets);
+	while (l) {
+		DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+		switch (T->result) {
+			case DM_SUCCESS:
+				TRACE(TRACE_NOTICE, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] message [%" PRIu64 "] size [%zd] is inserted", 
+						T->user_idnr, T->mailbox_idnr, T->message_idnr,
+						dbmail_message_get_size(self, FALSE));
+				delivered = self->msg_idnr = T->message_idnr;
+			break;
+			case -2:
+				TRACE(TRACE_ERR, "error delivering message to user [%" PRIu64 "], "
+						"maxmail exceeded", T->user_idnr);
+			break;
+			default:
+				TRACE(TRACE_ERR, "error delivering message to user [%" PRIu64 "]", 
+						T->user_idnr);
+			break;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
 	}
 
+	if (! delivered)
+		db_delete_physmessage(self->id);
+	else if (HeaderQueue_running())
+		HeaderQueue_push(self->id);
+
+	return t;
+}
+
+/* The physmessage is created pending: messagesize stays 0 and the
+ * internal_date is the creation time until db_deliver_targets stores
+ * the real values along with the first messages row. */
+static void insert_physmessage(DbmailMessage *self, Connection_T c)
+{
+	ResultSet_T r = NULL;
+	char *frag;
+	volatile uint64_t id = 0;
+
+	frag = db_returning("id");
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE) 
+		db_exec(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
+				DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
+	else
+		r = db_query(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
+				DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
+
 	g_free(frag);	
 
 	if (db_params.db_driver == DM_DRIVER_ORACLE)
@@ -1245,57 +1680,17 @@ static void insert_physmessage(DbmailMessage *self, Connection_T c)
 	}
 }
 
-int _message_insert(DbmailMessage *self, 
-		uint64_t user_idnr, 
-		const char *mailbox, 
-		const char *unique_id)
+static int _message_insert(DbmailMessage *self)
 {
-	uint64_t mailboxid;
-	char *frag = NULL;
-	Connection_T c; ResultSet_T r;
+	Connection_T c;
 	volatile int t = 0;
 
-	assert(unique_id);
-	assert(mailbox);
-
-	if (db_find_create_mailbox(mailbox, BOX_DEFAULT, user_idnr, &mailboxid) == -1)
-		return -1;
-	
-	if (mailboxid == 0) {
-		TRACE(TRACE_ERR, "mailbox [%s] could not be found!", mailbox);
-		return -1;
-	}
-
 	/* insert a new physmessage entry */
-	
-	/* now insert an entry into the messages table */
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
 		insert_physmessage(self, c);
-
-		if (db_params.db_driver == DM_DRIVER_ORACLE) {
-				db_exec(c, "INSERT INTO "
-						"%smessages(mailbox_idnr, physmessage_id, unique_id,"
-						"recent_flag, status) "
-						"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d)",
-						DBPFX, mailboxid, dbmail_message_get_physid(self), unique_id,
-						MESSAGE_STATUS_INSERT);
-				self->msg_idnr = db_get_pk(c, "messages");
-		} else {
-				frag = db_returning("message_idnr");
-				r = db_query(c, "INSERT INTO "
-						"%smessages(mailbox_idnr, physmessage_id, unique_id,"
-						"recent_flag, status) "
-						"VALUES (%" PRIu64 ", %" PRIu64 ", '%s', 1, %d) %s",
-						DBPFX, mailboxid, dbmail_message_get_physid(self), unique_id,
-						MESSAGE_STATUS_INSERT, frag);
-				g_free(frag);
-				self->msg_idnr = db_insert_result(c, r);
-		}
-		TRACE(TRACE_DEBUG,"new message_idnr [%" PRIu64 "]", self->msg_idnr);
-
-		t = DM_SUCCESS;
+		t = self->id ? DM_SUCCESS : DM_EQUERY;
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1309,15 +1704,73 @@ int _message_insert(DbmailMessage *self,
 }
 
 #define CACHE_WIDTH 255
+#define HEADER_BATCH 64
+
+/* a dbmail_header row waiting to be stored */
+typedef struct {
+	char *name;                  // lower-cased
+	char *value;
+	char hash[FIELDSIZE];
+	char sortfield[CACHE_WIDTH];
+	char datefield[CACHE_WIDTH];
+	uint64_t name_id;
+	uint64_t value_id;
+} HeaderRow_T;
+
+typedef struct {
+	DbmailMessage *message;
+	GList *rows;
+} HeaderBatch_T;
+
+static void header_row_add(HeaderBatch_T *B, const char *name, const char *value,
+		const char *sortfield, const char *datefield)
+{
+	HeaderRow_T *R = g_new0(HeaderRow_T, 1);
+
+	if (dm_get_hash_for_string(value, R->hash)) {
+		g_free(R);
+		return;
+	}
+	R->name = g_ascii_strdown(name, -1);
+	R->value = g_strdup(value);
+	g_strlcpy(R->sortfield, sortfield, CACHE_WIDTH);
+	g_strlcpy(R->datefield, datefield, CACHE_WIDTH);
+
+	B->rows = g_list_prepend(B->rows, R);
+}
+
+static void header_rows_free(GList *rows)
+{
+	rows = g_list_first(rows);
+	while (rows) {
+		HeaderRow_T *R = (HeaderRow_T *)rows->data;
+		g_free(R->name);
+		g_free(R->value);
+		g_free(R);
+		if (! g_list_next(rows)) break;
+		rows = g_list_next(rows);
+	}
+	g_list_free(g_list_first(rows));
+}
 
-void _message_cache_envelope_date(const DbmailMessage *self)
+static void header_rows_reset(GList *rows)
 {
+	rows = g_list_first(rows);
+	while (rows) {
+		HeaderRow_T *R = (HeaderRow_T *)rows->data;
+		R->name_id = R->value_id = 0;
+		if (! g_list_next(rows)) break;
+		rows = g_list_next(rows);
+	}
+}
+
+static void _message_cache_envelope_date(HeaderBatch_T *B)
+{
+	const DbmailMessage *self = B->message;
 	time_t date = self->internal_date;
 	char *value;
 	char datefield[CACHE_WIDTH];
 	char sortfield[CACHE_WIDTH];
-	uint64_t headervalue_id;
-	uint64_t headername_id;
 
 	value = g_mime_utils_header_format_date(
 			self->internal_date, 
@@ -1332,149 +1785,194 @@ void _message_cache_envelope_date(const DbmailMessage *self)
 	memset(datefield, 0, sizeof(datefield));
 	strftime(datefield, 20, "%Y-%m-%d", gmtime(&date));
 
-	_header_name_get_id(self, "Date", &headername_id);
-	_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+	header_row_add(B, "Date", value, sortfield, datefield);
 
 	g_free(value);
-
-	if (headervalue_id && headername_id)
-		_header_insert(self->id, headername_id, headervalue_id);
 }
 
-int dbmail_message_cache_headers(const DbmailMessage *self)
+/* assign id to all rows with this header name */
+static void header_rows_set_name(GList *rows, const char *name, uint64_t id)
 {
-	assert(self);
-	assert(self->id);
-
-	if (! GMIME_IS_MESSAGE(self->content)) {
-		TRACE(TRACE_ERR,"self->content is not a message");
-		return -1;
+	rows = g_list_first(rows);
+	while (rows) {
+		HeaderRow_T *R = (HeaderRow_T *)rows->data;
+		if ((! R->name_id) && (g_ascii_strcasecmp(R->name, name) == 0))
+			R->name_id = id;
+		if (! g_list_next(rows)) break;
+		rows = g_list_next(rows);
 	}
+}
 
-	/* 
-	 * store all headers as-is, plus separate copies for
-	 * searching and sorting
-	 * 
-	 * */
-	GMimeHeaderList *headers = g_mime_object_get_header_list(
-			GMIME_OBJECT(self->content));
-	g_mime_header_list_foreach(headers, (GMimeHeaderForeachFunc)_header_cache,
-			(gpointer)self);
+static void header_names_lookup(Connection_T c, GList *rows, GList *names)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	GString *q = g_string_new("");
+	gchar *case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
+	int i, count = g_list_length(names);
 
-	/* 
-	 * if there is no Date: header, store the envelope's date
-	 * 
-	 * */
-	if (! dbmail_message_get_header(self, "Date"))
-		_message_cache_envelope_date(self);
-	
-	/* 
-	 * not all messages have a references field or a in-reply-to field 
-	 *
-	 * */
-	dbmail_message_cache_referencesfield(self);
+	g_string_printf(q, "SELECT id, headername FROM %sheadername WHERE %s IN (", DBPFX, case_header);
+	for (i = 0; i < count; i++)
+		g_string_append_printf(q, "%s?", i ? "," : "");
+	g_string_append(q, ")");
 
-	return DM_SUCCESS;
-}
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "%s", q->str);
+	i = 1;
+	names = g_list_first(names);
+	while (names) {
+		db_stmt_set_str(s, i++, (const char *)names->data);
+		if (! g_list_next(names)) break;
+		names = g_list_next(names);
+	}
 
+	r = db_stmt_query(s);
+	while (db_result_next(r))
+		header_rows_set_name(rows, db_result_get(r, 1), db_result_get_u64(r, 0));
 
+	g_free(case_header);
+	g_string_free(q, TRUE);
+}
 
-static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id)
+static uint64_t header_name_insert(Connection_T c, const char *name)
 {
-	uint64_t *tmp = NULL;
-	gpointer cacheid;
-	gchar *case_header, *safe_header, *frag;
-	Connection_T c; ResultSet_T r; PreparedStatement_T s;
-	volatile int t = FALSE;
-
-	// rfc822 headernames are case-insensitive
-	safe_header = g_ascii_strdown(header,-1);
-	if ((cacheid = g_hash_table_lookup(self->header_dict, (gconstpointer)safe_header)) != NULL) {
-		*id = *(uint64_t *)cacheid;
-		g_free(safe_header);
-		return 1;
-	}
+	PreparedStatement_T s; ResultSet_T r;
+	uint64_t id = 0;
+	char *frag;
 
-	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
-	tmp = g_new0(uint64_t,1);
+	db_con_clear(c);
+	frag = db_returning("id");
+	s = db_stmt_prepare(c, "INSERT %s INTO %sheadername (headername) VALUES (?) %s",
+			db_get_sql(SQL_IGNORE), DBPFX, frag);
+	g_free(frag);
 
-	c = db_con_get();
+	db_stmt_set_str(s, 1, name);
 
-	TRY
-		db_begin_transaction(c);
-		*tmp = 0;
-		s = db_stmt_prepare(c, "SELECT id FROM %sheadername WHERE %s=?", DBPFX, case_header);
-		db_stmt_set_str(s,1,safe_header);
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		db_stmt_exec(s);
+		id = db_get_pk(c, "headername");
+	} else {
 		r = db_stmt_query(s);
+		id = db_insert_result(c, r);
+	}
+	TRACE(TRACE_DATABASE, "new headername.id [%" PRIu64 "]", id);
 
-		if (db_result_next(r)) {
-			*tmp = db_result_get_u64(r,0);
-		} else {
-			db_con_clear(c);
-
-			frag = db_returning("id");
-			s = db_stmt_prepare(c, "INSERT %s INTO %sheadername (headername) VALUES (?) %s",
-					db_get_sql(SQL_IGNORE), DBPFX, frag);
-			g_free(frag);
-
-			db_stmt_set_str(s,1,safe_header);
+	return id;
+}
 
-			if (db_params.db_driver == DM_DRIVER_ORACLE) {
-				db_stmt_exec(s);
-				*tmp = db_get_pk(c, "headername");
+/*
+ * resolve the ids of all header names: from the process-wide cache
+ * if allowed, then in one query per HEADER_BATCH distinct names. Only
+ * names never seen before are inserted one by one.
+ */
+static int header_names_resolve(Connection_T c, GList *rows, gboolean cached)
+{
+	GHashTable *missing = g_hash_table_new(g_str_hash, g_str_equal);
+	GList *l, *names = NULL, *batch = NULL;
+	int n = 0, t = DM_SUCCESS;
+
+	l = g_list_first(rows);
+	while (l) {
+		HeaderRow_T *R = (HeaderRow_T *)l->data;
+		if ((! g_hash_table_lookup(missing, R->name))
+				&& (! (cached && HeaderCache_getName(R->name, &R->name_id)))) {
+			g_hash_table_insert(missing, R->name, R->name);
+			names = g_list_append(names, R->name);
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	l = g_list_first(names);
+	while (l) {
+		batch = g_list_append(batch, l->data);
+		if ((++n == HEADER_BATCH) || (! g_list_next(l))) {
+			header_names_lookup(c, rows, batch);
+			g_list_free(batch);
+			batch = NULL;
+			n = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	l = g_list_first(rows);
+	while (l) {
+		HeaderRow_T *R = (HeaderRow_T *)l->data;
+		if (! R->name_id) {
+			uint64_t id;
+			if (! (id = header_name_insert(c, R->name))) {
+				/* inserted concurrently and ignored */
+				GList *one = g_list_append(NULL, R->name);
+				header_names_lookup(c, rows, one);
+				g_list_free(one);
 			} else {
-				r = db_stmt_query(s);
-				*tmp = db_insert_result(c, r);
+				header_rows_set_name(rows, R->name, id);
+			}
+			/* the row of the concurrent insert may not be visible
+			 * to this transaction; leave it to the caller's retry */
+			if (! R->name_id) {
+				TRACE(TRACE_INFO, "headername [%s] inserted concurrently", R->name);
+				t = DM_EQUERY;
+				break;
 			}
 		}
-		t = TRUE;
-		db_commit_transaction(c);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
 
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	g_list_free(g_list_first(names));
+	g_hash_table_destroy(missing);
 
-	g_free(case_header);
+	return t;
+}
 
-	if (t == DM_EQUERY) {
-		g_free(safe_header);
-		g_free(tmp);
-		return t;
+/* assign id to all rows with this header value */
+static void header_rows_set_value(GList *rows, const char *value, size_t size, uint64_t id)
+{
+	rows = g_list_first(rows);
+	while (rows) {
+		HeaderRow_T *R = (HeaderRow_T *)rows->data;
+		if ((! R->value_id) && (strlen(R->value) == size) && (memcmp(R->value, value, size) == 0))
+			R->value_id = id;
+		if (! g_list_next(rows)) break;
+		rows = g_list_next(rows);
 	}
-
-	*id = *tmp;
-	g_hash_table_insert(self->header_dict, (gpointer)(safe_header), (gpointer)(tmp));
-	return 1;
 }
 
-static uint64_t _header_value_exists(Connection_T c, const char *value, const char *hash)
+static void header_values_lookup(Connection_T c, GHashTable *byhash, GList *hashes)
 {
-	ResultSet_T r; PreparedStatement_T s;
-	uint64_t id = 0;
-	char blob_cmp[DEF_FRAGSIZE];
-	memset(blob_cmp, 0, sizeof(blob_cmp));
+	PreparedStatement_T s; ResultSet_T r;
+	GString *q = g_string_new("");
+	int i, count = g_list_length(hashes);
 
-	if (db_params.db_driver == DM_DRIVER_ORACLE && strlen(value) > DM_ORA_MAX_BYTES_LOB_CMP) {
-		/** Value greater then DM_ORA_MAX_BYTES_LOB_CMP will cause SQL exception */
-		return 0;
-	}
-	db_con_clear(c);
-	snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "headervalue");
+	g_string_printf(q, "SELECT id, hash, headervalue FROM %sheadervalue WHERE hash IN (", DBPFX);
+	for (i = 0; i < count; i++)
+		g_string_append_printf(q, "%s?", i ? "," : "");
+	g_string_append(q, ")");
 
-	s = db_stmt_prepare(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
-	db_stmt_set_str(s, 1, hash);
-	db_stmt_set_blob(s, 2, value, strlen(value));
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "%s", q->str);
+	i = 1;
+	hashes = g_list_first(hashes);
+	while (hashes) {
+		db_stmt_set_str(s, i++, (const char *)hashes->data);
+		if (! g_list_next(hashes)) break;
+		hashes = g_list_next(hashes);
+	}
 
 	r = db_stmt_query(s);
-	if (db_result_next(r))
-		id = db_result_get_u64(r,0);
-
-	return id;
+	while (db_result_next(r)) {
+		int l;
+		const void *blob;
+		uint64_t id = db_result_get_u64(r, 0);
+		GList *rows = g_hash_table_lookup(byhash, db_result_get(r, 1));
+		if (! rows)
+			continue;
+		blob = db_result_get_blob(r, 2, &l);
+		header_rows_set_value(rows, (const char *)blob, (size_t)l, id);
+	}
 
+	g_string_free(q, TRUE);
 }
 
 static uint64_t _header_value_insert(Connection_T c, const char *value, const char *sortfield, const char *datefield, const char *hash)
@@ -1514,58 +2012,142 @@ static uint64_t _header_value_insert(Connection_T c, const char *value, const ch
 	return id;
 }
 
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id)
-{
-	uint64_t tmp = 0;
-	char hash[FIELDSIZE];
-	memset(hash, 0, sizeof(hash));
-
-	Connection_T c;
-	if (dm_get_hash_for_string(value, hash))
-		return FALSE;
+/*
+ * resolve the ids of all header values: from the process-wide cache
+ * if allowed, then in one query per HEADER_BATCH distinct hashes.
+ * Values not found are inserted.
+ */
+static int header_values_resolve(Connection_T c, GList *rows, gboolean cached)
+{
+	GHashTable *byhash;
+	GList *l, *hashes = NULL, *batch = NULL;
+	int n = 0, t = DM_SUCCESS;
+
+	byhash = g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, NULL,
+			(GDestroyNotify)g_list_free);
+
+	l = g_list_first(rows);
+	while (l) {
+		HeaderRow_T *R = (HeaderRow_T *)l->data;
+		if (! (cached && HeaderCache_getValue(R->value, &R->value_id))) {
+			GList *same = g_hash_table_lookup(byhash, R->hash);
+			if (same) {
+				same = g_list_append(same, R);
+			} else {
+				hashes = g_list_append(hashes, R->hash);
+				g_hash_table_insert(byhash, R->hash, g_list_append(NULL, R));
+			}
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	l = g_list_first(hashes);
+	while (l) {
+		batch = g_list_append(batch, l->data);
+		if ((++n == HEADER_BATCH) || (! g_list_next(l))) {
+			header_values_lookup(c, byhash, batch);
+			g_list_free(batch);
+			batch = NULL;
+			n = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	l = g_list_first(rows);
+	while (l) {
+		HeaderRow_T *R = (HeaderRow_T *)l->data;
+		if (! R->value_id) {
+			uint64_t id = _header_value_insert(c, R->value, R->sortfield, R->datefield, R->hash);
+			if (! id) {
+				TRACE(TRACE_INFO, "headervalue [%s] not inserted", R->hash);
+				t = DM_EQUERY;
+				break;
+			}
+			/* identical values within this message share the new row */
+			header_rows_set_value(g_hash_table_lookup(byhash, R->hash), R->value, strlen(R->value), id);
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
 
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		if ((tmp = _header_value_exists(c, value, (const char *)hash)) != 0)
-			*id = tmp;
-		else if ((tmp = _header_value_insert(c, value, sortfield, datefield, (const char *)hash)) != 0)
-			*id = tmp;
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		*id = 0;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	g_list_free(g_list_first(hashes));
+	g_hash_table_destroy(byhash);
 
-	return TRUE;
+	return t;
 }
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
-{
+/*
+ * Insert the relations between physmessage, header name and header
+ * value with multi-row inserts. Oracle has no multi-row VALUES, so
+ * rows are inserted one at a time there, still in the same transaction.
+ */
+static void header_rows_insert(Connection_T c, uint64_t physid, GList *rows)
+{
+	PreparedStatement_T s;
+	GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GList *l, *batch = NULL;
+	GString *q = g_string_new("");
+	int i, n = 0, max = (db_params.db_driver == DM_DRIVER_ORACLE) ? 1 : HEADER_BATCH;
+
+	l = g_list_first(rows);
+	while (l) {
+		HeaderRow_T *R = (HeaderRow_T *)l->data;
+		gchar *key = g_strdup_printf("%" PRIu64 ":%" PRIu64 "", R->name_id, R->value_id);
+		if ((! R->name_id) || (! R->value_id)) {
+			TRACE(TRACE_INFO, "error inserting header [%s]. skipping.", R->name);
+			g_free(key);
+		} else if (g_hash_table_lookup(seen, key)) {
+			g_free(key);
+		} else {
+			g_hash_table_insert(seen, key, R);
+			batch = g_list_append(batch, R);
+			n++;
+		}
 
-	Connection_T c; PreparedStatement_T s; volatile gboolean t = TRUE;
+		if (n && ((n == max) || (! g_list_next(l)))) {
+			g_string_printf(q, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES ", DBPFX);
+			for (i = 0; i < n; i++)
+				g_string_append_printf(q, "%s(?,?,?)", i ? "," : "");
 
-	c = db_con_get();
-	db_con_clear(c);
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES (?,?,?)", DBPFX);
-		db_stmt_set_u64(s, 1, physmessage_id);
-		db_stmt_set_u64(s, 2, headername_id);
-		db_stmt_set_u64(s, 3, headervalue_id);
-		db_stmt_exec(s);
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		db_rollback_transaction(c);
-		t = FALSE;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
-	
-	return t;
+			db_con_clear(c);
+			s = db_stmt_prepare(c, "%s", q->str);
+			i = 1;
+			batch = g_list_first(batch);
+			while (batch) {
+				HeaderRow_T *row = (HeaderRow_T *)batch->data;
+				db_stmt_set_u64(s, i++, physid);
+				db_stmt_set_u64(s, i++, row->name_id);
+				db_stmt_set_u64(s, i++, row->value_id);
+				if (! g_list_next(batch)) break;
+				batch = g_list_next(batch);
+			}
+			db_stmt_exec(s);
+
+			g_list_free(g_list_first(batch));
+			batch = NULL;
+			n = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_string_free(q, TRUE);
+	g_hash_table_destroy(seen);
+}
+
+/* make the ids of a committed batch available to other deliveries */
+static void header_rows_publish(GList *rows)
+{
+	rows = g_list_first(rows);
+	while (rows) {
+		HeaderRow_T *R = (HeaderRow_T *)rows->data;
+		HeaderCache_setName(R->name, R->name_id);
+		HeaderCache_setValue(R->value, R->value_id);
+		if (! g_list_next(rows)) break;
+		rows = g_list_next(rows);
+	}
 }
 
 static GString * _header_addresses(InternetAddressList *ialist)
@@ -1624,9 +2206,8 @@ static GString * _header_addresses(InternetAddressList *ialist)
 
 static void _header_cache(const char *header, const char *raw, gpointer user_data)
 {
-	uint64_t headername_id;
-	uint64_t headervalue_id;
-	DbmailMessage *self = (DbmailMessage *)user_data;
+	HeaderBatch_T *B = (HeaderBatch_T *)user_data;
+	DbmailMessage *self = B->message;
 	time_t date;
 	volatile gboolean isaddr = 0, isdate = 0, issubject = 0;
 	const char *charset = dbmail_message_get_charset(self);
@@ -1644,9 +2225,6 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 
 	TRACE(TRACE_DEBUG,"headername [%s]", header);
 
-	if ((_header_name_get_id(self, header, &headername_id) < 0))
-		return;
-
 	if (g_ascii_strcasecmp(header,"From")==0)
 		isaddr=1;
 	else if (g_ascii_strcasecmp(header,"To")==0)
@@ -1731,60 +2309,21 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	if (sortfield[0] == '\0')
 		g_strlcpy(sortfield, value, CACHE_WIDTH-1);
 
-	/* Fetch header value id if exists, else insert, and return new id */
-	_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+	/* names and values are resolved and stored for all headers at once */
+	header_row_add(B, header, value, sortfield, datefield);
 
 	g_free(value);
 
-	/* Insert relation between physmessage, header name and header value */
-	if (headervalue_id)
-		_header_insert(self->id, headername_id, headervalue_id);
-	else
-		TRACE(TRACE_INFO, "error inserting headervalue. skipping.");
-
-	headervalue_id=0;
-
 	emaillist=NULL;
 	date=0;
 }
 
-static void insert_field_cache(uint64_t physid, const char *field, const char *value)
-{
-	gchar *clean_value;
-	Connection_T c; PreparedStatement_T s;
-
-	g_return_if_fail(value != NULL);
-
-	/* field values are truncated to 255 bytes */
-	clean_value = g_strndup(value,CACHE_WIDTH);
-
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c,"INSERT INTO %s%sfield (physmessage_id, %sfield) VALUES (?,?)", DBPFX, field, field);
-		db_stmt_set_u64(s, 1, physid);
-		db_stmt_set_str(s, 2, clean_value);
-		db_stmt_exec(s);
-		db_commit_transaction(c);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		TRACE(TRACE_ERR, "insert %sfield failed [%s]", field, value);
-	FINALLY
-		db_con_close(c);
-	END_TRY;
-	g_free(clean_value);
-}
-
-#define DM_ADDRESS_TYPE_TO "To"
-#define DM_ADDRESS_TYPE_CC "Cc"
-#define DM_ADDRESS_TYPE_FROM "From"
-#define DM_ADDRESS_TYPE_REPL "Reply-to"
-
-void dbmail_message_cache_referencesfield(const DbmailMessage *self)
+/* the message-ids in References and In-Reply-To, truncated to 255 bytes */
+static GList * references_collect(const DbmailMessage *self)
 {
 	GMimeReferences *refs, *head;
 	GTree *tree;
+	GList *ids = NULL;
 	const char *referencesfield, *inreplytofield;
 	char *field;
 
@@ -1798,16 +2337,20 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 
 	if (! refs) {
 		TRACE(TRACE_DEBUG, "reference_decode failed [%" PRIu64 "]", self->id);
-		return;
+		return NULL;
 	}
 	
 	head = refs;
 	tree = g_tree_new_full((GCompareDataFunc)dm_strcmpdata, NULL, NULL, NULL);
 	
 	while (refs->msgid) {
-		if (! g_tree_lookup(tree,refs->msgid)) {
-			insert_field_cache(self->id, "references", refs->msgid);
-			g_tree_insert(tree,refs->msgid,refs->msgid);
+		/* field values are truncated to 255 bytes */
+		char *id = g_strndup(refs->msgid, CACHE_WIDTH);
+		if (! g_tree_lookup(tree, id)) {
+			g_tree_insert(tree, id, id);
+			ids = g_list_append(ids, id);
+		} else {
+			g_free(id);
 		}
 		if (refs->next == NULL)
 			break;
@@ -1816,6 +2359,161 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 
 	g_tree_destroy(tree);
 	g_mime_references_clear(&head);
+
+	return ids;
+}
+
+static void references_insert(Connection_T c, uint64_t physid, GList *ids)
+{
+	PreparedStatement_T s;
+	GList *l, *batch = NULL;
+	GString *q = g_string_new("");
+	int i, n = 0, max = (db_params.db_driver == DM_DRIVER_ORACLE) ? 1 : HEADER_BATCH;
+
+	l = g_list_first(ids);
+	while (l) {
+		batch = g_list_append(batch, l->data);
+		if ((++n == max) || (! g_list_next(l))) {
+			g_string_printf(q, "INSERT INTO %sreferencesfield (physmessage_id, referencesfield) VALUES ", DBPFX);
+			for (i = 0; i < n; i++)
+				g_string_append_printf(q, "%s(?,?)", i ? "," : "");
+
+			db_con_clear(c);
+			s = db_stmt_prepare(c, "%s", q->str);
+			i = 1;
+			batch = g_list_first(batch);
+			while (batch) {
+				db_stmt_set_u64(s, i++, physid);
+				db_stmt_set_str(s, i++, (const char *)batch->data);
+				if (! g_list_next(batch)) break;
+				batch = g_list_next(batch);
+			}
+			db_stmt_exec(s);
+
+			g_list_free(g_list_first(batch));
+			batch = NULL;
+			n = 0;
+		}
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_string_free(q, TRUE);
+}
+
+/*
+ * store the header rows and references of a message in a single
+ * transaction. A header name or value that can not be resolved fails
+ * the whole transaction.
+ */
+static int header_rows_store(uint64_t physid, GList *rows, GList *refs, gboolean cached)
+{
+	Connection_T c;
+	volatile int t = DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if (rows) {
+			if (header_names_resolve(c, rows, cached) == DM_EQUERY
+					|| header_values_resolve(c, rows, cached) == DM_EQUERY)
+				t = DM_EQUERY;
+			else
+				header_rows_insert(c, physid, rows);
+		}
+		if (t == DM_SUCCESS && refs)
+			references_insert(c, physid, refs);
+		if (t == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_SUCCESS)
+		header_rows_publish(rows);
+
+	return t;
+}
+
+int dbmail_message_cache_headers(const DbmailMessage *self)
+{
+	HeaderBatch_T B;
+	GList *refs;
+	int t;
+
+	assert(self);
+	assert(self->id);
+
+	if (! GMIME_IS_MESSAGE(self->content)) {
+		TRACE(TRACE_ERR,"self->content is not a message");
+		return -1;
+	}
+
+	B.message = (DbmailMessage *)self;
+	B.rows = NULL;
+
+	/* 
+	 * store all headers as-is, plus separate copies for
+	 * searching and sorting
+	 * 
+	 * */
+	GMimeHeaderList *headers = g_mime_object_get_header_list(
+			GMIME_OBJECT(self->content));
+	g_mime_header_list_foreach(headers, (GMimeHeaderForeachFunc)_header_cache,
+			(gpointer)&B);
+
+	/* 
+	 * if there is no Date: header, store the envelope's date
+	 * 
+	 * */
+	if (! dbmail_message_get_header(self, "Date"))
+		_message_cache_envelope_date(&B);
+
+	B.rows = g_list_reverse(B.rows);
+	
+	/* 
+	 * not all messages have a references field or a in-reply-to field 
+	 *
+	 * */
+	refs = references_collect(self);
+
+	if ((t = header_rows_store(self->id, B.rows, refs, TRUE)) == DM_EQUERY) {
+		/* a cached id may have been removed by dbmail-util, or a
+		 * name or value was inserted by a concurrent transaction */
+		TRACE(TRACE_INFO, "[%" PRIu64 "] retry with uncached ids", self->id);
+		HeaderCache_flush();
+		header_rows_reset(B.rows);
+		t = header_rows_store(self->id, B.rows, refs, FALSE);
+	}
+
+	header_rows_free(B.rows);
+	g_list_destroy(refs);
+
+	return t;
+}
+
+#define DM_ADDRESS_TYPE_TO "To"
+#define DM_ADDRESS_TYPE_CC "Cc"
+#define DM_ADDRESS_TYPE_FROM "From"
+#define DM_ADDRESS_TYPE_REPL "Reply-to"
+
+void dbmail_message_cache_referencesfield(const DbmailMessage *self)
+{
+	GList *refs;
+
+	if (! (refs = references_collect(self)))
+		return;
+
+	if (header_rows_store(self->id, NULL, refs, FALSE) == DM_EQUERY)
+		TRACE(TRACE_ERR, "insert referencesfield failed [%" PRIu64 "]", self->id);
+
+	g_list_destroy(refs);
 }
 	
 void dbmail_message_cache_envelope(const DbmailMessage *self)
@@ -1845,6 +2543,42 @@ void dbmail_message_cache_envelope(const DbmailMessage *self)
 	envelope = NULL;
 }
 
+void dbmail_message_cache_bodystructure(const DbmailMessage *self)
+{
+	char *bodystructure = NULL, *body = NULL;
+	Connection_T c; PreparedStatement_T s;
+
+	bodystructure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+
+	if ((! bodystructure) || (! body)) {
+		TRACE(TRACE_WARNING, "[%" PRIu64 "] unable to construct bodystructure", self->id);
+		g_free(bodystructure);
+		g_free(body);
+		return;
+	}
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		s = db_stmt_prepare(c, "INSERT INTO %sbodystructure (physmessage_id, bodystructure, body) VALUES (?,?,?)", DBPFX);
+		db_stmt_set_u64(s, 1, self->id);
+		db_stmt_set_str(s, 2, bodystructure);
+		db_stmt_set_str(s, 3, body);
+		db_stmt_exec(s);
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		TRACE(TRACE_ERR, "insert bodystructure failed [%s]", bodystructure);
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(bodystructure);
+	g_free(body);
+}
+
 // 
 // construct a new message where only sender, recipient, subject and 
 // a body are known. The body can be any kind of charset. Make sure
@@ -2101,9 +2835,8 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 		uint64_t useridnr, const char *mailbox, mailbox_source source,
 		int *msgflags, GList *keywords)
 {
-	uint64_t mboxidnr = 0, newmsgidnr = 0;
+	uint64_t mboxidnr = 0;
 	Field_T val;
-	size_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
 
 	if (db_find_create_mailbox(mailbox, source, useridnr, &mboxidnr) != 0) {
 		TRACE(TRACE_ERR, "mailbox [%s] not found", mailbox);
@@ -2163,29 +2896,13 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 		}
 	}
 
-	// Ok, we have the ACL right, time to deliver the message.
-	switch (db_copymsg(message->msg_idnr, mboxidnr, useridnr, &newmsgidnr, TRUE)) {
-	case -2:
-		TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "],"
-				"maxmail exceeded", useridnr);
-		return DSN_CLASS_QUOTA;
-	case -1:
-		TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "]", 
-				useridnr);
-		return DSN_CLASS_TEMP;
-	default:
-		TRACE(TRACE_NOTICE, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] message [%" PRIu64 "] size [%zd] is inserted", 
-				useridnr, mboxidnr, newmsgidnr, msgsize);
-		if (msgflags || keywords) {
-			TRACE(TRACE_NOTICE, "message id=%" PRIu64 ", setting imap flags", 
-				newmsgidnr);
-
-			if (db_set_msgflag(newmsgidnr, msgflags, keywords, IMAPFA_ADD, 0, NULL))
-				db_mailbox_seq_update(mboxidnr, newmsgidnr);
-		}
-		message->msg_idnr = newmsgidnr;
-		return DSN_CLASS_OK;
-	}
+	// Ok, we have the ACL right, queue the message for delivery.
+	// Quotum is checked when the queued targets are delivered.
+	TRACE(TRACE_DEBUG, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] queued", 
+			useridnr, mboxidnr);
+	dbmail_message_add_target(message, useridnr, mboxidnr, msgflags, keywords);
+
+	return DSN_CLASS_OK;
 }
 
 static int parse_and_escape(const char *in, char **out)
@@ -2628,35 +3345,61 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
  *   - A list of destinations
  *
  * What we do:
- *   - Store the message
+ *   - Store the message once
  *   - Process the destination addresses into lists:
  *     - Local useridnr's
  *     - External forwards
  *     - No such user bounces
- *   - Store the local useridnr's
+ *   - Sort for the local useridnr's
  *     - Run the message through each user's sorting rules
  *     - Potentially alter the delivery:
  *       - Different mailbox
  *       - Bounce
  *       - Reply with vacation message
  *       - Forward to another address
- *     - Check the user's quota before delivering
+ *   - Deliver to all mailboxes in a single transaction
+ *     - Check the users' quota before delivering
  *       - Do this *after* their sorting rules, since the
  *         sorting rules might not store the message anyways
  *   - Send out the no such user bounces
  *   - Send out the external forwards
- *   - Delete the temporary message from the database
  * What we return:
  *   - 0 on success
  *   - -1 on full failure
  */
 
+typedef struct {
+	uint64_t useridnr;
+	dsn_class_t class;
+	guint first, last;	/* targets queued for this user */
+} Recipient_T;
+
+static dsn_class_t recipient_class(DbmailMessage *message, Recipient_T *R)
+{
+	guint i;
+	dsn_class_t class = R->class;
+
+	if (class != DSN_CLASS_OK)
+		return class;
+
+	for (i = R->first; i < R->last; i++) {
+		DeliveryTarget_T *T = g_list_nth_data(message->targets, i);
+		if (T->result == -2)
+			class = DSN_CLASS_QUOTA;
+		else if (T->result != DM_SUCCESS && class == DSN_CLASS_OK)
+			class = DSN_CLASS_TEMP;
+	}
+
+	return class;
+}
+
 int insert_messages(DbmailMessage *message, List_T dsnusers)
 {
-	uint64_t tmpid;
 	int result=0;
 	Field_T val;
 	gboolean quota_softfail = FALSE;
+	GList *recipients = NULL, *r;
+	List_T first;
 
  	delivery_status_t final_dsn;
 
@@ -2665,7 +3408,7 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		return result;
 	} 
 
-	TRACE(TRACE_DEBUG, "temporary msgidnr is [%" PRIu64 "]", message->msg_idnr);
+	TRACE(TRACE_DEBUG, "physmessage_id is [%" PRIu64 "]", message->id);
 
 	config_get_value("QUOTA_FAILURE", "DELIVERY", val);
 	if (SMATCH(val, "soft"))
@@ -2675,21 +3418,14 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 	else
 		TRACE(TRACE_INFO, "Using default hard bounce for quota failure");
 
-
-	tmpid = message->msg_idnr; // for later removal
-
 	// TODO: Run a Sieve script associated with the internal delivery user.
 	// Code would go here, after we've stored the message 
 	// before we've started delivering it
 
-	/* Loop through the users list. */
-	dsnusers = p_list_first(dsnusers);
+	/* Sort for all users. */
+	first = dsnusers = p_list_first(dsnusers);
 	while (dsnusers) {
-		
 		GList *userids;
-
-		int ok = 0, temp = 0, fail = 0, fail_quota = 0;
-		
 		Delivery_T *delivery = (Delivery_T *)p_list_data(dsnusers);
 		
 		/* Each user may have a list of user_idnr's for local
@@ -2697,33 +3433,70 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		userids = g_list_first(delivery->userids);
 		while (userids) {
 			uint64_t *useridnr = (uint64_t *) userids->data;
+			Recipient_T *R = g_new0(Recipient_T, 1);
 
+			R->useridnr = *useridnr;
+			R->first = g_list_length(message->targets);
 			TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-			switch (sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source)) {
+			R->class = sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source);
+			R->last = g_list_length(message->targets);
+			recipients = g_list_append(recipients, R);
+
+			/* Automatic reply and notification */
+			if (execute_auto_ran(message, *useridnr) < 0) {
+				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
+			}   
+
+			if (! g_list_next(userids))
+				break;
+			userids = g_list_next(userids);
+		}
+
+		if (! p_list_next(dsnusers))
+			break;
+		dsnusers = p_list_next(dsnusers);
+	}
+
+	/* Deliver to all mailboxes at once. */
+	if (dbmail_message_deliver(message) == DM_EQUERY)
+		TRACE(TRACE_ERR, "delivery of physmessage [%" PRIu64 "] failed", message->id);
+
+	/* Collect the results. */
+	r = g_list_first(recipients);
+	dsnusers = first;
+	while (dsnusers) {
+		
+		GList *userids;
+
+		int ok = 0, temp = 0, fail = 0, fail_quota = 0;
+		
+		Delivery_T *delivery = (Delivery_T *)p_list_data(dsnusers);
+		
+		userids = g_list_first(delivery->userids);
+		while (userids && r) {
+			Recipient_T *R = (Recipient_T *)r->data;
+
+			switch (recipient_class(message, R)) {
 			case DSN_CLASS_OK:
-				TRACE(TRACE_INFO, "successful sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
+				TRACE(TRACE_INFO, "successful sort_and_deliver for useridnr [%" PRIu64 "]", R->useridnr);
 				ok = 1;
 				break;
 			case DSN_CLASS_FAIL:
-				TRACE(TRACE_ERR, "permanent failure sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
+				TRACE(TRACE_ERR, "permanent failure sort_and_deliver for useridnr [%" PRIu64 "]", R->useridnr);
 				fail = 1;
 				break;
 			case DSN_CLASS_QUOTA:
-				TRACE(TRACE_NOTICE, "mailbox over quota, message rejected for useridnr [%" PRIu64 "]", *useridnr);
+				TRACE(TRACE_NOTICE, "mailbox over quota, message rejected for useridnr [%" PRIu64 "]", R->useridnr);
 				fail_quota = 1;
 				break;
 			case DSN_CLASS_TEMP:
 			default:
-				TRACE(TRACE_ERR, "unknown temporary failure in sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
+				TRACE(TRACE_ERR, "unknown temporary failure in sort_and_deliver for useridnr [%" PRIu64 "]", R->useridnr);
 				temp = 1;
 				break;
 			}
 
-			/* Automatic reply and notification */
-			if (execute_auto_ran(message, *useridnr) < 0) {
-				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
-			}   
-
+			r = g_list_next(r);
 			if (! g_list_next(userids))
 				break;
 			userids = g_list_next(userids);
@@ -2772,7 +3545,7 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 			TRACE(TRACE_DEBUG, "delivering to external addresses");
 			const char *from = dbmail_message_get_header(message, "Return-Path");
 
-			/* Forward using the temporary stored message. */
+			/* Forward using the stored message. */
 			if (send_forward_list(message, delivery->forwards, from)) {
 				/* If forward fails, tell the sender that we're
 				 * having a transient error. They'll resend. */
@@ -2786,12 +3559,7 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 
 	}
 
-	/* Always delete the temporary message, even if the delivery failed.
-	 * It is the MTA's job to requeue or bounce the message,
-	 * and our job to keep a tidy database ;-) */
-	if (! db_delete_message(tmpid)) 
-		TRACE(TRACE_ERR, "failed to delete temporary message [%" PRIu64 "]", tmpid);
-	TRACE(TRACE_DEBUG, "temporary message deleted from database. Done.");
+	g_list_destroy(recipients);
 
 	return 0;
 }
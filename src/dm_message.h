@@ -54,10 +54,38 @@ DbmailMessage * dbmail_message_construct(DbmailMessage *self,
  */
 
 int dbmail_message_store(DbmailMessage *message);
+/*
+ * \brief queue a messages row for a stored message
+ * \param msgflags optional array of IMAP_NFLAGS flags
+ * \param keywords optional list of keywords, copied
+ */
+void dbmail_message_add_target(DbmailMessage *message, uint64_t user_idnr,
+		uint64_t mailbox_idnr, int *msgflags, GList *keywords);
+/*
+ * \brief create the messages rows for all queued targets in a
+ *        single transaction. The physmessage is removed again if
+ *        no target could be delivered.
+ * \return DM_SUCCESS or DM_EQUERY. The result of each target is
+ *        set in message->targets.
+ */
+int dbmail_message_deliver(DbmailMessage *message);
+/*
+ * \brief create the messages rows for targets, which need not be
+ *        queued on the message, and store its sizes and internal date.
+ * \return the result of db_deliver_targets
+ */
+int dbmail_message_deliver_targets(DbmailMessage *message, GList *targets);
 int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
 DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid);
+/*
+ * \brief reassemble a message as a CRLF encoded stream without parsing it
+ * \param pool memory pool for the stream
+ * \param physid physmessage_id
+ * \return stream or NULL if the message has no mimeparts
+ */
+String_T dbmail_message_retrieve_crlf(Mempool_T pool, uint64_t physid);
 
 /*
  * attribute accessors
@@ -97,6 +125,7 @@ GList * dbmail_message_get_header_repeated(const DbmailMessage *self, const char
 
 void dbmail_message_cache_referencesfield(const DbmailMessage *self);
 void dbmail_message_cache_envelope(const DbmailMessage *self);
+void dbmail_message_cache_bodystructure(const DbmailMessage *self);
 
 /*
  * destructor
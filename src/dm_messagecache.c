@@ -0,0 +1,260 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include "dm_messagecache.h"
+
+#define THIS_MODULE "MessageCache"
+
+#define T MessageCache_T
+
+#define MESSAGE_CACHE_SIZE 32 // megabytes
+#define MESSAGE_CACHE_STATS 1000
+
+struct T {
+	uint64_t id;
+	Mempool_T pool;
+	String_T crlf;
+	char *structure;    // BODYSTRUCTURE
+	char *body;         // BODY
+	char *envelope;
+	size_t size;        // bytes accounted for this entry
+	GList *link;        // position in the lru queue, NULL if not cached
+	int refs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GTree *cache = NULL;   // physmessage_id -> T
+static GQueue *lru = NULL;    // most recently used first
+static int64_t cache_limit = -1;
+static uint64_t cache_bytes = 0;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+
+static void cache_entry_free(T E)
+{
+	g_free(E->structure);
+	g_free(E->body);
+	g_free(E->envelope);
+	p_string_free(E->crlf, TRUE);
+	mempool_close(&E->pool);
+	g_free(E);
+}
+
+/*
+ * drop a reference. Caller must hold the lock.
+ */
+static void cache_entry_unref(T E)
+{
+	if (--E->refs > 0)
+		return;
+	cache_entry_free(E);
+}
+
+/*
+ * take an entry out of the cache. Caller must hold the lock.
+ */
+static void cache_entry_evict(T E)
+{
+	g_queue_delete_link(lru, E->link);
+	E->link = NULL;
+	cache_bytes -= E->size;
+	g_tree_remove(cache, &E->id);
+	cache_entry_unref(E);
+}
+
+static void cache_init(void)
+{
+	Field_T val;
+
+	if (cache_limit >= 0)
+		return;
+
+	cache_limit = MESSAGE_CACHE_SIZE;
+	config_get_value("message_cache_size", "IMAP", val);
+	if (strlen(val))
+		cache_limit = atoi(val);
+	if (cache_limit < 0)
+		cache_limit = 0;
+	cache_limit *= 1024 * 1024;
+
+	if (cache_limit > 0) {
+		cache = g_tree_new((GCompareFunc)ucmp);
+		lru = g_queue_new();
+	}
+	TRACE(TRACE_DEBUG, "message cache size [%" PRId64 "] bytes", cache_limit);
+}
+
+static void cache_count(gboolean hit)
+{
+	uint64_t lookups;
+
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+
+	lookups = cache_hits + cache_misses;
+	if (lookups % MESSAGE_CACHE_STATS == 0)
+		TRACE(TRACE_INFO, "hits [%" PRIu64 "] misses [%" PRIu64 "] entries [%d] bytes [%" PRIu64 "]",
+				cache_hits, cache_misses, g_tree_nnodes(cache), cache_bytes);
+}
+
+T MessageCache_lookup(uint64_t physid)
+{
+	T E;
+
+	PLOCK(cache_lock);
+	cache_init();
+	if (! cache) {
+		PUNLOCK(cache_lock);
+		return NULL;
+	}
+
+	if ((E = g_tree_lookup(cache, &physid))) {
+		E->refs++;
+		g_queue_unlink(lru, E->link);
+		g_queue_push_head_link(lru, E->link);
+	}
+	cache_count(E != NULL);
+	PUNLOCK(cache_lock);
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] %s", physid, E?"hit":"miss");
+
+	return E;
+}
+
+T MessageCache_store(DbmailMessage *message)
+{
+	T E, old;
+
+	assert(message && message->content && message->crlf);
+
+	E = g_new0(struct T, 1);
+	E->id = message->id;
+	E->refs = 1;
+
+	if (! (E->structure = imap_get_structure(GMIME_MESSAGE(message->content), 1))) {
+		TRACE(TRACE_ERR, "[%" PRIu64 "] error fetching body structure", E->id);
+		g_free(E);
+		return NULL;
+	}
+	if (! (E->body = imap_get_structure(GMIME_MESSAGE(message->content), 0))) {
+		TRACE(TRACE_ERR, "[%" PRIu64 "] error fetching body", E->id);
+		g_free(E->structure);
+		g_free(E);
+		return NULL;
+	}
+	if (GMIME_IS_MESSAGE(message->content))
+		E->envelope = imap_get_envelope(GMIME_MESSAGE(message->content));
+
+	E->pool = mempool_open();
+	E->crlf = p_string_new(E->pool, p_string_str(message->crlf));
+
+	E->size = sizeof(struct T) + p_string_len(E->crlf)
+		+ strlen(E->structure) + strlen(E->body)
+		+ (E->envelope ? strlen(E->envelope) : 0);
+
+	PLOCK(cache_lock);
+	cache_init();
+
+	// entries larger than a quarter of the cache would only flush it
+	if ((! cache) || (E->size > (uint64_t)cache_limit / 4)) {
+		PUNLOCK(cache_lock);
+		return E;
+	}
+
+	// another session stored this message meanwhile
+	if ((old = g_tree_lookup(cache, &E->id)))
+		cache_entry_evict(old);
+
+	while (cache_bytes + E->size > (uint64_t)cache_limit) {
+		T last = g_queue_peek_tail(lru);
+		if (! last) break;
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] evict [%zu] bytes", last->id, last->size);
+		cache_entry_evict(last);
+	}
+
+	E->refs++; // the cache and the caller
+	g_queue_push_head(lru, E);
+	E->link = g_queue_peek_head_link(lru);
+	g_tree_insert(cache, &E->id, E);
+	cache_bytes += E->size;
+	PUNLOCK(cache_lock);
+
+	return E;
+}
+
+void MessageCache_release(T *E)
+{
+	T e = *E;
+
+	if (! e)
+		return;
+
+	PLOCK(cache_lock);
+	cache_entry_unref(e);
+	PUNLOCK(cache_lock);
+
+	*E = NULL;
+}
+
+gboolean MessageCache_accepts(uint64_t size)
+{
+	gboolean accepts;
+
+	PLOCK(cache_lock);
+	cache_init();
+	accepts = (cache && (size <= (uint64_t)cache_limit / 4));
+	PUNLOCK(cache_lock);
+
+	return accepts;
+}
+
+uint64_t MessageCache_getId(T E)
+{
+	return E->id;
+}
+
+String_T MessageCache_getCRLF(T E)
+{
+	return E->crlf;
+}
+
+const char * MessageCache_getStructure(T E, gboolean extension)
+{
+	return extension ? E->structure : E->body;
+}
+
+const char * MessageCache_getEnvelope(T E)
+{
+	return E->envelope;
+}
+
+void MessageCache_stats(uint64_t *hits, uint64_t *misses, uint64_t *bytes)
+{
+	PLOCK(cache_lock);
+	if (hits) *hits = cache_hits;
+	if (misses) *misses = cache_misses;
+	if (bytes) *bytes = cache_bytes;
+	PUNLOCK(cache_lock);
+}
+
+#undef T
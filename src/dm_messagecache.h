@@ -0,0 +1,73 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * process-wide cache of reconstructed messages
+ *
+ * Entries are keyed by physmessage_id and hold the CRLF encoded
+ * message together with its BODYSTRUCTURE, BODY and ENVELOPE
+ * strings. Entries are immutable once stored and reference
+ * counted, so they can be shared by all sessions. The cache is
+ * bounded by the total size of the entries and evicts the least
+ * recently used ones first.
+ */
+
+#ifndef DM_MESSAGECACHE_H
+#define DM_MESSAGECACHE_H
+
+#include "dbmail.h"
+
+#define T MessageCache_T
+
+typedef struct T *T;
+
+/*
+ * \brief get a cached message
+ * \param physid physmessage_id
+ * \return referenced entry or NULL on a miss
+ */
+extern T            MessageCache_lookup(uint64_t physid);
+/*
+ * \brief add a retrieved message to the cache
+ * \param message fully parsed message
+ * \return referenced entry, or NULL if the message has no valid
+ *         structure. Messages that do not fit the cache get a
+ *         private entry that is freed on release.
+ */
+extern T            MessageCache_store(DbmailMessage *message);
+extern void         MessageCache_release(T *);
+/*
+ * \brief would a message of this size be kept in the cache
+ */
+extern gboolean     MessageCache_accepts(uint64_t size);
+
+extern uint64_t     MessageCache_getId(T);
+extern String_T     MessageCache_getCRLF(T);
+extern const char * MessageCache_getStructure(T, gboolean extension);
+extern const char * MessageCache_getEnvelope(T);
+
+/*
+ * \brief cache statistics
+ */
+extern void         MessageCache_stats(uint64_t *hits, uint64_t *misses, uint64_t *bytes);
+
+#undef T
+
+#endif
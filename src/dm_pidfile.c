@@ -32,6 +32,7 @@
 /* These are used by pidfile_remove. */
 static FILE *pidfile_to_close;
 static char *pidfile_to_remove;
+static pid_t pidfile_owner;	/* forked children inherit the atexit handler */
 
 /* Check if a process exists. */
 static int process_exists(pid_t pid)
@@ -78,6 +79,9 @@ static void pidfile_remove(void)
 {
 	int res;
 
+	if (getpid() != pidfile_owner)
+		return;
+
 	if (pidfile_to_close) {
 		res = fclose(pidfile_to_close);
 		if (res) TRACE(TRACE_ERR, "Error closing pidfile: [%s].",
@@ -131,6 +135,7 @@ void pidfile_create(const char *pidFile, pid_t pid)
 
 	pidfile_to_close = f;
 	pidfile_to_remove = g_strdup(pidFile);
+	pidfile_owner = getpid();
 
 }
 
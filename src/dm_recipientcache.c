@@ -0,0 +1,236 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+#include "dbmail.h"
+#include "dm_recipientcache.h"
+
+#define THIS_MODULE "RecipientCache"
+
+#define RECIPIENT_CACHE_SIZE 10000 // entries
+#define RECIPIENT_CACHE_TTL 0      // seconds
+#define RECIPIENT_CACHE_NEGATIVE_TTL 0
+#define RECIPIENT_CACHE_STATS 10000
+
+typedef struct {
+	char *address;
+	delivery_status_t dsn;
+	GList *userids;   // uint64_t *
+	GList *forwards;  // char *
+	time_t expires;
+	GList *link;
+} Entry_T;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *cache = NULL; // address -> Entry_T
+static GQueue *lru = NULL;       // most recently used first
+static int cache_limit = -1;
+static int cache_ttl = RECIPIENT_CACHE_TTL;
+static int cache_negative_ttl = RECIPIENT_CACHE_NEGATIVE_TTL;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+
+static GList * ids_copy(GList *ids)
+{
+	GList *copy = NULL;
+
+	ids = g_list_first(ids);
+	while (ids) {
+		uint64_t *id = g_new0(uint64_t, 1);
+		*id = *(uint64_t *)ids->data;
+		copy = g_list_prepend(copy, id);
+		if (! g_list_next(ids)) break;
+		ids = g_list_next(ids);
+	}
+
+	return g_list_reverse(copy);
+}
+
+static GList * strings_copy(GList *strings)
+{
+	GList *copy = NULL;
+
+	strings = g_list_first(strings);
+	while (strings) {
+		copy = g_list_prepend(copy, g_strdup((char *)strings->data));
+		if (! g_list_next(strings)) break;
+		strings = g_list_next(strings);
+	}
+
+	return g_list_reverse(copy);
+}
+
+static void entry_free(Entry_T *E)
+{
+	g_free(E->address);
+	g_list_destroy(E->userids);
+	g_list_destroy(E->forwards);
+	g_free(E);
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static void entry_evict(Entry_T *E)
+{
+	g_queue_delete_link(lru, E->link);
+	g_hash_table_remove(cache, E->address);
+}
+
+static void config_int(const char *name, int *value)
+{
+	Field_T val;
+
+	config_get_value(name, "LMTP", val);
+	if (strlen(val))
+		*value = atoi(val);
+	if (*value < 0)
+		*value = 0;
+}
+
+/*
+ * Caller must hold the lock.
+ */
+static gboolean cache_init(void)
+{
+	if (cache_limit < 0) {
+		cache_limit = RECIPIENT_CACHE_SIZE;
+		config_int("resolve_cache_size", &cache_limit);
+		config_int("resolve_cache_ttl", &cache_ttl);
+		config_int("resolve_cache_negative_ttl", &cache_negative_ttl);
+		if (cache_limit > 0 && (cache_ttl > 0 || cache_negative_ttl > 0)) {
+			cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)entry_free);
+			lru = g_queue_new();
+		}
+		TRACE(TRACE_DEBUG, "recipient cache size [%d] ttl [%d] negative ttl [%d]",
+				cache_limit, cache_ttl, cache_negative_ttl);
+	}
+
+	return cache != NULL;
+}
+
+static void cache_count(gboolean hit)
+{
+	uint64_t lookups;
+
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+
+	lookups = cache_hits + cache_misses;
+	if (lookups % RECIPIENT_CACHE_STATS == 0)
+		TRACE(TRACE_INFO, "hits [%" PRIu64 "] misses [%" PRIu64 "] entries [%u]",
+				cache_hits, cache_misses, g_hash_table_size(cache));
+}
+
+gboolean RecipientCache_get(Delivery_T *delivery)
+{
+	Entry_T *E;
+	gboolean hit = FALSE;
+
+	if (! delivery->address)
+		return FALSE;
+
+	PLOCK(cache_lock);
+	if (! cache_init()) {
+		PUNLOCK(cache_lock);
+		return FALSE;
+	}
+
+	if ((E = g_hash_table_lookup(cache, delivery->address))) {
+		if (E->expires <= time(NULL)) {
+			entry_evict(E);
+		} else {
+			g_queue_unlink(lru, E->link);
+			g_queue_push_head_link(lru, E->link);
+			delivery->dsn = E->dsn;
+			delivery->userids = g_list_concat(delivery->userids, ids_copy(E->userids));
+			delivery->forwards = g_list_concat(delivery->forwards, strings_copy(E->forwards));
+			hit = TRUE;
+		}
+	}
+	cache_count(hit);
+	PUNLOCK(cache_lock);
+
+	TRACE(TRACE_DEBUG, "[%s] %s", delivery->address, hit?"hit":"miss");
+
+	return hit;
+}
+
+void RecipientCache_set(Delivery_T *delivery)
+{
+	Entry_T *E;
+	int ttl = 0;
+
+	if (! delivery->address)
+		return;
+
+	PLOCK(cache_lock);
+	if (cache_init()) {
+		if (delivery->dsn.class == DSN_CLASS_OK)
+			ttl = cache_ttl;
+		else if (delivery->dsn.class == DSN_CLASS_FAIL)
+			ttl = cache_negative_ttl;
+	}
+	if (ttl <= 0) {
+		PUNLOCK(cache_lock);
+		return;
+	}
+
+	if ((E = g_hash_table_lookup(cache, delivery->address)))
+		entry_evict(E);
+
+	while (g_hash_table_size(cache) >= (guint)cache_limit) {
+		Entry_T *last = g_queue_peek_tail(lru);
+		if (! last) break;
+		entry_evict(last);
+	}
+
+	E = g_new0(Entry_T, 1);
+	E->address = g_strdup(delivery->address);
+	E->dsn = delivery->dsn;
+	E->userids = ids_copy(delivery->userids);
+	E->forwards = strings_copy(delivery->forwards);
+	E->expires = time(NULL) + ttl;
+	g_queue_push_head(lru, E);
+	E->link = g_queue_peek_head_link(lru);
+	g_hash_table_insert(cache, E->address, E);
+	PUNLOCK(cache_lock);
+}
+
+void RecipientCache_flush(void)
+{
+	PLOCK(cache_lock);
+	if (cache) {
+		g_queue_clear(lru);
+		g_hash_table_remove_all(cache);
+	}
+	PUNLOCK(cache_lock);
+	TRACE(TRACE_INFO, "flushed");
+}
+
+void RecipientCache_stats(uint64_t *hits, uint64_t *misses)
+{
+	PLOCK(cache_lock);
+	if (hits) *hits = cache_hits;
+	if (misses) *misses = cache_misses;
+	PUNLOCK(cache_lock);
+}
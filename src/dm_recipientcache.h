@@ -0,0 +1,54 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * process-wide cache of resolved delivery addresses
+ *
+ * Keeps the outcome of dsnuser_resolve for an envelope address - the
+ * user ids and forwards it expands to and the resulting status - so
+ * mail to a large list of local recipients does not walk the alias
+ * chains in the auth backend again for every message. Unknown
+ * addresses are cached as well, for a shorter time. The cache is
+ * bounded, entries expire, and it can be flushed with SIGUSR2.
+ */
+
+#ifndef DM_RECIPIENTCACHE_H
+#define DM_RECIPIENTCACHE_H
+
+#include "dbmail.h"
+
+/*
+ * \brief fill the userids, forwards and status of a delivery
+ * from the cache
+ * \return TRUE on a hit
+ */
+extern gboolean RecipientCache_get(Delivery_T *delivery);
+
+/*
+ * \brief remember how the address of a delivery was resolved.
+ * Temporary failures are never cached.
+ */
+extern void     RecipientCache_set(Delivery_T *delivery);
+
+extern void     RecipientCache_flush(void);
+extern void     RecipientCache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,483 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "dbmail.h"
+#include "dm_searchindex.h"
+#include "dm_headerqueue.h"
+
+#define THIS_MODULE "SearchIndex"
+
+#define T SearchIndex_T
+
+#define SEARCH_INDEX_SIZE 64 // mailboxes
+#define SEARCH_INDEX_STATS 1000
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+static const char *search_fields[SEARCH_FIELD_MAX] = {
+	"from", "to", "cc", "subject"
+};
+
+typedef struct {
+	const char *fields[SEARCH_FIELD_MAX];
+	const char *sortkeys[SEARCH_FIELD_MAX];
+	const char *date;
+	const char *sortdate;
+} Entry_T;
+
+struct T {
+	uint64_t id;             // mailbox_idnr
+	uint64_t complete;       // all messages up to this uid are indexed
+	GTree *entries;          // uid -> Entry_T
+	GStringChunk *strings;   // interned values
+	pthread_mutex_t lock;
+	GList *link;             // position in the lru queue
+	int refs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GTree *cache = NULL;   // mailbox_idnr -> T
+static GQueue *lru = NULL;    // most recently used first
+static int cache_limit = -1;
+static uint64_t cache_hits = 0;
+static uint64_t cache_loads = 0;
+
+int SearchIndex_field(const char *headername)
+{
+	int i;
+	for (i = 0; i < SEARCH_FIELD_MAX; i++) {
+		if (MATCH(headername, search_fields[i]))
+			return i;
+	}
+	return -1;
+}
+
+static T index_new(uint64_t id)
+{
+	T I = g_new0(struct T, 1);
+	I->id = id;
+	I->entries = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, g_free);
+	I->strings = g_string_chunk_new(4096);
+	pthread_mutex_init(&I->lock, NULL);
+	return I;
+}
+
+static void index_clear(T I)
+{
+	g_tree_destroy(I->entries);
+	g_string_chunk_free(I->strings);
+	I->entries = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, g_free);
+	I->strings = g_string_chunk_new(4096);
+	I->complete = 0;
+}
+
+static void index_free(T I)
+{
+	g_tree_destroy(I->entries);
+	g_string_chunk_free(I->strings);
+	pthread_mutex_destroy(&I->lock);
+	g_free(I);
+}
+
+static void cache_init(void)
+{
+	Field_T val;
+
+	if (cache_limit >= 0)
+		return;
+
+	cache_limit = SEARCH_INDEX_SIZE;
+	config_get_value("search_index_mailboxes", "IMAP", val);
+	if (strlen(val))
+		cache_limit = atoi(val);
+	if (cache_limit < 0)
+		cache_limit = 0;
+
+	if (cache_limit > 0) {
+		cache = g_tree_new((GCompareFunc)ucmp);
+		lru = g_queue_new();
+	}
+	TRACE(TRACE_DEBUG, "search index size [%d] mailboxes", cache_limit);
+}
+
+static Entry_T * index_entry(T I, uint64_t uid)
+{
+	Entry_T *E;
+	uint64_t *key;
+
+	if ((E = g_tree_lookup(I->entries, &uid)))
+		return E;
+
+	key = g_new0(uint64_t, 1);
+	*key = uid;
+	E = g_new0(Entry_T, 1);
+	g_tree_insert(I->entries, key, E);
+
+	return E;
+}
+
+static void index_add_value(T I, Entry_T *E, int field, const char *raw)
+{
+	gchar *value;
+
+	if (g_utf8_validate(raw, -1, NULL))
+		value = g_utf8_casefold(raw, -1);
+	else
+		value = g_ascii_strdown(raw, -1);
+
+	if (E->fields[field]) {
+		gchar *joined = g_strconcat(E->fields[field], "\n", value, NULL);
+		E->fields[field] = g_string_chunk_insert_const(I->strings, joined);
+		g_free(joined);
+	} else {
+		E->fields[field] = g_string_chunk_insert_const(I->strings, value);
+	}
+	g_free(value);
+}
+
+/* messages without any header rows, while deferred caching is on */
+static void index_pending(T I, Connection_T c, GTree *pending)
+{
+	ResultSet_T r; PreparedStatement_T s;
+
+	if (! HeaderQueue_deferred())
+		return;
+
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "SELECT m.message_idnr FROM %smessages m "
+			"LEFT JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+			"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) AND m.message_idnr > ? "
+			"AND h.physmessage_id IS NULL",
+			DBPFX, DBPFX);
+	db_stmt_set_u64(s, 1, I->id);
+	db_stmt_set_int(s, 2, MESSAGE_STATUS_NEW);
+	db_stmt_set_int(s, 3, MESSAGE_STATUS_SEEN);
+	db_stmt_set_u64(s, 4, I->complete);
+	r = db_stmt_query(s);
+	while (db_result_next(r)) {
+		uint64_t *uid = g_new0(uint64_t, 1);
+		*uid = db_result_get_u64(r, 0);
+		g_tree_insert(pending, uid, uid);
+	}
+}
+
+struct index_missing {
+	T index;
+	GTree *pending;
+	uint64_t complete;
+	gboolean gap;
+};
+
+/*
+ * messages without any of the indexed headers get an empty entry,
+ * and the uid up to which the index is complete is moved forward.
+ */
+static gboolean _index_fill(uint64_t *uid, gpointer UNUSED msn, struct index_missing *m)
+{
+	if (*uid <= m->index->complete)
+		return FALSE;
+
+	if (m->pending && g_tree_lookup(m->pending, uid)) {
+		m->gap = TRUE;
+		return FALSE;
+	}
+
+	index_entry(m->index, *uid);
+
+	if (! m->gap)
+		m->complete = *uid;
+
+	return FALSE;
+}
+
+struct index_partial {
+	uint64_t complete;
+	GList *uids;
+};
+
+static gboolean _index_partial(uint64_t *uid, gpointer UNUSED E, struct index_partial *p)
+{
+	if (*uid > p->complete)
+		p->uids = g_list_prepend(p->uids, uid);
+	return FALSE;
+}
+
+/*
+ * entries past the complete part may hold only some of their
+ * headers, drop them so they are loaded again as a whole.
+ */
+static void index_trim(T I)
+{
+	GList *l;
+	struct index_partial p;
+
+	p.complete = I->complete;
+	p.uids = NULL;
+	g_tree_foreach(I->entries, (GTraverseFunc)_index_partial, &p);
+
+	l = g_list_first(p.uids);
+	while (l) {
+		g_tree_remove(I->entries, l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	g_list_free(g_list_first(p.uids));
+}
+
+static int index_load(T I, GTree *ids)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile int t = DM_SUCCESS;
+	volatile int rows = 0;
+	GTree *pending = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+	struct index_missing m;
+	Field_T frag;
+
+	date2char_str("v.datefield", &frag);
+
+	index_trim(I);
+
+	m.index = I;
+	m.pending = NULL;
+	m.complete = I->complete;
+	m.gap = FALSE;
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT m.message_idnr, n.headername, v.headervalue, %s, v.sortfield "
+				"FROM %smessages m "
+				"JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+				"JOIN %sheadername n ON h.headername_id = n.id "
+				"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) AND m.message_idnr > ? "
+				"AND n.headername IN ('from','to','cc','subject','date')",
+				frag, DBPFX, DBPFX, DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, I->id);
+		db_stmt_set_int(s, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(s, 3, MESSAGE_STATUS_SEEN);
+		db_stmt_set_u64(s, 4, I->complete);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			uint64_t uid = db_result_get_u64(r, 0);
+			const char *name = db_result_get(r, 1);
+			const char *sortfield = db_result_get(r, 4);
+			Entry_T *E = index_entry(I, uid);
+			int field;
+
+			if (MATCH(name, "date")) {
+				const char *date = db_result_get(r, 3);
+				if (date && strlen(date) >= 10 && (! E->date)) {
+					char day[11];
+					g_strlcpy(day, date, sizeof(day));
+					E->date = g_string_chunk_insert_const(I->strings, day);
+				}
+				if (sortfield && (! E->sortdate))
+					E->sortdate = g_string_chunk_insert_const(I->strings, sortfield);
+			} else if ((field = SearchIndex_field(name)) >= 0) {
+				int l;
+				const void *blob = db_result_get_blob(r, 2, &l);
+				gchar *value = g_strndup(blob, l);
+				index_add_value(I, E, field, value);
+				g_free(value);
+				if (sortfield && (! E->sortkeys[field]))
+					E->sortkeys[field] = g_string_chunk_insert_const(I->strings, sortfield);
+			}
+			rows++;
+		}
+
+		index_pending(I, c, pending);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		g_tree_destroy(pending);
+		index_clear(I);
+		return t;
+	}
+
+	m.pending = pending;
+	g_tree_foreach(ids, (GTraverseFunc)_index_fill, &m);
+	I->complete = m.complete;
+	g_tree_destroy(m.pending);
+
+	TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] loaded [%d] headers, complete up to [%" PRIu64 "]",
+			I->id, rows, I->complete);
+
+	return t;
+}
+
+struct index_check {
+	uint64_t complete;
+	gboolean missing;
+};
+
+/*
+ * does the index miss any message the caller can see
+ */
+static gboolean _index_missing(uint64_t *uid, gpointer UNUSED msn, struct index_check *c)
+{
+	if (*uid > c->complete)
+		c->missing = TRUE;
+	return c->missing;
+}
+
+static void cache_count(gboolean hit)
+{
+	uint64_t lookups;
+
+	if (hit)
+		cache_hits++;
+	else
+		cache_loads++;
+
+	lookups = cache_hits + cache_loads;
+	if (lookups % SEARCH_INDEX_STATS == 0)
+		TRACE(TRACE_INFO, "hits [%" PRIu64 "] loads [%" PRIu64 "] mailboxes [%d]",
+				cache_hits, cache_loads, g_tree_nnodes(cache));
+}
+
+T SearchIndex_get(uint64_t mailbox_id, GTree *ids)
+{
+	T I;
+	struct index_check check;
+
+	PLOCK(cache_lock);
+	cache_init();
+	if (! cache) {
+		PUNLOCK(cache_lock);
+		return NULL;
+	}
+
+	if ((I = g_tree_lookup(cache, &mailbox_id))) {
+		g_queue_unlink(lru, I->link);
+		g_queue_push_head_link(lru, I->link);
+	} else {
+		GList *l;
+		while (g_tree_nnodes(cache) >= cache_limit) {
+			T last = NULL;
+			// evict the least recently used index that is not in use
+			for (l = g_queue_peek_tail_link(lru); l; l = l->prev) {
+				if (((T)l->data)->refs == 0) {
+					last = (T)l->data;
+					break;
+				}
+			}
+			if (! last) break;
+			g_queue_delete_link(lru, last->link);
+			g_tree_remove(cache, &last->id);
+			index_free(last);
+		}
+		I = index_new(mailbox_id);
+		g_queue_push_head(lru, I);
+		I->link = g_queue_peek_head_link(lru);
+		g_tree_insert(cache, &I->id, I);
+	}
+	I->refs++;
+	PUNLOCK(cache_lock);
+
+	PLOCK(I->lock);
+
+	// expunged messages are only dropped by starting over
+	if (g_tree_nnodes(I->entries) > 2 * g_tree_nnodes(ids) + 100)
+		index_clear(I);
+
+	check.complete = I->complete;
+	check.missing = FALSE;
+	g_tree_foreach(ids, (GTraverseFunc)_index_missing, &check);
+
+	if (check.missing && (index_load(I, ids) == DM_EQUERY)) {
+		SearchIndex_release(&I);
+		return NULL;
+	}
+
+	PLOCK(cache_lock);
+	cache_count(! check.missing);
+	PUNLOCK(cache_lock);
+
+	return I;
+}
+
+void SearchIndex_release(T *I)
+{
+	T i = *I;
+
+	if (! i)
+		return;
+
+	PUNLOCK(i->lock);
+
+	PLOCK(cache_lock);
+	i->refs--;
+	PUNLOCK(cache_lock);
+
+	*I = NULL;
+}
+
+gboolean SearchIndex_has(T I, uint64_t uid)
+{
+	return (uid <= I->complete) && g_tree_lookup(I->entries, &uid);
+}
+
+const char * SearchIndex_getField(T I, uint64_t uid, SearchField_T field)
+{
+	Entry_T *E;
+	if (! (E = g_tree_lookup(I->entries, &uid)))
+		return NULL;
+	return E->fields[field];
+}
+
+const char * SearchIndex_getDate(T I, uint64_t uid)
+{
+	Entry_T *E;
+	if (! (E = g_tree_lookup(I->entries, &uid)))
+		return NULL;
+	return E->date;
+}
+
+const char * SearchIndex_getSortKey(T I, uint64_t uid, SearchField_T field)
+{
+	Entry_T *E;
+	if (! (E = g_tree_lookup(I->entries, &uid)))
+		return NULL;
+	return E->sortkeys[field];
+}
+
+const char * SearchIndex_getSortDate(T I, uint64_t uid)
+{
+	Entry_T *E;
+	if (! (E = g_tree_lookup(I->entries, &uid)))
+		return NULL;
+	return E->sortdate;
+}
+
+void SearchIndex_stats(uint64_t *hits, uint64_t *loads)
+{
+	PLOCK(cache_lock);
+	if (hits) *hits = cache_hits;
+	if (loads) *loads = cache_loads;
+	PUNLOCK(cache_lock);
+}
+
+#undef T
@@ -0,0 +1,97 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * process-wide per-mailbox index of searchable header fields
+ *
+ * For every message of a mailbox the index holds the case-folded
+ * From, To, Cc and Subject header values and the sent date, as found
+ * in the header cache, and the SORT keys of those fields as computed
+ * at delivery. Equal values are stored once. Headers never change
+ * after delivery, so an index only has to load the messages added
+ * since it was last used. Flags, keywords, sizes and internal dates
+ * are taken from the MailboxState of the session, which together lets
+ * most SEARCH commands run without a database query.
+ */
+
+#ifndef DM_SEARCHINDEX_H
+#define DM_SEARCHINDEX_H
+
+#include "dbmail.h"
+
+#define T SearchIndex_T
+
+typedef struct T *T;
+
+typedef enum {
+	SEARCH_FIELD_FROM = 0,
+	SEARCH_FIELD_TO,
+	SEARCH_FIELD_CC,
+	SEARCH_FIELD_SUBJECT,
+	SEARCH_FIELD_MAX
+} SearchField_T;
+
+/*
+ * \brief map a lower-cased header name to an indexed field
+ * \return the field, or -1 if the header is not indexed
+ */
+extern int          SearchIndex_field(const char *headername);
+
+/*
+ * \brief get the index of a mailbox, loading the messages it misses
+ * \param mailbox_id mailbox
+ * \param ids uid -> msn tree of the messages the caller can see
+ * \return locked index, or NULL if disabled or on error
+ */
+extern T            SearchIndex_get(uint64_t mailbox_id, GTree *ids);
+extern void         SearchIndex_release(T *);
+
+/*
+ * \brief is a message indexed. Messages whose header cache is still
+ *        pending are not.
+ */
+extern gboolean     SearchIndex_has(T, uint64_t uid);
+/*
+ * \return all case-folded values of the field, separated by
+ *         newlines, or NULL
+ */
+extern const char * SearchIndex_getField(T, uint64_t uid, SearchField_T field);
+/*
+ * \return sent date as YYYY-MM-DD, or NULL
+ */
+extern const char * SearchIndex_getDate(T, uint64_t uid);
+/*
+ * \return SORT key of the first header of the field: the mailbox of
+ *         the first address, or the base subject. NULL if missing.
+ */
+extern const char * SearchIndex_getSortKey(T, uint64_t uid, SearchField_T field);
+/*
+ * \return sent date in UTC as YYYY-MM-DD HH:MM:SS, or NULL
+ */
+extern const char * SearchIndex_getSortDate(T, uint64_t uid);
+
+/*
+ * \brief cache statistics
+ */
+extern void         SearchIndex_stats(uint64_t *hits, uint64_t *loads);
+
+#undef T
+
+#endif
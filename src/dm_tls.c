@@ -33,11 +33,47 @@
 
 SSL_CTX *tls_context;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* 
+ * older openssl releases need locking callbacks before TLS 
+ * sessions can be handled by more than one reactor thread
+ */
+static pthread_mutex_t *tls_locks = NULL;
+
+static void tls_locking_cb(int mode, int n, const char UNUSED *file, int UNUSED line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&tls_locks[n]);
+	else
+		pthread_mutex_unlock(&tls_locks[n]);
+}
+
+static unsigned long tls_thread_id_cb(void)
+{
+	return (unsigned long)pthread_self();
+}
+
+static void tls_init_locks(void)
+{
+	int i;
+	if (tls_locks)
+		return;
+	tls_locks = g_new0(pthread_mutex_t, CRYPTO_num_locks());
+	for (i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&tls_locks[i], NULL);
+	CRYPTO_set_id_callback(tls_thread_id_cb);
+	CRYPTO_set_locking_callback(tls_locking_cb);
+}
+#endif
+
 /* Create the initial SSL context structure */
 SSL_CTX *tls_init(void) {
 	SSL_CTX *ctx;
 	SSL_library_init();
 	SSL_load_error_strings();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	tls_init_locks();
+#endif
 	/* FIXME: We need to allow for the allowed SSL/TLS versions to be */
 	/* configurable. */
 	
@@ -25,6 +25,7 @@
  */
 
 #include "dbmail.h"
+#include "dm_mailboxwatch.h"
 
 #define THIS_MODULE "imap"
 
@@ -32,8 +33,6 @@
 #define MAX_FAULTY_RESPONSES 5
 
 extern ServerConfig_T *server_conf;
-extern GAsyncQueue *queue;
-extern struct event_base *evbase;
 
 const char AcceptedTagChars[] =
     "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
@@ -360,7 +359,10 @@ void imap_cb_time(void *arg)
 		if (! (++session->loop % idle_interval)) {
 			imap_session_printf(session, "* OK\r\n");
 		}
-		dbmail_imap_session_mailbox_status(session,TRUE);
+		// with the mailbox watcher running we are woken up
+		// through imap_cb_notify when the mailbox changes
+		if (! MailboxWatch_running())
+			dbmail_imap_session_mailbox_status(session,TRUE);
 		dbmail_imap_session_buff_flush(session);
 		ci_uncork(session->ci);
 	} else {
@@ -370,6 +372,26 @@ void imap_cb_time(void *arg)
 	}
 }
 
+/*
+ * called by the mailbox watcher when the mailbox
+ * selected by an idling session has changed
+ */
+static void imap_cb_notify(gpointer arg)
+{
+	ImapSession *session = (ImapSession *) arg;
+	TRACE(TRACE_DEBUG,"[%p]", session);
+
+	if (session->state == CLIENTSTATE_QUIT_QUEUED)
+		return;
+	if (! (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE))
+		return;
+
+	ci_cork(session->ci);
+	dbmail_imap_session_mailbox_status(session,TRUE);
+	dbmail_imap_session_buff_flush(session);
+	ci_uncork(session->ci);
+}
+
 static int checktag(const char *s)
 {
 	int i;
@@ -531,6 +553,8 @@ void imap_handle_input(ImapSession *session)
 			else
 				imap_session_printf(session,"%s BAD Expecting DONE\r\n", session->tag);
 
+			if (session->mailbox)
+				MailboxWatch_remove(session->mailbox->id, session);
 			session->command_state = TRUE; // done
 			imap_session_reset(session);
 
@@ -590,11 +614,12 @@ int imap_handle_connection(client_sock *c)
 
 	ci = client_init(c);
 
+	MailboxWatch_start(imap_cb_notify);
+
 	session = dbmail_imap_session_new(c->pool);
 
-	assert(evbase);
-	ci->rev = event_new(evbase, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
-	ci->wev = event_new(evbase, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+	ci->rev = event_new(dm_reactor_base(), ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
+	ci->wev = event_new(dm_reactor_base(), ci->tx, EV_WRITE, socket_write_cb, (void *)session);
 	ci_cork(ci);
 
 	session->ci = ci;
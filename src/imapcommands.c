@@ -26,6 +26,8 @@
  */
 
 #include "dbmail.h"
+#include "dm_mailboxwatch.h"
+#include "dm_mailboxlist.h"
 #define THIS_MODULE "imap"
 
 #ifndef _GNU_SOURCE
@@ -36,9 +38,6 @@ extern DBParam_T db_params;
 #define DBPFX db_params.pfx
 
 extern ServerConfig_T *server_conf;
-extern int selfpipe[2];
-extern pthread_mutex_t selfpipe_lock;
-extern GAsyncQueue *queue;
 extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern const char AcceptedMailboxnameChars[];
@@ -50,27 +49,22 @@ struct cmd_t {
 	int action;
 	int flaglist[IMAP_NFLAGS];
 	GList *keywords;
-	uint64_t mailbox_id;
+	GTree *changed;
 	uint64_t seq;
 	uint64_t unchangedsince;
 };
 
-/* 
- * push a message onto the queue and notify the
- * event-loop by sending a char into the selfpipe
- */
-
 #define SESSION_GET \
 	ImapSession *self = D->session
 
+/* 
+ * push a message onto the queue of the session's reactor
+ * and notify its event-loop by sending a char into the selfpipe
+ */
+
 #define SESSION_RETURN \
 	D->session->command_state = TRUE; \
-	g_async_queue_push(queue, (gpointer)D); \
-	PLOCK(selfpipe_lock); \
-	if (selfpipe[1] > -1) { \
-		if (write(selfpipe[1], "D", 1)) { /* ignore */; } \
-	} \
-	PUNLOCK(selfpipe_lock); \
+	dm_thread_data_return(D); \
 	return;
 
 /* Macro for OK answers with optional response code */
@@ -654,6 +648,7 @@ void _ic_delete_enter(dm_thread_data *D)
 			}
 
 			MailboxState_setNoSelect(S, TRUE);
+			MailboxList_changed();
 			db_mailbox_seq_update(mailbox_idnr, 0);
 			if (! dm_quota_user_dec(self->userid, mailbox_size)) {
 				D->status=DM_EQUERY;
@@ -918,15 +913,15 @@ int _ic_unsubscribe(ImapSession *self)
  *
  * This is called for each found folder in a loop.
  */
-static gboolean _ic_list_write_out_found_folder(gpointer UNUSED key, MailboxState_T M, ImapSession *self)
+static void _ic_list_write_out_found_folder(ImapSession *self, MailboxListItem_T *I)
 {
 	GList *plist = NULL;
 	char *pstring = NULL;
-	if (MailboxState_noSelect(M))
+	if (I->no_select)
 		plist = g_list_append(plist, "\\noselect");
-	if (MailboxState_noInferiors(M))
+	if (I->no_inferiors)
 		plist = g_list_append(plist, "\\noinferiors");
-	if (MailboxState_noChildren(M))
+	if (I->no_children)
 		plist = g_list_append(plist, "\\hasnochildren");
 	else
 		plist = g_list_append(plist, "\\haschildren");
@@ -934,18 +929,10 @@ static gboolean _ic_list_write_out_found_folder(gpointer UNUSED key, MailboxStat
 	/* show */
 	pstring = dbmail_imap_plist_as_string(plist);
 	dbmail_imap_session_buff_printf(self, "* %s %s \"%s\" \"%s\"\r\n", self->command,
-			pstring, MAILBOX_SEPARATOR, MailboxState_getName(M));
+			pstring, MAILBOX_SEPARATOR, I->name);
 
 	g_list_free(g_list_first(plist));
 	g_free(pstring);
-
-	return FALSE;
-}
-
-void free_mailboxstate(void *data)
-{
-	MailboxState_T M = (MailboxState_T)data;
-	MailboxState_free(&M);
 }
 
 /*
@@ -957,17 +944,9 @@ void _ic_list_enter(dm_thread_data *D)
 {
 	SESSION_GET;
 	int list_is_lsub = 0;
-	GList *children = NULL;
-	// store the found real folders
-	GTree *found_folders = NULL;
-	// found hierarchy elements should have lower priority than real folders
-	// that's why store them separately in another GTree
-	// this is to not to let them mask out real folders if they are found first
-	GTree *found_hierarchy = NULL;
-	MailboxState_T M = NULL;
+	GList *found = NULL, *l;
 	unsigned i;
 	char pattern[255];
-	char mailbox[IMAP_MAX_MAILBOX_NAMELEN];
 	const char *refname;
 
 	/* check if self->args are both empty strings, i.e. A001 LIST "" "" 
@@ -995,112 +974,22 @@ void _ic_list_enter(dm_thread_data *D)
 
 	if (self->command_type == IMAP_COMM_LSUB) list_is_lsub = 1;
 
-	D->status = db_findmailbox_by_regex(self->userid, pattern, &children, list_is_lsub);
-	if (D->status == -1) {
+	D->status = MailboxList_find(self->userid, pattern, list_is_lsub, &found);
+	if (D->status == DM_EQUERY) {
 		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
 		SESSION_RETURN;
-	} else if (D->status == 1) {
-		dbmail_imap_session_buff_printf(self, "%s BAD invalid pattern specified\r\n", self->tag);
-		SESSION_RETURN;
 	}
 
-	found_folders = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,g_free,free_mailboxstate);
-	found_hierarchy = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,g_free,free_mailboxstate);
-
-	while ((! D->status) && children) {
-		gboolean show = FALSE;
-		// determine whether the found element is part of a hierarchy
-		// if yes, it will be added to a separate tree (to have lower priority)
-		gboolean hierarchy_element = FALSE;
-
-		memset(&mailbox, 0, IMAP_MAX_MAILBOX_NAMELEN);
-
-		uint64_t mailbox_id = *(uint64_t *)children->data;
-		if ( (D->status = db_getmailboxname(mailbox_id, self->userid, mailbox)) != DM_SUCCESS) {
-			break;
-		}
-
-		// avoid fully loading mailbox here
-		M = MailboxState_new(self->pool, 0);
-		MailboxState_setId(M, mailbox_id);
-		MailboxState_info(M);
-		MailboxState_setName(M, mailbox);
-
-		/* Enforce match of mailbox to pattern. */
-		TRACE(TRACE_DEBUG,"test if [%s] matches [%s]", mailbox, pattern);
-		if (! listex_match(pattern, mailbox, MAILBOX_SEPARATOR, 0)) {
-			TRACE(TRACE_DEBUG,"mailbox [%s] doesn't match pattern [%s]", mailbox, pattern);
-			if (g_str_has_suffix(pattern,"%")) {
-				TRACE(TRACE_DEBUG,"searching for matching hierarchy");
-				/*
-				   If the "%" wildcard is the last character of a mailbox name argument, matching levels
-				   of hierarchy are also returned.  If these levels of hierarchy are not also selectable 
-				   mailboxes, they are returned with the \Noselect mailbox name attribute
-				   */
-
-				// split mailbox name by delimiters
-				char *m = NULL, **p = g_strsplit(mailbox,MAILBOX_SEPARATOR,0);
-				int l = g_strv_length(p);
-				// cut each part off from the name in each iteration
-				// and check whether that partial name matches
-				// that indicates a matching hierarchy
-				while (l > 1) {
-					if (p[l]) {
-						g_free(p[l]);
-						p[l] = NULL;
-					}
-					m = g_strjoinv(MAILBOX_SEPARATOR, p);
-					if (listex_match(pattern, m, MAILBOX_SEPARATOR, 0)) {
-						TRACE(TRACE_DEBUG,"partial hierarchy [%s] matches [%s]", m, pattern);
-
-						MailboxState_setName(M, m);
-						MailboxState_setNoSelect(M, TRUE);
-						MailboxState_setNoChildren(M, FALSE);
-						show = TRUE;
-						hierarchy_element = TRUE;
-						g_free(m);
-						break;
-					} else {
-						TRACE(TRACE_DEBUG,"partial hierarchy [%s] doesn't match [%s]", m, pattern);
-					}
-					g_free(m);
-					l--;
-				}
-				g_strfreev(p);
-			}
-		} else {
-			TRACE(TRACE_DEBUG,"[%s] does match [%s]", mailbox, pattern);
-			show = TRUE;
-		}
-
-		// add the result if either:
-		//  - it's not a hierarchy element (so real folder) AND it cannot be found among real folders
-		//  - it's a hierarchy element AND it cannot be found among hierarchy elements
-		if (show && MailboxState_getName(M)) {
-			char *s = g_strdup(MailboxState_getName(M));
-			if (! hierarchy_element)
-				g_tree_insert(found_folders, (gpointer)s, M);
-			else 
-				g_tree_insert(found_hierarchy, (gpointer)s, M);
-		} else {
-			MailboxState_free(&M);
-		}
-
-		if (! g_list_next(children)) break;
-		children = g_list_next(children);
-	}
-
-	TRACE(TRACE_DEBUG,"copying found hierarchy to found_folders");
-	g_tree_merge(found_folders, found_hierarchy, IST_SUBSEARCH_OR);
-
 	TRACE(TRACE_DEBUG,"writing out found_folders");
-	g_tree_foreach(found_folders, (GTraverseFunc)_ic_list_write_out_found_folder, self);
-
-	if (found_hierarchy) g_tree_destroy(found_hierarchy);
-	if (found_folders) g_tree_destroy(found_folders);
-	if (children) g_list_destroy(children);
+	l = g_list_first(found);
+	while (l) {
+		_ic_list_write_out_found_folder(self, (MailboxListItem_T *)l->data);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+	MailboxList_free(&found);
 
-	if (! D->status) dbmail_imap_session_buff_printf(self, "%s OK %s completed\r\n", self->tag, self->command);
+	dbmail_imap_session_buff_printf(self, "%s OK %s completed\r\n", self->tag, self->command);
 
 	SESSION_RETURN;
 }
@@ -1269,6 +1158,8 @@ int _ic_idle(ImapSession *self)
 	self->command_state = IDLE;
 	dbmail_imap_session_buff_printf(self, "+ idling\r\n");
 	dbmail_imap_session_mailbox_status(self,TRUE);
+	if (self->state == CLIENTSTATE_SELECTED)
+		MailboxWatch_add(self->mailbox->id, MailboxState_getSeq(self->mailbox->mbstate), self);
 	dbmail_imap_session_buff_flush(self);
 	ci_uncork(self->ci);
 
@@ -1436,7 +1327,6 @@ void _ic_append_enter(dm_thread_data *D)
 	// MessageInfo
 	info = g_new0(MessageInfo,1);
 	info->uid = message_id;
-	info->mailbox_id = mboxid;
 	for (flagcount = 0; flagcount < IMAP_NFLAGS; flagcount++)
 		info->flags[flagcount] = flaglist[flagcount];
 	info->flags[IMAP_FLAG_RECENT] = 1;
@@ -1732,6 +1622,38 @@ int _dm_imapsession_get_ids(ImapSession *self, const char *set)
 
 
 
+/*
+ * collapse the selected message ids into ranges of messages
+ * that are adjacent in the mailbox, for the set-based updates
+ */
+static GList * _dm_imapsession_get_ranges(ImapSession *self)
+{
+	GList *ids, *ranges = NULL;
+	GTree *msns = MailboxState_getIds(self->mailbox->mbstate);
+	uint64_t *range = NULL, last = 0;
+
+	ids = g_list_first(g_tree_keys(self->ids));
+	while (ids) {
+		uint64_t *id = (uint64_t *)ids->data;
+		uint64_t *msn = g_tree_lookup(msns, id);
+
+		if (range && msn && last && (*msn == last + 1)) {
+			range[1] = *id;
+		} else {
+			range = g_new0(uint64_t, 2);
+			range[0] = range[1] = *id;
+			ranges = g_list_prepend(ranges, range);
+		}
+		last = msn ? *msn : 0;
+
+		if (! g_list_next(ids)) break;
+		ids = g_list_next(ids);
+	}
+	g_list_free(g_list_first(ids));
+
+	return g_list_reverse(ranges);
+}
+
 /*
  * _ic_fetch()
  *
@@ -1813,18 +1735,8 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 
 	msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), id);
 
-	if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
-		changed = db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, cmd->unchangedsince, msginfo);
-		if (changed < 0) {
-			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
-			D->status = TRUE;
-			return TRUE;
-		} else if (changed) {
-			db_message_set_seq(*id, cmd->seq);
-		} else {
-			self->ids_list = g_list_prepend(self->ids_list, id);
-		}
-	}
+	if (cmd->changed && g_tree_lookup(cmd->changed, id))
+		changed = 1;
 
 	// Set the system flags
 	for (i = 0; i < IMAP_NFLAGS; i++) {
@@ -1891,6 +1803,7 @@ static void _ic_store_enter(dm_thread_data *D)
 	bool needflags = false;
 	int startflags = 0, endflags = 0;
 	String_T buffer = NULL;
+	GList *failed = NULL;
 
 	k = self->args_idx;
 
@@ -2043,7 +1956,22 @@ static void _ic_store_enter(dm_thread_data *D)
 		if (self->ids) {
 			uint64_t seq = db_mailbox_seq_update(MailboxState_getId(self->mailbox->mbstate), 0);
 			cmd.seq = seq;
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+			if (g_tree_nnodes(self->ids) && MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
+				GList *ranges = _dm_imapsession_get_ranges(self);
+				cmd.changed = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+				if (db_set_msgflag_set(MailboxState_getId(self->mailbox->mbstate), ranges,
+							cmd.flaglist, cmd.keywords, cmd.action,
+							cmd.unchangedsince, seq, cmd.changed, &failed) < 0) {
+					dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+					D->status = TRUE;
+				}
+				g_list_destroy(ranges);
+			}
+			if (! D->status)
+				g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+			if (cmd.changed)
+				g_tree_destroy(cmd.changed);
+			self->cmd = NULL;
 		}
 	}
 
@@ -2051,16 +1979,16 @@ static void _ic_store_enter(dm_thread_data *D)
 
 	if (result || D->status) {
 		if (result) D->status = result;
+		g_list_destroy(failed);
 		SESSION_RETURN;
 	}
 
-	if (self->ids_list) {
-		GString *failed_ids = g_list_join_u64(self->ids_list, ",");
+	if (failed) {
+		GString *failed_ids = g_list_join_u64(failed, ",");
 		buffer = p_string_new(self->pool, "");
 		p_string_printf(buffer, "MODIFIED [%s]", failed_ids->str);
 		g_string_free(failed_ids, TRUE);
-		g_list_free(g_list_first(self->ids_list));
-		self->ids_list = NULL;
+		g_list_destroy(failed);
 		SESSION_OK_WITH_RESP_CODE(p_string_str(buffer));
 		p_string_free(buffer, TRUE);
 	} else {
@@ -2083,47 +2011,18 @@ int _ic_store(ImapSession *self)
  * copy a message to another mailbox
  */
 
-static gboolean _do_copy(uint64_t *id, gpointer UNUSED value, ImapSession *self)
-{
-	struct cmd_t *cmd = self->cmd;
-	uint64_t newid = 0;
-	int result;
-	uint64_t *new_ids_element = NULL;
-
-	result = db_copymsg(*id, cmd->mailbox_id, self->userid, &newid, TRUE);
-	db_message_set_seq(*id, cmd->seq);
-	if (result == -1) {
-		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
-		return TRUE;
-	}
-	if (result == -2) {
-		dbmail_imap_session_buff_printf(self, "%s NO quotum would exceed\r\n", self->tag);
-		return TRUE;
-	}
-	// insert the new uid to the new_ids collection
-	// reserve memory for the new element in new_ids
-	new_ids_element = g_new0(uint64_t,1);
-	*new_ids_element = newid;
-	TRACE(TRACE_DEBUG, "copied uid %" PRIu64 " -> %" PRIu64, *id, *new_ids_element);
-	// prepending is faster then appending
-	self->new_ids = g_list_prepend(self->new_ids, new_ids_element);
-	return FALSE;
-}
-
-
 static void _ic_copy_enter(dm_thread_data *D)
 {
 	SESSION_GET;
 	uint64_t destmboxid;
-	int result;
+	int result, copied = DM_SUCCESS;
 	MailboxState_T S;
-	struct cmd_t cmd;
 	const char *src, *dst;
 
 	src = p_string_str(self->args[self->args_idx]);
 	dst = p_string_str(self->args[self->args_idx+1]);
 
-	GList *old_ids;
+	GList *old_ids = NULL;
 	GString *old_ids_buff;
 	GString *new_ids_buff;
 
@@ -2148,30 +2047,39 @@ static void _ic_copy_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
-	memset(&cmd, 0, sizeof(cmd));
-	cmd.mailbox_id = destmboxid;
-	self->cmd = &cmd;
 	if ((result = _dm_imapsession_get_ids(self, src)) == DM_SUCCESS) {
-		if (self->ids) {
-			cmd.seq = db_mailbox_seq_update(destmboxid, 0);
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_copy, self);
+		if (self->ids && g_tree_nnodes(self->ids)) {
+			GList *ranges = _dm_imapsession_get_ranges(self);
+			copied = db_copymsg_set(MailboxState_getId(self->mailbox->mbstate), ranges,
+					destmboxid, self->userid, TRUE, &old_ids, &self->new_ids);
+			g_list_destroy(ranges);
 		}
 	}
-	self->cmd = NULL;
 
 	if (result) {
 		D->status = result;
 		SESSION_RETURN;
 	}
 
+	if (copied == -2) {
+		dbmail_imap_session_buff_printf(self, "%s NO quotum would exceed\r\n", self->tag);
+		D->status = 1;
+		SESSION_RETURN;
+	} else if (copied == DM_EGENERAL) {
+		dbmail_imap_session_buff_printf(self, "%s NO some of the requested messages no longer exist\r\n", self->tag);
+		D->status = 1;
+		SESSION_RETURN;
+	} else if (copied < 0) {
+		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+		D->status = 1;
+		SESSION_RETURN;
+	}
+
 	if (MailboxState_getId(self->mailbox->mbstate) == destmboxid)
 		dbmail_imap_session_mailbox_status(self, TRUE);
 
-	self->new_ids = g_list_reverse(self->new_ids);
-
-	old_ids = g_tree_keys(self->ids);
 	old_ids_buff = g_list_join_u64(old_ids,",");
-	g_list_free(g_list_first(old_ids));
+	g_list_destroy(old_ids);
 
 	new_ids_buff = g_list_join_u64(self->new_ids,",");
 
@@ -21,6 +21,7 @@
 /* implementation for lmtp commands according to RFC 1081 */
 
 #include "dbmail.h"
+#include "dm_headerqueue.h"
 #define THIS_MODULE "lmtp"
 
 #define MAX_ERRORS 3
@@ -83,6 +84,51 @@ static void lmtp_cb_time(void *arg)
 	ci_write(session->ci, "221 Connection timeout BYE\r\n");
 }
 		
+static void lmtp_handle_input(void *arg);
+
+/*
+ * worker thread: run a complete command
+ */
+static void lmtp_cb_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	D->status = lmtp(D->client);
+	dm_thread_data_return(D);
+}
+
+/*
+ * main thread: write the replies and pick up any pipelined
+ * commands already in the read buffer
+ */
+static void lmtp_cb_leave(gpointer data)
+{
+	int state;
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_T *session = D->client;
+
+	PLOCK(session->ci->lock);
+	state = session->ci->client_state;
+	PUNLOCK(session->ci->lock);
+
+	if (state & CLIENT_ERR) {
+		client_session_bailout(&session);
+		return;
+	}
+
+	client_session_flush(session);
+
+	if (D->status == -3) {
+		client_session_bailout(&session);
+		return;
+	}
+
+	client_session_reset_parser(session);
+	ci_uncork(session->ci);
+
+	if (session->state != CLIENTSTATE_QUIT)
+		lmtp_handle_input(session);
+}
+
 static void lmtp_handle_input(void *arg)
 {
 	int l;
@@ -97,19 +143,18 @@ static void lmtp_handle_input(void *arg)
 
 		if ((l = lmtp_tokenizer(session, buffer))) {
 			if (l == -3) {
+				client_session_flush(session);
 				client_session_bailout(&session);
 				return;
 			}
 
 			if (l > 0) {
-				if (lmtp(session) == -3) {
-					client_session_bailout(&session);
-					return;
-				}
-				client_session_reset_parser(session);
+				dm_client_thread_push(session, lmtp_cb_enter, lmtp_cb_leave, NULL);
+				return;
 			}
 
 			if (l < 0) {
+				client_session_flush(session);
 				client_session_reset_parser(session);
 			}
 		}
@@ -168,6 +213,7 @@ static void lmtp_rset(ClientSession_T *session, gboolean reset_state)
 int lmtp_handle_connection(client_sock *c)
 {
 	ClientSession_T *session = client_session_new(c);
+	HeaderQueue_start();
 	client_session_set_timeout(session, server_conf->login_timeout);
         send_greeting(session);
 	reset_callbacks(session);
@@ -180,7 +226,7 @@ int lmtp_error(ClientSession_T * session, const char *formatstring, ...)
 	char *s;
 
 	if (session->error_count >= MAX_ERRORS) {
-		ci_write(session->ci, "500 Too many errors, closing connection.\r\n");
+		client_session_printf(session, "500 Too many errors, closing connection.\r\n");
 		session->SessionResult = 2;	/* possible flood */
 		return -3;
 	}
@@ -190,7 +236,7 @@ int lmtp_error(ClientSession_T * session, const char *formatstring, ...)
 	s = g_strdup_vprintf(formatstring, cp);
 	va_end(cp);
 	va_end(ap);
-	ci_write(session->ci, s);
+	client_session_printf(session, "%s", s);
 	g_free(s);
 
 	session->error_count++;
@@ -278,7 +324,6 @@ int lmtp_tokenizer(ClientSession_T *session, char *buffer)
 int lmtp(ClientSession_T * session)
 {
 	DbmailMessage *msg;
-	ClientBase_T *ci = session->ci;
 	int helpcmd;
 	const char *class, *subject, *detail;
 	size_t tmplen = 0, tmppos = 0;
@@ -288,16 +333,16 @@ int lmtp(ClientSession_T * session)
 	switch (session->command_type) {
 
 	case LMTP_QUIT:
-		ci_write(ci, "221 %s BYE\r\n", session->hostname);
+		client_session_printf(session, "221 %s BYE\r\n", session->hostname);
 		session->state = CLIENTSTATE_QUIT;
 		return 1;
 
 	case LMTP_NOOP:
-		ci_write(ci, "250 OK\r\n");
+		client_session_printf(session, "250 OK\r\n");
 		return 1;
 
 	case LMTP_RSET:
-		ci_write(ci, "250 OK\r\n");
+		client_session_printf(session, "250 OK\r\n");
 		lmtp_rset(session,TRUE);
 		return 1;
 
@@ -306,7 +351,7 @@ int lmtp(ClientSession_T * session)
 		 * The RFC requires a couple of SMTP extensions
 		 * with a MUST statement, so just hardcode them.
 		 * */
-		ci_write(ci, "250-%s\r\n250-PIPELINING\r\n"
+		client_session_printf(session, "250-%s\r\n250-PIPELINING\r\n"
 			"250-ENHANCEDSTATUSCODES\r\n250 SIZE\r\n", 
 			session->hostname);
 				/* This is a SHOULD implement:
@@ -343,23 +388,23 @@ int lmtp(ClientSession_T * session)
 		if ((helpcmd == LMTP_LHLO) || (helpcmd == LMTP_DATA) || 
 			(helpcmd == LMTP_RSET) || (helpcmd == LMTP_QUIT) || 
 			(helpcmd == LMTP_NOOP) || (helpcmd == LMTP_HELP)) {
-			ci_write(ci, "%s", LMTP_HELP_TEXT[helpcmd]);
+			client_session_printf(session, "%s", LMTP_HELP_TEXT[helpcmd]);
 		} else
-			ci_write(ci, "%s", LMTP_HELP_TEXT[LMTP_END]);
+			client_session_printf(session, "%s", LMTP_HELP_TEXT[LMTP_END]);
 		return 1;
 
 	case LMTP_VRFY:
 		/* RFC 2821 says this SHOULD be implemented...
 		 * and the goal is to say if the given address
 		 * is a valid delivery address at this server. */
-		ci_write(ci, "502 Command not implemented\r\n");
+		client_session_printf(session, "502 Command not implemented\r\n");
 		return 1;
 
 	case LMTP_EXPN:
 		/* RFC 2821 says this SHOULD be implemented...
 		 * and the goal is to return the membership
 		 * of the specified mailing list. */
-		ci_write(ci, "502 Command not implemented\r\n");
+		client_session_printf(session, "502 Command not implemented\r\n");
 		return 1;
 
 	case LMTP_MAIL:
@@ -369,11 +414,11 @@ int lmtp(ClientSession_T * session)
 		state = session->state;
 
 		if (state != CLIENTSTATE_AUTHENTICATED) {
-			ci_write(ci, "550 Command out of sequence.\r\n");
+			client_session_printf(session, "550 Command out of sequence.\r\n");
 			return 1;
 		} 
 		if (p_list_length(session->from) > 0) {
-			ci_write(ci, "500 Sender already received. Use RSET to clear.\r\n");
+			client_session_printf(session, "500 Sender already received. Use RSET to clear.\r\n");
 			return 1;
 		}
 		/* First look for an email address.
@@ -394,7 +439,7 @@ int lmtp(ClientSession_T * session)
 			return 1;
 
 		if (find_bounded(arg, '<', '>', &tmpaddr, &tmplen, &tmppos) < 0) {
-			ci_write(ci, "500 No address found. Missing <> boundries.\r\n");
+			client_session_printf(session, "500 No address found. Missing <> boundries.\r\n");
 			return 1;
 		}
 
@@ -415,11 +460,11 @@ int lmtp(ClientSession_T * session)
 		/* This is all a bit nested now... */
 		if (tmpbody) {
 			if (MATCH(tmpbody, "8BITMIME")) {   // RFC1652
-				ci_write(ci, "500 Please use 7BIT MIME only.\r\n");
+				client_session_printf(session, "500 Please use 7BIT MIME only.\r\n");
 				return 1;
 			}
 			if (MATCH(tmpbody, "BINARYMIME")) { // RFC3030
-				ci_write(ci, "500 Please use 7BIT MIME only.\r\n");
+				client_session_printf(session, "500 Please use 7BIT MIME only.\r\n");
 				return 1;
 			}
 		}
@@ -427,7 +472,7 @@ int lmtp(ClientSession_T * session)
 		String_T s = p_string_new(session->pool, tmpaddr);
 		g_free(tmpaddr);
 
-		ci_write(ci, "250 Sender <%s> OK\r\n", p_string_str(s));
+		client_session_printf(session, "250 Sender <%s> OK\r\n", p_string_str(s));
 
 		session->from = p_list_prepend(session->from, s);
 
@@ -437,7 +482,7 @@ int lmtp(ClientSession_T * session)
 		state = session->state;
 
 		if (state != CLIENTSTATE_AUTHENTICATED) {
-			ci_write(ci, "550 Command out of sequence.\r\n");
+			client_session_printf(session, "550 Command out of sequence.\r\n");
 			return 1;
 		} 
 
@@ -453,7 +498,7 @@ int lmtp(ClientSession_T * session)
 			return 1;
 
 		if (find_bounded(arg, '<', '>', &tmpaddr, &tmplen, &tmppos) < 0 || tmplen < 1) {
-			ci_write(ci, "500 No address found. Missing <> boundries or address is null.\r\n");
+			client_session_printf(session, "500 No address found. Missing <> boundries or address is null.\r\n");
 			return 1;
 		}
 
@@ -467,7 +512,7 @@ int lmtp(ClientSession_T * session)
 
 		if (dsnuser_resolve(dsnuser) != 0) {
 			TRACE(TRACE_ERR, "dsnuser_resolve_list failed");
-			ci_write(ci, "430 Temporary failure in recipient lookup\r\n");
+			client_session_printf(session, "430 Temporary failure in recipient lookup\r\n");
 			dsnuser_free(dsnuser);
 			g_free(dsnuser);
 			return 1;
@@ -476,11 +521,11 @@ int lmtp(ClientSession_T * session)
 		/* Class 2 means the address was deliverable in some way. */
 		switch (dsnuser->dsn.class) {
 			case DSN_CLASS_OK:
-				ci_write(ci, "250 Recipient <%s> OK\r\n", dsnuser->address);
+				client_session_printf(session, "250 Recipient <%s> OK\r\n", dsnuser->address);
 				session->rcpt = p_list_append(session->rcpt, dsnuser);
 				break;
 			default:
-				ci_write(ci, "550 Recipient <%s> FAIL\r\n", dsnuser->address);
+				client_session_printf(session, "550 Recipient <%s> FAIL\r\n", dsnuser->address);
 				dsnuser_free(dsnuser);
 				g_free(dsnuser);
 				break;
@@ -497,7 +542,7 @@ int lmtp(ClientSession_T * session)
 		p_string_truncate(session->rbuff,0);
 
 		if (insert_messages(msg, session->rcpt) == -1) {
-			ci_write(ci, "430 Message not received\r\n");
+			client_session_printf(session, "430 Message not received\r\n");
 			dbmail_message_free(msg);
 			return 1;
 		}
@@ -513,12 +558,12 @@ int lmtp(ClientSession_T * session)
 			/* Give a simple OK, otherwise a detailed message. */
 			switch (dsnuser->dsn.class) {
 				case DSN_CLASS_OK:
-					ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
+					client_session_printf(session, "%d%d%d Recipient <%s> OK\r\n",
 							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
 							dsnuser->address);
 					break;
 				default:
-					ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
+					client_session_printf(session, "%d%d%d Recipient <%s> %s %s %s\r\n",
 							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
 							dsnuser->address, class, subject, detail);
 			}
@@ -26,6 +26,7 @@
  */
 
 #include "dbmail.h"
+#include "dm_fulltext.h"
 #define THIS_MODULE "maintenance"
 #define PNAME "dbmail/maintenance"
 
@@ -71,7 +72,8 @@ int do_showhelp(void) {
 	"     -a        perform all checks (in this release: -ctubpds)\n"
 	"     -c        clean up database (optimize/vacuum)\n"
 	"     -t        test for message integrity\n"
-	"     -b        body/header/envelope cache check\n"
+	"     -b        body/header/envelope/bodystructure cache and\n"
+	"               full-text index check\n"
 	"     -p        purge messages have the DELETE status set\n"
 	"     -d        set DELETE status for deleted messages\n"
 	"     -s        remove dangling/invalid aliases and forwards\n"
@@ -839,6 +841,95 @@ static int do_envelope(void)
 
 }
 
+static int do_bodystructure(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL for cached bodystructures...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL for cached bodystructures...\n");
+	}
+	time(&start);
+
+	if (db_icheck_bodystructure(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_bodystructure(lost) < 0) {
+			qerrorf("Error setting the bodystructure cache");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking bodystructure cache took %g seconds\n",
+	       difftime(stop, start));
+	
+	return 0;
+
+}
+
+
+static int do_fulltext(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (! FullText_enabled())
+		return 0;
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL for full-text index...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL for full-text index...\n");
+	}
+	time(&start);
+
+	if (FullText_icheck(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] physmessages with un-indexed parts.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] physmessages with un-indexed parts.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (FullText_rebuild(lost) < 0) {
+			qerrorf("Error building the full-text index");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking full-text index took %g seconds\n",
+	       difftime(stop, start));
+	
+	return 0;
+
+}
 
 int do_header_cache(void)
 {
@@ -853,6 +944,14 @@ int do_header_cache(void)
 		serious_errors = 1;
 		return -1;
 	}
+	if (do_bodystructure()) {
+		serious_errors = 1;
+		return -1;
+	}
+	if (do_fulltext()) {
+		serious_errors = 1;
+		return -1;
+	}
 	
 	if (no_to_all) 
 		qprintf("\nChecking DBMAIL for cached header values...\n");
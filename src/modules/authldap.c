@@ -25,6 +25,7 @@
 
 #define AUTH_QUERY_SIZE 1024
 #define LDAP_RES_SIZE 1024
+#define LDAP_BIND_POOL_SIZE 8
 
 extern char configFile[PATH_MAX];
 
@@ -32,6 +33,10 @@ GStaticPrivate ldap_conn_key;
 static GOnce ldap_conn_once = G_ONCE_INIT;
 static int authldap_connect(void);
 
+/* connections used to validate user credentials */
+static pthread_mutex_t bind_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static GQueue *bind_pool = NULL;
+
 typedef struct _ldap_cfg {
 	Field_T bind_dn, bind_pw, base_dn, port, uri, version, scope, hostname;
 	Field_T user_objectclass, forw_objectclass;
@@ -43,7 +48,9 @@ typedef struct _ldap_cfg {
 	Field_T field_members;
 	Field_T query_string;
 	Field_T referrals;
+	Field_T query_timeout, bind_pool_size;
 	int scope_int, port_int, version_int;
+	int query_timeout_int, bind_pool_size_int;
 } _ldap_cfg_t;
 
 static _ldap_cfg_t _ldap_cfg;
@@ -74,6 +81,8 @@ static void __auth_get_config(void)
 	GETCONFIGVALUE("QUERY_STRING",		"LDAP", _ldap_cfg.query_string);
 	GETCONFIGVALUE("SCOPE",			"LDAP", _ldap_cfg.scope);
 	GETCONFIGVALUE("REFERRALS",		"LDAP", _ldap_cfg.referrals);
+	GETCONFIGVALUE("QUERY_TIMEOUT",		"LDAP", _ldap_cfg.query_timeout);
+	GETCONFIGVALUE("BIND_POOL_SIZE",	"LDAP", _ldap_cfg.bind_pool_size);
 
 	/* Store the port as an integer for later use. */
 	_ldap_cfg.port_int = atoi(_ldap_cfg.port);
@@ -83,6 +92,18 @@ static void __auth_get_config(void)
 	/* defaults to version 3 */
 	if (!_ldap_cfg.version_int)
 		_ldap_cfg.version_int=3;
+
+	/* zero waits for the server as long as it takes */
+	_ldap_cfg.query_timeout_int = atoi(_ldap_cfg.query_timeout);
+	if (_ldap_cfg.query_timeout_int < 0)
+		_ldap_cfg.query_timeout_int = 0;
+
+	_ldap_cfg.bind_pool_size_int = LDAP_BIND_POOL_SIZE;
+	if (strlen(_ldap_cfg.bind_pool_size))
+		_ldap_cfg.bind_pool_size_int = atoi(_ldap_cfg.bind_pool_size);
+	if (_ldap_cfg.bind_pool_size_int < 0)
+		_ldap_cfg.bind_pool_size_int = 0;
+
 	/* Compare the input string with the possible options,
 	 * making sure not to exceeed the length of the given string */
 	{
@@ -157,20 +178,16 @@ static int auth_ldap_bind(void)
 }
 
 /*
- * authldap_connect()
+ * authldap_open()
  *
- * initializes the connection for authentication.
- * 
- * returns 0 on success, -1 on failure
+ * create a new, unbound connection handle
  */
-static int authldap_connect(void)
+static LDAP * authldap_open(void)
 {
 	int version = 0;
 	LDAP *_ldap_conn = NULL;
 	int ret;
 
-	g_once(&ldap_conn_once, authldap_once, NULL);
-
 	switch (_ldap_cfg.version_int) {
 		case 3:
 			version = LDAP_VERSION3;
@@ -208,40 +225,150 @@ static int authldap_connect(void)
 	if (strncasecmp(_ldap_cfg.referrals, "no", 2) == 0)
 		ldap_set_option(_ldap_conn, LDAP_OPT_REFERRALS, 0);
 
-	g_static_private_set(&ldap_conn_key, _ldap_conn, (GDestroyNotify)authldap_free);
+	return _ldap_conn;
+}
+
+/*
+ * authldap_connect()
+ *
+ * initializes the connection for authentication.
+ * 
+ * returns 0 on success, -1 on failure
+ */
+static int authldap_connect(void)
+{
+	g_once(&ldap_conn_once, authldap_once, NULL);
+
+	/* releases the previous connection of this thread, if any */
+	g_static_private_set(&ldap_conn_key, authldap_open(), (GDestroyNotify)authldap_free);
 
 	return auth_ldap_bind();	
 }
 
 static int authldap_reconnect(void)
 {
-	LDAP *c;
-	if ((c = ldap_con_get())) authldap_free((gpointer)c);
 	return authldap_connect();
 }
 
+/*
+ * take a connection for a user bind from the pool, or open a new one
+ */
+static LDAP * bind_pool_get(void)
+{
+	LDAP *c = NULL;
+
+	g_once(&ldap_conn_once, authldap_once, NULL);
+
+	PLOCK(bind_pool_lock);
+	if (bind_pool)
+		c = g_queue_pop_head(bind_pool);
+	PUNLOCK(bind_pool_lock);
+
+	if (! c)
+		c = authldap_open();
+
+	return c;
+}
+
+/*
+ * return a connection to the pool. Connections in an unknown
+ * state, or beyond the size of the pool, are closed.
+ */
+static void bind_pool_put(LDAP *c, gboolean reuse)
+{
+	if (! c)
+		return;
+
+	if (reuse) {
+		PLOCK(bind_pool_lock);
+		if (! bind_pool)
+			bind_pool = g_queue_new();
+		if (g_queue_get_length(bind_pool) < (guint)_ldap_cfg.bind_pool_size_int) {
+			g_queue_push_head(bind_pool, c);
+			c = NULL;
+		}
+		PUNLOCK(bind_pool_lock);
+	}
+
+	if (c)
+		authldap_free((gpointer)c);
+}
+
+static void bind_pool_drain(void)
+{
+	LDAP *c;
+
+	PLOCK(bind_pool_lock);
+	if (bind_pool) {
+		while ((c = g_queue_pop_head(bind_pool)))
+			authldap_free((gpointer)c);
+		g_queue_free(bind_pool);
+		bind_pool = NULL;
+	}
+	PUNLOCK(bind_pool_lock);
+}
+
+/*
+ * run a search and wait for the complete result, at most
+ * QUERY_TIMEOUT seconds if set. A search that times out is
+ * abandoned.
+ *
+ * returns an LDAP result code
+ */
+static int authldap_search_ext(LDAP *c, const gchar *query, LDAPMessage **res)
+{
+	struct timeval tv, *timeout = NULL;
+	int msgid, err;
+
+	*res = NULL;
+
+	if ((err = ldap_search_ext(c, _ldap_cfg.base_dn, _ldap_cfg.scope_int,
+			query, NULL, 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &msgid)))
+		return err;
+
+	if (_ldap_cfg.query_timeout_int) {
+		tv.tv_sec = _ldap_cfg.query_timeout_int;
+		tv.tv_usec = 0;
+		timeout = &tv;
+	}
+
+	switch (ldap_result(c, msgid, LDAP_MSG_ALL, timeout, res)) {
+		case 0:
+			ldap_abandon_ext(c, msgid, NULL, NULL);
+			*res = NULL;
+			return LDAP_TIMEOUT;
+		case -1:
+			ldap_get_option(c, LDAP_OPT_RESULT_CODE, &err);
+			*res = NULL;
+			return err ? err : LDAP_OTHER;
+	}
+
+	if ((err = ldap_result2error(c, *res, 0))) {
+		ldap_msgfree(*res);
+		*res = NULL;
+	}
+
+	return err;
+}
+
 static LDAPMessage * authldap_search(const gchar *query)
 {
 	LDAPMessage *ldap_res;
-	int _ldap_attrsonly = 0;
-	char **_ldap_attrs = NULL;
 	int c=0, err;
-	LDAP *_ldap_conn;
 
 	g_return_val_if_fail(query!=NULL, NULL);
 
-	_ldap_conn = ldap_con_get();
-
 	while (c++ < 5) {
 		TRACE(TRACE_DEBUG, " [%s]", query);
-		err = ldap_search_s(_ldap_conn, _ldap_cfg.base_dn, _ldap_cfg.scope_int, 
-				query, _ldap_attrs, _ldap_attrsonly, &ldap_res);
+		/* the connection changes when we had to reconnect */
+		err = authldap_search_ext(ldap_con_get(), query, &ldap_res);
 
 		if (! err)
 			return ldap_res;
 
 		switch (err) {
 			case LDAP_SERVER_DOWN:
+			case LDAP_TIMEOUT:
 				TRACE(TRACE_WARNING, "LDAP gone away: %s. Try to reconnect(%d/5).", ldap_err2string(err),c);
 				if (authldap_reconnect())
 					sleep(2); // reconnect failed. wait before trying again
@@ -592,6 +719,7 @@ int auth_connect(void)
 int auth_disconnect(void)
 {
 	g_static_private_free(&ldap_conn_key);
+	bind_pool_drain();
 	return 0;
 }
 
@@ -1194,12 +1322,12 @@ int auth_change_mailboxsize(uint64_t user_idnr, uint64_t new_size)
  */
 int auth_validate(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr)
 {
-	LDAP *_ldap_conn = ldap_con_get();
+	LDAP *_ldap_conn;
 	TimeString_T timestring;
 	char real_username[DM_USERNAME_LEN];
 	int result;
 	uint64_t mailbox_idnr;
-	int ldap_err;
+	int ldap_err, tries = 0;
 	char *ldap_dn = NULL;
 
 	assert(user_idnr != NULL);
@@ -1239,10 +1367,19 @@ int auth_validate(ClientBase_T *ci, const char *username, const char *password,
 		return 0;
 	}
 
-	/* now, try to rebind as the given DN using the supplied password */
-	TRACE(TRACE_DEBUG, "rebinding as [%s] to validate password", ldap_dn);
-
-	ldap_err = ldap_bind_s(_ldap_conn, ldap_dn, password, LDAP_AUTH_SIMPLE);
+	/* now, try to bind as the given DN using the supplied password,
+	 * on a pooled connection so the search connection of this thread
+	 * stays bound as admin */
+	TRACE(TRACE_DEBUG, "binding as [%s] to validate password", ldap_dn);
+
+	while (tries++ < 2) {
+		_ldap_conn = bind_pool_get();
+		ldap_err = ldap_bind_s(_ldap_conn, ldap_dn, password, LDAP_AUTH_SIMPLE);
+		bind_pool_put(_ldap_conn, (ldap_err == LDAP_SUCCESS || ldap_err == LDAP_INVALID_CREDENTIALS));
+		/* a pooled connection may have been closed by the server */
+		if (ldap_err != LDAP_SERVER_DOWN)
+			break;
+	}
 
 	if (ldap_err) {
 		TRACE(TRACE_ERR, "ldap_bind_s failed: %s", ldap_err2string(ldap_err));
@@ -1251,9 +1388,6 @@ int auth_validate(ClientBase_T *ci, const char *username, const char *password,
 		db_user_log_login(*user_idnr);
 	}
 	
-	/* rebind as admin */
-	auth_ldap_bind();
-	
 	if (ldap_dn)
 		ldap_memfree(ldap_dn);
 
@@ -165,17 +165,17 @@ int send_alert(uint64_t user_idnr, char *subject, char *body)
 	new_message = dbmail_message_new(NULL);
 	new_message = dbmail_message_construct(new_message, to, from, subject, body);
 
-	// Pre-insert the message and get a new_message->id
+	// Store the message and get a new_message->id
 	dbmail_message_store(new_message);
-	uint64_t tmpid = new_message->id;
 
-	if (sort_deliver_to_mailbox(new_message, user_idnr,
-			"INBOX", BOX_BRUTEFORCE, msgflags, NULL) != DSN_CLASS_OK) {
+	if ((sort_deliver_to_mailbox(new_message, user_idnr,
+			"INBOX", BOX_BRUTEFORCE, msgflags, NULL) != DSN_CLASS_OK)
+			|| (dbmail_message_deliver(new_message) != DM_SUCCESS)
+			|| (! new_message->msg_idnr)) {
 		TRACE(TRACE_ERR, "Unable to deliver alert [%s] to user [%" PRIu64 "]", subject, user_idnr);
 	}
 
 	g_free(to);
-	db_delete_message(tmpid);
 	dbmail_message_free(new_message);
 
 	return 0;
@@ -182,7 +182,6 @@ static int db_createsession(uint64_t user_idnr, ClientSession_T * session)
 
 static void pop3_close(ClientSession_T *session)
 {
-	ClientBase_T *ci = session->ci;
 	TRACE(TRACE_DEBUG,"[%p] sessionResult [%d]", session, session->SessionResult);
 
 	session->state = CLIENTSTATE_QUIT;
@@ -198,13 +197,13 @@ static void pop3_close(ClientSession_T *session)
 
 			/* if everything went well, write down everything and do a cleanup */
 			if (db_update_pop(session) == DM_SUCCESS)
-				ci_write(ci, "+OK see ya later\r\n");
+				client_session_printf(session, "+OK see ya later\r\n");
 			else
-				ci_write(ci, "-ERR some deleted messages not removed\r\n");
+				client_session_printf(session, "-ERR some deleted messages not removed\r\n");
 			break;
 
 		case 1:
-			ci_write(ci, "-ERR I'm leaving, you're too slow\r\n");
+			client_session_printf(session, "-ERR I'm leaving, you're too slow\r\n");
 			TRACE(TRACE_ERR, "client timed out, connection closed");
 			break;
 
@@ -220,12 +219,62 @@ static void pop3_close(ClientSession_T *session)
 			break;
 		}
 	} else {
-		ci_write(ci, "+OK see ya later\r\n");
+		client_session_printf(session, "+OK see ya later\r\n");
 	}
+}
+
+
+/*
+ * worker thread: run a single command
+ */
+static void pop3_cb_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	char *buffer = (char *)D->data;
 
-	client_session_bailout(&session);
+	D->status = pop3(D->client, buffer);
+	g_free(buffer);
+	D->data = NULL;
+
+	dm_thread_data_return(D);
 }
 
+/*
+ * main thread: write the replies and resume reading
+ */
+static void pop3_cb_leave(gpointer data)
+{
+	int state;
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientSession_T *session = D->client;
+
+	PLOCK(session->ci->lock);
+	state = session->ci->client_state;
+	PUNLOCK(session->ci->lock);
+
+	if (state & CLIENT_ERR) {
+		client_session_bailout(&session);
+		return;
+	}
+
+	client_session_flush(session);
+
+	switch (D->status) {
+		case 1:
+			break;
+		case 2:
+			if (ci_starttls(session->ci) < 0) {
+				client_session_bailout(&session);
+				return;
+			}
+			break;
+		default: // QUIT, failure or flood
+			client_session_bailout(&session);
+			return;
+	}
+
+	ci_uncork(session->ci);
+}
 
 /* the default pop3 read handler */
 
@@ -243,9 +292,7 @@ static void pop3_handle_input(void *arg)
 	if (ci_readln(session->ci, buffer) == 0)
 		return;
 
-	ci_cork(session->ci);
-	if (pop3(session, buffer) > 0)
-		ci_uncork(session->ci);
+	dm_client_thread_push(session, pop3_cb_enter, pop3_cb_leave, g_strdup(buffer));
 }
 
 void pop3_cb_write(void *arg)
@@ -298,11 +345,9 @@ int pop3_error(ClientSession_T * session, const char *formatstring, ...)
 {
 	va_list ap, cp;
 	char *s;
-	ClientBase_T *ci = session->ci;
 
 	if (session->error_count >= MAX_ERRORS) {
-		ci_write(ci, "-ERR too many errors\r\n");
-		client_session_bailout(&session);
+		client_session_printf(session, "-ERR too many errors\r\n");
 		return -3;
 	} else {
 		va_start(ap, formatstring);
@@ -310,7 +355,7 @@ int pop3_error(ClientSession_T * session, const char *formatstring, ...)
 		s = g_strdup_vprintf(formatstring, cp);
 		va_end(cp);
 		va_end(ap);
-		ci_write(ci, s);
+		client_session_printf(session, "%s", s);
 		g_free(s);
 	}
 
@@ -339,7 +384,7 @@ static int _pop3_session_authenticated(ClientSession_T *session, int user_idnr)
 
 	result = db_createsession(user_idnr, session);
 	if (result == 1) {
-		ci_write(ci, "+OK %s has %" PRIu64 " messages (%" PRIu64 " octets)\r\n", 
+		client_session_printf(session, "+OK %s has %" PRIu64 " messages (%" PRIu64 " octets)\r\n", 
 				session->username, 
 				session->virtual_totalmessages, 
 				session->virtual_totalsize);
@@ -449,9 +494,8 @@ int pop3(ClientSession_T *session, const char *buffer)
 
 		if (session->ci->sock->ssl_state)
 			return pop3_error(session, "-ERR TLS already active\r\n");
-		ci_write(session->ci, "+OK Begin TLS now\r\n");
-		if (ci_starttls(session->ci) < 0) return 0;
-		return 1;
+		client_session_printf(session, "+OK Begin TLS now\r\n");
+		return 2; /* negotiated in the main thread */
 
 	case POP3_USER:
 		if (state != CLIENTSTATE_INITIAL_CONNECT)
@@ -469,7 +513,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			strncpy(session->username, value, strlen(value) + 1);
 		}
 
-		ci_write(ci, "+OK Password required for %s\r\n", session->username);
+		client_session_printf(session, "+OK Password required for %s\r\n", session->username);
 		return 1;
 
 	case POP3_PASS:
@@ -523,7 +567,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			while (session->messagelst) {
 				msg = (struct message *)p_list_data(session->messagelst);
 				if ((msg ) && (msg->messageid == strtoull(value,NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {
-					ci_write(ci, "+OK %" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
+					client_session_printf(session, "+OK %" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
 					found = 1;
 				}
 				if (! p_list_next(session->messagelst))
@@ -537,27 +581,27 @@ int pop3(ClientSession_T *session, const char *buffer)
 		}
 
 		/* just drop the list */
-		ci_write(ci, "+OK %" PRIu64 " messages (%" PRIu64 " octets)\r\n", session->virtual_totalmessages, session->virtual_totalsize);
+		client_session_printf(session, "+OK %" PRIu64 " messages (%" PRIu64 " octets)\r\n", session->virtual_totalmessages, session->virtual_totalsize);
 
 		if (session->virtual_totalmessages > 0) {
 			/* traversing list */
 			while (session->messagelst) {
 				msg = (struct message *)p_list_data(session->messagelst);
 				if ((msg) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE))
-					ci_write(ci, "%" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
+					client_session_printf(session, "%" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
 				if (! p_list_next(session->messagelst))
 					break;
 				session->messagelst = p_list_next(session->messagelst);
 			}
 		}
-		ci_write(ci, ".\r\n");
+		client_session_printf(session, ".\r\n");
 		return 1;
 
 	case POP3_STAT:
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		ci_write(ci, "+OK %" PRIu64 " %" PRIu64 "\r\n", 
+		client_session_printf(session, "+OK %" PRIu64 " %" PRIu64 "\r\n", 
 				session->virtual_totalmessages, 
 				session->virtual_totalsize);
 
@@ -581,8 +625,8 @@ int pop3(ClientSession_T *session, const char *buffer)
 				msg->virtual_messagestatus = MESSAGE_STATUS_SEEN;
 				if (! (s = db_get_message_lines(msg->realmessageid, -2)))
 					return -1;
-				ci_write(ci, "+OK %" PRIu64 " octets\r\n%s", (uint64_t)strlen(s), s);
-				ci_write(ci, "\r\n.\r\n");
+				client_session_printf(session, "+OK %" PRIu64 " octets\r\n%s", (uint64_t)strlen(s), s);
+				client_session_printf(session, "\r\n.\r\n");
 				g_free(s);
 				return 1;
 			}
@@ -606,7 +650,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 				session->virtual_totalsize -= msg->msize;
 				session->virtual_totalmessages -= 1;
 
-				ci_write(ci, "+OK message %" PRIu64 " deleted\r\n", msg->messageid);
+				client_session_printf(session, "+OK message %" PRIu64 " deleted\r\n", msg->messageid);
 				return 1;
 			}
 			if (! p_list_next(session->messagelst))
@@ -634,7 +678,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			session->messagelst = p_list_next(session->messagelst);
 		}
 
-		ci_write(ci, "+OK %" PRIu64 " messages (%" PRIu64 " octets)\r\n", session->virtual_totalmessages, session->virtual_totalsize);
+		client_session_printf(session, "+OK %" PRIu64 " messages (%" PRIu64 " octets)\r\n", session->virtual_totalmessages, session->virtual_totalsize);
 
 		return 1;
 
@@ -648,7 +692,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			msg = (struct message *)p_list_data(session->messagelst);
 			if ((msg) && (msg->virtual_messagestatus == MESSAGE_STATUS_NEW)) {
 				/* we need the last message that has been accessed */
-				ci_write(ci, "+OK %" PRIu64 "\r\n", msg->messageid - 1);
+				client_session_printf(session, "+OK %" PRIu64 "\r\n", msg->messageid - 1);
 				return 1;
 			}
 			if (! p_list_next(session->messagelst))
@@ -657,7 +701,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 		}
 
 		/* all old messages */
-		ci_write(ci, "+OK %" PRIu64 "\r\n", session->virtual_totalmessages);
+		client_session_printf(session, "+OK %" PRIu64 "\r\n", session->virtual_totalmessages);
 
 		return 1;
 
@@ -665,7 +709,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		ci_write(ci, "+OK\r\n");
+		client_session_printf(session, "+OK\r\n");
 		return 1;
 
 	case POP3_UIDL:
@@ -679,7 +723,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			while (session->messagelst) {
 				msg = (struct message *)p_list_data(session->messagelst);
 				if ((msg) && (msg->messageid == strtoull(value,NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {
-					ci_write(ci, "+OK %" PRIu64 " %s\r\n", msg->messageid,msg->uidl);
+					client_session_printf(session, "+OK %" PRIu64 " %s\r\n", msg->messageid,msg->uidl);
 					found = 1;
 				}
 
@@ -694,14 +738,14 @@ int pop3(ClientSession_T *session, const char *buffer)
 		}
 
 		/* just drop the list */
-		ci_write(ci, "+OK Some very unique numbers for you\r\n");
+		client_session_printf(session, "+OK Some very unique numbers for you\r\n");
 
 		if (session->virtual_totalmessages > 0) {
 			/* traversing list */
 			while (session->messagelst) {
 				msg = (struct message *)p_list_data(session->messagelst); 
 				if (msg && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE))
-					ci_write(ci, "%" PRIu64 " %s\r\n", msg->messageid, msg->uidl);
+					client_session_printf(session, "%" PRIu64 " %s\r\n", msg->messageid, msg->uidl);
 
 				if (! p_list_next(session->messagelst))
 					break;
@@ -709,7 +753,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 			}
 		}
 
-		ci_write(ci, ".\r\n");
+		client_session_printf(session, ".\r\n");
 
 		return 1;
 
@@ -831,13 +875,13 @@ int pop3(ClientSession_T *session, const char *buffer)
 		while (session->messagelst) {
 			msg = (struct message *)p_list_data(session->messagelst);
 			if ((msg) && (msg->messageid == top_messageid) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {	/* message is not deleted */
-				char *s = NULL; size_t i;
+				char *s = NULL;
 				if (! (s = db_get_message_lines(msg->realmessageid, top_lines)))
 					return -1;
-				i = ci_write(ci, "+OK %" PRIu64 " lines of message %" PRIu64 "\r\n%s", top_lines, top_messageid, s);
-				ci_write(ci, "\r\n.\r\n");
+				client_session_printf(session, "+OK %" PRIu64 " lines of message %" PRIu64 "\r\n%s", top_lines, top_messageid, s);
+				client_session_printf(session, "\r\n.\r\n");
 				g_free(s);
-				return i;
+				return 1;
 			}
 			if (! p_list_next(session->messagelst))
 				break;
@@ -847,7 +891,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 		return pop3_error(session, "-ERR no such message\r\n");
 
 	case POP3_CAPA:
-		ci_write(ci, "+OK Capability list follows\r\nTOP\r\nUSER\r\nUIDL%s\r\n.\r\n", server_conf->ssl?"\r\nSTLS":"");
+		client_session_printf(session, "+OK Capability list follows\r\nTOP\r\nUSER\r\nUIDL%s\r\n.\r\n", server_conf->ssl?"\r\nSTLS":"");
 		return 1;
 
 	default:
@@ -25,9 +25,13 @@
  */
 
 #include <libgen.h>
+#include <sys/wait.h>
 #include "dbmail.h"
 #include "dm_request.h"
 #include "dm_mempool.h"
+#include "dm_mailboxwatch.h"
+#include "dm_headerqueue.h"
+#include "dm_recipientcache.h"
 
 #define THIS_MODULE "server"
 
@@ -37,8 +41,6 @@ volatile sig_atomic_t mainReload = 0;
 // thread data
 Mempool_T    queue_pool;
 Mempool_T    small_pool;
-GAsyncQueue *queue;
-GThreadPool *tpool = NULL;
 
 extern char configFile[PATH_MAX];
 ServerConfig_T   *server_conf;
@@ -55,7 +57,13 @@ struct event *sig_hup = NULL;
 struct event *sig_term = NULL;
 struct event *sig_pipe = NULL;
 struct event *sig_usr = NULL;
-struct event *heartbeat = NULL;
+struct event *sig_usr2 = NULL;
+struct event *sig_quit = NULL;
+
+static struct event **evsock = NULL;	/* listening sockets */
+static int evsock_count = 0;
+static struct event *drain_timer = NULL;
+static gboolean server_is_worker = FALSE;	/* forked by a prefork master */
 
 SSL_CTX *tls_context;
 
@@ -63,10 +71,87 @@ FILE *fstdout = NULL;
 extern FILE *fstderr;
 FILE *fnull = NULL;
 
-/* self-pipe
+/*
+ * reactors
+ *
+ * A reactor is a thread running its own event base together with its
+ * own worker pool and async queue. The main thread is reactor 0; it
+ * owns the listening sockets and the signal handlers. Accepted
+ * connections are handed out round-robin and stay pinned to their
+ * reactor, so all network IO for a session happens on one thread.
+ */
+typedef struct {
+	int id;
+	pthread_t thread;
+	struct event_base *evbase;
+	GAsyncQueue *queue;
+	GThreadPool *tpool;
+	int selfpipe[2];		/* self-pipe */
+	pthread_mutex_t selfpipe_lock;
+	struct event *heartbeat;
+	GHashTable *clients;		/* open connections of this reactor */
+	pthread_mutex_t clients_lock;
+	gboolean running;		/* thread started */
+} Reactor_T;
+
+static Reactor_T *reactors = NULL;
+static int reactor_count = 0;
+static int reactor_next = 0;
+static pthread_key_t reactor_key;	/* reactor served by the current thread */
+static gboolean reactor_key_created = FALSE;
+
+#define REACTOR_CLOSE_GRACE 2		/* seconds for sessions to close on stop */
+
+/*
+ * the reactor of the calling thread. Event loop threads and their
+ * workers always have one; any other thread falls back to reactor 0.
+ */
+static Reactor_T * reactor_current(void)
+{
+	Reactor_T *R = (Reactor_T *)pthread_getspecific(reactor_key);
+	return R ? R : &reactors[0];
+}
+
+gpointer dm_reactor_current(void)
+{
+	return (gpointer)reactor_current();
+}
+
+struct event_base * dm_reactor_base(void)
+{
+	return reactor_current()->evbase;
+}
+
+/*
+ * keep track of the connections of each reactor, so they can be
+ * closed from their own event loop on shutdown
  */
-int selfpipe[2];
-pthread_mutex_t selfpipe_lock;
+gpointer dm_reactor_attach(ClientBase_T *client)
+{
+	Reactor_T *R;
+
+	if (! reactors)
+		return NULL;
+
+	R = reactor_current();
+	PLOCK(R->clients_lock);
+	g_hash_table_insert(R->clients, client, client);
+	PUNLOCK(R->clients_lock);
+
+	return R;
+}
+
+void dm_reactor_detach(gpointer reactor, ClientBase_T *client)
+{
+	Reactor_T *R = (Reactor_T *)reactor;
+
+	if (! (reactors && R))
+		return;
+
+	PLOCK(R->clients_lock);
+	g_hash_table_remove(R->clients, client);
+	PUNLOCK(R->clients_lock);
+}
 
 /* 
  *
@@ -77,52 +162,79 @@ pthread_mutex_t selfpipe_lock;
  *
  */
 
-static void cb_queue_drain(int fd, short what UNUSED, void *arg UNUSED)
+static void reactor_queue_drain(Reactor_T *R)
+{
+	gpointer data;
+	do {
+		data = g_async_queue_try_pop(R->queue);
+		if (data) {
+			dm_thread_data *D = (gpointer)data;
+			if (D->cb_leave) D->cb_leave(data);
+			dm_thread_data_free(data);
+		}
+	} while (data);
+}
+
+/*
+ * drop the jobs left after the event loop has stopped
+ */
+static void reactor_queue_discard(Reactor_T *R)
+{
+	gpointer data;
+	while ((data = g_async_queue_try_pop(R->queue)))
+		dm_thread_data_free(data);
+}
+
+static void cb_queue_drain(int fd, short what UNUSED, void *arg)
 {
 	char buf[1024];
-	event_del(heartbeat);
-	dm_queue_drain();
-	PLOCK(selfpipe_lock);
+	Reactor_T *R = (Reactor_T *)arg;
+	event_del(R->heartbeat);
+	reactor_queue_drain(R);
+	PLOCK(R->selfpipe_lock);
 	if (read(fd, buf, sizeof(buf))) { /* ignore */ }
-	PUNLOCK(selfpipe_lock);
-	event_add(heartbeat, NULL);
+	PUNLOCK(R->selfpipe_lock);
+	event_add(R->heartbeat, NULL);
 }
 
+static void reactor_wakeup(Reactor_T *R, const char *c)
+{
+	PLOCK(R->selfpipe_lock);
+	if (R->selfpipe[1] > -1) {
+		if (write(R->selfpipe[1], c, 1)) { /* ignore */ }
+	}
+	PUNLOCK(R->selfpipe_lock);
+}
 
 void dm_queue_heartbeat(void)
 {
-	if (pipe(selfpipe))
-		TRACE(TRACE_EMERG, "self-pipe setup failed");
-
-	UNBLOCK(selfpipe[0]);
-	UNBLOCK(selfpipe[1]);
+	int i;
+	for (i = 0; i < reactor_count; i++) {
+		Reactor_T *R = &reactors[i];
+		if (pipe(R->selfpipe))
+			TRACE(TRACE_EMERG, "self-pipe setup failed");
 
-	pthread_mutex_init(&selfpipe_lock, NULL);
+		UNBLOCK(R->selfpipe[0]);
+		UNBLOCK(R->selfpipe[1]);
 
-	heartbeat = event_new(evbase, selfpipe[0], EV_READ, cb_queue_drain, NULL);
-	event_add(heartbeat, NULL);
+		R->heartbeat = event_new(R->evbase, R->selfpipe[0], EV_READ, cb_queue_drain, R);
+		event_add(R->heartbeat, NULL);
+	}
 }
 
 void dm_queue_drain(void)
 {
-	gpointer data;
-	do {
-		data = g_async_queue_try_pop(queue);
-		if (data) {
-			dm_thread_data *D = (gpointer)data;
-			if (D->cb_leave) D->cb_leave(data);
-			dm_thread_data_free(data);
-		}
-	} while (data);
+	reactor_queue_drain(reactor_current());
 }
 
 /*
- * push a job to the queue
+ * push a job to the queue of a reactor
  *
  */
 
-void dm_queue_push(void *cb, void *session, void *data)
+void dm_queue_push_reactor(gpointer reactor, void *cb, void *session, void *data)
 {
+	Reactor_T *R = (Reactor_T *)reactor;
 	dm_thread_data *D;
 	D = mempool_pop(queue_pool, sizeof(*D));
 	D->magic    = DM_THREAD_DATA_MAGIC;
@@ -131,14 +243,21 @@ void dm_queue_push(void *cb, void *session, void *data)
 	D->cb_enter = NULL;
 	D->cb_leave = cb;
 	D->session  = session;
+	D->client   = NULL;
 	D->data     = data;
 
-        g_async_queue_push(queue, (gpointer)D);
-	PLOCK(selfpipe_lock);
-	if (selfpipe[1] > -1) {
-		if (write(selfpipe[1], "Q", 1)) { /* ignore */ }
-	}
-	PUNLOCK(selfpipe_lock);
+        g_async_queue_push(R->queue, (gpointer)D);
+	reactor_wakeup(R, "Q");
+}
+
+/*
+ * push a job to the queue of the current reactor
+ *
+ */
+
+void dm_queue_push(void *cb, void *session, void *data)
+{
+	dm_queue_push_reactor(reactor_current(), cb, session, data);
 }
 
 /* 
@@ -151,6 +270,7 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	GError *err = NULL;
 	ImapSession *s;
 	dm_thread_data *D;
+	GThreadPool *tpool = reactor_current()->tpool;
 
 	assert(session);
 
@@ -169,6 +289,7 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	D->cb_enter = cb_enter;
 	D->cb_leave = cb_leave;
 	D->session  = session;
+	D->client   = NULL;
 	D->data     = data;
 
 	// we're not done until we're done
@@ -187,6 +308,52 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
 }
 
+/*
+ * push a pop3/lmtp job to the thread pool
+ *
+ * the worker must not do any network IO; replies are collected
+ * in session->wbuff and written by cb_leave in the event loop.
+ * The worker hands the job back with dm_thread_data_return.
+ */
+void dm_client_thread_push(ClientSession_T *session, gpointer cb_enter, gpointer cb_leave, gpointer data)
+{
+	GError *err = NULL;
+	dm_thread_data *D;
+
+	assert(session);
+
+	ci_cork(session->ci);
+
+	if (session->state == CLIENTSTATE_QUIT_QUEUED)
+		return;
+
+	D = mempool_pop(queue_pool, sizeof(*D));
+	D->magic    = DM_THREAD_DATA_MAGIC;
+	D->status   = 0;
+	D->pool     = queue_pool;
+	D->cb_enter = cb_enter;
+	D->cb_leave = cb_leave;
+	D->session  = NULL;
+	D->client   = session;
+	D->data     = data;
+
+	TRACE(TRACE_DEBUG,"[%p] [%p]", D, D->client);
+
+	g_thread_pool_push(reactor_current()->tpool, D, &err);
+	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
+}
+
+/*
+ * worker threads: hand a finished job back to the event loop
+ * of the reactor that owns the session
+ */
+void dm_thread_data_return(gpointer data)
+{
+	Reactor_T *R = reactor_current();
+	g_async_queue_push(R->queue, data);
+	reactor_wakeup(R, "D");
+}
+
 void dm_thread_data_free(gpointer data)
 {
 	dm_thread_data *D = (dm_thread_data *)data;
@@ -219,9 +386,18 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 {
 	TRACE(TRACE_DEBUG,"data[%p], user_data[%p]", data, user_data);
 	dm_thread_data *D = (dm_thread_data *)data;
-	ImapSession *session = (ImapSession *)D->session;
-	if (session->state == CLIENTSTATE_QUIT_QUEUED)
-		return;
+
+	// workers belong to the reactor that owns the pool
+	pthread_setspecific(reactor_key, user_data);
+
+	if (D->client) {
+		if (D->client->state == CLIENTSTATE_QUIT_QUEUED)
+			return;
+	} else {
+		ImapSession *session = (ImapSession *)D->session;
+		if (session->state == CLIENTSTATE_QUIT_QUEUED)
+			return;
+	}
 
 	D->cb_enter(D);
 }
@@ -232,33 +408,190 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
  *
  */
 
-static int server_setup(ServerConfig_T *conf)
+static void * reactor_loop(void *arg)
 {
+	Reactor_T *R = (Reactor_T *)arg;
+
+	pthread_setspecific(reactor_key, R);
+
+	TRACE(TRACE_DEBUG, "reactor [%d] dispatching event loop...", R->id);
+	event_base_dispatch(R->evbase);
+	TRACE(TRACE_DEBUG, "reactor [%d] done", R->id);
+
+	return NULL;
+}
+
+/*
+ * create the reactors. The first one runs on evbase in the
+ * calling thread; the others get their own event base.
+ */
+void dm_reactors_open(int count, guint workers)
+{
+	int i;
 	GError *err = NULL;
-	guint tpool_size = db_params.max_db_connections;
 
-	server_set_sighandler();
+	assert(evbase);
 
-	small_pool = mempool_open();
+	if (! queue_pool)
+		queue_pool = mempool_open();
 
-	if (! MATCH(conf->service_name,"IMAP")) 
-		return 0;
+	if (! reactor_key_created) {
+		pthread_key_create(&reactor_key, NULL);
+		reactor_key_created = TRUE;
+	}
+
+	reactor_count = max(count, 1);
+	reactor_next = 0;
+	reactors = g_new0(Reactor_T, reactor_count);
+
+	TRACE(TRACE_INFO, "starting [%d] reactors with [%u] workers each", reactor_count, workers);
+
+	for (i = 0; i < reactor_count; i++) {
+		Reactor_T *R = &reactors[i];
+		R->id = i;
+		R->selfpipe[0] = R->selfpipe[1] = -1;
+		pthread_mutex_init(&R->selfpipe_lock, NULL);
+		pthread_mutex_init(&R->clients_lock, NULL);
+		R->clients = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+		// the main thread runs the first reactor on the global evbase
+		R->evbase = i ? event_base_new() : evbase;
+
+		// Asynchronous message queue for receiving messages
+		// from worker threads in the event loop.
+		//
+		// Only the event loop thread of a reactor is allowed 
+		// to do network IO for its sessions.
+		R->queue = g_async_queue_new();
+
+		// Create the thread pool
+		if (! (R->tpool = g_thread_pool_new((GFunc)dm_thread_dispatch,R,workers,TRUE,&err)))
+			TRACE(TRACE_DEBUG,"g_thread_pool creation failed [%s]", err->message);
+	}
+
+	pthread_setspecific(reactor_key, &reactors[0]);
+}
+
+/*
+ * start the event loops of all reactors but the first,
+ * which is run by the main thread.
+ */
+void dm_reactors_start(void)
+{
+	int i;
+	for (i = 1; i < reactor_count; i++) {
+		Reactor_T *R = &reactors[i];
+		if (pthread_create(&R->thread, NULL, reactor_loop, R)) {
+			TRACE(TRACE_EMERG, "unable to start reactor [%d]: %s", i, strerror(errno));
+			continue;
+		}
+		R->running = TRUE;
+	}
+}
 
-	// Asynchronous message queue for receiving messages
-	// from worker threads in the main thread. 
-	//
-	// Only the main thread is allowed to do network IO.
-	// see the libevent docs for the ratio and a work-around.
-	// Dbmail only needs and uses a single eventbase for now.
-	queue = g_async_queue_new();
+static void _shutdown_client(ClientBase_T *client, gpointer UNUSED value, gpointer UNUSED data)
+{
+	if (client->rx >= 0)
+		shutdown(client->rx, SHUT_RDWR);
+	if ((client->tx >= 0) && (client->tx != client->rx))
+		shutdown(client->tx, SHUT_RDWR);
+}
 
-	queue_pool = mempool_open();
+/*
+ * event loop thread: make the sessions of this reactor see EOF,
+ * so they are closed the normal way before the loop exits
+ */
+static void reactor_close_clients(gpointer UNUSED data)
+{
+	Reactor_T *R = reactor_current();
 
-	// Create the thread pool
-	if (! (tpool = g_thread_pool_new((GFunc)dm_thread_dispatch,NULL,tpool_size,TRUE,&err)))
-		TRACE(TRACE_DEBUG,"g_thread_pool creation failed [%s]", err->message);
+	PLOCK(R->clients_lock);
+	TRACE(TRACE_DEBUG, "reactor [%d] closing [%u] connections", R->id, g_hash_table_size(R->clients));
+	g_hash_table_foreach(R->clients, (GHFunc)_shutdown_client, NULL);
+	PUNLOCK(R->clients_lock);
+}
 
-	assert(evbase);
+/*
+ * stop the reactor threads after closing their sessions, wait for
+ * them and their workers, and free them. Called from the main thread.
+ */
+void dm_reactors_stop(void)
+{
+	int i;
+	struct timeval grace = { REACTOR_CLOSE_GRACE, 0 };
+
+	if (! reactors)
+		return;
+
+	for (i = 1; i < reactor_count; i++) {
+		if (! reactors[i].running)
+			continue;
+		dm_queue_push_reactor(&reactors[i], reactor_close_clients, NULL, NULL);
+		event_base_loopexit(reactors[i].evbase, &grace);
+	}
+	for (i = 1; i < reactor_count; i++) {
+		if (! reactors[i].running)
+			continue;
+		if (pthread_equal(reactors[i].thread, pthread_self()))
+			continue; // exiting from this reactor
+		pthread_join(reactors[i].thread, NULL);
+		reactors[i].running = FALSE;
+	}
+	for (i = 0; i < reactor_count; i++) {
+		Reactor_T *R = &reactors[i];
+		if (R->tpool) {
+			g_thread_pool_free(R->tpool, TRUE, TRUE);
+			R->tpool = NULL;
+		}
+		reactor_queue_discard(R);
+		if (R->heartbeat)
+			event_free(R->heartbeat);
+		PLOCK(R->selfpipe_lock);
+		if (R->selfpipe[0] > -1)
+			close(R->selfpipe[0]);
+		if (R->selfpipe[1] > -1)
+			close(R->selfpipe[1]);
+		R->selfpipe[0] = R->selfpipe[1] = -1;
+		PUNLOCK(R->selfpipe_lock);
+		g_async_queue_unref(R->queue);
+		g_hash_table_destroy(R->clients);
+		if (i)
+			event_base_free(R->evbase);
+	}
+
+	if (reactor_key_created)
+		pthread_setspecific(reactor_key, NULL);
+	g_free(reactors);
+	reactors = NULL;
+	reactor_count = 0;
+}
+
+/*
+ * round-robin reactor selection for new connections
+ */
+gpointer dm_reactor_assign(void)
+{
+	Reactor_T *R = &reactors[reactor_next];
+	reactor_next = (reactor_next + 1) % reactor_count;
+	return R;
+}
+
+static int server_setup(ServerConfig_T *conf)
+{
+	int count;
+
+	server_set_sighandler();
+
+	if (! small_pool)
+		small_pool = mempool_open();
+
+	if (MATCH(conf->service_name,"HTTP")) 
+		return 0;
+
+	// The database connection pool is the real limit on concurrent
+	// commands, so it is shared out among the reactors.
+	count = max(conf->reactors, 1);
+	dm_reactors_open(count, max(db_params.max_db_connections / count, 1));
 
 	return 0;
 }
@@ -300,11 +633,12 @@ static int server_start_cli(ServerConfig_T *conf)
 #endif
 
 		evbase = event_base_new();
+		conf->reactors = 1; // a single session on stdin
+		conf->processes = 1;
 		if (server_setup(conf)) return -1;
 		conf->ClientHandler(c);
 
-		if (MATCH(conf->service_name, "IMAP"))
-			dm_queue_heartbeat();
+		dm_queue_heartbeat();
 
 		event_base_dispatch(evbase);
 	}
@@ -478,6 +812,14 @@ static void create_inet_socket(ServerConfig_T *conf, int i, gboolean ssl)
 		}
 		UNBLOCK(s);
 
+#ifdef SO_REUSEPORT
+		if (conf->processes > 1) {
+			int so_reuseport = 1;
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &so_reuseport, sizeof(so_reuseport)) == -1)
+				TRACE(TRACE_ERR, "setsockopt::error [%s]", strerror(errno));
+		}
+#endif
+
 		dm_bind_and_listen(s, res->ai_addr, res->ai_addrlen, conf->backlog, ssl);
 		if (ssl)
 			conf->ssl_listenSockets[conf->ssl_socketcount++] = s;
@@ -502,7 +844,7 @@ static void server_close_sockets(ServerConfig_T *conf)
 			if (conf->ssl_listenSockets[i] > 0)
 				close(conf->ssl_listenSockets[i]);
 		conf->ssl_socketcount=0;
-		if (strlen(conf->socket))
+		if (strlen(conf->socket) && (! server_is_worker))
 			unlink(conf->socket);
 
 		mempool_push(small_pool, conf->listenSockets, sizeof(int) * MAXSOCKETS);
@@ -516,7 +858,6 @@ static void server_exit(void)
 	server_close_sockets(server_conf);
 	//event_base_free(evbase);
 
-	pthread_mutex_destroy(&selfpipe_lock);
 	if (fstdout) fclose(fstdout);
 	if (fstderr) fclose(fstderr);
 	if (fnull) fclose(fnull);
@@ -552,6 +893,16 @@ static void server_create_sockets(ServerConfig_T * conf)
 	}
 }
 
+/*
+ * run the client handler for a new connection in the
+ * event loop of the reactor it was assigned to
+ */
+static void server_client_handler(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	server_conf->ClientHandler((client_sock *)D->data);
+}
+
 #ifdef DEBUG
 static void _sock_cb(int sock, short event, void *arg, gboolean ssl)
 #else
@@ -560,6 +911,7 @@ static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
 {
 	Mempool_T pool;
 	client_sock *c;
+	Reactor_T *R;
 	int csock;
 	struct sockaddr *caddr;
 	struct sockaddr *saddr;
@@ -638,7 +990,11 @@ static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
 	TRACE(TRACE_INFO, "connection accepted");
 
 	/* streams are ready, perform handling */
-	server_conf->ClientHandler((client_sock *)c);
+	R = (Reactor_T *)dm_reactor_assign();
+	if (R == reactor_current())
+		server_conf->ClientHandler((client_sock *)c);
+	else
+		dm_queue_push_reactor(R, server_client_handler, NULL, c);
 
 	/* reschedule */
 	event_add(ev, NULL);
@@ -655,6 +1011,40 @@ static void server_sock_ssl_cb(int sock, short event, void *arg)
 }
 
 
+/*
+ * graceful shutdown: stop accepting new connections and exit
+ * once the open ones are done, or the idle timeout has passed.
+ */
+static void server_drain_cb(int UNUSED fd, short UNUSED what, void UNUSED *arg)
+{
+	static int ticks = 0;
+	int active = ci_count();
+
+	if (active && (++ticks < server_conf->timeout)) {
+		TRACE(TRACE_DEBUG, "waiting for [%d] connections", active);
+		return;
+	}
+
+	TRACE(TRACE_NOTICE, "[%d] connections left, exiting", active);
+	exit(0);
+}
+
+static void server_drain(void)
+{
+	int i;
+	struct timeval tv = { 1, 0 };
+
+	if (drain_timer)
+		return;
+
+	TRACE(TRACE_NOTICE, "stop accepting new connections");
+	for (i = 0; i < evsock_count; i++)
+		event_del(evsock[i]);
+
+	drain_timer = event_new(evbase, -1, EV_PERSIST, server_drain_cb, NULL);
+	event_add(drain_timer, &tv);
+}
+
 void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 {
 	struct event *ev = arg;
@@ -664,9 +1054,15 @@ void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 			mainReload = 1;
 		case SIGPIPE: // ignore
 		break;
+		case SIGQUIT:
+			server_drain();
+		break;
 		case SIGUSR1:
 			g_mem_profile();
 		break;
+		case SIGUSR2:
+			RecipientCache_flush();
+		break;
 		default:
 			exit(0);
 		break;
@@ -693,6 +1089,14 @@ static int server_set_sighandler(void)
 	evsignal_assign(sig_pipe, evbase, SIGPIPE, server_sig_cb, sig_pipe);
 	evsignal_add(sig_pipe, NULL);
 
+	sig_quit = evsignal_new(evbase, SIGQUIT, server_sig_cb, NULL);
+	evsignal_assign(sig_quit, evbase, SIGQUIT, server_sig_cb, sig_quit);
+	evsignal_add(sig_quit, NULL);
+
+	sig_usr2 = evsignal_new(evbase, SIGUSR2, server_sig_cb, NULL);
+	evsignal_assign(sig_usr2, evbase, SIGUSR2, server_sig_cb, sig_usr2);
+	evsignal_add(sig_usr2, NULL);
+
 #if MEMDEBUG
 	sig_usr = evsignal_new(evbase, SIGUSR1, server_sig_cb, NULL); 
 	evsignal_assign(sig_usr, evbase, SIGUSR1, server_sig_cb, sig_usr); 
@@ -709,15 +1113,14 @@ static int server_set_sighandler(void)
 void disconnect_all(void)
 {
 	TRACE(TRACE_INFO, "disconnecting all");
+	dm_reactors_stop();
+	MailboxWatch_stop();
+	HeaderQueue_stop();
 	db_disconnect();
 	auth_disconnect();
 	g_mime_shutdown();
 	config_free();
 
-	if (tpool) { 
-		g_thread_pool_free(tpool, TRUE, TRUE);
-		tpool = NULL;
-	}
 	if (sig_int) {
 		event_free(sig_int);
 		sig_int = NULL;
@@ -740,6 +1143,14 @@ void disconnect_all(void)
 		free(sig_pipe);
 		sig_pipe = NULL;
 	}
+	if (sig_quit) {
+		free(sig_quit);
+		sig_quit = NULL;
+	}
+	if (sig_usr2) {
+		free(sig_usr2);
+		sig_usr2 = NULL;
+	}
 }
 
 static void server_pidfile(ServerConfig_T *conf)
@@ -763,19 +1174,31 @@ static void server_pidfile(ServerConfig_T *conf)
 	configured = TRUE;
 }
 
-int server_run(ServerConfig_T *conf)
+/*
+ * register the listening sockets with the main event base
+ */
+static void server_listen(ServerConfig_T *conf)
 {
-	int i;
-	struct event **evsock;
-
-	mainReload = 0;
-
-	assert(conf);
-	reopen_logs(conf);
-
- 	TRACE(TRACE_NOTICE, "starting main service loop for [%s]", conf->service_name);
+	int i, k;
+
+	evsock_count = conf->socketcount + conf->ssl_socketcount;
+	evsock = g_new0(struct event *, evsock_count);
+	for (i = 0; i < conf->socketcount; i++) {
+		TRACE(TRACE_DEBUG, "Adding event for plain socket [%d] [%d/%d]", conf->listenSockets[i], i+1, evsock_count);
+		evsock[i] = event_new(evbase, conf->listenSockets[i], EV_READ, server_sock_cb, NULL);
+		event_assign(evsock[i], evbase, conf->listenSockets[i], EV_READ, server_sock_cb, evsock[i]);
+		event_add(evsock[i], NULL);
+	}
+	for (k = i, i = 0; i < conf->ssl_socketcount; i++, k++) {
+		TRACE(TRACE_DEBUG, "Adding event for ssl socket [%d] [%d/%d]", conf->ssl_listenSockets[i], k+1, evsock_count);
+		evsock[k] = event_new(evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, NULL);
+		event_assign(evsock[k], evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, evsock[k]);
+		event_add(evsock[k], NULL);
+	}
+}
 
-	server_conf = conf;
+static int server_connect(void)
+{
 	if (db_connect() != 0) {
 		TRACE(TRACE_ERR, "could not connect to database");
 		return -1;
@@ -787,10 +1210,11 @@ int server_run(ServerConfig_T *conf)
 	}
 	srand((int) ((int) time(NULL) + (int) getpid()));
 
- 	TRACE(TRACE_NOTICE, "starting main service loop for [%s]", conf->service_name);
-
-	server_conf = conf;
+	return 0;
+}
 
+static int server_event_setup(ServerConfig_T *conf)
+{
 	evthread_use_pthreads();
 #ifdef DEBUG
 	event_enable_debug_mode();
@@ -798,7 +1222,308 @@ int server_run(ServerConfig_T *conf)
 #endif
 	evbase = event_base_new();
 
-	if (server_setup(conf)) return -1;
+	return server_setup(conf);
+}
+
+static void server_dispatch(ServerConfig_T *conf)
+{
+	if (! MATCH(conf->service_name, "HTTP")) {
+		dm_queue_heartbeat();
+		dm_reactors_start();
+	}
+
+	TRACE(TRACE_DEBUG,"dispatching event loop...");
+
+	event_base_dispatch(evbase);
+}
+
+/*
+ * prefork mode
+ *
+ * The master binds the listening sockets, drops privileges and forks
+ * a number of worker processes. Each worker runs the normal event
+ * loop with its own database pool. Where SO_REUSEPORT is available
+ * every worker gets a private set of inet sockets bound to the same
+ * addresses, so the kernel spreads new connections over them. The
+ * master restarts workers that die, replaces them on SIGHUP and
+ * stops them on SIGTERM.
+ */
+typedef struct {
+	pid_t pid;
+	time_t started;
+	int *sockets;
+	int socketcount;
+	int *ssl_sockets;
+	int ssl_socketcount;
+} Worker_T;
+
+static Worker_T *workers = NULL;
+static int worker_count = 0;
+static volatile sig_atomic_t master_reload = 0;
+static volatile sig_atomic_t master_stop = 0;
+static volatile sig_atomic_t master_flush = 0;
+
+static void master_sig_handler(int sig)
+{
+	switch (sig) {
+		case SIGHUP:
+			master_reload = 1;
+			break;
+		case SIGUSR2:
+			master_flush = 1;
+			break;
+		case SIGINT:
+		case SIGTERM:
+			master_stop = 1;
+			break;
+	}
+}
+
+static void master_set_sighandler(void)
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = master_sig_handler;	// no SA_RESTART: interrupt waitpid
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGUSR2, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &act, NULL);
+}
+
+static void master_reset_sighandler(void)
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGUSR2, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGPIPE, &act, NULL);
+}
+
+/*
+ * give every worker its own inet listeners. The unix socket can not
+ * be shared this way, so all workers accept on the same one.
+ */
+static void master_create_sockets(ServerConfig_T *conf)
+{
+	int i, j, *sockets, *ssl_sockets, socketcount, ssl_socketcount;
+
+	if (strlen(conf->port))
+		server_create_sockets(conf);
+
+	sockets = conf->listenSockets;
+	ssl_sockets = conf->ssl_listenSockets;
+	socketcount = conf->socketcount;
+	ssl_socketcount = conf->ssl_socketcount;
+
+	for (i = 0; i < worker_count; i++) {
+		Worker_T *W = &workers[i];
+#ifdef SO_REUSEPORT
+		if (i && strlen(conf->port)) {
+			conf->listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
+			conf->ssl_listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
+			conf->socketcount = 0;
+			conf->ssl_socketcount = 0;
+			if (strlen(conf->socket))
+				conf->listenSockets[conf->socketcount++] = sockets[0];
+			for (j = 0; j < conf->ipcount; j++)
+				create_inet_socket(conf, j, FALSE);
+			if (conf->ssl && strlen(conf->ssl_port)) {
+				for (j = 0; j < conf->ipcount; j++)
+					create_inet_socket(conf, j, TRUE);
+			}
+		}
+#endif
+		W->sockets = conf->listenSockets;
+		W->socketcount = conf->socketcount;
+		W->ssl_sockets = conf->ssl_listenSockets;
+		W->ssl_socketcount = conf->ssl_socketcount;
+	}
+
+	// the master itself owns the first set
+	conf->listenSockets = sockets;
+	conf->ssl_listenSockets = ssl_sockets;
+	conf->socketcount = socketcount;
+	conf->ssl_socketcount = ssl_socketcount;
+}
+
+static gboolean worker_has_socket(Worker_T *W, int sock)
+{
+	int i;
+	for (i = 0; i < W->socketcount; i++)
+		if (W->sockets[i] == sock) return TRUE;
+	for (i = 0; i < W->ssl_socketcount; i++)
+		if (W->ssl_sockets[i] == sock) return TRUE;
+	return FALSE;
+}
+
+static void worker_run(ServerConfig_T *conf, int slot)
+{
+	int i, j;
+	Worker_T *W = &workers[slot];
+
+	server_is_worker = TRUE;
+	master_reset_sighandler();
+
+	// close the listeners of the other workers
+	for (i = 0; i < worker_count; i++) {
+		Worker_T *O = &workers[i];
+		if ((i == slot) || (O->sockets == W->sockets))
+			continue;
+		for (j = 0; j < O->socketcount; j++)
+			if (! worker_has_socket(W, O->sockets[j])) close(O->sockets[j]);
+		for (j = 0; j < O->ssl_socketcount; j++)
+			if (! worker_has_socket(W, O->ssl_sockets[j])) close(O->ssl_sockets[j]);
+	}
+
+	conf->listenSockets = W->sockets;
+	conf->socketcount = W->socketcount;
+	conf->ssl_listenSockets = W->ssl_sockets;
+	conf->ssl_socketcount = W->ssl_socketcount;
+
+	TRACE(TRACE_NOTICE, "worker [%d] started for [%s]", slot, conf->service_name);
+
+	if (server_connect())
+		exit(1);
+	if (server_event_setup(conf))
+		exit(1);
+
+	server_listen(conf);
+	server_dispatch(conf);
+
+	exit(0);
+}
+
+static void worker_start(ServerConfig_T *conf, int slot)
+{
+	pid_t pid;
+	Worker_T *W = &workers[slot];
+
+	// a worker that keeps dying right away is not restarted at full speed
+	if (W->started && (time(NULL) - W->started) < 1)
+		sleep(1);
+
+	if ((pid = fork()) < 0) {
+		TRACE(TRACE_ERR, "fork failed [%s]", strerror(errno));
+		return;
+	}
+
+	if (pid == 0)
+		worker_run(conf, slot);
+
+	W->pid = pid;
+	W->started = time(NULL);
+	TRACE(TRACE_INFO, "worker [%d] pid [%d]", slot, pid);
+}
+
+static int server_prefork(ServerConfig_T *conf)
+{
+	int i, status;
+	pid_t pid;
+
+	worker_count = conf->processes;
+	workers = g_new0(Worker_T, worker_count);
+
+	if (! small_pool)
+		small_pool = mempool_open();
+
+	master_create_sockets(conf);
+
+	atexit(server_exit);
+
+	if (drop_privileges(conf->serverUser, conf->serverGroup) < 0)
+		TRACE(TRACE_WARNING, "unable to drop privileges");
+
+	server_pidfile(conf);
+
+	master_set_sighandler();
+
+	TRACE(TRACE_NOTICE, "starting [%d] worker processes", worker_count);
+	for (i = 0; i < worker_count; i++)
+		worker_start(conf, i);
+
+	while (! master_stop) {
+		if (master_reload) {
+			master_reload = 0;
+			TRACE(TRACE_NOTICE, "reload: replacing worker processes");
+			config_read(configFile);
+			reopen_logs(conf);
+			// start the new generation before the old one drains
+			for (i = 0; i < worker_count; i++) {
+				pid_t old = workers[i].pid;
+				workers[i].started = 0;
+				worker_start(conf, i);
+				if (old > 0) kill(old, SIGQUIT);
+			}
+		}
+
+		if (master_flush) {
+			master_flush = 0;
+			// caches live in the workers
+			for (i = 0; i < worker_count; i++)
+				if (workers[i].pid > 0) kill(workers[i].pid, SIGUSR2);
+		}
+
+		/* Poll rather than block: a signal arriving between the flag
+		 * checks above and a blocking waitpid would go unnoticed until
+		 * the next worker exits. */
+		if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
+			usleep(200000);
+			continue;
+		}
+
+		for (i = 0; i < worker_count; i++) {
+			if (workers[i].pid != pid)
+				continue;
+			workers[i].pid = 0;
+			if (WIFSIGNALED(status))
+				TRACE(TRACE_ERR, "worker [%d] pid [%d] killed by signal [%d]", i, pid, WTERMSIG(status));
+			else
+				TRACE(TRACE_WARNING, "worker [%d] pid [%d] exited [%d]", i, pid, WEXITSTATUS(status));
+			if (! master_stop)
+				worker_start(conf, i);
+			break;
+		}
+	}
+
+	TRACE(TRACE_NOTICE, "stopping worker processes");
+	for (i = 0; i < worker_count; i++)
+		if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+	while (waitpid(-1, &status, 0) > 0 || errno == EINTR)
+		;
+
+	return 0;
+}
+
+int server_run(ServerConfig_T *conf)
+{
+	int i;
+
+	mainReload = 0;
+
+	assert(conf);
+	reopen_logs(conf);
+
+ 	TRACE(TRACE_NOTICE, "starting main service loop for [%s]", conf->service_name);
+
+	server_conf = conf;
+
+	if ((conf->processes > 1) && (! MATCH(conf->service_name, "HTTP")))
+		return server_prefork(conf);
+
+	if (server_connect())
+		return -1;
+
+	if (server_event_setup(conf)) return -1;
 
 	if (strlen(conf->port)) {
 
@@ -820,23 +1545,8 @@ int server_run(ServerConfig_T *conf)
 				}
 			}
 		} else {
-			int k, total;
 			server_create_sockets(conf);
-			total = conf->socketcount + conf->ssl_socketcount;
-			evsock = g_new0(struct event *, total);
-			for (i = 0; i < conf->socketcount; i++) {
-				TRACE(TRACE_DEBUG, "Adding event for plain socket [%d] [%d/%d]", conf->listenSockets[i], i+1, total);
-				evsock[i] = event_new(evbase, conf->listenSockets[i], EV_READ, server_sock_cb, NULL);
-				event_assign(evsock[i], evbase, conf->listenSockets[i], EV_READ, server_sock_cb, evsock[i]);
-				event_add(evsock[i], NULL);
-			}
-			k = i+1;
-			for (k = i, i = 0; i < conf->ssl_socketcount; i++, k++) {
-				TRACE(TRACE_DEBUG, "Adding event for ssl socket [%d] [%d/%d]", conf->ssl_listenSockets[i], k+1, total);
-				evsock[k] = event_new(evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, NULL);
-				event_assign(evsock[k], evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, evsock[k]);
-				event_add(evsock[k], NULL);
-			}
+			server_listen(conf);
 		}
 	}	
 
@@ -847,12 +1557,7 @@ int server_run(ServerConfig_T *conf)
 	
 	server_pidfile(conf);
 
-	if (MATCH(conf->service_name, "IMAP"))
-		dm_queue_heartbeat();
-
-	TRACE(TRACE_DEBUG,"dispatching event loop...");
-
-	event_base_dispatch(evbase);
+	server_dispatch(conf);
 
 	return 0;
 }
@@ -1085,6 +1790,26 @@ void server_config_load(ServerConfig_T * config, const char * const service)
 		TRACE(TRACE_EMERG, "value for BACKLOG is invalid: [%d]", config->backlog);
 	TRACE(TRACE_DEBUG, "%s backlog [%d]", service, config->backlog);
 
+	/* read items: REACTORS */
+	config_get_value("REACTORS", service, val);
+	if (strlen(val) == 0)
+		config->reactors = 1;
+	else if ((config->reactors = atoi(val)) <= 0) {
+		TRACE(TRACE_WARNING, "value for REACTORS is invalid: [%s], using [1]", val);
+		config->reactors = 1;
+	}
+	TRACE(TRACE_DEBUG, "%s reactors [%d]", service, config->reactors);
+
+	/* read items: PROCESSES */
+	config_get_value("PROCESSES", service, val);
+	if (strlen(val) == 0)
+		config->processes = 1;
+	else if ((config->processes = atoi(val)) <= 0) {
+		TRACE(TRACE_WARNING, "value for PROCESSES is invalid: [%s], using [1]", val);
+		config->processes = 1;
+	}
+	TRACE(TRACE_DEBUG, "%s processes [%d]", service, config->processes);
+
 	/* read items: RESOLVE_IP */
 	config_get_value("RESOLVE_IP", service, val);
 	if (strlen(val) == 0)
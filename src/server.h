@@ -54,12 +54,26 @@ int StartCliServer(ServerConfig_T * conf);
 int server_run(ServerConfig_T *conf);
 
 void dm_queue_push(void *cb, void *session, void *data);
+void dm_queue_push_reactor(gpointer reactor, void *cb, void *session, void *data);
 void dm_queue_drain(void);
 void dm_queue_heartbeat(void);
 
 void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data);
 void dm_thread_data_sendmessage(gpointer data);
 
+gpointer dm_reactor_current(void);
+struct event_base * dm_reactor_base(void);
+gpointer dm_reactor_assign(void);
+gpointer dm_reactor_attach(ClientBase_T *client);
+void dm_reactor_detach(gpointer reactor, ClientBase_T *client);
+
+void dm_reactors_open(int count, guint workers);
+void dm_reactors_start(void);
+void dm_reactors_stop(void);
+
+void dm_client_thread_push(ClientSession_T *session, gpointer cb_enter, gpointer cb_leave, gpointer data);
+void dm_thread_data_return(gpointer data);
+
 void server_showhelp(const char *service, const char *greeting);
 int server_getopt(ServerConfig_T *config, const char *service, int argc, char *argv[]);
 int server_mainloop(ServerConfig_T *config, const char *servicename);
@@ -35,6 +35,7 @@
 #include <check.h>
 #include "check_dbmail.h"
 #include "dm_cram.h"
+#include "dm_authcache.h"
 
 extern char configFile[PATH_MAX];
 extern int quiet;
@@ -95,6 +96,56 @@ START_TEST(test_auth_validate)
 }
 END_TEST
 
+START_TEST(test_auth_cache)
+{
+	uint64_t user_idnr = 0, cached_idnr = 0, generation;
+	uint64_t hits, misses, hits_before;
+	char *userid;
+	int result;
+	ClientBase_T *ci = ci_new();
+
+	config_set_value("auth_cache_ttl", "DBMAIL", "60");
+	AuthCache_flush();
+
+	result = auth_validate(ci, "testuser1", "test", &user_idnr);
+	fail_unless(result==1,"auth_validate failed [%d]", result);
+	AuthCache_stats(&hits_before, &misses);
+	result = auth_validate(ci, "testuser1", "test", &cached_idnr);
+	fail_unless(result==1,"auth_validate failed on second login [%d]", result);
+	fail_unless(cached_idnr == user_idnr, "user_idnr mismatch on second login");
+	AuthCache_stats(&hits, &misses);
+	fail_unless(hits > hits_before, "second login not served from the cache");
+
+	hits_before = hits;
+	result = auth_validate(ci, "testuser1", "testwrong", &cached_idnr);
+	fail_unless(result==0,"auth_validate accepted a wrong password [%d]", result);
+	AuthCache_stats(&hits, &misses);
+	fail_unless(hits == hits_before, "wrong password served from the cache");
+
+	userid = auth_get_userid(user_idnr);
+	fail_unless(userid && MATCH(userid, "testuser1"), "auth_get_userid failed");
+	g_free(userid);
+	AuthCache_stats(&hits_before, &misses);
+	userid = auth_get_userid(user_idnr);
+	fail_unless(userid && MATCH(userid, "testuser1"), "auth_get_userid failed on second lookup");
+	g_free(userid);
+	AuthCache_stats(&hits, &misses);
+	fail_unless(hits > hits_before, "second auth_get_userid not served from the cache");
+
+	/* results obtained before a flush are not stored */
+	generation = AuthCache_generation();
+	AuthCache_flush();
+	AuthCache_setValid("testuser1", "teststale", user_idnr, generation);
+	fail_if(AuthCache_getValid("testuser1", "teststale", &cached_idnr), "stale credentials were cached");
+
+	config_set_value("auth_cache_ttl", "DBMAIL", "0");
+	AuthCache_flush();
+	fail_if(AuthCache_getValid("testuser1", "test", &cached_idnr), "cache still enabled");
+
+	ci_delete(ci);
+}
+END_TEST
+
 #if 0
 START_TEST(test_auth_change_password)
 {
@@ -218,6 +269,7 @@ Suite *dbmail_common_suite(void)
 	
 	tcase_add_checked_fixture(tc_auth, setup, teardown);
 	tcase_add_test(tc_auth, test_auth_validate);
+	tcase_add_test(tc_auth, test_auth_cache);
 	//tcase_add_test(tc_auth, test_auth_change_password);
 	//tcase_add_test(tc_auth, test_auth_change_password_raw);
 	tcase_add_test(tc_auth, test_auth_cram_md5);
@@ -35,10 +35,13 @@
 // Test dsnuser_resolve through all of its pathways.
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_mailboxlist.h"
 
 extern char configFile[PATH_MAX];
 extern int quiet;
 extern int reallyquiet;
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
 
 uint64_t useridnr = 0;
 uint64_t useridnr_domain = 0;
@@ -138,6 +141,66 @@ START_TEST(test_db_stmt_set_str)
 }
 END_TEST
 
+START_TEST(test_db_stmt_stats)
+{
+	Connection_T c; PreparedStatement_T s, t; ResultSet_T r;
+	const char *q = "select userid from dbmail_users where userid=?";
+	const char *ids = "select userid from %susers where user_idnr=%" PRIu64 "";
+	uint64_t prepared = 0, executed = 0, prepared2 = 0, executed2 = 0, i;
+	double elapsed = 0, elapsed2 = 0;
+	gboolean stmt_stats = db_params.stmt_stats;
+
+	db_params.stmt_stats = TRUE;
+	db_stmt_stats(q, &prepared, &executed, &elapsed);
+
+	c = db_con_get();
+	s = db_stmt_prepare(c, q);
+	fail_unless(s != NULL, "db_stmt_prepare failed");
+	db_stmt_set_str(s, 1, "testuser1");
+	r = db_stmt_query(s);
+	fail_unless(db_result_next(r), "db_result_next failed");
+	fail_unless(MATCH(db_result_get(r, 0), "testuser1"), "wrong result");
+
+	t = db_stmt_prepare(c, q);
+	fail_unless(t != NULL, "db_stmt_prepare failed");
+	db_stmt_set_str(t, 1, DBMAIL_DELIVERY_USERNAME);
+	r = db_stmt_query(t);
+	fail_unless(db_result_next(r), "db_result_next failed");
+	fail_unless(MATCH(db_result_get(r, 0), DBMAIL_DELIVERY_USERNAME), "wrong result for second statement");
+
+	db_con_clear(c);
+	s = db_stmt_prepare(c, q);
+	fail_unless(s != NULL, "db_stmt_prepare after clear failed");
+	db_stmt_set_str(s, 1, "testuser1");
+	r = db_stmt_query(s);
+	fail_unless(db_result_next(r), "db_result_next failed");
+	db_stmt_exec(s);
+	db_con_close(c);
+
+	fail_unless(db_stmt_stats(q, &prepared2, &executed2, &elapsed2), "statement not counted");
+	fail_unless(prepared2 == prepared + 3, "prepared [%" PRIu64 "] times, expected [%" PRIu64 "]",
+			prepared2, prepared + 3);
+	fail_unless(executed2 == executed + 4, "executed [%" PRIu64 "] times, expected [%" PRIu64 "]",
+			executed2, executed + 4);
+	fail_unless(elapsed2 >= elapsed, "execution time not summed");
+
+	/* statements with inlined values are counted by their template */
+	fail_unless(! db_stmt_stats(ids, NULL, NULL, NULL), "statement counted before it was prepared");
+	c = db_con_get();
+	for (i = 1; i <= 3; i++) {
+		s = db_stmt_prepare(c, ids, DBPFX, i);
+		db_stmt_query(s);
+	}
+	db_con_close(c);
+	fail_unless(db_stmt_stats(ids, &prepared, &executed, &elapsed), "template not counted");
+	fail_unless(prepared == 3 && executed == 3, "template prepared [%" PRIu64 "] executed [%" PRIu64 "]",
+			prepared, executed);
+	fail_unless(elapsed >= 0, "negative execution time");
+
+	db_params.stmt_stats = stmt_stats;
+}
+END_TEST
+
 START_TEST(test_Connection_executeQuery)
 {
 	Connection_T c; ResultSet_T r = NULL;
@@ -259,6 +322,85 @@ START_TEST(test_db_findmailbox_by_regex)
 }
 END_TEST
 
+START_TEST(test_MailboxList_find)
+{
+	GList *found = NULL;
+	MailboxListItem_T *I;
+	uint64_t parent_id = 0, leaf_id = 0;
+
+	db_createmailbox("testlistbox", testidnr, &parent_id);
+	db_createmailbox("testlistbox/sub/leaf", testidnr, &leaf_id);
+
+	fail_unless(MailboxList_find(testidnr, "testlistbox", FALSE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "MailboxList_find failed");
+	I = found->data;
+	fail_unless(I->id == parent_id && (! I->no_children), "mailbox should have children");
+	MailboxList_free(&found);
+
+	fail_unless(MailboxList_find(testidnr, "testlistbox/%", FALSE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "MailboxList_find failed");
+	I = found->data;
+	fail_unless(MATCH(I->name, "testlistbox/sub") && I->no_select && (! I->no_children),
+			"level of hierarchy should be noselect");
+	MailboxList_free(&found);
+
+	fail_unless(MailboxList_find(testidnr, "testlistbox/*", FALSE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "MailboxList_find failed");
+	I = found->data;
+	fail_unless(I->id == leaf_id && I->no_children, "leaf should have no children");
+	MailboxList_free(&found);
+
+	fail_unless(MailboxList_find(testidnr, "testlistbox*", TRUE, &found) == DM_SUCCESS);
+	fail_unless(found == NULL, "unsubscribed mailboxes should not be listed");
+
+	db_subscribe(leaf_id, testidnr);
+	fail_unless(MailboxList_find(testidnr, "testlistbox*", TRUE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "subscribed mailbox should be listed");
+	MailboxList_free(&found);
+
+	db_delete_mailbox(leaf_id, 0, 0);
+	db_delete_mailbox(parent_id, 0, 0);
+
+	fail_unless(MailboxList_find(testidnr, "testlistbox*", FALSE, &found) == DM_SUCCESS);
+	fail_unless(found == NULL, "deleted mailboxes should not be listed");
+}
+END_TEST
+
+START_TEST(test_MailboxList_cache)
+{
+	GList *found = NULL;
+	uint64_t mailbox_id = 0;
+
+	config_set_value("list_cache_ttl", "IMAP", "60");
+
+	db_createmailbox("testlistcache", testidnr, &mailbox_id);
+	fail_unless(MailboxList_find(testidnr, "testlistcache*", FALSE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "MailboxList_find failed");
+	MailboxList_free(&found);
+
+	/* changes made by another process, which does not reach
+	 * MailboxList_changed() in this one */
+	db_update("UPDATE %smailboxes SET name = 'testlistcache2' WHERE mailbox_idnr = %" PRIu64 "",
+			DBPFX, mailbox_id);
+	db_mailbox_seq_update(mailbox_id, 0);
+	fail_unless(MailboxList_find(testidnr, "testlistcache2", FALSE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "renamed mailbox not listed");
+	MailboxList_free(&found);
+
+	db_update("INSERT INTO %ssubscription (user_id, mailbox_id) VALUES (%" PRIu64 ", %" PRIu64 ")",
+			DBPFX, testidnr, mailbox_id);
+	db_mailbox_seq_update(mailbox_id, 0);
+	fail_unless(MailboxList_find(testidnr, "testlistcache*", TRUE, &found) == DM_SUCCESS);
+	fail_unless(g_list_length(found) == 1, "subscribed mailbox not listed");
+	MailboxList_free(&found);
+
+	db_update("DELETE FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_id);
+	fail_unless(MailboxList_find(testidnr, "testlistcache*", FALSE, &found) == DM_SUCCESS);
+	fail_unless(found == NULL, "deleted mailbox listed");
+
+	config_set_value("list_cache_ttl", "IMAP", "0");
+}
+END_TEST
 
 START_TEST(test_db_createmailbox)
 {
@@ -425,6 +567,7 @@ Suite *dbmail_db_suite(void)
 
 	tcase_add_test(tc_db, test_db_stmt_prepare);
 	tcase_add_test(tc_db, test_db_stmt_set_str);
+	tcase_add_test(tc_db, test_db_stmt_stats);
 
 	tcase_add_test(tc_db, test_Connection_executeQuery);
 	tcase_add_test(tc_db, test_db_createmailbox);
@@ -434,6 +577,8 @@ Suite *dbmail_db_suite(void)
 	tcase_add_test(tc_db, test_db_mailbox_create_with_parents);
 	tcase_add_test(tc_db, test_mailbox_match_new);
 	tcase_add_test(tc_db, test_db_findmailbox_by_regex);
+	tcase_add_test(tc_db, test_MailboxList_find);
+	tcase_add_test(tc_db, test_MailboxList_cache);
 	tcase_add_test(tc_db, test_db_get_sql);
 
 	return s;
@@ -35,6 +35,7 @@
 // Test dsnuser_resolve through all of its pathways.
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_recipientcache.h"
 
 extern char configFile[PATH_MAX];
 extern int quiet;
@@ -250,6 +251,62 @@ START_TEST(test_resolve_userpart_catchall)
 }
 END_TEST
 
+START_TEST(test_resolve_cache)
+{
+	Delivery_T delivery;
+
+	// off by default
+	dsnuser_init(&delivery);
+	delivery.address = alias;
+	dsnuser_resolve(&delivery);
+	fail_unless(! RecipientCache_get(&delivery), "recipient cache enabled by default");
+	g_list_destroy(delivery.userids);
+	g_list_destroy(delivery.forwards);
+}
+END_TEST
+
+START_TEST(test_resolve_cache_enabled)
+{
+	Delivery_T delivery;
+	uint64_t hits = 0, misses = 0, hits2 = 0;
+	guint userids;
+
+	config_set_value("resolve_cache_ttl", "LMTP", "60");
+	config_set_value("resolve_cache_negative_ttl", "LMTP", "10");
+
+	RecipientCache_flush();
+	RecipientCache_stats(&hits, &misses);
+
+	dsnuser_init(&delivery);
+	delivery.address = alias;
+	dsnuser_resolve(&delivery);
+	fail_unless(delivery.dsn.class == DSN_CLASS_OK, "dsnuser_resolve failed alias.");
+	userids = g_list_length(delivery.userids);
+	g_list_destroy(delivery.userids);
+	g_list_destroy(delivery.forwards);
+
+	dsnuser_init(&delivery);
+	delivery.address = alias;
+	dsnuser_resolve(&delivery);
+	RecipientCache_stats(&hits2, NULL);
+	fail_unless(hits2 == hits + 1, "alias not resolved from cache");
+	fail_unless(delivery.dsn.class == DSN_CLASS_OK);
+	fail_unless(g_list_length(delivery.userids) == userids);
+	g_list_destroy(delivery.userids);
+	g_list_destroy(delivery.forwards);
+
+	// unknown addresses are cached too
+	dsnuser_init(&delivery);
+	delivery.address = "nobody-testfail@nonexistantdomain.invalid";
+	dsnuser_resolve(&delivery);
+	fail_unless(delivery.dsn.class == DSN_CLASS_FAIL);
+	fail_unless(RecipientCache_get(&delivery), "negative entry not cached");
+
+	RecipientCache_flush();
+	fail_unless(! RecipientCache_get(&delivery), "cache not flushed");
+}
+END_TEST
+
 START_TEST(test_tostring)
 {
 	int res;
@@ -321,6 +378,8 @@ Suite *dbmail_dsn_suite(void)
 	tcase_add_test(tc_dsn, test_resolve_username_mailbox);
 	tcase_add_test(tc_dsn, test_resolve_domain_catchall);
 	tcase_add_test(tc_dsn, test_resolve_userpart_catchall);
+	tcase_add_test(tc_dsn, test_resolve_cache);
+	tcase_add_test(tc_dsn, test_resolve_cache_enabled);
 	tcase_add_test(tc_dsn, test_tostring);
 	return s;
 }
@@ -35,9 +35,11 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_mailboxwatch.h"
 
 extern char configFile[PATH_MAX];
 extern DBParam_T db_params;
+extern struct event_base *evbase;
 extern Mempool_T queue_pool;
 
 #define DBPFX db_params.pfx
@@ -189,6 +191,61 @@ START_TEST(test_imap_session_new)
 }
 END_TEST
 
+static GList *watch_notified = NULL;
+
+static void _watch_notify(gpointer session)
+{
+	watch_notified = g_list_append(watch_notified, session);
+}
+
+START_TEST(test_mailbox_watch)
+{
+	uint64_t user_idnr = 0, mailbox_id = 0, seq;
+	int idle = 1, late = 2;
+
+	auth_user_exists("testuser1", &user_idnr);
+	db_find_create_mailbox("INBOX", BOX_COMMANDLINE, user_idnr, &mailbox_id);
+	fail_unless(mailbox_id > 0);
+
+	evbase = event_base_new();
+	dm_reactors_open(1, 1);
+	MailboxWatch_start(_watch_notify);
+	fail_unless(MailboxWatch_running(), "watcher not started");
+
+	seq = db_mailbox_seq_update(mailbox_id, 0);
+	MailboxWatch_add(mailbox_id, seq, &idle);
+	dm_queue_drain();
+	fail_unless(watch_notified == NULL, "session woken up without a change");
+
+	/* a change made in this process wakes up the session */
+	db_mailbox_seq_update(mailbox_id, 0);
+	dm_queue_drain();
+	fail_unless(g_list_length(watch_notified) == 1, "session not woken up");
+	fail_unless(watch_notified->data == &idle, "wrong session woken up");
+	g_list_free(watch_notified);
+	watch_notified = NULL;
+
+	/* a session that saw an older seq is woken up when it starts watching */
+	MailboxWatch_add(mailbox_id, seq, &late);
+	dm_queue_drain();
+	fail_unless(g_list_find(watch_notified, &late) != NULL, "late session not woken up");
+	g_list_free(watch_notified);
+	watch_notified = NULL;
+
+	/* sessions that stopped watching are left alone */
+	MailboxWatch_remove(mailbox_id, &idle);
+	MailboxWatch_remove(mailbox_id, &late);
+	db_mailbox_seq_update(mailbox_id, 0);
+	dm_queue_drain();
+	fail_unless(watch_notified == NULL, "removed session woken up");
+
+	MailboxWatch_stop();
+	dm_reactors_stop();
+	event_base_free(evbase);
+	evbase = NULL;
+}
+END_TEST
+
 START_TEST(test_imap_get_structure)
 {
 	DbmailMessage *message;
@@ -1048,6 +1105,7 @@ Suite *dbmail_suite(void)
 	
 	tcase_add_checked_fixture(tc_session, setup, teardown);
 	tcase_add_test(tc_session, test_imap_session_new);
+	tcase_add_test(tc_session, test_mailbox_watch);
 	tcase_add_test(tc_session, test_imap_get_structure);
 	tcase_add_test(tc_session, test_imap_cleanup_address);
 	tcase_add_test(tc_session, test_internet_address_list_parse_string);
@@ -34,6 +34,8 @@
 #include <check.h>
 #include <assert.h>
 #include "check_dbmail.h"
+#include "dm_headerqueue.h"
+#include "dm_fulltext.h"
 
 extern char *multipart_message;
 extern char configFile[PATH_MAX];
@@ -46,9 +48,10 @@ uint64_t empty_box = 0;
 /* we need this one because we can't directly link imapd.o */
 int imap_before_smtp = 0;
 
-static void add_message(void)
+static uint64_t add_message_string(const char *msgstring)
 {
 	int result;
+	uint64_t physid;
 	DbmailMessage *message;
 	Mempool_T pool = mempool_open();
 	List_T dsnusers = p_list_new(pool);
@@ -66,7 +69,7 @@ static void add_message(void)
 	userids = g_list_prepend(userids, uid);
 
 	message = dbmail_message_new(NULL);
-	message = dbmail_message_init_with_string(message,multipart_message);
+	message = dbmail_message_init_with_string(message,msgstring);
 
 	dsnuser_init(dsnuser);
 	dsnuser->address = g_strdup("testuser1");
@@ -78,9 +81,18 @@ static void add_message(void)
 
 	assert(result==0);
 
+	physid = dbmail_message_get_physid(message);
+
 	dsnuser_free_list(dsnusers);
 	dbmail_message_free(message);
 	mempool_close(&pool);
+
+	return physid;
+}
+
+static void add_message(void)
+{
+	add_message_string(multipart_message);
 }
 
 static gboolean tree_print(gpointer key, gpointer value, gpointer data UNUSED)
@@ -408,6 +420,432 @@ START_TEST(test_dbmail_mailbox_search)
 }
 END_TEST
 
+static int _search_count(Mempool_T pool, const char *query)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	int found;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool, query, &size);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, 0);
+	dbmail_mailbox_search(mb);
+	found = g_tree_nnodes(mb->found);
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	return found;
+}
+
+START_TEST(test_dbmail_mailbox_search_memory)
+{
+	int all, found, notfound;
+	Mempool_T pool = mempool_open();
+
+	all = _search_count(pool, "1:*");
+
+	found = _search_count(pool, "1:* SEEN");
+	notfound = _search_count(pool, "1:* UNSEEN");
+	fail_unless(all == found + notfound, "SEARCH SEEN failed (all: %d, found: %d, notfound: %d)", all, found, notfound);
+
+	found = _search_count(pool, "1:* SUBJECT a");
+	notfound = _search_count(pool, "1:* NOT SUBJECT a");
+	fail_unless(all == found + notfound, "SEARCH SUBJECT failed (all: %d, found: %d, notfound: %d)", all, found, notfound);
+
+	found = _search_count(pool, "1:* OR FROM a SENTSINCE 1-Jan-1970");
+	notfound = _search_count(pool, "1:* NOT OR FROM a SENTSINCE 1-Jan-1970");
+	fail_unless(all == found + notfound, "SEARCH OR failed (all: %d, found: %d, notfound: %d)", all, found, notfound);
+
+	found = _search_count(pool, "1:* LARGER 100 SINCE 1-Jan-1970");
+	notfound = _search_count(pool, "1:* NOT ( LARGER 100 SINCE 1-Jan-1970 )");
+	fail_unless(all == found + notfound, "SEARCH LARGER failed (all: %d, found: %d, notfound: %d)", all, found, notfound);
+
+	mempool_close(&pool);
+}
+END_TEST
+
+static int _physmessage_rows(const char *table, uint64_t physid)
+{
+	Connection_T c; ResultSet_T r;
+	int rows = 0;
+
+	c = db_con_get();
+	r = db_query(c, "SELECT physmessage_id FROM %s%s WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, table, physid);
+	while (db_result_next(r))
+		rows++;
+	db_con_close(c);
+
+	return rows;
+}
+
+static char * _envelope_cached(uint64_t physid)
+{
+	Connection_T c; ResultSet_T r;
+	char *envelope = NULL;
+
+	c = db_con_get();
+	r = db_query(c, "SELECT envelope FROM %senvelope WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, physid);
+	if (db_result_next(r))
+		envelope = g_strdup(db_result_get(r, 0));
+	db_con_close(c);
+
+	return envelope;
+}
+
+START_TEST(test_dbmail_mailbox_search_deferred)
+{
+	int all, found, notfound;
+	uint64_t physid;
+	char *msgstring, *query, *envelope, *cached;
+	DbmailMessage *m;
+	Mempool_T pool = mempool_open();
+
+	config_set_value("header_cache_deferred", "DBMAIL", "yes");
+	HeaderQueue_open();
+	fail_unless(HeaderQueue_running(), "header queue not running");
+
+	msgstring = g_strdup_printf("From: \"Deferred\" <deferred@example.org>\n"
+			"To: testuser1@example.org\n"
+			"Subject: deferred header cache\n"
+			"Date: Tue, 04 Dec 2007 19:52:16 +0800\n"
+			"X-Deferred: token%d\n"
+			"\n"
+			"deferred\n", (int)getpid());
+	query = g_strdup_printf("1:* HEADER X-Deferred token%d", (int)getpid());
+
+	physid = add_message_string(msgstring);
+	fail_unless(physid > 0, "delivery failed");
+
+	// before the queue runs
+	fail_unless(_physmessage_rows("header", physid) == 0, "header cache not deferred");
+	fail_unless(_physmessage_rows("envelope", physid) == 0, "envelope cache not deferred");
+
+	all = _search_count(pool, "1:*");
+	found = _search_count(pool, query);
+	notfound = _search_count(pool, "1:* NOT HEADER X-Deferred deferred-none");
+	fail_unless(found == 1, "SEARCH HEADER on a pending message found [%d]", found);
+	fail_unless(notfound == all, "SEARCH NOT HEADER on a pending message (all: %d, notfound: %d)", all, notfound);
+
+	// the envelope FETCH serves while the cache is pending
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_retrieve(m, physid);
+	fail_unless(m != NULL, "dbmail_message_retrieve failed");
+	envelope = imap_get_envelope(GMIME_MESSAGE(m->content));
+	dbmail_message_free(m);
+	fail_unless(envelope && strstr(envelope, "\"deferred header cache\""), "envelope of pending message [%s]", envelope);
+
+	// after the queue runs
+	HeaderQueue_run();
+
+	fail_unless(_physmessage_rows("header", physid) > 0, "header cache not filled");
+	cached = _envelope_cached(physid);
+	fail_unless(cached != NULL, "envelope cache not filled");
+	fail_unless(MATCH(envelope, cached), "cached envelope differs [%s] [%s]", envelope, cached);
+
+	fail_unless(_search_count(pool, query) == 1, "SEARCH HEADER on a cached message failed");
+	fail_unless(_search_count(pool, "1:* NOT HEADER X-Deferred deferred-none") == all,
+			"SEARCH NOT HEADER on a cached message failed");
+
+	HeaderQueue_stop();
+	config_set_value("header_cache_deferred", "DBMAIL", "no");
+
+	g_free(cached);
+	g_free(envelope);
+	g_free(query);
+	g_free(msgstring);
+	mempool_close(&pool);
+}
+END_TEST
+
+static char * _search_result(Mempool_T pool, const char *query, gboolean dbsearch)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	char *result;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	mb->dbsearch = dbsearch;
+	search_keys = _build_search_keys(pool, query, &size);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, 0);
+	dbmail_mailbox_search(mb);
+	result = tree_as_string(mb->found);
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	return result;
+}
+
+START_TEST(test_dbmail_mailbox_search_memory_sql)
+{
+	const char *queries[] = {
+		"1:* SEEN", "1:* UNSEEN", "1:* NOT SEEN",
+		"1:* NEW", "1:* NOT NEW", "1:* OLD", "1:* NOT OLD",
+		"1:* RECENT", "1:* FLAGGED", "1:* UNFLAGGED",
+		"1:* ANSWERED UNDELETED", "1:* OR DRAFT SEEN",
+		"1:* SUBJECT a", "1:* NOT FROM nfg",
+		NULL
+	};
+	int i, flags[IMAP_NFLAGS];
+	uint64_t msn = 1, *uid;
+	MailboxState_T M;
+	Mempool_T pool = mempool_open();
+
+	// give the messages different flags
+	M = MailboxState_new(pool, get_mailbox_id("INBOX"));
+	uid = g_tree_lookup(MailboxState_getMsn(M), &msn);
+	fail_unless(uid != NULL, "no first message");
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	db_set_msgflag(*uid, flags, NULL, IMAPFA_ADD, 0, NULL);
+	MailboxState_free(&M);
+
+	for (i = 0; queries[i]; i++) {
+		char *memory = _search_result(pool, queries[i], FALSE);
+		char *sql = _search_result(pool, queries[i], TRUE);
+		fail_unless(MATCH(memory, sql), "SEARCH %s differs in memory [%s] and sql [%s]",
+				queries[i], memory, sql);
+		g_free(memory);
+		g_free(sql);
+	}
+
+	mempool_close(&pool);
+}
+END_TEST
+
+static int _fulltext_postings(uint64_t physid, const char *term)
+{
+	Connection_T c; ResultSet_T r;
+	int rows = 0;
+
+	c = db_con_get();
+	r = db_query(c, "SELECT p.part_id FROM %spartlists l "
+			"JOIN %sfts_postings p ON p.part_id = l.part_id "
+			"JOIN %sfts_terms t ON t.id = p.term_id "
+			"WHERE l.physmessage_id = %" PRIu64 " AND t.term = '%s'",
+			DBPFX, DBPFX, DBPFX, physid, term);
+	while (db_result_next(r))
+		rows++;
+	db_con_close(c);
+
+	return rows;
+}
+
+static void _fulltext_set(const char *value)
+{
+	config_set_value("fulltext_index", "DBMAIL", value);
+	FullText_reset();
+}
+
+/* like _search_result, for search strings holding spaces */
+static char * _fulltext_result(Mempool_T pool, const char *key, const char *value, gboolean index)
+{
+	String_T search_keys[5];
+	uint64_t idx = 0;
+	int i = 0;
+	char *result;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+
+	_fulltext_set(index ? "yes" : "no");
+
+	mb->dbsearch = TRUE;
+	memset(search_keys, 0, sizeof(search_keys));
+	search_keys[i++] = p_string_new(pool, "1:*");
+	if (strncmp(key, "NOT ", 4) == 0) {
+		search_keys[i++] = p_string_new(pool, "NOT");
+		key += 4;
+	}
+	search_keys[i++] = p_string_new(pool, key);
+	search_keys[i++] = p_string_new(pool, value);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, 0);
+	dbmail_mailbox_search(mb);
+	result = tree_as_string(mb->found);
+	dbmail_mailbox_free(mb);
+	return result;
+}
+
+START_TEST(test_dbmail_mailbox_search_fulltext)
+{
+	uint64_t indexed, unindexed;
+	char *msgstring, *word, *encoded;
+	char *values[6];
+	const char *keys[] = { "BODY", "TEXT", "BODY", "TEXT", "NOT BODY", NULL };
+	int i, pid = (int)getpid();
+	Mempool_T pool = mempool_open();
+
+	word = g_strdup_printf("ftsbase%dword", pid);
+	encoded = g_base64_encode((const guchar *)word, strlen(word));
+
+	_fulltext_set("yes");
+	msgstring = g_strdup_printf("From: \"Fulltext\" <fulltext@example.org>\n"
+			"To: testuser1@example.org\n"
+			"Subject: fulltext index\n"
+			"MIME-Version: 1.0\n"
+			"Content-Type: multipart/mixed; boundary=\"fts\"\n"
+			"\n"
+			"--fts\n"
+			"Content-Type: text/plain; charset=utf-8\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			"%s\n"
+			"--fts\n"
+			"Content-Type: text/plain; charset=iso-8859-1\n"
+			"Content-Transfer-Encoding: quoted-printable\n"
+			"\n"
+			"ftsquoted%d=\nsoft caf=E9\n"
+			"--fts\n"
+			"Content-Type: text/plain\n"
+			"\n"
+			"ftsplain%dword tail\n"
+			"--fts--\n", encoded, pid, pid);
+	indexed = add_message_string(msgstring);
+	g_free(msgstring);
+
+	// the decoded text is indexed, not the transfer-encoding
+	fail_unless(_fulltext_postings(indexed, word) == 1, "base64 part not indexed");
+	msgstring = g_strdup_printf("ftsquoted%dsoft", pid);
+	fail_unless(_fulltext_postings(indexed, msgstring) == 1, "quoted-printable part not indexed");
+	g_free(msgstring);
+	fail_unless(_fulltext_postings(indexed, "caf\xc3\xa9") == 1, "charset not decoded");
+	fail_unless(_fulltext_postings(indexed, "e9") == 0, "quoted-printable escape indexed");
+
+	// a message stored without the index is still found
+	_fulltext_set("no");
+	msgstring = g_strdup_printf("From: \"Fulltext\" <fulltext@example.org>\n"
+			"To: testuser1@example.org\n"
+			"Subject: fulltext unindexed\n"
+			"\n"
+			"unindexed ftsquoted%dsoft body\n", pid);
+	unindexed = add_message_string(msgstring);
+	g_free(msgstring);
+	fail_unless(_fulltext_postings(unindexed, "unindexed") == 0, "indexed while disabled");
+
+	values[0] = g_strdup(word);
+	values[1] = g_strdup_printf("ftsquoted%dsoft", pid);
+	values[2] = g_strdup_printf("plain%dword ta", pid);
+	values[3] = g_strdup("fulltext index");
+	values[4] = g_strdup("unindexed");
+	values[5] = NULL;
+
+	for (i = 0; keys[i]; i++) {
+		char *scan = _fulltext_result(pool, keys[i], values[i], FALSE);
+		char *index = _fulltext_result(pool, keys[i], values[i], TRUE);
+		fail_unless(MATCH(scan, index), "SEARCH %s \"%s\" differs without [%s] and with [%s] index",
+				keys[i], values[i], scan, index);
+		// the base64 text is only in the index, and not confirmed
+		fail_unless(strlen(index) > 0 || i == 0, "SEARCH %s \"%s\" found nothing",
+				keys[i], values[i]);
+		g_free(scan);
+		g_free(index);
+		g_free(values[i]);
+	}
+
+	_fulltext_set("no");
+	g_free(encoded);
+	g_free(word);
+	mempool_close(&pool);
+}
+END_TEST
+
+static char * _sort_result(Mempool_T pool, const char *query, uint64_t limit, gboolean dbsearch)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	char *result;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	mb->dbsearch = dbsearch;
+	search_keys = _build_search_keys(pool, query, &size);
+	dbmail_mailbox_set_uid(mb, TRUE);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_SORTED);
+	dbmail_mailbox_search(mb);
+	dbmail_mailbox_sort_limit(mb, limit);
+	result = dbmail_mailbox_sorted_as_string(mb);
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	return result;
+}
+
+START_TEST(test_dbmail_mailbox_sort_limit)
+{
+	char *all, *first;
+	char **ids;
+	Mempool_T pool = mempool_open();
+
+	all = _sort_result(pool, "( reverse arrival subject ) us-ascii 1:*", 0, FALSE);
+	fail_unless(all != NULL, "SORT failed");
+
+	first = _sort_result(pool, "( reverse arrival subject ) us-ascii 1:*", 2, FALSE);
+	fail_unless(first != NULL, "SORT with limit failed");
+	ids = g_strsplit(first, " ", 0);
+	fail_unless(g_strv_length(ids) <= 2, "SORT with limit returned too many ids [%s]", first);
+	fail_unless(strncmp(all, first, strlen(first)) == 0
+			&& (all[strlen(first)] == ' ' || all[strlen(first)] == '\0'),
+			"SORT with limit differs from full sort [%s] [%s]", first, all);
+	g_strfreev(ids);
+	g_free(first);
+
+	first = _sort_result(pool, "( reverse arrival subject ) us-ascii 1:*", 100000, FALSE);
+	fail_unless(first && MATCH(all, first), "SORT with large limit differs from full sort");
+	g_free(first);
+
+	g_free(all);
+	mempool_close(&pool);
+}
+END_TEST
+
+static void _sort_memory_sql(void)
+{
+	const char *queries[] = {
+		"( from ) us-ascii 1:*",
+		"( reverse from ) us-ascii 1:*",
+		"( subject ) us-ascii 1:*",
+		"( reverse subject ) us-ascii 1:*",
+		"( date ) us-ascii 1:*",
+		"( reverse date ) us-ascii 1:*",
+		"( size ) us-ascii 1:*",
+		"( reverse size ) us-ascii 1:*",
+		"( subject reverse size ) us-ascii 1:*",
+		"( from date ) us-ascii 1:* SEEN",
+		NULL
+	};
+	int i;
+	Mempool_T pool = mempool_open();
+
+	for (i = 0; queries[i]; i++) {
+		char *memory = _sort_result(pool, queries[i], 0, FALSE);
+		char *sql = _sort_result(pool, queries[i], 0, TRUE);
+		fail_unless(g_strcmp0(memory, sql) == 0, "SORT %s differs in memory [%s] and sql [%s]",
+				queries[i], memory, sql);
+		g_free(memory);
+		g_free(sql);
+
+		memory = _sort_result(pool, queries[i], 2, FALSE);
+		sql = _sort_result(pool, queries[i], 2, TRUE);
+		fail_unless(g_strcmp0(memory, sql) == 0, "SORT %s with limit differs in memory [%s] and sql [%s]",
+				queries[i], memory, sql);
+		g_free(memory);
+		g_free(sql);
+	}
+
+	mempool_close(&pool);
+}
+
+START_TEST(test_dbmail_mailbox_sort_memory_sql)
+{
+	_sort_memory_sql();
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_sort_memory_sql_noindex)
+{
+	// without the search index only sizes and dates sort in memory
+	config_set_value("search_index_mailboxes", "IMAP", "0");
+	_sort_memory_sql();
+	config_set_value("search_index_mailboxes", "IMAP", "64");
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_search_parsed_1)
 {
 	uint64_t idx=0;
@@ -616,7 +1054,14 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_dump);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_build_imap_search);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort_limit);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort_memory_sql);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort_memory_sql_noindex);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_memory);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_memory_sql);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_deferred);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_fulltext);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
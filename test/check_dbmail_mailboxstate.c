@@ -55,12 +55,13 @@ static uint64_t get_mailbox_id(const char *name)
 
 static void insert_message(void)
 {
-	uint64_t newmsgidnr = 0;
 	DbmailMessage *message;
 	message = dbmail_message_new(NULL);
 	message = dbmail_message_init_with_string(message,multipart_message);
 	dbmail_message_store(message);
-	db_copymsg(message->msg_idnr, testboxid, testuserid, &newmsgidnr, TRUE);
+	dbmail_message_add_target(message, testuserid, testboxid, NULL, NULL);
+	dbmail_message_deliver(message);
+	dbmail_message_free(message);
 }
 
 void setup(void)
@@ -106,6 +107,246 @@ START_TEST(test_metadata)
 }
 END_TEST
 
+START_TEST(test_update)
+{
+	GList *ids;
+	uint64_t uid;
+	MailboxState_T M, N, O;
+
+	M = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_getExists(M) == 0);
+
+	insert_message();
+	insert_message();
+
+	N = MailboxState_update(NULL, M);
+	fail_unless(MailboxState_getExists(N) == 2);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(N)) == 2);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(M)) == 0, "old state was modified");
+	MailboxState_free(&M);
+
+	// expunge the first message
+	ids = g_tree_keys(MailboxState_getMsginfo(N));
+	uid = *(uint64_t *)g_list_first(ids)->data;
+	g_list_free(g_list_first(ids));
+	db_set_message_status(uid, MESSAGE_STATUS_DELETE);
+	db_mailbox_seq_update(testboxid, 0);
+
+	O = MailboxState_update(NULL, N);
+	fail_unless(MailboxState_getExists(O) == 1);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(O)) == 1);
+	fail_unless(g_tree_lookup(MailboxState_getMsginfo(O), &uid) == NULL, "expunged message still present");
+	fail_unless(g_tree_lookup(MailboxState_getIds(O), &uid) == NULL);
+
+	MailboxState_free(&N);
+	MailboxState_free(&O);
+}
+END_TEST
+
+START_TEST(test_lookup)
+{
+	MailboxState_T M, N, O;
+
+	M = MailboxState_lookup(NULL, testboxid);
+	fail_unless(M != NULL);
+	fail_unless(MailboxState_getExists(M) == 0);
+
+	insert_message();
+
+	// stale snapshot gets refreshed
+	N = MailboxState_lookup(NULL, testboxid);
+	fail_unless(MailboxState_getExists(N) == 1);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(N)) == 1);
+
+	// shared snapshot, private copies
+	O = MailboxState_lookup(NULL, testboxid);
+	fail_unless(O != N);
+	fail_unless(MailboxState_getSeq(O) == MailboxState_getSeq(N));
+	fail_unless(MailboxState_getMsginfo(O) != MailboxState_getMsginfo(N));
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(O)) == 1);
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+	MailboxState_free(&O);
+}
+END_TEST
+
+/* the uid and msn maps point into the MessageInfo records */
+static void check_maps(MailboxState_T M, unsigned count)
+{
+	GTree *msginfo = MailboxState_getMsginfo(M);
+	GTree *ids = MailboxState_getIds(M);
+	GTree *msn = MailboxState_getMsn(M);
+	uint64_t i;
+
+	fail_unless(g_tree_nnodes(msginfo) == (gint)count, "msginfo has [%d] records", g_tree_nnodes(msginfo));
+	fail_unless(g_tree_nnodes(ids) == (gint)count);
+	fail_unless(g_tree_nnodes(msn) == (gint)count);
+
+	for (i = 1; i <= count; i++) {
+		uint64_t *uid = g_tree_lookup(msn, &i);
+		MessageInfo *info;
+		fail_unless(uid != NULL, "msn [%" PRIu64 "] missing", i);
+		info = g_tree_lookup(msginfo, uid);
+		fail_unless(info != NULL);
+		fail_unless(uid == &info->uid, "msn map does not point at the record");
+		fail_unless(info->msn == i, "record has msn [%" PRIu64 "] for [%" PRIu64 "]", info->msn, i);
+		fail_unless(g_tree_lookup(ids, uid) == &info->msn, "uid map does not point at the record");
+	}
+}
+
+START_TEST(test_remap)
+{
+	GList *uids;
+	uint64_t uid, first = 1;
+	MessageInfo *info;
+	MailboxState_T M;
+
+	insert_message();
+	insert_message();
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	check_maps(M, 3);
+
+	info = g_tree_lookup(MailboxState_getMsginfo(M), g_tree_lookup(MailboxState_getMsn(M), &first));
+	fail_unless(info->flags[IMAP_FLAG_SEEN] == 0);
+	fail_unless(info->flags[IMAP_FLAG_RECENT] == 1);
+
+	// drop the middle message: msns close up
+	uids = g_tree_keys(MailboxState_getMsginfo(M));
+	uid = *(uint64_t *)g_list_nth_data(uids, 1);
+	g_list_free(uids);
+	fail_unless(MailboxState_removeUid(M, uid) == DM_SUCCESS);
+	fail_unless(g_tree_lookup(MailboxState_getIds(M), &uid) == NULL);
+	check_maps(M, 2);
+
+	fail_unless(MailboxState_removeUid(M, uid) == DM_EGENERAL, "removed an unknown uid");
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_rights)
+{
+	uint64_t anyone = 0, seq;
+	MailboxState_T N, M = MailboxState_new(NULL, testboxid);
+
+	fail_unless(acl_has_right(M, testuserid, ACL_RIGHT_ADMINISTER) == TRUE, "owner should have all rights");
+
+	auth_user_exists(DBMAIL_ACL_ANYONE_USER, &anyone);
+	fail_unless(anyone > 0);
+	fail_unless(acl_has_right(M, anyone, ACL_RIGHT_READ) == FALSE);
+
+	seq = MailboxState_getSeq(M);
+	acl_set_rights(anyone, testboxid, "lr");
+	fail_unless(acl_has_right(M, anyone, ACL_RIGHT_READ) == TRUE, "cached rights not invalidated");
+	/* other processes notice through the mailbox seq */
+	N = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_getSeq(N) > seq, "mailbox seq not bumped by acl_set_rights");
+	seq = MailboxState_getSeq(N);
+	MailboxState_free(&N);
+	fail_unless(acl_has_right(M, anyone, ACL_RIGHT_INSERT) == FALSE);
+
+	acl_delete_acl(anyone, testboxid);
+	fail_unless(acl_has_right(M, anyone, ACL_RIGHT_READ) == FALSE, "cached rights not invalidated");
+	N = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_getSeq(N) > seq, "mailbox seq not bumped by acl_delete_acl");
+	MailboxState_free(&N);
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+static GList * testbox_ranges(MailboxState_T M)
+{
+	GList *ids, *ranges = NULL;
+	uint64_t *range = g_new0(uint64_t, 2);
+
+	ids = g_tree_keys(MailboxState_getMsginfo(M));
+	range[0] = *(uint64_t *)g_list_first(ids)->data;
+	range[1] = *(uint64_t *)g_list_last(ids)->data;
+	g_list_free(g_list_first(ids));
+
+	ranges = g_list_append(ranges, range);
+	return ranges;
+}
+
+START_TEST(test_db_set_msgflag_set)
+{
+	int flags[IMAP_NFLAGS];
+	uint64_t seq, uid;
+	GList *ranges, *failed = NULL;
+	GTree *changed;
+	MailboxState_T M;
+
+	insert_message();
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	ranges = testbox_ranges(M);
+	uid = *(uint64_t *)g_list_first(ranges)->data;
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+
+	changed = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, NULL);
+	seq = db_mailbox_seq_update(testboxid, 0);
+	fail_unless(db_set_msgflag_set(testboxid, ranges, flags, NULL, IMAPFA_ADD, 0, seq, changed, NULL) == 2);
+	fail_unless(g_tree_nnodes(changed) == 2);
+	fail_unless(g_tree_lookup(changed, &uid) != NULL);
+	fail_unless(db_get_msgflag("seen", uid) == 1);
+	g_tree_destroy(changed);
+
+	// nothing left to change
+	seq = db_mailbox_seq_update(testboxid, 0);
+	fail_unless(db_set_msgflag_set(testboxid, ranges, flags, NULL, IMAPFA_ADD, 0, seq, NULL, NULL) == 0);
+
+	// conditional store on messages changed since
+	seq = db_mailbox_seq_update(testboxid, 0);
+	fail_unless(db_set_msgflag_set(testboxid, ranges, flags, NULL, IMAPFA_REMOVE, 1, seq, NULL, &failed) == 0);
+	fail_unless(g_list_length(failed) == 2);
+	fail_unless(db_get_msgflag("seen", uid) == 1);
+	g_list_destroy(failed);
+
+	g_list_destroy(ranges);
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_db_copymsg_set)
+{
+	uint64_t copyboxid;
+	GList *ranges, *old_ids = NULL, *new_ids = NULL;
+	MailboxState_T M, N;
+
+	insert_message();
+	insert_message();
+	insert_message();
+
+	copyboxid = get_mailbox_id(TESTBOX "/copy");
+
+	M = MailboxState_new(NULL, testboxid);
+	ranges = testbox_ranges(M);
+
+	fail_unless(db_copymsg_set(testboxid, ranges, copyboxid, testuserid, TRUE, &old_ids, &new_ids) == DM_SUCCESS);
+	fail_unless(g_list_length(old_ids) == 3);
+	fail_unless(g_list_length(new_ids) == 3);
+	fail_unless(*(uint64_t *)g_list_first(new_ids)->data > *(uint64_t *)g_list_last(old_ids)->data);
+
+	N = MailboxState_new(NULL, copyboxid);
+	fail_unless(MailboxState_getExists(N) == 3);
+	fail_unless(MailboxState_getRecent(N) == 3);
+
+	g_list_destroy(old_ids);
+	g_list_destroy(new_ids);
+	g_list_destroy(ranges);
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+	db_delete_mailbox(copyboxid, 0, 0);
+}
+END_TEST
+
 static void mailboxstate_destroy(MailboxState_T M)
 {
 	MailboxState_free(&M);
@@ -146,7 +387,13 @@ Suite *dbmail_common_suite(void)
 	tcase_add_checked_fixture(tc_state, setup, teardown);
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_metadata);
+	tcase_add_test(tc_state, test_update);
+	tcase_add_test(tc_state, test_lookup);
+	tcase_add_test(tc_state, test_remap);
+	tcase_add_test(tc_state, test_rights);
 	tcase_add_test(tc_state, test_mbxinfo);
+	tcase_add_test(tc_state, test_db_set_msgflag_set);
+	tcase_add_test(tc_state, test_db_copymsg_set);
 
 	return s;
 }
@@ -33,8 +33,12 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_messagecache.h"
+#include "dm_headercache.h"
 
 extern char configFile[PATH_MAX];
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
 extern char *multipart_message;
 extern char *multipart_message_part;
 extern char *raw_lmtp_data;
@@ -415,6 +419,172 @@ START_TEST(test_dbmail_message_store)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_store_dedup)
+{
+	DbmailMessage *m;
+	uint64_t first, second;
+	Connection_T c; ResultSet_T r;
+	int rows = 0, shared = 0;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	first = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	second = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	fail_unless(first && second && first != second, "dbmail_message_store failed");
+
+	c = db_con_get();
+	r = db_query(c, "SELECT a.part_id, b.part_id FROM %spartlists a "
+			"JOIN %spartlists b ON a.part_key=b.part_key "
+			"AND a.part_depth=b.part_depth AND a.part_order=b.part_order "
+			"WHERE a.physmessage_id=%" PRIu64 " AND b.physmessage_id=%" PRIu64 "",
+			DBPFX, DBPFX, first, second);
+	while (db_result_next(r)) {
+		rows++;
+		if (db_result_get_u64(r, 0) == db_result_get_u64(r, 1))
+			shared++;
+	}
+	db_con_close(c);
+
+	fail_unless(rows > 0, "no partlists stored");
+	fail_unless(rows == shared, "mimeparts not deduplicated [%d/%d]", shared, rows);
+}
+END_TEST
+
+START_TEST(test_header_cache)
+{
+	DbmailMessage *m;
+	uint64_t hits, misses, hits2, misses2, id = 0;
+	Connection_T c; ResultSet_T r;
+	int rows = 0;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+
+	HeaderCache_stats(&hits, &misses);
+	fail_unless(HeaderCache_getName("mime-version", &id), "header name not cached");
+	fail_unless(id > 0, "no id for cached header name");
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+
+	HeaderCache_stats(&hits2, &misses2);
+	fail_unless(hits2 > hits, "no header cache hits [%" PRIu64 "/%" PRIu64 "]", hits, hits2);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*) FROM %sheader WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, dbmail_message_get_physid(m));
+	if (db_result_next(r))
+		rows = db_result_get_int(r, 0);
+	db_con_close(c);
+	fail_unless(rows > 0, "no headers cached for second message");
+
+	HeaderCache_flush();
+	fail_unless(! HeaderCache_getName("mime-version", &id), "flush failed");
+
+	dbmail_message_free(m);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_deliver)
+{
+	DbmailMessage *m;
+	uint64_t userid = 0, inbox = 0, other = 0, physid;
+	Connection_T c; ResultSet_T r;
+	GList *l;
+	int rows = 0;
+	int flags[IMAP_NFLAGS];
+
+	auth_user_exists("testuser1", &userid);
+	db_find_create_mailbox("INBOX", BOX_DEFAULT, userid, &inbox);
+	db_find_create_mailbox("INBOX/deliver", BOX_DEFAULT, userid, &other);
+	fail_unless(userid && inbox && other, "test fixture failed");
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_FLAGGED] = 1;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	fail_unless(m->msg_idnr == 0, "dbmail_message_store created a message");
+
+	c = db_con_get();
+	r = db_query(c, "SELECT messagesize FROM %sphysmessage WHERE id = %" PRIu64 "", DBPFX, physid);
+	fail_unless(db_result_next(r) && db_result_get_u64(r, 0) == 0, "physmessage not pending before delivery");
+	db_con_close(c);
+
+	dbmail_message_add_target(m, userid, inbox, NULL, NULL);
+	dbmail_message_add_target(m, userid, other, flags, NULL);
+	fail_unless(dbmail_message_deliver(m) == DM_SUCCESS, "dbmail_message_deliver failed");
+
+	l = g_list_first(m->targets);
+	while (l) {
+		DeliveryTarget_T *T = (DeliveryTarget_T *)l->data;
+		fail_unless(T->result == DM_SUCCESS, "target not delivered");
+		fail_unless(T->message_idnr > 0, "target has no message_idnr");
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	c = db_con_get();
+	r = db_query(c, "SELECT mailbox_idnr, flagged_flag FROM %smessages WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, physid);
+	while (db_result_next(r)) {
+		uint64_t id = db_result_get_u64(r, 0);
+		fail_unless(id == inbox || id == other, "message delivered to the wrong mailbox");
+		fail_unless(db_result_get_int(r, 1) == (id == other ? 1 : 0), "flags not set");
+		rows++;
+	}
+	db_con_close(c);
+
+	fail_unless(rows == 2, "expected two messages for one physmessage, got [%d]", rows);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT messagesize FROM %sphysmessage WHERE id = %" PRIu64 "", DBPFX, physid);
+	fail_unless(db_result_next(r) && db_result_get_u64(r, 0) == dbmail_message_get_size(m, FALSE),
+			"physmessage size not stored on delivery");
+	db_con_close(c);
+
+	dbmail_message_free(m);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_cache_bodystructure)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	char *bodystructure, *body;
+	int rows = 0;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	bodystructure = imap_get_structure(GMIME_MESSAGE(m->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(m->content), 0);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT bodystructure, body FROM %sbodystructure "
+			"WHERE physmessage_id=%" PRIu64 "", DBPFX, dbmail_message_get_physid(m));
+	while (db_result_next(r)) {
+		rows++;
+		fail_unless(MATCH(db_result_get(r, 0), bodystructure), "bodystructure mismatch");
+		fail_unless(MATCH(db_result_get(r, 1), body), "body mismatch");
+	}
+	db_con_close(c);
+
+	fail_unless(rows == 1, "bodystructure not cached [%d]", rows);
+
+	g_free(bodystructure);
+	g_free(body);
+	dbmail_message_free(m);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_store2)
 {
 	DbmailMessage *m, *n;
@@ -478,6 +648,36 @@ START_TEST(test_dbmail_message_retrieve)
 
 }
 END_TEST
+
+START_TEST(test_dbmail_message_retrieve_crlf)
+{
+	DbmailMessage *m, *n;
+	Mempool_T pool;
+	String_T s;
+	uint64_t physid;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	n = dbmail_message_new(NULL);
+	n = dbmail_message_retrieve(n, physid);
+	fail_unless(n != NULL, "dbmail_message_retrieve failed");
+
+	pool = mempool_open();
+	s = dbmail_message_retrieve_crlf(pool, physid);
+	fail_unless(s != NULL, "dbmail_message_retrieve_crlf failed");
+	fail_unless(p_string_len(s) == p_string_len(n->crlf), "stream length [%" PRIu64 "] != [%" PRIu64 "]",
+			p_string_len(s), p_string_len(n->crlf));
+	COMPARE(p_string_str(n->crlf), p_string_str(s));
+
+	p_string_free(s, TRUE);
+	mempool_close(&pool);
+	dbmail_message_free(n);
+}
+END_TEST
+
 //DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const GString *content);
 START_TEST(test_dbmail_message_init_with_string)
 {
@@ -724,11 +924,27 @@ START_TEST(test_dbmail_message_cache_headers)
 {
 	DbmailMessage *m = dbmail_message_new(NULL);
 	char *s = g_new0(char,20);
+	Connection_T c; ResultSet_T r;
+	int headers = 0, refs = 0;
 	m = dbmail_message_init_with_string(m,multipart_message);
 	dbmail_message_set_header(m, 
 			"References", 
 			"<20050326155326.1afb0377@ibook.linuks.mine.nu> <20050326181954.GB17389@khazad-dum.debian.net> <20050326193756.77747928@ibook.linuks.mine.nu> ");
 	dbmail_message_store(m);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*) FROM %sheader WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, dbmail_message_get_physid(m));
+	if (db_result_next(r))
+		headers = db_result_get_int(r, 0);
+	db_con_clear(c);
+	r = db_query(c, "SELECT COUNT(*) FROM %sreferencesfield WHERE physmessage_id = %" PRIu64 "",
+			DBPFX, dbmail_message_get_physid(m));
+	if (db_result_next(r))
+		refs = db_result_get_int(r, 0);
+	db_con_close(c);
+	fail_unless(headers > 10, "headers not cached [%d]", headers);
+	fail_unless(refs == 3, "references not cached [%d]", refs);
 	dbmail_message_free(m);
 
 	sprintf(s,"%.*s",10,"abcdefghijklmnopqrstuvwxyz");
@@ -872,6 +1088,7 @@ END_TEST
 START_TEST(test_db_get_message_lines)
 {
 	DbmailMessage *m;
+	uint64_t userid = 0, inbox = 0;
 	char *result;
 	char *raw;
 	const char *header = "From: foo@bar.org\r\n"
@@ -887,7 +1104,10 @@ START_TEST(test_db_get_message_lines)
 	m = dbmail_message_new(NULL);
 	m = dbmail_message_init_with_string(m, raw);
 	dbmail_message_store(m);
-
+	auth_user_exists("testuser1", &userid);
+	db_find_create_mailbox("INBOX", BOX_DEFAULT, userid, &inbox);
+	dbmail_message_add_target(m, userid, inbox, NULL, NULL);
+	dbmail_message_deliver(m);
 
 	result = db_get_message_lines(m->msg_idnr, 0);
 	fail_unless(MATCH(result, header));
@@ -906,6 +1126,49 @@ START_TEST(test_db_get_message_lines)
 }
 END_TEST
 
+START_TEST(test_message_cache)
+{
+	DbmailMessage *m;
+	MessageCache_T C, D;
+	uint64_t hits = 0, misses = 0, bytes = 0;
+	uint64_t physid = 9999999;
+	char *s;
+
+	m = message_init(multipart_message);
+	dbmail_message_set_physid(m, physid);
+
+	C = MessageCache_lookup(physid);
+	fail_unless(C == NULL, "message cache: unexpected hit");
+
+	C = MessageCache_store(m);
+	fail_unless(C != NULL, "message cache: store failed");
+	fail_unless(MessageCache_getId(C) == physid);
+	fail_unless(MATCH(p_string_str(MessageCache_getCRLF(C)), p_string_str(m->crlf)));
+
+	s = imap_get_structure(GMIME_MESSAGE(m->content), 1);
+	fail_unless(MATCH(MessageCache_getStructure(C, TRUE), s), "message cache: bodystructure mismatch");
+	g_free(s);
+	s = imap_get_structure(GMIME_MESSAGE(m->content), 0);
+	fail_unless(MATCH(MessageCache_getStructure(C, FALSE), s), "message cache: body mismatch");
+	g_free(s);
+	fail_unless(MessageCache_getEnvelope(C) != NULL);
+	dbmail_message_free(m);
+
+	// entries outlive the message they were built from
+	D = MessageCache_lookup(physid);
+	fail_unless(D == C, "message cache: expected hit");
+	MessageCache_release(&D);
+	fail_unless(D == NULL);
+
+	MessageCache_stats(&hits, &misses, &bytes);
+	fail_unless(hits == 1, "message cache: hits [%" PRIu64 "]", hits);
+	fail_unless(misses == 1, "message cache: misses [%" PRIu64 "]", misses);
+	fail_unless(bytes > p_string_len(MessageCache_getCRLF(C)), "message cache: bytes [%" PRIu64 "]", bytes);
+
+	MessageCache_release(&C);
+}
+END_TEST
+
 Suite *dbmail_message_suite(void)
 {
 	Suite *s = suite_create("Dbmail Message");
@@ -920,7 +1183,12 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_g_mime_object_get_body);
 	tcase_add_test(tc_message, test_dbmail_message_store);
 	tcase_add_test(tc_message, test_dbmail_message_store2);
+	tcase_add_test(tc_message, test_dbmail_message_store_dedup);
+	tcase_add_test(tc_message, test_dbmail_message_deliver);
+	tcase_add_test(tc_message, test_header_cache);
+	tcase_add_test(tc_message, test_dbmail_message_cache_bodystructure);
 	tcase_add_test(tc_message, test_dbmail_message_retrieve);
+	tcase_add_test(tc_message, test_dbmail_message_retrieve_crlf);
 	tcase_add_test(tc_message, test_dbmail_message_init_with_string);
 	tcase_add_test(tc_message, test_dbmail_message_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_hdrs_to_string);
@@ -937,6 +1205,7 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_get_size);
 	tcase_add_test(tc_message, test_encoding);
 	tcase_add_test(tc_message, test_db_get_message_lines);
+	tcase_add_test(tc_message, test_message_cache);
 	return s;
 }
 
@@ -34,6 +34,7 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#include "dm_fulltext.h"
 
 extern char configFile[PATH_MAX];
 extern int quiet;
@@ -554,6 +555,26 @@ START_TEST(test_date_sql2imap)
 }
 END_TEST
 
+START_TEST(test_fulltext_terms)
+{
+	GList *terms;
+
+	terms = FullText_terms("Hello, hello WORLD! a x-ray Caf\xc3\xa9");
+	fail_unless(g_list_length(terms) == 4, "FullText_terms failed [%d]", g_list_length(terms));
+	terms = g_list_first(terms);
+	fail_unless(MATCH((char *)terms->data, "hello"), "FullText_terms failed [%s]", (char *)terms->data);
+	terms = g_list_next(terms);
+	fail_unless(MATCH((char *)terms->data, "world"), "FullText_terms failed [%s]", (char *)terms->data);
+	terms = g_list_next(terms);
+	fail_unless(MATCH((char *)terms->data, "ray"), "FullText_terms failed [%s]", (char *)terms->data);
+	terms = g_list_next(terms);
+	fail_unless(strcmp((char *)terms->data, "caf\xc3\xa9") == 0, "FullText_terms failed [%s]", (char *)terms->data);
+	g_list_destroy(terms);
+
+	fail_unless(FullText_terms("a . b") == NULL, "FullText_terms failed");
+	fail_unless(FullText_terms("") == NULL, "FullText_terms failed");
+}
+END_TEST
 
 Suite *dbmail_misc_suite(void)
 {
@@ -583,6 +604,7 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_get_crlf_encoded_opt2);
 	tcase_add_test(tc_misc, test_date_imap2sql);
 	tcase_add_test(tc_misc, test_date_sql2imap);
+	tcase_add_test(tc_misc, test_fulltext_terms);
 
 	return s;
 }
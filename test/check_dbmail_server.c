@@ -35,6 +35,8 @@
 #include "check_dbmail.h"
 
 extern char configFile[PATH_MAX];
+extern struct event_base *evbase;
+extern ServerConfig_T *server_conf;
 
 
 /* we need this one because we can't directly link imapd.o */
@@ -87,19 +89,273 @@ START_TEST(test_dm_sock_compare)
 }
 END_TEST
 
+typedef struct {
+	int sock;
+	gpointer reactor;
+	gboolean other_thread;
+	ClientBase_T *client;
+	volatile gint done;
+} ReactorJob_T;
+
+static pthread_t main_thread;
+
+static void _reactor_job(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ReactorJob_T *J = (ReactorJob_T *)D->data;
+
+	J->reactor = dm_reactor_current();
+	J->other_thread = ! pthread_equal(pthread_self(), main_thread);
+	J->client = g_new0(ClientBase_T, 1);
+	J->client->rx = J->client->tx = J->sock;
+	dm_reactor_attach(J->client);
+	g_atomic_int_set(&J->done, 1);
+}
+
+START_TEST(test_reactors)
+{
+	ReactorJob_T J;
+	gpointer R;
+	int sv[2], i;
+	char c;
+
+	memset(&J, 0, sizeof(J));
+	main_thread = pthread_self();
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	J.sock = sv[0];
+
+	evbase = event_base_new();
+	dm_reactors_open(2, 1);
+	dm_queue_heartbeat();
+	dm_reactors_start();
+
+	fail_unless(dm_reactor_assign() == dm_reactor_current(), "first connection not on the main reactor");
+	R = dm_reactor_assign();
+	fail_unless(R != dm_reactor_current(), "second connection not on the other reactor");
+
+	dm_queue_push_reactor(R, _reactor_job, NULL, &J);
+	for (i = 0; (i < 100) && (! g_atomic_int_get(&J.done)); i++)
+		usleep(10000);
+	fail_unless(g_atomic_int_get(&J.done), "job not run by its reactor");
+	fail_unless(J.reactor == R, "job run by the wrong reactor");
+	fail_unless(J.other_thread, "job run by the main thread");
+
+	/* stopping closes the connections of the other reactors and joins them */
+	dm_reactors_stop();
+	fail_unless(read(sv[1], &c, 1) == 0, "connection of the stopped reactor not closed");
+
+	close(sv[0]);
+	close(sv[1]);
+	g_free(J.client);
+	event_base_free(evbase);
+	evbase = NULL;
+}
+END_TEST
+
+typedef struct {
+	gboolean worker;
+	gboolean main;
+	volatile gint entered;
+	volatile gint left;
+} ClientJob_T;
+
+static void _client_job_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientJob_T *J = (ClientJob_T *)D->data;
+
+	J->worker = ! pthread_equal(pthread_self(), main_thread);
+	client_session_printf(D->client, "250 OK\r\n");
+	g_atomic_int_set(&J->entered, 1);
+	dm_thread_data_return(D);
+}
+
+static void _client_job_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ClientJob_T *J = (ClientJob_T *)D->data;
+
+	J->main = pthread_equal(pthread_self(), main_thread);
+	client_session_flush(D->client);
+	g_atomic_int_set(&J->left, 1);
+}
+
+START_TEST(test_client_thread_push)
+{
+	ServerConfig_T conf;
+	ClientSession_T *session;
+	client_sock *c;
+	struct sockaddr_storage addr;
+	ClientJob_T J;
+	char buf[32];
+	int sv[2], i;
+
+	memset(&J, 0, sizeof(J));
+	memset(&conf, 0, sizeof(conf));
+	memset(&addr, 0, sizeof(addr));
+	main_thread = pthread_self();
+	server_conf = &conf;
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	evbase = event_base_new();
+	dm_reactors_open(1, 2);
+
+	c = g_new0(client_sock, 1);
+	c->pool = mempool_open();
+	c->sock = sv[0];
+	c->caddr = c->saddr = (struct sockaddr *)&addr;
+	c->caddr_len = c->saddr_len = sizeof(addr);
+	session = client_session_new(c);
+
+	/* the command runs on a worker, which may not touch the socket */
+	dm_client_thread_push(session, _client_job_enter, _client_job_leave, &J);
+	for (i = 0; (i < 100) && (! g_atomic_int_get(&J.entered)); i++)
+		usleep(10000);
+	fail_unless(g_atomic_int_get(&J.entered), "job not run by the pool");
+	fail_unless(J.worker, "job run by the main thread");
+	fail_unless(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) < 0, "worker wrote to the client");
+
+	/* the reply is written once the job is back in the event loop */
+	for (i = 0; (i < 100) && (! g_atomic_int_get(&J.left)); i++) {
+		dm_queue_drain();
+		usleep(10000);
+	}
+	fail_unless(g_atomic_int_get(&J.left), "job not returned to the event loop");
+	fail_unless(J.main, "reply not flushed by the main thread");
+	memset(buf, 0, sizeof(buf));
+	fail_unless(read(sv[1], buf, sizeof(buf) - 1) > 0, "no reply");
+	fail_unless(MATCH(buf, "250 OK\r\n"), "wrong reply [%s]", buf);
+
+	dm_reactors_stop();
+	close(sv[0]);
+	close(sv[1]);
+	event_base_free(evbase);
+	evbase = NULL;
+	server_conf = NULL;
+}
+END_TEST
+
+/*
+ * every prefork worker answers a single connection with its pid and
+ * that of its parent, and then exits
+ */
+static int _prefork_handler(client_sock *c)
+{
+	char reply[64];
+
+	snprintf(reply, sizeof(reply), "%d %d\r\n", (int)getpid(), (int)getppid());
+	if (write(c->sock, reply, strlen(reply)) < 0)
+		_exit(1);
+	close(c->sock);
+	_exit(0);
+	return 0;
+}
+
+static pid_t _prefork_ask(int port, pid_t *parent)
+{
+	struct sockaddr_in sin;
+	char reply[64];
+	int i, s, pid = 0, ppid = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// workers take a moment to (re)start
+	for (i = 0; (i < 100) && (! pid); i++) {
+		memset(reply, 0, sizeof(reply));
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		if ((connect(s, (struct sockaddr *)&sin, sizeof(sin)) == 0) && 
+				(read(s, reply, sizeof(reply) - 1) > 0))
+			sscanf(reply, "%d %d", &pid, &ppid);
+		close(s);
+		if (! pid)
+			usleep(50000);
+	}
+	*parent = (pid_t)ppid;
+	return (pid_t)pid;
+}
+
+START_TEST(test_prefork)
+{
+	ServerConfig_T conf;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	pid_t master, seen[3], parent;
+	int i, s, port, status = -1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(bind(s, (struct sockaddr *)&sin, len) == 0);
+	fail_unless(getsockname(s, (struct sockaddr *)&sin, &len) == 0);
+	port = ntohs(sin.sin_port);
+	close(s);
+
+	if (! (master = fork())) {
+		memset(&conf, 0, sizeof(conf));
+		g_strlcpy(conf.service_name, "POP", FIELDSIZE);
+		g_strlcpy(conf.process_name, "check_dbmail_server", FIELDSIZE);
+		snprintf(conf.port, FIELDSIZE, "%d", port);
+		conf.iplist = g_new0(char *, 1);
+		conf.iplist[0] = g_strdup("127.0.0.1");
+		conf.ipcount = 1;
+		conf.backlog = 16;
+		conf.reactors = 1;
+		conf.processes = 2;
+		conf.pidFile = "/tmp/check_dbmail_server.pid";
+		conf.ClientHandler = _prefork_handler;
+		exit(server_run(&conf));
+	}
+	fail_unless(master > 0, "fork failed");
+
+	/* two workers can only answer three connections if the master
+	 * replaces the ones that are gone */
+	for (i = 0; i < 3; i++) {
+		seen[i] = _prefork_ask(port, &parent);
+		fail_unless(seen[i] > 0, "no worker answered");
+		fail_unless(parent == master, "answered by [%d], not a worker", seen[i]);
+	}
+	fail_unless(seen[0] != seen[1] && seen[1] != seen[2] && seen[0] != seen[2], 
+			"worker answered more than once");
+
+	kill(master, SIGTERM);
+	for (i = 0; (i < 100) && (waitpid(master, &status, WNOHANG) == 0); i++)
+		usleep(50000);
+	fail_unless(WIFEXITED(status) && (WEXITSTATUS(status) == 0), "master did not stop");
+
+	// the workers are gone with it
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0, "workers still listening");
+	close(s);
+	unlink("/tmp/check_dbmail_server.pid");
+}
+END_TEST
+
 Suite *dbmail_server_suite(void)
 {
 	Suite *s = suite_create("Dbmail Server");
 	TCase *tc_pool = tcase_create("ServerPool");
 	TCase *tc_server = tcase_create("Server");
+	TCase *tc_prefork = tcase_create("Prefork");
 	
 	suite_add_tcase(s, tc_pool);
 	suite_add_tcase(s, tc_server);
+	suite_add_tcase(s, tc_prefork);
 	
 	tcase_add_checked_fixture(tc_pool, setup, teardown);
 	
 	tcase_add_checked_fixture(tc_server, setup, teardown);
 	tcase_add_test(tc_server, test_dm_sock_compare);
+	tcase_add_test(tc_server, test_reactors);
+	tcase_add_test(tc_server, test_client_thread_push);
+
+	// restarting a worker that died right away is throttled
+	tcase_add_checked_fixture(tc_prefork, setup, teardown);
+	tcase_set_timeout(tc_prefork, 10);
+	tcase_add_test(tc_prefork, test_prefork);
 	
 	return s;
 }